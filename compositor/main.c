@@ -1031,8 +1031,11 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct xkb_rule_names xkb_names;
 	struct weston_config_section *s;
 	int repaint_msec;
+	int repaint_adaptive;
+	double miss_target;
 	int vt_switching;
 	int cal;
+	int coalesce_motion;
 
 	/* weston.ini [keyboard] */
 	s = weston_config_get_section(config, "keyboard", NULL, NULL);
@@ -1072,12 +1075,32 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	weston_log("Output repaint window is %d ms maximum.\n",
 		   ec->repaint_msec);
 
+	weston_config_section_get_bool(s, "adaptive-repaint-window",
+				       &repaint_adaptive, false);
+	ec->repaint_adaptive = repaint_adaptive;
+	weston_config_section_get_double(s, "repaint-miss-target",
+					 &miss_target,
+					 ec->repaint_miss_target * 100.0);
+	if (miss_target <= 0.0 || miss_target >= 50.0) {
+		weston_log("Invalid repaint-miss-target value in config: %f\n",
+			   miss_target);
+	} else {
+		ec->repaint_miss_target = miss_target / 100.0;
+	}
+	if (ec->repaint_adaptive)
+		weston_log("Output repaint window is adaptive, "
+			   "targeting %.2f%% missed frames.\n",
+			   ec->repaint_miss_target * 100.0);
+
 	/* weston.ini [libinput] */
 	s = weston_config_get_section(config, "libinput", NULL, NULL);
 	weston_config_section_get_bool(s, "touchscreen_calibrator", &cal, 0);
 	if (cal)
 		weston_compositor_enable_touch_calibrator(ec,
 						save_touch_device_calibration);
+	weston_config_section_get_bool(s, "coalesce_motion",
+				       &coalesce_motion, true);
+	ec->coalesce_pointer_motion = coalesce_motion;
 
 	return 0;
 }
@@ -2164,6 +2187,8 @@ load_drm_backend(struct weston_compositor *c,
 	                               &config.pageflip_timeout, 0);
 	weston_config_section_get_bool(section, "pixman-shadow", &use_shadow, 1);
 	config.use_pixman_shadow = use_shadow;
+	weston_config_section_get_uint(section, "pixman-buffers",
+				       &config.pixman_buffers, 2);
 
 	config.base.struct_version = WESTON_DRM_BACKEND_CONFIG_VERSION;
 	config.base.struct_size = sizeof(struct weston_drm_backend_config);
@@ -46,6 +46,7 @@
 #include "shared/os-compatibility.h"
 #include "shared/timespec-util.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
 
 struct shared_output {
 	struct weston_output *output;
@@ -56,8 +57,10 @@ struct shared_output {
 		struct wl_display *display;
 		struct wl_registry *registry;
 		struct wl_compositor *compositor;
+		uint32_t compositor_version;
 		struct wl_shm *shm;
 		uint32_t shm_formats;
+		struct zwp_linux_dmabuf_v1 *dmabuf;
 		struct zwp_fullscreen_shell_v1 *fshell;
 		struct wl_output *output;
 		struct wl_surface *surface;
@@ -75,10 +78,36 @@ struct shared_output {
 		struct wl_list free_buffers;
 	} shm;
 
+	/* Frames the output shares as dmabufs are passed on to the parent
+	 * as they are; the shm path is the fallback. */
+	struct {
+		bool enabled;
+		struct wl_listener capture_listener;
+		struct weston_capture_wait *wait;
+		struct ss_dmabuf_buffer *creating;
+		struct wl_list buffers;	/* ss_dmabuf_buffer::link */
+		bool missed;	/* a frame was dropped while busy */
+	} dmabuf;
+
 	int cache_dirty;
 	pixman_image_t *cache_image;
-	uint32_t *tmp_data;
-	size_t tmp_data_size;
+	struct wl_list pending_reads;
+};
+
+/* A captured frame handed to the parent, until the parent releases it */
+struct ss_dmabuf_buffer {
+	struct shared_output *output;
+	struct wl_list link;
+	struct weston_capture_frame *frame;
+	struct zwp_linux_buffer_params_v1 *params;
+	struct wl_buffer *buffer;
+};
+
+/* Damage waiting for its pixels to be read back from the renderer */
+struct ss_read {
+	struct shared_output *output;
+	struct wl_list link;
+	pixman_region32_t damage;
 };
 
 struct ss_seat {
@@ -567,42 +596,6 @@ output_compute_transform(struct weston_output *output,
 static void
 shared_output_destroy(struct shared_output *so);
 
-static int
-shared_output_ensure_tmp_data(struct shared_output *so,
-			      pixman_region32_t *region)
-{
-	pixman_box32_t *ext;
-	size_t size;
-
-	if (!pixman_region32_not_empty(region))
-		return 0;
-
-	ext = pixman_region32_extents(region);
-
-	/* Damage is in output coordinates.
-	 *
-	 * We are multiplying by 4 because the temporary data needs to be able
-	 * to store an 32 bit-per-pixel buffer.
-	 */
-	size = 4 * (ext->x2 - ext->x1) * (ext->y2 - ext->y1)
-		 * so->output->current_scale * so->output->current_scale;
-
-	if (so->tmp_data != NULL && size <= so->tmp_data_size)
-		return 0;
-
-	free(so->tmp_data);
-	so->tmp_data = malloc(size);
-	if (so->tmp_data == NULL) {
-		so->tmp_data_size = 0;
-		errno = ENOMEM;
-		return -1;
-	}
-
-	so->tmp_data_size = size;
-
-	return 0;
-}
-
 static void
 shared_output_update(struct shared_output *so);
 
@@ -707,9 +700,13 @@ registry_handle_global(void *data, struct wl_registry *registry,
 	struct shared_output *so = data;
 
 	if (strcmp(interface, "wl_compositor") == 0) {
+		/* Version 3 to set the buffer transform and scale of
+		 * shared dmabufs */
+		so->parent.compositor_version = MIN(version, 3);
 		so->parent.compositor =
 			wl_registry_bind(registry,
-					 id, &wl_compositor_interface, 1);
+					 id, &wl_compositor_interface,
+					 so->parent.compositor_version);
 	} else if (strcmp(interface, "wl_output") == 0 && !so->parent.output) {
 		so->parent.output =
 			wl_registry_bind(registry,
@@ -721,6 +718,10 @@ registry_handle_global(void *data, struct wl_registry *registry,
 			wl_registry_bind(registry,
 					 id, &wl_shm_interface, 1);
 		wl_shm_add_listener(so->parent.shm, &shm_listener, so);
+	} else if (strcmp(interface, "zwp_linux_dmabuf_v1") == 0) {
+		so->parent.dmabuf =
+			wl_registry_bind(registry,
+					 id, &zwp_linux_dmabuf_v1_interface, 1);
 	} else if (strcmp(interface, "zwp_fullscreen_shell_v1") == 0) {
 		so->parent.fshell =
 			wl_registry_bind(registry,
@@ -800,6 +801,65 @@ struct zwp_fullscreen_shell_mode_feedback_v1_listener mode_feedback_listener = {
 	mode_feedback_ok,
 };
 
+static void
+shared_output_read_done(struct weston_output *output, void *pixels,
+			int pixels_stride, void *data)
+{
+	struct ss_read *read = data;
+	struct shared_output *so = read->output;
+	int32_t x, y, width, height, stride, src_stride, src_y;
+	int i, nrects, do_yflip;
+	pixman_box32_t *r, ext;
+	uint32_t *cache_data;
+
+	wl_list_remove(&read->link);
+
+	/* The share went away while the read was in flight */
+	if (!so || !pixels)
+		goto out;
+
+	ext = *pixman_region32_extents(&read->damage);
+
+	/* The cache may have been resized since the read was issued */
+	pixman_region32_intersect_rect(&read->damage, &read->damage, 0, 0,
+				       pixman_image_get_width(so->cache_image),
+				       pixman_image_get_height(so->cache_image));
+
+	do_yflip = !!(output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+
+	/* The extents were read in one go; bottom-up when y-flipped */
+	src_stride = pixels_stride / 4;
+	if (do_yflip)
+		src_stride = -src_stride;
+
+	stride = pixman_image_get_stride(so->cache_image) / 4;
+	cache_data = pixman_image_get_data(so->cache_image);
+	r = pixman_region32_rectangles(&read->damage, &nrects);
+	for (i = 0; i < nrects; ++i) {
+		x = r[i].x1;
+		y = r[i].y1;
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
+
+		if (do_yflip)
+			src_y = 1 - (ext.y2 - ext.y1) + (y - ext.y1);
+		else
+			src_y = y - ext.y1;
+
+		pixman_blt(pixels, cache_data, src_stride, stride, 32, 32,
+			   x - ext.x1, src_y, x, y, width, height);
+	}
+
+	so->cache_dirty = 1;
+
+out:
+	pixman_region32_fini(&read->damage);
+	free(read);
+
+	if (so)
+		shared_output_update(so);
+}
+
 static void
 shared_output_repainted(struct wl_listener *listener, void *data)
 {
@@ -807,10 +867,12 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		container_of(listener, struct shared_output, frame_listener);
 	pixman_region32_t damage;
 	struct ss_shm_buffer *sb;
-	int32_t x, y, width, height, stride;
-	int i, nrects, do_yflip;
-	pixman_box32_t *r;
-	uint32_t *cache_data;
+	struct ss_read *read;
+	int32_t width, height, stride, y;
+	pixman_box32_t *ext;
+
+	if (so->dmabuf.enabled)
+		return;
 
 	/* Damage in output coordinates */
 	pixman_region32_init(&damage);
@@ -851,44 +913,261 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		pixman_region32_init_rect(&damage, 0, 0, width, height);
 	}
 
-	if (shared_output_ensure_tmp_data(so, &damage) < 0) {
+	if (!pixman_region32_not_empty(&damage)) {
+		pixman_region32_fini(&damage);
+		return;
+	}
+
+	read = zalloc(sizeof *read);
+	if (!read) {
+		pixman_region32_fini(&damage);
 		shared_output_destroy(so);
 		return;
 	}
 
-	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	read->output = so;
+	pixman_region32_init(&read->damage);
+	pixman_region32_copy(&read->damage, &damage);
+	pixman_region32_fini(&damage);
+	wl_list_insert(so->pending_reads.prev, &read->link);
 
-	cache_data = pixman_image_get_data(so->cache_image);
-	r = pixman_region32_rectangles(&damage, &nrects);
-	for (i = 0; i < nrects; ++i) {
-		x = r[i].x1;
-		y = r[i].y1;
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
+	/* Read the damage extents at once and without waiting for the
+	 * renderer; the cache is updated when the pixels arrive. */
+	ext = pixman_region32_extents(&read->damage);
+	if (so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
+		y = height - ext->y2;
+	else
+		y = ext->y1;
+
+	if (weston_output_read_pixels_async(so->output, PIXMAN_a8r8g8b8,
+					    ext->x1, y,
+					    ext->x2 - ext->x1,
+					    ext->y2 - ext->y1,
+					    shared_output_read_done,
+					    read) < 0) {
+		wl_list_remove(&read->link);
+		pixman_region32_fini(&read->damage);
+		free(read);
+		shared_output_destroy(so);
+	}
+}
 
-		if (do_yflip) {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, so->output->current_mode->height - r[i].y2,
-				width, height);
-
-			pixman_blt(so->tmp_data, cache_data, -width, stride,
-				   32, 32, 0, 1 - height, x, y, width, height);
-		} else {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, y, width, height);
-
-			pixman_blt(so->tmp_data, cache_data, width, stride,
-				   32, 32, 0, 0, x, y, width, height);
-		}
+static void
+ss_dmabuf_buffer_destroy(struct ss_dmabuf_buffer *db)
+{
+	if (db->params)
+		zwp_linux_buffer_params_v1_destroy(db->params);
+	if (db->buffer)
+		wl_buffer_destroy(db->buffer);
+	weston_capture_frame_unref(db->frame);
+	wl_list_remove(&db->link);
+	free(db);
+}
+
+/* Ask for a frame of what was missed while the parent was busy */
+static void
+shared_output_dmabuf_catch_up(struct shared_output *so)
+{
+	if (!so->dmabuf.missed || so->parent.frame_cb ||
+	    so->dmabuf.wait || so->dmabuf.creating)
+		return;
+
+	so->dmabuf.missed = false;
+	weston_output_schedule_repaint(so->output);
+}
+
+static void
+dmabuf_buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct ss_dmabuf_buffer *db = data;
+	struct shared_output *so = db->output;
+
+	ss_dmabuf_buffer_destroy(db);
+
+	/* Holding fewer frames, the output shares them again */
+	shared_output_dmabuf_catch_up(so);
+}
+
+static const struct wl_buffer_listener dmabuf_buffer_listener = {
+	dmabuf_buffer_release
+};
+
+static void
+shared_output_dmabuf_frame_callback(void *data, struct wl_callback *cb,
+				    uint32_t time)
+{
+	struct shared_output *so = data;
+
+	if (cb != so->parent.frame_cb)
+		return;
+
+	wl_callback_destroy(cb);
+	so->parent.frame_cb = NULL;
+
+	if (so->dmabuf.enabled)
+		shared_output_dmabuf_catch_up(so);
+	else
+		shared_output_update(so);
+}
+
+static const struct wl_callback_listener shared_output_dmabuf_frame_listener = {
+	shared_output_dmabuf_frame_callback
+};
+
+static void
+params_created(void *data, struct zwp_linux_buffer_params_v1 *params,
+	       struct wl_buffer *buffer)
+{
+	struct ss_dmabuf_buffer *db = data;
+	struct shared_output *so = db->output;
+	struct weston_output *output = so->output;
+
+	zwp_linux_buffer_params_v1_destroy(db->params);
+	db->params = NULL;
+	db->buffer = buffer;
+	wl_buffer_add_listener(buffer, &dmabuf_buffer_listener, db);
+	so->dmabuf.creating = NULL;
+
+	/* The parent applies the output transform instead of us */
+	wl_surface_set_buffer_transform(so->parent.surface, output->transform);
+	wl_surface_set_buffer_scale(so->parent.surface, output->current_scale);
+	wl_surface_damage(so->parent.surface, 0, 0,
+			  output->width, output->height);
+	wl_surface_attach(so->parent.surface, buffer, 0, 0);
+
+	so->parent.frame_cb = wl_surface_frame(so->parent.surface);
+	wl_callback_add_listener(so->parent.frame_cb,
+				 &shared_output_dmabuf_frame_listener, so);
+
+	wl_surface_commit(so->parent.surface);
+	wl_display_flush(so->parent.display);
+}
+
+static void
+shared_output_dmabuf_disable(struct shared_output *so);
+
+static void
+params_failed(void *data, struct zwp_linux_buffer_params_v1 *params)
+{
+	struct ss_dmabuf_buffer *db = data;
+	struct shared_output *so = db->output;
+
+	weston_log("Screen share: parent cannot import the output's "
+		   "buffers, copying them instead\n");
+
+	so->dmabuf.creating = NULL;
+	ss_dmabuf_buffer_destroy(db);
+	shared_output_dmabuf_disable(so);
+
+	/* The shm path copies with the output transform applied, starting
+	 * from a full copy */
+	wl_surface_set_buffer_transform(so->parent.surface,
+					WL_OUTPUT_TRANSFORM_NORMAL);
+	wl_surface_set_buffer_scale(so->parent.surface, 1);
+	weston_output_damage(so->output);
+}
+
+static const struct zwp_linux_buffer_params_v1_listener params_listener = {
+	params_created,
+	params_failed
+};
+
+static void
+shared_output_dmabuf_ready(struct weston_capture_frame *frame, void *data)
+{
+	struct shared_output *so = data;
+	struct ss_dmabuf_buffer *db;
+	int i;
+
+	so->dmabuf.wait = NULL;
+
+	db = zalloc(sizeof *db);
+	if (!db) {
+		so->dmabuf.missed = true;
+		return;
 	}
 
-	pixman_region32_fini(&damage);
+	db->output = so;
+	db->frame = weston_capture_frame_ref(frame);
+	wl_list_insert(&so->dmabuf.buffers, &db->link);
+
+	db->params = zwp_linux_dmabuf_v1_create_params(so->parent.dmabuf);
+	for (i = 0; i < frame->n_planes; i++)
+		zwp_linux_buffer_params_v1_add(db->params, frame->fd[i], i,
+					       frame->offset[i],
+					       frame->stride[i],
+					       frame->modifier >> 32,
+					       frame->modifier & 0xffffffff);
+	zwp_linux_buffer_params_v1_add_listener(db->params,
+						&params_listener, db);
+	zwp_linux_buffer_params_v1_create(db->params,
+					  frame->width, frame->height,
+					  frame->format, 0);
+	wl_display_flush(so->parent.display);
 
-	so->cache_dirty = 1;
+	so->dmabuf.creating = db;
+}
 
-	shared_output_update(so);
+static void
+shared_output_captured(struct wl_listener *listener, void *data)
+{
+	struct shared_output *so =
+		container_of(listener, struct shared_output,
+			     dmabuf.capture_listener);
+	struct weston_capture_frame *frame = data;
+
+	/* Only the newest frame matters; while the parent is still busy
+	 * with the last one, come back for a fresh one later instead of
+	 * holding on to more buffers. Same for frames the output skipped,
+	 * typically as we hold too many of its buffers. */
+	if (!frame || so->parent.frame_cb || so->dmabuf.wait ||
+	    so->dmabuf.creating) {
+		so->dmabuf.missed = true;
+		return;
+	}
+
+	so->dmabuf.missed = false;
+
+	/* The parent cannot wait for the fence, so wait for it here */
+	so->dmabuf.wait = weston_capture_frame_wait(frame,
+						    shared_output_dmabuf_ready,
+						    so);
+}
+
+static void
+shared_output_dmabuf_disable(struct shared_output *so)
+{
+	struct ss_dmabuf_buffer *db, *tmp;
+
+	if (!so->dmabuf.enabled)
+		return;
+
+	so->dmabuf.enabled = false;
+	wl_list_remove(&so->dmabuf.capture_listener.link);
+
+	weston_capture_wait_cancel(so->dmabuf.wait);
+	so->dmabuf.wait = NULL;
+	so->dmabuf.creating = NULL;
+
+	wl_list_for_each_safe(db, tmp, &so->dmabuf.buffers, link)
+		ss_dmabuf_buffer_destroy(db);
+}
+
+static bool
+shared_output_dmabuf_enable(struct shared_output *so)
+{
+	/* Without a renderer sharing its buffers, as with pixman, the
+	 * pixels are copied out */
+	if (!so->output->capture_dmabuf || !so->parent.dmabuf ||
+	    so->parent.compositor_version < 3)
+		return false;
+
+	so->dmabuf.enabled = true;
+	so->dmabuf.capture_listener.notify = shared_output_captured;
+	wl_signal_add(&so->output->capture_signal,
+		      &so->dmabuf.capture_listener);
+
+	return true;
 }
 
 static struct shared_output *
@@ -971,6 +1250,8 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	/* Ok, everything's created.  We should be good to go */
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
+	wl_list_init(&so->pending_reads);
+	wl_list_init(&so->dmabuf.buffers);
 
 	so->output = output;
 	so->output_destroyed.notify = output_destroyed;
@@ -979,6 +1260,9 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	so->frame_listener.notify = shared_output_repainted;
 	wl_signal_add(&output->frame_signal, &so->frame_listener);
 	output->disable_planes++;
+	if (shared_output_dmabuf_enable(so))
+		weston_log("Screen share: passing on output buffers as "
+			   "dmabufs\n");
 	weston_output_damage(output);
 
 	return so;
@@ -998,9 +1282,21 @@ static void
 shared_output_destroy(struct shared_output *so)
 {
 	struct ss_shm_buffer *buffer, *bnext;
+	struct ss_read *read, *rnext;
 
 	so->output->disable_planes--;
 
+	shared_output_dmabuf_disable(so);
+	if (so->parent.dmabuf)
+		zwp_linux_dmabuf_v1_destroy(so->parent.dmabuf);
+
+	/* Reads still in flight complete into nothing */
+	wl_list_for_each_safe(read, rnext, &so->pending_reads, link) {
+		read->output = NULL;
+		wl_list_remove(&read->link);
+		wl_list_init(&read->link);
+	}
+
 	wl_list_for_each_safe(buffer, bnext, &so->shm.buffers, link)
 		ss_shm_buffer_destroy(buffer);
 	wl_list_for_each_safe(buffer, bnext, &so->shm.free_buffers, free_link)
@@ -1013,7 +1309,6 @@ shared_output_destroy(struct shared_output *so)
 	wl_list_remove(&so->frame_listener.link);
 
 	pixman_image_unref(so->cache_image);
-	free(so->tmp_data);
 
 	free(so);
 }
@@ -25,6 +25,7 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,10 +36,18 @@
 
 #include "compositor.h"
 #include "shared/helpers.h"
+#include "shared/os-compatibility.h"
+
+/* The most moved between two fds per callback */
+#define CLIPBOARD_CHUNK_SIZE (64 * 1024)
 
 struct clipboard_source {
 	struct weston_data_source base;
-	struct wl_array contents;
+	/* The selection is kept in an anonymous file rather than on the
+	 * heap, so that it is spliced in and out without copies and
+	 * released in one go */
+	int contents_fd;
+	size_t size;
 	struct clipboard *clipboard;
 	struct wl_event_source *event_source;
 	uint32_t serial;
@@ -73,35 +82,84 @@ clipboard_source_unref(struct clipboard_source *source)
 	s = source->base.mime_types.data;
 	free(*s);
 	wl_array_release(&source->base.mime_types);
-	wl_array_release(&source->contents);
+	close(source->contents_fd);
 	free(source);
 }
 
+/* Copies through a buffer, for fds splice() does not support */
+static ssize_t
+clipboard_copy(int in, loff_t *in_offset, int out, loff_t *out_offset,
+	       size_t size)
+{
+	char buffer[4096];
+	ssize_t len, written;
+
+	if (size > sizeof buffer)
+		size = sizeof buffer;
+
+	if (in_offset)
+		len = pread(in, buffer, size, *in_offset);
+	else
+		len = read(in, buffer, size);
+	if (len <= 0)
+		return len;
+
+	if (out_offset)
+		written = pwrite(out, buffer, len, *out_offset);
+	else
+		written = write(out, buffer, len);
+	if (written < 0)
+		return -1;
+	if (written == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* A short write is fine if the rest can be read again, out may be
+	 * non-blocking */
+	if (written < len && !in_offset) {
+		errno = EIO;
+		return -1;
+	}
+
+	return written;
+}
+
+static ssize_t
+clipboard_splice(int in, loff_t *in_offset, int out, loff_t *out_offset,
+		 size_t size)
+{
+	ssize_t len;
+
+	len = splice(in, in_offset, out, out_offset, size,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (len < 0 && errno == EINVAL)
+		len = clipboard_copy(in, in_offset, out, out_offset, size);
+
+	return len;
+}
+
 static int
 clipboard_source_data(int fd, uint32_t mask, void *data)
 {
 	struct clipboard_source *source = data;
 	struct clipboard *clipboard = source->clipboard;
-	char *p;
-	int len, size;
+	loff_t offset = source->size;
+	ssize_t len;
 
-	if (source->contents.alloc - source->contents.size < 1024) {
-		wl_array_add(&source->contents, 1024);
-		source->contents.size -= 1024;
-	}
-
-	p = source->contents.data + source->contents.size;
-	size = source->contents.alloc - source->contents.size;
-	len = read(fd, p, size);
+	len = clipboard_splice(fd, NULL, source->contents_fd, &offset,
+			       CLIPBOARD_CHUNK_SIZE);
 	if (len == 0) {
 		wl_event_source_remove(source->event_source);
 		close(fd);
 		source->event_source = NULL;
+	} else if (len < 0 && errno == EAGAIN) {
+		/* Spurious wakeup */
 	} else if (len < 0) {
 		clipboard_source_unref(source);
 		clipboard->source = NULL;
 	} else {
-		source->contents.size += len;
+		source->size += len;
 	}
 
 	return 1;
@@ -146,7 +204,12 @@ clipboard_source_create(struct clipboard *clipboard,
 	if (source == NULL)
 		return NULL;
 
-	wl_array_init(&source->contents);
+	source->contents_fd = os_create_anonymous_file(CLIPBOARD_CHUNK_SIZE);
+	if (source->contents_fd < 0) {
+		free(source);
+		return NULL;
+	}
+
 	wl_array_init(&source->base.mime_types);
 	source->base.resource = NULL;
 	source->base.accept = clipboard_source_accept;
@@ -177,6 +240,7 @@ clipboard_source_create(struct clipboard *clipboard,
  err_strdup:
 	wl_array_release(&source->base.mime_types);
  err_add:
+	close(source->contents_fd);
 	free(source);
 
 	return NULL;
@@ -192,17 +256,22 @@ static int
 clipboard_client_data(int fd, uint32_t mask, void *data)
 {
 	struct clipboard_client *client = data;
-	char *p;
+	loff_t offset = client->offset;
 	size_t size;
-	int len;
+	ssize_t len;
+
+	size = client->source->size - client->offset;
+	if (size > CLIPBOARD_CHUNK_SIZE)
+		size = CLIPBOARD_CHUNK_SIZE;
 
-	size = client->source->contents.size;
-	p = client->source->contents.data;
-	len = write(fd, p + client->offset, size - client->offset);
+	len = clipboard_splice(client->source->contents_fd, &offset,
+			       fd, NULL, size);
+	if (len < 0 && errno == EAGAIN)
+		return 1;
 	if (len > 0)
 		client->offset += len;
 
-	if (client->offset == size || len <= 0) {
+	if (client->offset == client->source->size || len <= 0) {
 		close(fd);
 		wl_event_source_remove(client->event_source);
 		clipboard_source_unref(client->source);
@@ -224,6 +293,9 @@ clipboard_client_create(struct clipboard_source *source, int fd)
 	if (client == NULL)
 		return;
 
+	/* A client reading slowly must not stall the compositor */
+	fcntl(fd, F_SETFL, O_WRONLY | O_NONBLOCK);
+
 	client->source = source;
 	source->refcount++;
 	client->event_source =
@@ -31,6 +31,7 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
@@ -171,6 +172,8 @@ enum wdrm_plane_property {
 	WDRM_PLANE_FB_ID,
 	WDRM_PLANE_CRTC_ID,
 	WDRM_PLANE_IN_FORMATS,
+	WDRM_PLANE_COLOR_ENCODING,
+	WDRM_PLANE_COLOR_RANGE,
 	WDRM_PLANE__COUNT
 };
 
@@ -196,6 +199,46 @@ static struct drm_property_enum_info plane_type_enums[] = {
 	},
 };
 
+/**
+ * Possible values for the WDRM_PLANE_COLOR_ENCODING property.
+ */
+enum wdrm_plane_color_encoding {
+	WDRM_PLANE_COLOR_ENCODING_BT601 = 0,
+	WDRM_PLANE_COLOR_ENCODING_BT709,
+	WDRM_PLANE_COLOR_ENCODING_BT2020,
+	WDRM_PLANE_COLOR_ENCODING__COUNT
+};
+
+static struct drm_property_enum_info plane_color_encoding_enums[] = {
+	[WDRM_PLANE_COLOR_ENCODING_BT601] = {
+		.name = "ITU-R BT.601 YCbCr",
+	},
+	[WDRM_PLANE_COLOR_ENCODING_BT709] = {
+		.name = "ITU-R BT.709 YCbCr",
+	},
+	[WDRM_PLANE_COLOR_ENCODING_BT2020] = {
+		.name = "ITU-R BT.2020 YCbCr",
+	},
+};
+
+/**
+ * Possible values for the WDRM_PLANE_COLOR_RANGE property.
+ */
+enum wdrm_plane_color_range {
+	WDRM_PLANE_COLOR_RANGE_LIMITED = 0,
+	WDRM_PLANE_COLOR_RANGE_FULL,
+	WDRM_PLANE_COLOR_RANGE__COUNT
+};
+
+static struct drm_property_enum_info plane_color_range_enums[] = {
+	[WDRM_PLANE_COLOR_RANGE_LIMITED] = {
+		.name = "YCbCr limited range",
+	},
+	[WDRM_PLANE_COLOR_RANGE_FULL] = {
+		.name = "YCbCr full range",
+	},
+};
+
 static const struct drm_property_info plane_props[] = {
 	[WDRM_PLANE_TYPE] = {
 		.name = "type",
@@ -213,6 +256,16 @@ static const struct drm_property_info plane_props[] = {
 	[WDRM_PLANE_FB_ID] = { .name = "FB_ID", },
 	[WDRM_PLANE_CRTC_ID] = { .name = "CRTC_ID", },
 	[WDRM_PLANE_IN_FORMATS] = { .name = "IN_FORMATS" },
+	[WDRM_PLANE_COLOR_ENCODING] = {
+		.name = "COLOR_ENCODING",
+		.enum_values = plane_color_encoding_enums,
+		.num_enum_values = WDRM_PLANE_COLOR_ENCODING__COUNT,
+	},
+	[WDRM_PLANE_COLOR_RANGE] = {
+		.name = "COLOR_RANGE",
+		.enum_values = plane_color_range_enums,
+		.num_enum_values = WDRM_PLANE_COLOR_RANGE__COUNT,
+	},
 };
 
 /**
@@ -223,6 +276,7 @@ enum wdrm_connector_property {
 	WDRM_CONNECTOR_DPMS,
 	WDRM_CONNECTOR_CRTC_ID,
 	WDRM_CONNECTOR_NON_DESKTOP,
+	WDRM_CONNECTOR_HDR_OUTPUT_METADATA,
 	WDRM_CONNECTOR__COUNT
 };
 
@@ -258,6 +312,29 @@ static const struct drm_property_info connector_props[] = {
 	},
 	[WDRM_CONNECTOR_CRTC_ID] = { .name = "CRTC_ID", },
 	[WDRM_CONNECTOR_NON_DESKTOP] = { .name = "non-desktop", },
+	[WDRM_CONNECTOR_HDR_OUTPUT_METADATA] = { .name = "HDR_OUTPUT_METADATA", },
+};
+
+/**
+ * Payload of the HDR_OUTPUT_METADATA connector blob, laid out as the
+ * kernel's struct hdr_output_metadata; older libdrm headers lack it.
+ */
+struct drm_hdr_output_metadata {
+	uint32_t metadata_type; /**< HDMI_STATIC_METADATA_TYPE1, i.e. 0 */
+	struct {
+		uint8_t eotf; /**< enum hdr_metadata_eotf */
+		uint8_t metadata_type;
+		struct {
+			uint16_t x, y;
+		} display_primaries[3];
+		struct {
+			uint16_t x, y;
+		} white_point;
+		uint16_t max_display_mastering_luminance;
+		uint16_t min_display_mastering_luminance;
+		uint16_t max_cll;
+		uint16_t max_fall;
+	} hdmi_metadata_type1;
 };
 
 /**
@@ -335,6 +412,7 @@ struct drm_backend {
 
 	int use_pixman;
 	bool use_pixman_shadow;
+	unsigned int pixman_buffers;
 
 	struct udev_input input;
 
@@ -349,6 +427,15 @@ struct drm_backend {
 
 	bool fb_modifiers;
 
+	/* Framebuffers imported from client buffers, kept until the
+	 * buffer is destroyed. struct drm_fb_cache_entry::link */
+	struct wl_list fb_cache;
+	uint64_t fb_cache_hits;
+	uint64_t fb_cache_misses;
+
+	/* State proposals skipped as known to fail */
+	uint64_t proposals_skipped;
+
 	struct weston_debug_scope *debug;
 };
 
@@ -389,6 +476,28 @@ struct drm_fb {
 
 	/* Used by dumb fbs */
 	void *map;
+
+	/* Set while the client buffer cache holds a reference */
+	struct drm_fb_cache_entry *cache_entry;
+};
+
+/**
+ * Framebuffers for a client buffer
+ *
+ * Importing a client buffer and adding a KMS framebuffer for it takes a
+ * few ioctls, and clients cycle through a handful of buffers. The cache
+ * keeps a reference on the framebuffers until the buffer is destroyed.
+ * While only the cache references a framebuffer, it does not keep the
+ * client buffer busy.
+ */
+struct drm_fb_cache_entry {
+	struct wl_list link; /* drm_backend::fb_cache */
+	struct weston_buffer *buffer;
+	struct wl_listener buffer_destroy_listener;
+
+	/* Indexed by whether the view was opaque, which picks the format */
+	struct drm_fb *fb[2];
+	bool failed[2];	/**< the buffer cannot be scanned out */
 };
 
 struct drm_edid {
@@ -431,6 +540,11 @@ struct drm_output_state {
 	struct wl_list link;
 	enum dpms_enum dpms;
 	struct wl_list plane_list;
+
+	/* Signal sent to the sink; eotf is SDR when no metadata is sent */
+	enum hdr_metadata_eotf eotf;
+	uint32_t colorspace; /**< enum weston_colorspace_enums */
+	struct drm_hdr_output_metadata hdr_metadata;
 };
 
 /**
@@ -454,6 +568,9 @@ struct drm_plane_state {
 	int32_t dest_x, dest_y;
 	uint32_t dest_w, dest_h;
 
+	enum wdrm_plane_color_encoding color_encoding;
+	enum wdrm_plane_color_range color_range;
+
 	bool complete;
 
 	struct wl_list link; /* drm_output_state::plane_list */
@@ -516,6 +633,28 @@ struct drm_head {
 	uint32_t inherited_crtc_id;	/**< Original CRTC assignment */
 };
 
+/* Most framebuffers an output cycles through with the Pixman-renderer */
+#define DRM_OUTPUT_MAX_DUMB 3
+
+/* Scenes whose state proposals are remembered per output */
+#define DRM_PROPOSE_MEMO_SIZE 16
+/* Frames after which a proposal known to fail is tried again */
+#define DRM_PROPOSE_MEMO_RETRY_FRAMES 120
+
+/**
+ * Outcome of the state proposals for a scene
+ *
+ * The key hashes everything about the views on an output which decides
+ * whether they can go on planes, but not the buffer contents, so it
+ * stays the same while clients cycle through their buffers.
+ */
+struct drm_propose_memo {
+	uint64_t key;
+	uint32_t failed_modes; /**< bitmask of drm_output_propose_state_mode */
+	uint32_t failed_frame; /**< drm_output::propose_frame of a failure */
+	uint32_t used_frame;   /**< for replacing the least recently used */
+};
+
 struct drm_output {
 	struct weston_output base;
 	struct drm_backend *backend;
@@ -551,10 +690,17 @@ struct drm_output {
 	 * yet acknowledged completion of state_cur. */
 	struct drm_output_state *state_last;
 
-	struct drm_fb *dumb[2];
-	pixman_image_t *image[2];
-	int current_image;
-	pixman_region32_t previous_damage;
+	/* Last HDR_OUTPUT_METADATA blob created for this output */
+	struct drm_hdr_output_metadata hdr_blob_data;
+	uint32_t hdr_blob_id;
+
+	/* Pixman-renderer framebuffers, used round-robin. The damage
+	 * of a buffer is what changed since it was last drawn to. */
+	struct drm_fb *dumb[DRM_OUTPUT_MAX_DUMB];
+	pixman_image_t *image[DRM_OUTPUT_MAX_DUMB];
+	pixman_region32_t dumb_damage[DRM_OUTPUT_MAX_DUMB];
+	unsigned int num_dumb;
+	unsigned int current_image;
 
 	struct vaapi_recorder *recorder;
 	struct wl_listener recorder_frame_listener;
@@ -564,6 +710,12 @@ struct drm_output {
 	bool virtual;
 
 	submit_frame_cb virtual_submit_frame;
+
+	/** Capture frames still holding one of our buffers */
+	struct wl_list capture_frames; /* drm_capture_frame::link */
+
+	struct drm_propose_memo propose_memo[DRM_PROPOSE_MEMO_SIZE];
+	uint32_t propose_frame;
 };
 
 static const char *const aspect_ratio_as_string[] = {
@@ -1334,7 +1486,8 @@ err_free:
 static void
 drm_fb_set_buffer(struct drm_fb *fb, struct weston_buffer *buffer)
 {
-	assert(fb->buffer_ref.buffer == NULL);
+	assert(fb->buffer_ref.buffer == NULL ||
+	       (fb->cache_entry && fb->buffer_ref.buffer == buffer));
 	assert(fb->type == BUFFER_CLIENT || fb->type == BUFFER_DMABUF);
 	weston_buffer_reference(&fb->buffer_ref, buffer);
 }
@@ -1346,8 +1499,12 @@ drm_fb_unref(struct drm_fb *fb)
 		return;
 
 	assert(fb->refcnt > 0);
-	if (--fb->refcnt > 0)
+	if (--fb->refcnt > 0) {
+		/* Only the cache is left; let the client have it back */
+		if (fb->cache_entry && fb->refcnt == 1)
+			weston_buffer_reference(&fb->buffer_ref, NULL);
 		return;
+	}
 
 	switch (fb->type) {
 	case BUFFER_PIXMAN_DUMB:
@@ -1594,6 +1751,164 @@ drm_plane_state_coords_for_view(struct drm_plane_state *state,
 	return true;
 }
 
+/**
+ * Primaries of a surface's content. Surfaces that never said are taken to
+ * be BT.709, like the SDR output signal.
+ */
+static uint32_t
+drm_surface_primaries(struct weston_surface *surface)
+{
+	if (surface->colorspace == WESTON_CS_UNDEFINED)
+		return WESTON_CS_BT709;
+
+	return surface->colorspace;
+}
+
+/**
+ * Check whether a view can be shown on a plane without passing through the
+ * renderer: planes hand pixels to the sink untouched, so the view has to
+ * use the transfer function and primaries the connector is signalling.
+ */
+static bool
+drm_view_matches_output_signal(struct drm_output_state *state,
+			       struct weston_view *ev)
+{
+	enum hdr_metadata_eotf eotf = weston_surface_get_eotf(ev->surface);
+
+	if (eotf != state->eotf)
+		return false;
+
+	if (eotf == EOTF_TRADITIONAL_GAMMA_SDR)
+		return true;
+
+	return drm_surface_primaries(ev->surface) == state->colorspace;
+}
+
+/**
+ * Pick the YCbCr to RGB conversion a plane needs to apply to a view, and
+ * check the plane can do it. RGB buffers need no conversion.
+ */
+static bool
+drm_plane_state_color_for_view(struct drm_plane_state *state,
+			       struct drm_fb *fb, struct weston_view *ev)
+{
+	struct drm_plane *plane = state->plane;
+	struct drm_property_info *info;
+
+	state->color_encoding = WDRM_PLANE_COLOR_ENCODING_BT601;
+	state->color_range = WDRM_PLANE_COLOR_RANGE_LIMITED;
+
+	if (fb->format->num_planes <= 1 && fb->format->hsub <= 1)
+		return true;
+
+	switch (ev->surface->colorspace) {
+	case WESTON_CS_BT709:
+	case WESTON_CS_SRGB:
+		state->color_encoding = WDRM_PLANE_COLOR_ENCODING_BT709;
+		break;
+	case WESTON_CS_BT2020:
+		state->color_encoding = WDRM_PLANE_COLOR_ENCODING_BT2020;
+		break;
+	default:
+		break;
+	}
+
+	/* Without the property, planes are assumed to only do BT.601 */
+	info = &plane->props[WDRM_PLANE_COLOR_ENCODING];
+	if (info->prop_id == 0)
+		return state->color_encoding == WDRM_PLANE_COLOR_ENCODING_BT601;
+
+	return info->enum_values[state->color_encoding].valid;
+}
+
+static void
+drm_fb_cache_entry_destroy(struct drm_fb_cache_entry *entry)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_LENGTH(entry->fb); i++) {
+		if (!entry->fb[i])
+			continue;
+
+		/* A framebuffer still on screen lives on without the cache */
+		entry->fb[i]->cache_entry = NULL;
+		drm_fb_unref(entry->fb[i]);
+	}
+
+	wl_list_remove(&entry->buffer_destroy_listener.link);
+	wl_list_remove(&entry->link);
+	free(entry);
+}
+
+static void
+drm_fb_cache_handle_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct drm_fb_cache_entry *entry =
+		container_of(listener, struct drm_fb_cache_entry,
+			     buffer_destroy_listener);
+
+	drm_fb_cache_entry_destroy(entry);
+}
+
+static struct drm_fb_cache_entry *
+drm_fb_cache_get(struct drm_backend *b, struct weston_buffer *buffer)
+{
+	struct drm_fb_cache_entry *entry;
+	struct wl_listener *listener;
+
+	listener = wl_signal_get(&buffer->destroy_signal,
+				 drm_fb_cache_handle_buffer_destroy);
+	if (listener)
+		return container_of(listener, struct drm_fb_cache_entry,
+				    buffer_destroy_listener);
+
+	entry = zalloc(sizeof *entry);
+	if (!entry)
+		return NULL;
+
+	entry->buffer = buffer;
+	entry->buffer_destroy_listener.notify =
+		drm_fb_cache_handle_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal,
+		      &entry->buffer_destroy_listener);
+	wl_list_insert(&b->fb_cache, &entry->link);
+
+	return entry;
+}
+
+static void
+drm_fb_cache_release(struct drm_backend *b)
+{
+	struct drm_fb_cache_entry *entry, *tmp;
+
+	wl_list_for_each_safe(entry, tmp, &b->fb_cache, link)
+		drm_fb_cache_entry_destroy(entry);
+}
+
+static struct drm_fb *
+drm_fb_import_buffer(struct drm_backend *b, struct weston_buffer *buffer,
+		     bool is_opaque)
+{
+	struct linux_dmabuf_buffer *dmabuf;
+	struct drm_fb *fb;
+	struct gbm_bo *bo;
+
+	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+	if (dmabuf)
+		return drm_fb_get_from_dmabuf(dmabuf, b, is_opaque);
+
+	bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
+			   buffer->resource, GBM_BO_USE_SCANOUT);
+	if (!bo)
+		return NULL;
+
+	fb = drm_fb_get_from_bo(bo, b, is_opaque, BUFFER_CLIENT);
+	if (!fb)
+		gbm_bo_destroy(bo);
+
+	return fb;
+}
+
 static struct drm_fb *
 drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
 {
@@ -1601,7 +1916,7 @@ drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
 	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
 	bool is_opaque = weston_view_is_opaque(ev, &ev->transform.boundingbox);
-	struct linux_dmabuf_buffer *dmabuf;
+	struct drm_fb_cache_entry *entry;
 	struct drm_fb *fb;
 
 	if (ev->alpha != 1.0f)
@@ -1620,23 +1935,24 @@ drm_fb_get_from_view(struct drm_output_state *state, struct weston_view *ev)
 	if (!b->gbm)
 		return NULL;
 
-	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
-	if (dmabuf) {
-		fb = drm_fb_get_from_dmabuf(dmabuf, b, is_opaque);
+	entry = drm_fb_cache_get(b, buffer);
+	if (entry && (entry->fb[is_opaque] || entry->failed[is_opaque])) {
+		b->fb_cache_hits++;
+		fb = entry->fb[is_opaque];
 		if (!fb)
 			return NULL;
+		drm_fb_ref(fb);
 	} else {
-		struct gbm_bo *bo;
-
-		bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
-				   buffer->resource, GBM_BO_USE_SCANOUT);
-		if (!bo)
+		b->fb_cache_misses++;
+		fb = drm_fb_import_buffer(b, buffer, is_opaque);
+		if (entry && !fb)
+			entry->failed[is_opaque] = true;
+		if (!fb)
 			return NULL;
 
-		fb = drm_fb_get_from_bo(bo, b, is_opaque, BUFFER_CLIENT);
-		if (!fb) {
-			gbm_bo_destroy(bo);
-			return NULL;
+		if (entry) {
+			entry->fb[is_opaque] = drm_fb_ref(fb);
+			fb->cache_entry = entry;
 		}
 	}
 
@@ -1691,6 +2007,8 @@ drm_output_state_alloc(struct drm_output *output,
 	assert(state);
 	state->output = output;
 	state->dpms = WESTON_DPMS_OFF;
+	state->eotf = EOTF_TRADITIONAL_GAMMA_SDR;
+	state->colorspace = WESTON_CS_BT709;
 	state->pending_state = pending_state;
 	if (pending_state)
 		wl_list_insert(&pending_state->output_list, &state->link);
@@ -1999,6 +2317,13 @@ drm_output_prepare_scanout_view(struct drm_output_state *output_state,
 	assert(!b->sprites_are_broken);
 	assert(mode == DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY);
 
+	/* Capture consumers only get the frames the renderer draws */
+	if (!wl_list_empty(&output->base.capture_signal.listener_list)) {
+		drm_debug(b, "\t\t\t\t[scanout] not placing view %p on scanout: "
+			     "output is being captured\n", ev);
+		return NULL;
+	}
+
 	/* Check the view spans exactly the output size, calculated in the
 	 * logical co-ordinate space. */
 	extents = pixman_region32_extents(&ev->transform.boundingbox);
@@ -2035,6 +2360,12 @@ drm_output_prepare_scanout_view(struct drm_output_state *output_state,
 	if (!drm_plane_state_coords_for_view(state, ev))
 		goto err;
 
+	if (!drm_plane_state_color_for_view(state, fb, ev)) {
+		drm_debug(b, "\t\t\t\t[scanout] not placing view %p on scanout: "
+			     "unsupported color encoding\n", ev);
+		goto err;
+	}
+
 	if (state->dest_x != 0 || state->dest_y != 0 ||
 	    state->dest_w != (unsigned) output->base.current_mode->width ||
 	    state->dest_h != (unsigned) output->base.current_mode->height)
@@ -2092,16 +2423,29 @@ drm_output_render_pixman(struct drm_output_state *state,
 	struct drm_output *output = state->output;
 	struct weston_compositor *ec = output->base.compositor;
 
-	output->current_image ^= 1;
+	pixman_region32_t *stale;
+	unsigned int i;
+
+	output->current_image = (output->current_image + 1) % output->num_dumb;
+	stale = &output->dumb_damage[output->current_image];
+
+	/* Only what changed since the buffer was last drawn to needs
+	 * repainting, or with a shadow buffer, copying. */
+	pixman_region32_intersect_rect(stale, stale,
+				       output->base.x, output->base.y,
+				       output->base.width, output->base.height);
 
 	pixman_renderer_output_set_buffer(&output->base,
 					  output->image[output->current_image]);
-	pixman_renderer_output_set_hw_extra_damage(&output->base,
-						   &output->previous_damage);
+	pixman_renderer_output_set_hw_extra_damage(&output->base, stale);
 
 	ec->renderer->repaint_output(&output->base, damage);
 
-	pixman_region32_copy(&output->previous_damage, damage);
+	for (i = 0; i < output->num_dumb; i++)
+		pixman_region32_union(&output->dumb_damage[i],
+				      &output->dumb_damage[i], damage);
+	pixman_region32_fini(stale);
+	pixman_region32_init(stale);
 
 	return drm_fb_ref(output->dumb[output->current_image]);
 }
@@ -2161,6 +2505,109 @@ drm_output_render(struct drm_output_state *state, pixman_region32_t *damage)
 				 &c->primary_plane.damage, damage);
 }
 
+/** A rendered framebuffer lent to capture consumers */
+struct drm_capture_frame {
+	struct weston_capture_frame base;
+	struct drm_fb *fb;	/* NULL once the output let go of its buffers */
+	struct wl_list link;	/* drm_output::capture_frames */
+};
+
+static int
+drm_fb_export_plane(struct drm_backend *b, struct drm_fb *fb, int plane)
+{
+	int fd, ret;
+
+	ret = drmPrimeHandleToFD(b->drm.fd, fb->handles[plane],
+				 DRM_CLOEXEC, &fd);
+	if (ret) {
+		weston_log("drmPrimeHandleFD failed, errno=%d\n", errno);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+drm_capture_frame_destroy(struct weston_capture_frame *base)
+{
+	struct drm_capture_frame *frame =
+		container_of(base, struct drm_capture_frame, base);
+
+	drm_fb_unref(frame->fb);
+	wl_list_remove(&frame->link);
+	free(frame);
+}
+
+/* The buffers go away with the GBM surface; consumers keep their dmabuf
+ * fds, which hold on to the memory. */
+static void
+drm_output_release_capture_frames(struct drm_output *output)
+{
+	struct drm_capture_frame *frame, *tmp;
+
+	wl_list_for_each_safe(frame, tmp, &output->capture_frames, link) {
+		drm_fb_unref(frame->fb);
+		frame->fb = NULL;
+		wl_list_remove(&frame->link);
+		wl_list_init(&frame->link);
+	}
+}
+
+/** Share the framebuffer just rendered with capture consumers
+ *
+ * Only buffers the renderer drew into are shared. While consumers hold
+ * references to enough of them that the next repaint would find no free
+ * buffer, frames are skipped instead, which consumers are told about so
+ * they can ask for a repaint once they let go of one.
+ */
+static void
+drm_output_send_capture(struct drm_output *output, struct drm_fb *fb)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_capture_frame *frame;
+	int i;
+
+	if (wl_list_empty(&output->base.capture_signal.listener_list))
+		return;
+
+	if (fb->type != BUFFER_GBM_SURFACE ||
+	    !gbm_surface_has_free_buffers(output->gbm_surface))
+		goto skip;
+
+	frame = zalloc(sizeof *frame);
+	if (!frame)
+		goto skip;
+
+	weston_capture_frame_init(&frame->base, &output->base);
+	frame->base.destroy = drm_capture_frame_destroy;
+	frame->base.width = fb->width;
+	frame->base.height = fb->height;
+	frame->base.format = fb->format->format;
+	frame->base.modifier = fb->modifier;
+	frame->base.n_planes = fb->num_planes;
+	frame->fb = drm_fb_ref(fb);
+	wl_list_insert(&output->capture_frames, &frame->link);
+
+	for (i = 0; i < fb->num_planes; i++) {
+		frame->base.fd[i] = drm_fb_export_plane(b, fb, i);
+		if (frame->base.fd[i] < 0) {
+			weston_capture_frame_unref(&frame->base);
+			goto skip;
+		}
+		frame->base.offset[i] = fb->offsets[i];
+		frame->base.stride[i] = fb->strides[i];
+	}
+
+	frame->base.fence_fd = gl_renderer->create_fence_fd(&output->base);
+
+	wl_signal_emit(&output->base.capture_signal, &frame->base);
+	weston_capture_frame_unref(&frame->base);
+	return;
+
+skip:
+	wl_signal_emit(&output->base.capture_signal, NULL);
+}
+
 static void
 drm_output_set_gamma(struct weston_output *output_base,
 		     uint16_t size, uint16_t *r, uint16_t *g, uint16_t *b)
@@ -2476,6 +2923,60 @@ drm_mode_ensure_blob(struct drm_backend *backend, struct drm_mode *mode)
 	return ret;
 }
 
+static int
+plane_add_enum_prop(drmModeAtomicReq *req, struct drm_plane *plane,
+		    enum wdrm_plane_property prop, unsigned int enum_value)
+{
+	struct drm_property_info *info = &plane->props[prop];
+
+	if (enum_value >= info->num_enum_values ||
+	    !info->enum_values[enum_value].valid)
+		return -1;
+
+	return plane_add_prop(req, plane, prop,
+			      info->enum_values[enum_value].value);
+}
+
+/**
+ * Return a blob holding the state's HDR metadata, reusing the last one
+ * created for the output when the metadata has not changed.
+ */
+static int
+drm_output_ensure_hdr_blob(struct drm_output_state *state, uint32_t *blob_id)
+{
+	struct drm_output *output = state->output;
+	struct drm_backend *b = output->backend;
+	uint32_t id;
+	int ret;
+
+	if (output->hdr_blob_id &&
+	    memcmp(&output->hdr_blob_data, &state->hdr_metadata,
+		   sizeof(state->hdr_metadata)) == 0) {
+		*blob_id = output->hdr_blob_id;
+		return 0;
+	}
+
+	ret = drmModeCreatePropertyBlob(b->drm.fd, &state->hdr_metadata,
+					sizeof(state->hdr_metadata), &id);
+	if (ret != 0) {
+		weston_log("failed to create HDR metadata blob: %m\n");
+		return ret;
+	}
+
+	drm_debug(b, "\t\t\t[atomic] created new HDR metadata blob %lu "
+		     "for output %s\n", (unsigned long) id, output->base.name);
+
+	/* Committed connector state holds its own reference to the blob,
+	 * so the previous one can be dropped straight away. */
+	if (output->hdr_blob_id)
+		drmModeDestroyPropertyBlob(b->drm.fd, output->hdr_blob_id);
+	output->hdr_blob_id = id;
+	output->hdr_blob_data = state->hdr_metadata;
+	*blob_id = id;
+
+	return 0;
+}
+
 static int
 drm_output_apply_state_atomic(struct drm_output_state *state,
 			      drmModeAtomicReq *req,
@@ -2486,6 +2987,7 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 	struct drm_plane_state *plane_state;
 	struct drm_mode *current_mode = to_drm_mode(output->base.current_mode);
 	struct drm_head *head;
+	uint32_t hdr_blob_id = 0;
 	int ret = 0;
 
 	drm_debug(b, "\t\t[atomic] %s output %lu (%s) state\n",
@@ -2497,11 +2999,27 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 		*flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
 	}
 
+	/* Some drivers need a full modeset to start or stop sending HDR
+	 * infoframes, or to change their contents. */
+	if (state->eotf != output->state_cur->eotf ||
+	    memcmp(&state->hdr_metadata, &output->state_cur->hdr_metadata,
+		   sizeof(state->hdr_metadata)) != 0) {
+		drm_debug(b, "\t\t\t[atomic] HDR metadata differs, "
+			     "modeset OK\n");
+		*flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+
 	if (state->dpms == WESTON_DPMS_ON) {
 		ret = drm_mode_ensure_blob(b, current_mode);
 		if (ret != 0)
 			return ret;
 
+		if (state->eotf != EOTF_TRADITIONAL_GAMMA_SDR) {
+			ret = drm_output_ensure_hdr_blob(state, &hdr_blob_id);
+			if (ret != 0)
+				return ret;
+		}
+
 		ret |= crtc_add_prop(req, output, WDRM_CRTC_MODE_ID,
 				     current_mode->blob_id);
 		ret |= crtc_add_prop(req, output, WDRM_CRTC_ACTIVE, 1);
@@ -2511,6 +3029,14 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 		wl_list_for_each(head, &output->base.head_list, base.output_link) {
 			ret |= connector_add_prop(req, head, WDRM_CONNECTOR_CRTC_ID,
 						  output->crtc_id);
+
+			/* Fails for heads without the property if we want
+			 * HDR, but clears it otherwise. */
+			if (hdr_blob_id ||
+			    head->props_conn[WDRM_CONNECTOR_HDR_OUTPUT_METADATA].prop_id)
+				ret |= connector_add_prop(req, head,
+							  WDRM_CONNECTOR_HDR_OUTPUT_METADATA,
+							  hdr_blob_id);
 		}
 	} else {
 		ret |= crtc_add_prop(req, output, WDRM_CRTC_MODE_ID, 0);
@@ -2551,6 +3077,15 @@ drm_output_apply_state_atomic(struct drm_output_state *state,
 		ret |= plane_add_prop(req, plane, WDRM_PLANE_CRTC_H,
 				      plane_state->dest_h);
 
+		if (plane->props[WDRM_PLANE_COLOR_ENCODING].prop_id)
+			ret |= plane_add_enum_prop(req, plane,
+						   WDRM_PLANE_COLOR_ENCODING,
+						   plane_state->color_encoding);
+		if (plane->props[WDRM_PLANE_COLOR_RANGE].prop_id)
+			ret |= plane_add_enum_prop(req, plane,
+						   WDRM_PLANE_COLOR_RANGE,
+						   plane_state->color_range);
+
 		if (ret != 0) {
 			weston_log("couldn't set plane state\n");
 			return ret;
@@ -2912,6 +3447,8 @@ drm_output_repaint(struct weston_output *output_base,
 	if (!scanout_state || !scanout_state->fb)
 		goto err;
 
+	drm_output_send_capture(output, scanout_state->fb);
+
 	return 0;
 
 err:
@@ -3082,6 +3619,12 @@ drm_repaint_begin(struct weston_compositor *compositor)
 		char *dbg = weston_compositor_print_scene_graph(compositor);
 		drm_debug(b, "[repaint] Beginning repaint; pending_state %p\n",
 			  ret);
+		drm_debug(b, "[repaint] framebuffer cache: %" PRIu64 " hits, "
+			  "%" PRIu64 " misses, %d buffers\n",
+			  b->fb_cache_hits, b->fb_cache_misses,
+			  wl_list_length(&b->fb_cache));
+		drm_debug(b, "[repaint] %" PRIu64 " state proposals skipped "
+			  "as known to fail\n", b->proposals_skipped);
 		drm_debug(b, "%s", dbg);
 		free(dbg);
 	}
@@ -3241,6 +3784,14 @@ drm_output_prepare_overlay_view(struct drm_output_state *output_state,
 			state = NULL;
 			continue;
 		}
+		if (!drm_plane_state_color_for_view(state, fb, ev)) {
+			drm_debug(b, "\t\t\t\t[overlay] not placing view %p on overlay %lu: "
+				     "unsupported color encoding\n",
+				  ev, (unsigned long) p->plane_id);
+			drm_plane_state_put_back(state);
+			state = NULL;
+			continue;
+		}
 
 		/* We hold one reference for the lifetime of this function;
 		 * from calling drm_fb_get_from_view, to the out label where
@@ -3498,6 +4049,118 @@ err:
 	drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
 }
 
+static bool
+drm_output_can_signal_hdr(struct drm_output *output)
+{
+	struct drm_head *head;
+
+	if (!output->backend->atomic_modeset)
+		return false;
+
+	wl_list_for_each(head, &output->base.head_list, base.output_link) {
+		if (!head->props_conn[WDRM_CONNECTOR_HDR_OUTPUT_METADATA].prop_id)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Find the topmost HDR view which could be scanned out on this output; the
+ * connector will signal its metadata to the sink.
+ */
+static struct weston_view *
+drm_output_find_hdr_view(struct drm_output *output)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	struct weston_view *ev;
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (ev->output_mask != (1u << output->base.id))
+			continue;
+
+		if (!ev->surface->buffer_ref.buffer)
+			continue;
+
+		if (weston_surface_get_eotf(ev->surface) !=
+		    EOTF_TRADITIONAL_GAMMA_SDR)
+			return ev;
+	}
+
+	return NULL;
+}
+
+/**
+ * Set the HDR metadata an output state sends to the sink from a view's
+ * surface, or go back to plain SDR if ev is NULL.
+ */
+static void
+drm_output_state_set_hdr(struct drm_output_state *state,
+			 struct weston_view *ev)
+{
+	struct drm_hdr_output_metadata *md = &state->hdr_metadata;
+	struct weston_hdr_metadata_static *src;
+
+	memset(md, 0, sizeof(*md));
+	state->eotf = EOTF_TRADITIONAL_GAMMA_SDR;
+	state->colorspace = WESTON_CS_BT709;
+
+	if (!ev)
+		return;
+
+	src = &ev->surface->hdr_metadata->metadata.static_metadata;
+	state->eotf = weston_surface_get_eotf(ev->surface);
+	state->colorspace = drm_surface_primaries(ev->surface);
+
+	md->hdmi_metadata_type1.eotf = state->eotf;
+	md->hdmi_metadata_type1.display_primaries[0].x = src->display_primary_r_x;
+	md->hdmi_metadata_type1.display_primaries[0].y = src->display_primary_r_y;
+	md->hdmi_metadata_type1.display_primaries[1].x = src->display_primary_g_x;
+	md->hdmi_metadata_type1.display_primaries[1].y = src->display_primary_g_y;
+	md->hdmi_metadata_type1.display_primaries[2].x = src->display_primary_b_x;
+	md->hdmi_metadata_type1.display_primaries[2].y = src->display_primary_b_y;
+	md->hdmi_metadata_type1.white_point.x = src->white_point_x;
+	md->hdmi_metadata_type1.white_point.y = src->white_point_y;
+	md->hdmi_metadata_type1.max_display_mastering_luminance =
+		src->max_luminance;
+	md->hdmi_metadata_type1.min_display_mastering_luminance =
+		src->min_luminance;
+	md->hdmi_metadata_type1.max_cll = src->max_cll;
+	md->hdmi_metadata_type1.max_fall = src->max_fall;
+}
+
+/* Mixed mode needs the last renderer framebuffer to test planes on top
+ * of; without one it cannot be proposed, whatever the scene. */
+static bool
+drm_output_can_propose_mixed(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_fb *scanout_fb = output->scanout_plane->state_cur->fb;
+
+	if (!scanout_fb ||
+	    (scanout_fb->type != BUFFER_GBM_SURFACE &&
+	     scanout_fb->type != BUFFER_PIXMAN_DUMB)) {
+		drm_debug(b, "\t\t[state] cannot propose mixed mode: "
+		             "for output %s (%lu): no previous renderer "
+		             "fb\n",
+			  output->base.name,
+			  (unsigned long) output->base.id);
+		return false;
+	}
+
+	if (scanout_fb->width != output->base.current_mode->width ||
+	    scanout_fb->height != output->base.current_mode->height) {
+		drm_debug(b, "\t\t[state] cannot propose mixed mode "
+		             "for output %s (%lu): previous fb has "
+			     "different size\n",
+			  output->base.name,
+			  (unsigned long) output->base.id);
+		return false;
+	}
+
+	return true;
+}
+
 static struct drm_output_state *
 drm_output_propose_state(struct weston_output *output_base,
 			 struct drm_pending_state *pending_state,
@@ -3507,7 +4170,7 @@ drm_output_propose_state(struct weston_output *output_base,
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
 	struct drm_output_state *state;
 	struct drm_plane_state *scanout_state = NULL;
-	struct weston_view *ev;
+	struct weston_view *ev, *hdr_view = NULL;
 	pixman_region32_t surface_overlap, renderer_region, occluded_region;
 	bool planes_ok = (mode != DRM_OUTPUT_PROPOSE_STATE_RENDERER_ONLY);
 	bool renderer_ok = (mode != DRM_OUTPUT_PROPOSE_STATE_PLANES_ONLY);
@@ -3530,28 +4193,8 @@ drm_output_propose_state(struct weston_output *output_base,
 		struct drm_plane *plane = output->scanout_plane;
 		struct drm_fb *scanout_fb = plane->state_cur->fb;
 
-		if (!scanout_fb ||
-		    (scanout_fb->type != BUFFER_GBM_SURFACE &&
-		     scanout_fb->type != BUFFER_PIXMAN_DUMB)) {
-			drm_debug(b, "\t\t[state] cannot propose mixed mode: "
-			             "for output %s (%lu): no previous renderer "
-			             "fb\n",
-				  output->base.name,
-				  (unsigned long) output->base.id);
-			drm_output_state_free(state);
-			return NULL;
-		}
-
-		if (scanout_fb->width != output_base->current_mode->width ||
-		    scanout_fb->height != output_base->current_mode->height) {
-			drm_debug(b, "\t\t[state] cannot propose mixed mode "
-			             "for output %s (%lu): previous fb has "
-				     "different size\n",
-				  output->base.name,
-				  (unsigned long) output->base.id);
-			drm_output_state_free(state);
-			return NULL;
-		}
+		/* drm_assign_planes() checked drm_output_can_propose_mixed() */
+		assert(scanout_fb);
 
 		scanout_state = drm_plane_state_duplicate(state,
 							  plane->state_cur);
@@ -3561,6 +4204,21 @@ drm_output_propose_state(struct weston_output *output_base,
 			  (unsigned long) output->base.id);
 	}
 
+	/* Only switch the sink to HDR when the state can be tested, and
+	 * everything not on a plane goes through a renderer which can encode
+	 * for it; otherwise the renderer tone-maps HDR views down to SDR. */
+	if (mode != DRM_OUTPUT_PROPOSE_STATE_RENDERER_ONLY &&
+	    !(b->use_pixman && mode == DRM_OUTPUT_PROPOSE_STATE_MIXED) &&
+	    drm_output_can_signal_hdr(output))
+		hdr_view = drm_output_find_hdr_view(output);
+
+	drm_output_state_set_hdr(state, hdr_view);
+	if (hdr_view)
+		drm_debug(b, "\t\t[state] signalling HDR metadata of view %p "
+			     "(EOTF %d) on output %s (%lu)\n",
+			  hdr_view, state->eotf, output->base.name,
+			  (unsigned long) output->base.id);
+
 	/*
 	 * Find a surface for each sprite in the output using some heuristics:
 	 * 1) size
@@ -3611,6 +4269,13 @@ drm_output_propose_state(struct weston_output *output_base,
 			force_renderer = true;
 		}
 
+		if (!drm_view_matches_output_signal(state, ev)) {
+			drm_debug(b, "\t\t\t\t[view] not assigning view %p to plane "
+			             "(EOTF or colorspace differs from output)\n",
+				  ev);
+			force_renderer = true;
+		}
+
 		/* Ignore views we know to be totally occluded. */
 		pixman_region32_init(&clipped_view);
 		pixman_region32_intersect(&clipped_view,
@@ -3761,6 +4426,147 @@ drm_propose_state_mode_to_string(enum drm_output_propose_state_mode mode)
 	return drm_output_propose_state_mode_as_string[mode];
 }
 
+static uint64_t
+propose_memo_hash(uint64_t hash, uint64_t value)
+{
+	/* FNV-1a, a word at a time */
+	return (hash ^ value) * 0x100000001b3ULL;
+}
+
+static uint64_t
+drm_output_propose_memo_key(struct drm_output *output)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct weston_buffer *buffer;
+	struct weston_view *ev;
+	pixman_box32_t *box;
+	uint64_t key = 0xcbf29ce484222325ULL;
+	union {
+		float f;
+		uint32_t u;
+	} alpha;
+
+	key = propose_memo_hash(key, (uintptr_t) output->base.current_mode);
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (!(ev->output_mask & (1u << output->base.id)))
+			continue;
+
+		alpha.f = ev->alpha;
+		key = propose_memo_hash(key, (uintptr_t) ev);
+		key = propose_memo_hash(key, ev->output_mask);
+		key = propose_memo_hash(key, alpha.u);
+		key = propose_memo_hash(key, ev->transform.enabled ?
+					     ev->transform.matrix.type : 0);
+
+		box = pixman_region32_extents(&ev->transform.boundingbox);
+		key = propose_memo_hash(key, ((uint64_t) box->x1 << 32) |
+					     (uint32_t) box->y1);
+		key = propose_memo_hash(key, ((uint64_t) box->x2 << 32) |
+					     (uint32_t) box->y2);
+
+		box = pixman_region32_extents(&ev->surface->opaque);
+		key = propose_memo_hash(key, ((uint64_t) box->x1 << 32) |
+					     (uint32_t) box->y1);
+		key = propose_memo_hash(key, ((uint64_t) box->x2 << 32) |
+					     (uint32_t) box->y2);
+
+		key = propose_memo_hash(key,
+			weston_surface_get_eotf(ev->surface));
+		key = propose_memo_hash(key, ev->surface->colorspace);
+		key = propose_memo_hash(key,
+			ev->surface->buffer_viewport.buffer.transform);
+		key = propose_memo_hash(key,
+			ev->surface->buffer_viewport.buffer.scale);
+
+		buffer = ev->surface->buffer_ref.buffer;
+		if (!buffer) {
+			key = propose_memo_hash(key, 0);
+			continue;
+		}
+
+		key = propose_memo_hash(key, ((uint64_t) buffer->width << 32) |
+					     (uint32_t) buffer->height);
+		key = propose_memo_hash(key,
+			wl_shm_buffer_get(buffer->resource) != NULL);
+
+		dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+		if (dmabuf) {
+			key = propose_memo_hash(key,
+						dmabuf->attributes.format);
+			key = propose_memo_hash(key,
+						dmabuf->attributes.modifier[0]);
+			key = propose_memo_hash(key,
+						dmabuf->attributes.n_planes);
+			key = propose_memo_hash(key,
+						dmabuf->attributes.flags);
+		}
+	}
+
+	return key;
+}
+
+static struct drm_propose_memo *
+drm_output_get_propose_memo(struct drm_output *output, uint64_t key)
+{
+	struct drm_propose_memo *memo, *oldest = &output->propose_memo[0];
+	unsigned i;
+
+	for (i = 0; i < ARRAY_LENGTH(output->propose_memo); i++) {
+		memo = &output->propose_memo[i];
+		if (memo->key == key && memo->used_frame != 0)
+			goto found;
+
+		if (output->propose_frame - memo->used_frame >
+		    output->propose_frame - oldest->used_frame)
+			oldest = memo;
+	}
+
+	memo = oldest;
+	memo->key = key;
+	memo->failed_modes = 0;
+
+found:
+	memo->used_frame = output->propose_frame;
+
+	/* Give failed proposals another chance once in a while, in case
+	 * what made the kernel reject them is gone */
+	if (memo->failed_modes &&
+	    output->propose_frame - memo->failed_frame >
+	    DRM_PROPOSE_MEMO_RETRY_FRAMES)
+		memo->failed_modes = 0;
+
+	return memo;
+}
+
+/* Proposes a state unless it is known to fail for the scene */
+static struct drm_output_state *
+drm_output_propose_state_memo(struct drm_output *output,
+			      struct drm_pending_state *pending_state,
+			      enum drm_output_propose_state_mode mode,
+			      struct drm_propose_memo *memo)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_output_state *state;
+
+	if (memo->failed_modes & (1u << mode)) {
+		drm_debug(b, "\t[repaint] skipping %s, known to fail for "
+			     "this scene\n",
+			  drm_propose_state_mode_to_string(mode));
+		b->proposals_skipped++;
+		return NULL;
+	}
+
+	state = drm_output_propose_state(&output->base, pending_state, mode);
+	if (!state) {
+		memo->failed_modes |= 1u << mode;
+		memo->failed_frame = output->propose_frame;
+	}
+
+	return state;
+}
+
 static void
 drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 {
@@ -3777,15 +4583,27 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 		  output_base->name, (unsigned long) output_base->id);
 
 	if (!b->sprites_are_broken && !output->virtual) {
+		struct drm_propose_memo *memo;
+
+		/* 0 marks unused memo entries */
+		if (++output->propose_frame == 0)
+			++output->propose_frame;
+		memo = drm_output_get_propose_memo(output,
+				drm_output_propose_memo_key(output));
+
 		drm_debug(b, "\t[repaint] trying planes-only build state\n");
-		state = drm_output_propose_state(output_base, pending_state, mode);
+		state = drm_output_propose_state_memo(output, pending_state,
+						      mode, memo);
 		if (!state) {
 			drm_debug(b, "\t[repaint] could not build planes-only "
 				     "state, trying mixed\n");
 			mode = DRM_OUTPUT_PROPOSE_STATE_MIXED;
-			state = drm_output_propose_state(output_base,
-							 pending_state,
-							 mode);
+			/* Not being able to propose mixed mode at all says
+			 * nothing about the scene, so is not remembered */
+			if (drm_output_can_propose_mixed(output))
+				state = drm_output_propose_state_memo(output,
+								      pending_state,
+								      mode, memo);
 		}
 		if (!state) {
 			drm_debug(b, "\t[repaint] could not build mixed-mode "
@@ -3805,6 +4623,12 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 	drm_debug(b, "\t[repaint] Using %s composition\n",
 		  drm_propose_state_mode_to_string(mode));
 
+	/* Have the renderer encode for whatever the sink is being sent */
+	output->base.eotf = state->eotf;
+	output->base.colorspace = state->colorspace;
+	output->base.max_luminance =
+		state->hdr_metadata.hdmi_metadata_type1.max_display_mastering_luminance;
+
 	wl_list_for_each(ev, &output_base->compositor->view_list, link) {
 		struct drm_plane *target_plane = NULL;
 
@@ -5021,6 +5845,7 @@ drm_output_init_egl(struct drm_output *output, struct drm_backend *b)
 	}
 
 	drm_output_init_cursor_egl(output, b);
+	output->base.capture_dmabuf = true;
 
 	return 0;
 }
@@ -5041,6 +5866,9 @@ drm_output_fini_egl(struct drm_output *output)
 		output->scanout_plane->state_cur->complete = true;
 	}
 
+	output->base.capture_dmabuf = false;
+	drm_output_release_capture_frames(output);
+
 	gl_renderer->output_destroy(&output->base);
 	gbm_surface_destroy(output->gbm_surface);
 	drm_output_fini_cursor_egl(output);
@@ -5069,7 +5897,7 @@ drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
 	}
 
 	/* FIXME error checking */
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < b->pixman_buffers; i++) {
 		output->dumb[i] = drm_fb_create_dumb(b, w, h, format);
 		if (!output->dumb[i])
 			goto err;
@@ -5088,11 +5916,18 @@ drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
 	if (pixman_renderer_output_create(&output->base, flags) < 0)
  		goto err;
 
-	weston_log("DRM: output %s %s shadow framebuffer.\n", output->base.name,
-		   b->use_pixman_shadow ? "uses" : "does not use");
+	weston_log("DRM: output %s %s shadow framebuffer, %u buffers.\n",
+		   output->base.name,
+		   b->use_pixman_shadow ? "uses" : "does not use",
+		   b->pixman_buffers);
 
-	pixman_region32_init_rect(&output->previous_damage,
-				  output->base.x, output->base.y, output->base.width, output->base.height);
+	output->num_dumb = b->pixman_buffers;
+	output->current_image = 0;
+	for (i = 0; i < output->num_dumb; i++)
+		pixman_region32_init_rect(&output->dumb_damage[i],
+					  output->base.x, output->base.y,
+					  output->base.width,
+					  output->base.height);
 
 	return 0;
 
@@ -5128,9 +5963,9 @@ drm_output_fini_pixman(struct drm_output *output)
 	}
 
 	pixman_renderer_output_destroy(&output->base);
-	pixman_region32_fini(&output->previous_damage);
 
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->num_dumb; i++) {
+		pixman_region32_fini(&output->dumb_damage[i]);
 		pixman_image_unref(output->image[i]);
 		drm_fb_unref(output->dumb[i]);
 		output->dumb[i] = NULL;
@@ -6163,6 +6998,11 @@ drm_output_deinit(struct weston_output *base)
 		}
 	}
 
+	if (output->hdr_blob_id) {
+		drmModeDestroyPropertyBlob(b->drm.fd, output->hdr_blob_id);
+		output->hdr_blob_id = 0;
+	}
+
 	drm_output_fini_crtc(output);
 }
 
@@ -6461,6 +7301,7 @@ drm_output_create(struct weston_compositor *compositor, const char *name)
 
 	output->backend = b;
 	output->gbm_bo_flags = GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING;
+	wl_list_init(&output->capture_frames);
 
 	weston_output_init(&output->base, compositor, name);
 
@@ -6623,6 +7464,8 @@ drm_destroy(struct weston_compositor *ec)
 	b->debug = NULL;
 	weston_compositor_shutdown(ec);
 
+	drm_fb_cache_release(b);
+
 	wl_list_for_each_safe(base, next, &ec->head_list, compositor_link)
 		drm_head_destroy(to_drm_head(base));
 
@@ -7058,11 +7901,9 @@ drm_virtual_output_submit_frame(struct drm_output *output,
 	int fd, ret;
 
 	assert(fb->num_planes == 1);
-	ret = drmPrimeHandleToFD(b->drm.fd, fb->handles[0], DRM_CLOEXEC, &fd);
-	if (ret) {
-		weston_log("drmPrimeHandleFD failed, errno=%d\n", errno);
+	fd = drm_fb_export_plane(b, fb, 0);
+	if (fd < 0)
 		return -1;
-	}
 
 	drm_fb_ref(fb);
 	ret = output->virtual_submit_frame(&output->base, fd, fb->strides[0],
@@ -7115,6 +7956,8 @@ drm_virtual_output_repaint(struct weston_output *output_base,
 	if (drm_virtual_output_submit_frame(output, scanout_state->fb) < 0)
 		goto err;
 
+	drm_output_send_capture(output, scanout_state->fb);
+
 	return 0;
 
 err:
@@ -7220,6 +8063,7 @@ drm_virtual_output_create(struct weston_compositor *c, char *name)
 
 	output->virtual = true;
 	output->gbm_bo_flags = GBM_BO_USE_LINEAR | GBM_BO_USE_RENDERING;
+	wl_list_init(&output->capture_frames);
 
 	weston_output_init(&output->base, c, name);
 
@@ -7338,6 +8182,14 @@ drm_backend_create(struct weston_compositor *compositor,
 	b->use_pixman = config->use_pixman;
 	b->pageflip_timeout = config->pageflip_timeout;
 	b->use_pixman_shadow = config->use_pixman_shadow;
+	b->pixman_buffers = config->pixman_buffers;
+	if (b->pixman_buffers == 0)
+		b->pixman_buffers = 2;
+	if (b->pixman_buffers < 2 || b->pixman_buffers > DRM_OUTPUT_MAX_DUMB) {
+		weston_log("Invalid number of pixman buffers %u, using 2.\n",
+			   b->pixman_buffers);
+		b->pixman_buffers = 2;
+	}
 
 	b->debug = weston_compositor_add_debug_scope(compositor, "drm-backend",
 						     "Debug messages from DRM/KMS backend\n",
@@ -7402,6 +8254,7 @@ drm_backend_create(struct weston_compositor *compositor,
 	weston_setup_vt_switch_bindings(compositor);
 
 	wl_list_init(&b->plane_list);
+	wl_list_init(&b->fb_cache);
 	create_sprites(b);
 
 	if (udev_input_init(&b->input,
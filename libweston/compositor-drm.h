@@ -35,7 +35,7 @@
 extern "C" {
 #endif
 
-#define WESTON_DRM_BACKEND_CONFIG_VERSION 3
+#define WESTON_DRM_BACKEND_CONFIG_VERSION 4
 
 struct libinput_device;
 
@@ -223,6 +223,10 @@ struct weston_drm_backend_config {
 
 	/** Use shadow buffer if using Pixman-renderer. */
 	bool use_pixman_shadow;
+
+	/** Number of framebuffers the Pixman-renderer cycles through,
+	 * between 2 and 3. 0 means the default of 2. */
+	uint32_t pixman_buffers;
 };
 
 #ifdef  __cplusplus
@@ -30,6 +30,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <linux/input.h>
 
 #if HAVE_FREERDP_VERSION_H
@@ -45,6 +47,11 @@
 		(FREERDP_VERSION_MINOR * 0x100) + FREERDP_VERSION_REVISION)
 
 
+#if FREERDP_VERSION_NUMBER >= 0x10200
+#define HAVE_RFX_ENCODE_MESSAGE
+#define HAVE_FRAME_ACKNOWLEDGE
+#endif
+
 #if FREERDP_VERSION_NUMBER >= 0x10201
 #define HAVE_SKIP_COMPRESSION
 #endif
@@ -105,6 +112,10 @@
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 #define RDP_MODE_FREQ 60 * 1000
+#define RDP_RFX_TILE_SIZE 64
+#define RDP_MAX_ENCODE_THREADS 16
+#define RDP_MAX_FRAMES_IN_FLIGHT 3
+#define RDP_LAG_TIMEOUT_MS 1000
 
 #if FREERDP_VERSION_MAJOR >= 2 && defined(PIXEL_FORMAT_BGRA32) && !defined(PIXEL_FORMAT_B8G8R8A8)
 	/* The RDP API is truly wonderful: the pixel format definition changed
@@ -150,10 +161,60 @@ struct rdp_head {
 	struct weston_head base;
 };
 
+enum rdp_codec {
+	RDP_CODEC_RFX = (1 << 0),
+	RDP_CODEC_NSC = (1 << 1),
+};
+
+#ifdef HAVE_RFX_ENCODE_MESSAGE
+/** A horizontal band of the damage, RemoteFX encoded by a single thread
+ *
+ * Bands start on a tile row, so no tile is shared between two bands.
+ */
+struct rdp_rfx_band {
+	RFX_CONTEXT *rfx_context;
+	pixman_box32_t box;
+	RFX_RECT *rects;	/* relative to the band */
+	int n_rects;
+	int rects_size;
+	RFX_MESSAGE *message;
+};
+#endif
+
+/** Encodes the damage of a frame once per codec, for all the peers
+ *
+ * RemoteFX is the expensive codec, so its bands are spread over a pool
+ * of worker threads while the compositor thread does the NSCodec part.
+ * Peers only serialize the result into their own stream.
+ */
+struct rdp_encoder {
+	pixman_image_t *image;
+
+	NSC_CONTEXT *nsc_context;
+	wStream *nsc_stream;
+	pixman_box32_t nsc_box;
+
+#ifdef HAVE_RFX_ENCODE_MESSAGE
+	struct rdp_rfx_band *bands;
+	int n_bands;
+	int n_queued;		/* bands of the frame being encoded */
+
+	pthread_t *threads;
+	int n_threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;	/* bands were queued, or quit */
+	pthread_cond_t done_cond;	/* the last band was encoded */
+	int next_band;
+	int bands_left;
+	bool quit;
+#endif
+};
+
 struct rdp_output {
 	struct weston_output base;
 	struct wl_event_source *finish_frame_timer;
 	pixman_image_t *shadow_surface;
+	struct rdp_encoder encoder;
 
 	struct wl_list peers;
 };
@@ -165,8 +226,19 @@ struct rdp_peer_context {
 	struct wl_event_source *events[MAX_FREERDP_FDS];
 	RFX_CONTEXT *rfx_context;
 	wStream *encode_stream;
+#ifndef HAVE_RFX_ENCODE_MESSAGE
 	RFX_RECT *rfx_rects;
-	NSC_CONTEXT *nsc_context;
+#endif
+
+	/* Frames sent and acknowledged, peers that stop acknowledging
+	 * skip frames and get their damage later */
+	uint32_t frame_id;
+	uint32_t acked_frame_id;
+	bool frame_acks;
+	struct timespec ack_time;	/* last acknowledgement or lag reset */
+	pixman_region32_t skipped_damage;
+	/* Checks on a lagging peer when no repaint does */
+	struct wl_event_source *lag_timer;
 
 	struct rdp_peers_item item;
 };
@@ -190,6 +262,179 @@ to_rdp_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct rdp_backend, base);
 }
 
+static void
+rdp_peer_send_surface_bits(freerdp_peer *peer, const pixman_box32_t *box,
+			   UINT32 codec_id, wStream *s)
+{
+	rdpUpdate *update = peer->update;
+	SURFACE_BITS_COMMAND cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+#ifdef HAVE_SKIP_COMPRESSION
+	cmd.skipCompression = TRUE;
+#endif
+	cmd.destLeft = box->x1;
+	cmd.destTop = box->y1;
+	cmd.destRight = box->x2;
+	cmd.destBottom = box->y2;
+	SURFACE_BPP(cmd) = 32;
+	SURFACE_CODECID(cmd) = codec_id;
+	SURFACE_WIDTH(cmd) = box->x2 - box->x1;
+	SURFACE_HEIGHT(cmd) = box->y2 - box->y1;
+	SURFACE_BITMAP_DATA_LEN(cmd) = Stream_GetPosition(s);
+	SURFACE_BITMAP_DATA(cmd) = Stream_Buffer(s);
+
+	update->SurfaceBits(update->context, &cmd);
+}
+
+#ifdef HAVE_RFX_ENCODE_MESSAGE
+static void
+rdp_rfx_band_encode(struct rdp_encoder *encoder, struct rdp_rfx_band *band)
+{
+	int stride = pixman_image_get_stride(encoder->image);
+	BYTE *ptr;
+
+	ptr = (BYTE *)pixman_image_get_data(encoder->image) +
+		band->box.y1 * stride + band->box.x1 * 4;
+
+	band->message = rfx_encode_message(band->rfx_context,
+			band->rects, band->n_rects, ptr,
+			band->box.x2 - band->box.x1,
+			band->box.y2 - band->box.y1, stride);
+}
+
+/* Encodes queued bands until none is left, called with the mutex held */
+static void
+rdp_encoder_drain(struct rdp_encoder *encoder)
+{
+	struct rdp_rfx_band *band;
+
+	while (encoder->next_band < encoder->n_queued) {
+		band = &encoder->bands[encoder->next_band++];
+
+		pthread_mutex_unlock(&encoder->mutex);
+		rdp_rfx_band_encode(encoder, band);
+		pthread_mutex_lock(&encoder->mutex);
+
+		if (--encoder->bands_left == 0)
+			pthread_cond_signal(&encoder->done_cond);
+	}
+}
+
+static void *
+rdp_encoder_worker(void *data)
+{
+	struct rdp_encoder *encoder = data;
+
+	pthread_mutex_lock(&encoder->mutex);
+	while (!encoder->quit) {
+		rdp_encoder_drain(encoder);
+		pthread_cond_wait(&encoder->work_cond, &encoder->mutex);
+	}
+	pthread_mutex_unlock(&encoder->mutex);
+
+	return NULL;
+}
+
+static void
+rdp_encoder_queue_rfx(struct rdp_encoder *encoder, pixman_region32_t *damage)
+{
+	pixman_box32_t *extents = &damage->extents;
+	pixman_region32_t band_damage;
+	pixman_box32_t *rects;
+	struct rdp_rfx_band *band;
+	RFX_RECT *band_rects;
+	int tile_rows, band_height, nrects, n_bands, i, y;
+
+	tile_rows = (extents->y2 - extents->y1 + RDP_RFX_TILE_SIZE - 1) /
+		    RDP_RFX_TILE_SIZE;
+	band_height = (tile_rows + encoder->n_bands - 1) / encoder->n_bands *
+		      RDP_RFX_TILE_SIZE;
+
+	/* Workers only look at the bands once they are published under
+	 * the mutex below, the previous frame's are all done by now */
+	n_bands = 0;
+	pixman_region32_init(&band_damage);
+	for (y = extents->y1; y < extents->y2; y += band_height) {
+		band = &encoder->bands[n_bands];
+		band->box.x1 = extents->x1;
+		band->box.x2 = extents->x2;
+		band->box.y1 = y;
+		band->box.y2 = MIN(y + band_height, extents->y2);
+
+		pixman_region32_intersect_rect(&band_damage, damage,
+					       band->box.x1, band->box.y1,
+					       band->box.x2 - band->box.x1,
+					       band->box.y2 - band->box.y1);
+		rects = pixman_region32_rectangles(&band_damage, &nrects);
+		if (!nrects)
+			continue;
+
+		if (nrects > band->rects_size) {
+			band_rects = realloc(band->rects,
+					     nrects * sizeof *band_rects);
+			if (!band_rects) {
+				weston_log("failed to allocate RemoteFX rects\n");
+				continue;
+			}
+			band->rects = band_rects;
+			band->rects_size = nrects;
+		}
+
+		for (i = 0; i < nrects; i++) {
+			band->rects[i].x = rects[i].x1 - band->box.x1;
+			band->rects[i].y = rects[i].y1 - band->box.y1;
+			band->rects[i].width = rects[i].x2 - rects[i].x1;
+			band->rects[i].height = rects[i].y2 - rects[i].y1;
+		}
+		band->n_rects = nrects;
+		n_bands++;
+	}
+	pixman_region32_fini(&band_damage);
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->n_queued = n_bands;
+	encoder->next_band = 0;
+	encoder->bands_left = encoder->n_queued;
+	pthread_cond_broadcast(&encoder->work_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+static void
+rdp_encoder_wait_rfx(struct rdp_encoder *encoder)
+{
+	pthread_mutex_lock(&encoder->mutex);
+	rdp_encoder_drain(encoder);
+	while (encoder->bands_left > 0)
+		pthread_cond_wait(&encoder->done_cond, &encoder->mutex);
+	pthread_mutex_unlock(&encoder->mutex);
+}
+
+static void
+rdp_peer_send_rfx(pixman_region32_t *damage, struct rdp_encoder *encoder,
+		  freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_rfx_band *band;
+	int i;
+
+	for (i = 0; i < encoder->n_queued; i++) {
+		band = &encoder->bands[i];
+		if (!band->message)
+			continue;
+
+		/* the peer's context keeps track of the codec headers */
+		Stream_Clear(context->encode_stream);
+		Stream_SetPosition(context->encode_stream, 0);
+		rfx_write_message(context->rfx_context, context->encode_stream,
+				  band->message);
+
+		rdp_peer_send_surface_bits(peer, &band->box,
+					   peer->settings->RemoteFxCodecId,
+					   context->encode_stream);
+	}
+}
+#else
 static void
 rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
 {
@@ -197,8 +442,6 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	pixman_box32_t *region, *rects;
 	uint32_t *ptr;
 	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND cmd;
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
 	Stream_Clear(context->encode_stream);
@@ -207,20 +450,6 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd.skipCompression = TRUE;
-#else
-	memset(&cmd, 0, sizeof(*cmd));
-#endif
-	cmd.destLeft = damage->extents.x1;
-	cmd.destTop = damage->extents.y1;
-	cmd.destRight = damage->extents.x2;
-	cmd.destBottom = damage->extents.y2;
-	SURFACE_BPP(cmd) = 32;
-	SURFACE_CODECID(cmd) = peer->settings->RemoteFxCodecId;
-	SURFACE_WIDTH(cmd) = width;
-	SURFACE_HEIGHT(cmd) = height;
-
 	ptr = pixman_image_get_data(image) + damage->extents.x1 +
 				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
 
@@ -242,54 +471,213 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 			pixman_image_get_stride(image)
 	);
 
-	SURFACE_BITMAP_DATA_LEN(cmd) = Stream_GetPosition(context->encode_stream);
-	SURFACE_BITMAP_DATA(cmd) = Stream_Buffer(context->encode_stream);
+	rdp_peer_send_surface_bits(peer, &damage->extents,
+				   peer->settings->RemoteFxCodecId,
+				   context->encode_stream);
+}
 
-	update->SurfaceBits(update->context, &cmd);
+/* This FreeRDP can only encode and serialize RemoteFX in one go, and
+ * the headers are per peer, so each peer encodes on its own */
+static void
+rdp_peer_send_rfx(pixman_region32_t *damage, struct rdp_encoder *encoder,
+		  freerdp_peer *peer)
+{
+	rdp_peer_refresh_rfx(damage, encoder->image, peer);
 }
+#endif
+
+static void
+rdp_encoder_encode_nsc(struct rdp_encoder *encoder, pixman_region32_t *damage)
+{
+	int stride = pixman_image_get_stride(encoder->image);
+	BYTE *ptr;
 
+	Stream_Clear(encoder->nsc_stream);
+	Stream_SetPosition(encoder->nsc_stream, 0);
+
+	ptr = (BYTE *)pixman_image_get_data(encoder->image) +
+		damage->extents.y1 * stride + damage->extents.x1 * 4;
+
+	nsc_compose_message(encoder->nsc_context, encoder->nsc_stream, ptr,
+			damage->extents.x2 - damage->extents.x1,
+			damage->extents.y2 - damage->extents.y1,
+			stride);
+
+	encoder->nsc_box = damage->extents;
+}
 
+/** Encodes the damage of image with each of the given codecs
+ *
+ * The result stays valid for rdp_peer_send_frame() until
+ * rdp_encoder_release().
+ */
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_encoder_encode(struct rdp_encoder *encoder, pixman_image_t *image,
+		   pixman_region32_t *damage, uint32_t codecs)
 {
-	int width, height;
-	uint32_t *ptr;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND cmd;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	encoder->image = image;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+#ifdef HAVE_RFX_ENCODE_MESSAGE
+	if (codecs & RDP_CODEC_RFX)
+		rdp_encoder_queue_rfx(encoder, damage);
+#endif
 
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
+	if (codecs & RDP_CODEC_NSC)
+		rdp_encoder_encode_nsc(encoder, damage);
 
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd.skipCompression = TRUE;
-#else
-	memset(cmd, 0, sizeof(*cmd));
+#ifdef HAVE_RFX_ENCODE_MESSAGE
+	/* the compositor thread joins the workers on what is left */
+	if (codecs & RDP_CODEC_RFX)
+		rdp_encoder_wait_rfx(encoder);
 #endif
+}
 
-	cmd.destLeft = damage->extents.x1;
-	cmd.destTop = damage->extents.y1;
-	cmd.destRight = damage->extents.x2;
-	cmd.destBottom = damage->extents.y2;
-	SURFACE_BPP(cmd) = 32;
-	SURFACE_CODECID(cmd) = peer->settings->NSCodecId;
-	SURFACE_WIDTH(cmd) = width;
-	SURFACE_HEIGHT(cmd) = height;
+static void
+rdp_encoder_release(struct rdp_encoder *encoder)
+{
+#ifdef HAVE_RFX_ENCODE_MESSAGE
+	struct rdp_rfx_band *band;
+	int i;
 
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+	for (i = 0; i < encoder->n_queued; i++) {
+		band = &encoder->bands[i];
+		if (band->message)
+			rfx_message_free(band->rfx_context, band->message);
+		band->message = NULL;
+	}
+	encoder->n_queued = 0;
+#endif
+}
 
-	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
-			width, height,
-			pixman_image_get_stride(image));
+static void
+rdp_encoder_reset(struct rdp_encoder *encoder, int width, int height)
+{
+#ifdef HAVE_RFX_ENCODE_MESSAGE
+	int i;
 
-	SURFACE_BITMAP_DATA_LEN(cmd) = Stream_GetPosition(context->encode_stream);
-	SURFACE_BITMAP_DATA(cmd) = Stream_Buffer(context->encode_stream);
+	for (i = 0; i < encoder->n_bands; i++)
+		RFX_RESET(encoder->bands[i].rfx_context, width, height);
+#endif
+	NSC_RESET(encoder->nsc_context, width, height);
+}
 
-	update->SurfaceBits(update->context, &cmd);
+#ifdef HAVE_RFX_ENCODE_MESSAGE
+static void
+rdp_encoder_fini_rfx(struct rdp_encoder *encoder)
+{
+	int i;
+
+	pthread_mutex_lock(&encoder->mutex);
+	encoder->quit = true;
+	pthread_cond_broadcast(&encoder->work_cond);
+	pthread_mutex_unlock(&encoder->mutex);
+
+	for (i = 0; i < encoder->n_threads; i++)
+		pthread_join(encoder->threads[i], NULL);
+	free(encoder->threads);
+
+	pthread_cond_destroy(&encoder->done_cond);
+	pthread_cond_destroy(&encoder->work_cond);
+	pthread_mutex_destroy(&encoder->mutex);
+
+	for (i = 0; encoder->bands && i < encoder->n_bands; i++) {
+		if (encoder->bands[i].rfx_context)
+			rfx_context_free(encoder->bands[i].rfx_context);
+		free(encoder->bands[i].rects);
+	}
+	free(encoder->bands);
+}
+
+static int
+rdp_encoder_init_rfx(struct rdp_encoder *encoder)
+{
+	RFX_CONTEXT *rfx_context;
+	long cpus;
+	int i;
+
+	/* the compositor thread takes bands too */
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	encoder->n_threads = MIN(MAX(cpus - 1, 0), RDP_MAX_ENCODE_THREADS);
+
+	/* a few bands per thread even out damage of uneven complexity */
+	encoder->n_bands = (encoder->n_threads + 1) * 2;
+	encoder->bands = zalloc(encoder->n_bands * sizeof *encoder->bands);
+	encoder->threads = zalloc(MAX(encoder->n_threads, 1) *
+				  sizeof *encoder->threads);
+	pthread_mutex_init(&encoder->mutex, NULL);
+	pthread_cond_init(&encoder->work_cond, NULL);
+	pthread_cond_init(&encoder->done_cond, NULL);
+	if (!encoder->bands || !encoder->threads)
+		goto err;
+
+	for (i = 0; i < encoder->n_bands; i++) {
+		rfx_context = rfx_context_new(TRUE);
+		if (!rfx_context)
+			goto err;
+
+		rfx_context->mode = RLGR3;
+		rfx_context_set_pixel_format(rfx_context, DEFAULT_PIXEL_FORMAT);
+		encoder->bands[i].rfx_context = rfx_context;
+	}
+
+	for (i = 0; i < encoder->n_threads; i++) {
+		if (pthread_create(&encoder->threads[i], NULL,
+				   rdp_encoder_worker, encoder) != 0) {
+			weston_log("RDP encoder: only %d of %d threads started\n",
+				   i, encoder->n_threads);
+			encoder->n_threads = i;
+			break;
+		}
+	}
+
+	return 0;
+
+err:
+	encoder->n_threads = 0;
+	rdp_encoder_fini_rfx(encoder);
+	return -1;
+}
+#endif
+
+static int
+rdp_encoder_init(struct rdp_encoder *encoder, int width, int height)
+{
+	encoder->nsc_context = nsc_context_new();
+	if (!encoder->nsc_context)
+		return -1;
+
+	nsc_context_set_pixel_format(encoder->nsc_context, DEFAULT_PIXEL_FORMAT);
+
+	encoder->nsc_stream = Stream_New(NULL, 65536);
+	if (!encoder->nsc_stream)
+		goto err_nsc;
+
+#ifdef HAVE_RFX_ENCODE_MESSAGE
+	if (rdp_encoder_init_rfx(encoder) < 0)
+		goto err_stream;
+#endif
+
+	rdp_encoder_reset(encoder, width, height);
+
+	return 0;
+
+#ifdef HAVE_RFX_ENCODE_MESSAGE
+err_stream:
+	Stream_Free(encoder->nsc_stream, TRUE);
+#endif
+err_nsc:
+	nsc_context_free(encoder->nsc_context);
+	return -1;
+}
+
+static void
+rdp_encoder_fini(struct rdp_encoder *encoder)
+{
+#ifdef HAVE_RFX_ENCODE_MESSAGE
+	rdp_encoder_fini_rfx(encoder);
+#endif
+	Stream_Free(encoder->nsc_stream, TRUE);
+	nsc_context_free(encoder->nsc_context);
 }
 
 static void
@@ -311,7 +699,6 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 {
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND cmd;
-	SURFACE_FRAME_MARKER marker;
 	pixman_box32_t *rect, subrect;
 	int nrects, i;
 	int heightIncrement, remainingHeight, top;
@@ -320,10 +707,6 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	if (!nrects)
 		return;
 
-	marker.frameId++;
-	marker.frameAction = SURFACECMD_FRAMEACTION_BEGIN;
-	update->SurfaceFrameMarker(peer->context, &marker);
-
 	memset(&cmd, 0, sizeof(cmd));
 	SURFACE_BPP(cmd) = 32;
 	SURFACE_CODECID(cmd) = 0;
@@ -359,24 +742,127 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 			   top += SURFACE_HEIGHT(cmd);
 		}
 	}
+}
 
-	marker.frameAction = SURFACECMD_FRAMEACTION_END;
-	update->SurfaceFrameMarker(peer->context, &marker);
+static uint32_t
+rdp_peer_codecs(freerdp_peer *peer)
+{
+	if (peer->settings->RemoteFxCodec)
+		return RDP_CODEC_RFX;
+	if (peer->settings->NSCodec)
+		return RDP_CODEC_NSC;
+	return 0;
+}
+
+static bool
+rdp_peer_wants_frames(struct rdp_peers_item *item)
+{
+	return (item->flags & RDP_PEER_ACTIVATED) &&
+	       (item->flags & RDP_PEER_OUTPUT_ENABLED);
+}
+
+/* Peers that acknowledge frames but let too many go unacknowledged
+ * are not keeping up with the encoded stream */
+static bool
+rdp_peer_is_lagging(RdpPeerContext *context)
+{
+	return context->frame_acks &&
+	       context->frame_id - context->acked_frame_id > RDP_MAX_FRAMES_IN_FLIGHT;
 }
 
+/* Takes the frames in flight as acknowledged, so the peer gets frames
+ * again even if its acknowledgements got lost */
 static void
-rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+rdp_peer_reset_lag(RdpPeerContext *context)
+{
+	context->acked_frame_id = context->frame_id;
+	weston_compositor_read_presentation_clock(context->rdpBackend->compositor,
+						  &context->ack_time);
+}
+
+/* Like rdp_peer_is_lagging(), but gives up on peers that have not
+ * acknowledged anything for too long */
+static bool
+rdp_peer_check_lag(RdpPeerContext *context, const struct timespec *now)
+{
+	int64_t elapsed;
+
+	if (!rdp_peer_is_lagging(context))
+		return false;
+
+	/* Come back at the timeout in case the output goes still */
+	elapsed = timespec_sub_to_msec(now, &context->ack_time);
+	if (elapsed < RDP_LAG_TIMEOUT_MS) {
+		wl_event_source_timer_update(context->lag_timer,
+					     RDP_LAG_TIMEOUT_MS - elapsed);
+		return true;
+	}
+
+	weston_log("RDP peer did not acknowledge frames for %d ms, "
+		   "resuming\n", RDP_LAG_TIMEOUT_MS);
+	rdp_peer_reset_lag(context);
+
+	return false;
+}
+
+/* Sends the frames a lagging peer skipped once it is given up on, as
+ * nothing else may repaint the output by then */
+static int
+rdp_peer_lag_timeout(void *data)
+{
+	RdpPeerContext *context = data;
+	struct rdp_output *output = context->rdpBackend->output;
+	struct timespec now;
+
+	weston_compositor_read_presentation_clock(context->rdpBackend->compositor,
+						  &now);
+	if (rdp_peer_check_lag(context, &now))
+		return 0;
+
+	if (output && pixman_region32_not_empty(&context->skipped_damage))
+		weston_output_schedule_repaint(&output->base);
+
+	return 0;
+}
+
+/** Sends what the output's encoder made of damage to a peer */
+static void
+rdp_peer_send_frame(pixman_region32_t *damage, freerdp_peer *peer)
 {
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	struct rdp_output *output = context->rdpBackend->output;
+	struct rdp_encoder *encoder = &output->encoder;
 	rdpSettings *settings = peer->settings;
+	rdpUpdate *update = peer->update;
+	SURFACE_FRAME_MARKER marker;
+
+	marker.frameId = ++context->frame_id;
+	marker.frameAction = SURFACECMD_FRAMEACTION_BEGIN;
+	update->SurfaceFrameMarker(peer->context, &marker);
 
 	if (settings->RemoteFxCodec)
-		rdp_peer_refresh_rfx(region, output->shadow_surface, peer);
+		rdp_peer_send_rfx(damage, encoder, peer);
 	else if (settings->NSCodec)
-		rdp_peer_refresh_nsc(region, output->shadow_surface, peer);
+		rdp_peer_send_surface_bits(peer, &encoder->nsc_box,
+					   settings->NSCodecId,
+					   encoder->nsc_stream);
 	else
-		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
+		rdp_peer_refresh_raw(damage, encoder->image, peer);
+
+	marker.frameAction = SURFACECMD_FRAMEACTION_END;
+	update->SurfaceFrameMarker(peer->context, &marker);
+}
+
+static void
+rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_output *output = context->rdpBackend->output;
+
+	rdp_encoder_encode(&output->encoder, output->shadow_surface, region,
+			   rdp_peer_codecs(peer));
+	rdp_peer_send_frame(region, peer);
+	rdp_encoder_release(&output->encoder);
 }
 
 static void
@@ -395,19 +881,56 @@ rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage,
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
 	struct rdp_peers_item *outputPeer;
+	RdpPeerContext *peerCtx;
+	pixman_region32_t frame_damage;
+	struct timespec now;
+	uint32_t codecs = 0;
 
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
 
-	if (pixman_region32_not_empty(damage)) {
+	/* Lagging peers skip the frame rather than hold the others back,
+	 * and get its damage along with the next frame they take. */
+	pixman_region32_init(&frame_damage);
+	pixman_region32_copy(&frame_damage, damage);
+	weston_compositor_read_presentation_clock(ec, &now);
+	wl_list_for_each(outputPeer, &output->peers, link) {
+		if (!rdp_peer_wants_frames(outputPeer))
+			continue;
+
+		peerCtx = (RdpPeerContext *)outputPeer->peer->context;
+		if (rdp_peer_check_lag(peerCtx, &now)) {
+			pixman_region32_union(&peerCtx->skipped_damage,
+					      &peerCtx->skipped_damage, damage);
+			continue;
+		}
+
+		pixman_region32_union(&frame_damage, &frame_damage,
+				      &peerCtx->skipped_damage);
+		codecs |= rdp_peer_codecs(outputPeer->peer);
+	}
+	pixman_region32_intersect_rect(&frame_damage, &frame_damage, 0, 0,
+				       pixman_image_get_width(output->shadow_surface),
+				       pixman_image_get_height(output->shadow_surface));
+
+	if (pixman_region32_not_empty(&frame_damage)) {
+		rdp_encoder_encode(&output->encoder, output->shadow_surface,
+				   &frame_damage, codecs);
+
 		wl_list_for_each(outputPeer, &output->peers, link) {
-			if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
-					(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
-			{
-				rdp_peer_refresh_region(damage, outputPeer->peer);
-			}
+			peerCtx = (RdpPeerContext *)outputPeer->peer->context;
+			if (!rdp_peer_wants_frames(outputPeer) ||
+			    rdp_peer_is_lagging(peerCtx))
+				continue;
+
+			rdp_peer_send_frame(&frame_damage, outputPeer->peer);
+			pixman_region32_fini(&peerCtx->skipped_damage);
+			pixman_region32_init(&peerCtx->skipped_damage);
 		}
+
+		rdp_encoder_release(&output->encoder);
 	}
+	pixman_region32_fini(&frame_damage);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
@@ -487,6 +1010,7 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 			0, 0, 0, 0, 0, 0, target_mode->width, target_mode->height);
 	pixman_image_unref(rdpOutput->shadow_surface);
 	rdpOutput->shadow_surface = new_shadow_buffer;
+	rdp_encoder_reset(&rdpOutput->encoder, target_mode->width, target_mode->height);
 
 	wl_list_for_each(rdpPeer, &rdpOutput->peers, link) {
 		settings = rdpPeer->peer->settings;
@@ -565,8 +1089,16 @@ rdp_output_enable(struct weston_output *base)
 		return -1;
 	}
 
+	if (rdp_encoder_init(&output->encoder, output->base.current_mode->width,
+			     output->base.current_mode->height) < 0) {
+		weston_log("Failed to create the RDP encoder.\n");
+		pixman_image_unref(output->shadow_surface);
+		return -1;
+	}
+
 	if (pixman_renderer_output_create(&output->base,
 					  PIXMAN_RENDERER_OUTPUT_USE_SHADOW) < 0) {
+		rdp_encoder_fini(&output->encoder);
 		pixman_image_unref(output->shadow_surface);
 		return -1;
 	}
@@ -588,6 +1120,7 @@ rdp_output_disable(struct weston_output *base)
 	if (!output->base.enabled)
 		return 0;
 
+	rdp_encoder_fini(&output->encoder);
 	pixman_image_unref(output->shadow_surface);
 	pixman_renderer_output_destroy(&output->base);
 
@@ -736,22 +1269,16 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 	context->rfx_context->height = client->settings->DesktopHeight;
 	rfx_context_set_pixel_format(context->rfx_context, DEFAULT_PIXEL_FORMAT);
 
-	context->nsc_context = nsc_context_new();
-	if (!context->nsc_context)
-		goto out_error_nsc;
-
-	nsc_context_set_pixel_format(context->nsc_context, DEFAULT_PIXEL_FORMAT);
-
 	context->encode_stream = Stream_New(NULL, 65536);
 	if (!context->encode_stream)
 		goto out_error_stream;
 
+	pixman_region32_init(&context->skipped_damage);
+
 	FREERDP_CB_RETURN(TRUE);
 
-out_error_nsc:
-	rfx_context_free(context->rfx_context);
 out_error_stream:
-	nsc_context_free(context->nsc_context);
+	rfx_context_free(context->rfx_context);
 	FREERDP_CB_RETURN(FALSE);
 }
 
@@ -767,6 +1294,8 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		if (context->events[i])
 			wl_event_source_remove(context->events[i]);
 	}
+	if (context->lag_timer)
+		wl_event_source_remove(context->lag_timer);
 
 	if (context->item.flags & RDP_PEER_ACTIVATED) {
 		weston_seat_release_keyboard(context->item.seat);
@@ -775,10 +1304,12 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		 * but it would crash on reconnect */
 	}
 
+	pixman_region32_fini(&context->skipped_damage);
 	Stream_Free(context->encode_stream, TRUE);
-	nsc_context_free(context->nsc_context);
 	rfx_context_free(context->rfx_context);
+#ifndef HAVE_RFX_ENCODE_MESSAGE
 	free(context->rfx_rects);
+#endif
 }
 
 
@@ -1002,7 +1533,6 @@ xf_peer_activate(freerdp_peer* client)
 
 	weston_output = &output->base;
 	RFX_RESET(peerCtx->rfx_context, weston_output->width, weston_output->height);
-	NSC_RESET(peerCtx->nsc_context, weston_output->width, weston_output->height);
 
 	if (peersItem->flags & RDP_PEER_ACTIVATED)
 		return TRUE;
@@ -1170,7 +1700,10 @@ xf_input_synchronize_event(rdpInput *input, UINT32 flags)
 	pixman_box32_t box;
 	pixman_region32_t damage;
 
-	/* sends a full refresh */
+	/* sends a full refresh, which also brings a lagging peer back */
+	rdp_peer_reset_lag(peerCtx);
+	pixman_region32_clear(&peerCtx->skipped_damage);
+
 	box.x1 = 0;
 	box.y1 = 0;
 	box.x2 = output->base.width;
@@ -1238,13 +1771,36 @@ xf_suppress_output(rdpContext *context, BYTE allow, const RECTANGLE_16 *area)
 {
 	RdpPeerContext *peerContext = (RdpPeerContext *)context;
 
-	if (allow)
+	if (allow) {
 		peerContext->item.flags |= RDP_PEER_OUTPUT_ENABLED;
-	else
+		rdp_peer_reset_lag(peerContext);
+	} else {
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
+	}
+
+	FREERDP_CB_RETURN(TRUE);
+}
+
+#ifdef HAVE_FRAME_ACKNOWLEDGE
+static FREERDP_CB_RET_TYPE
+xf_surface_frame_acknowledge(rdpContext *context, UINT32 frameId)
+{
+	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+	struct rdp_output *output = peerContext->rdpBackend->output;
+
+	peerContext->frame_acks = true;
+	peerContext->acked_frame_id = frameId;
+	weston_compositor_read_presentation_clock(peerContext->rdpBackend->compositor,
+						  &peerContext->ack_time);
+
+	/* caught up, send what was skipped even if nothing changes */
+	if (output && !rdp_peer_is_lagging(peerContext) &&
+	    pixman_region32_not_empty(&peerContext->skipped_damage))
+		weston_output_schedule_repaint(&output->base);
 
 	FREERDP_CB_RETURN(TRUE);
 }
+#endif
 
 static int
 rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
@@ -1296,6 +1852,10 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	client->Activate = xf_peer_activate;
 
 	client->update->SuppressOutput = (pSuppressOutput)xf_suppress_output;
+#ifdef HAVE_FRAME_ACKNOWLEDGE
+	client->update->SurfaceFrameAcknowledge =
+		(pSurfaceFrameAcknowledge)xf_surface_frame_acknowledge;
+#endif
 
 	input = client->input;
 	input->SynchronizeEvent = xf_input_synchronize_event;
@@ -1319,6 +1879,13 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	for ( ; i < MAX_FREERDP_FDS; i++)
 		peerCtx->events[i] = 0;
 
+	peerCtx->lag_timer = wl_event_loop_add_timer(loop, rdp_peer_lag_timeout,
+						     peerCtx);
+	if (!peerCtx->lag_timer) {
+		weston_log("unable to create the lag timer\n");
+		goto error_initialize;
+	}
+
 	wl_list_insert(&b->output->peers, &peerCtx->item.link);
 	return 0;
 
@@ -33,6 +33,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <assert.h>
@@ -67,6 +68,8 @@
 #include "version.h"
 #include "plugin-registry.h"
 #include "pixel-formats.h"
+#include "view-index.h"
+#include "frame-stats.h"
 
 #define DEFAULT_REPAINT_WINDOW 7 /* milliseconds */
 
@@ -318,6 +321,7 @@ weston_view_create(struct weston_surface *surface)
 	pixman_region32_init(&view->geometry.scissor);
 	pixman_region32_init(&view->transform.boundingbox);
 	view->transform.dirty = 1;
+	wl_list_init(&view->transform.dirty_link);
 
 	return view;
 }
@@ -448,6 +452,9 @@ weston_surface_state_init(struct weston_surface_state *state)
 	state->buffer_viewport.buffer.src_width = wl_fixed_from_int(-1);
 	state->buffer_viewport.surface.width = -1;
 	state->buffer_viewport.changed = 0;
+
+	/* Until the client says, so YUV keeps the BT.601 conversion */
+	state->colorspace = WESTON_CS_UNDEFINED;
 }
 
 static void
@@ -522,7 +529,7 @@ weston_surface_create(struct weston_compositor *compositor)
 
 	weston_matrix_init(&surface->buffer_to_surface_matrix);
 	weston_matrix_init(&surface->surface_to_buffer_matrix);
-	surface->colorspace = WESTON_CS_BT709;
+	surface->colorspace = WESTON_CS_UNDEFINED;
 
 	wl_list_init(&surface->pointer_constraints);
 
@@ -1347,6 +1354,9 @@ weston_view_update_transform(struct weston_view *view)
 		weston_view_update_transform(parent);
 
 	view->transform.dirty = 0;
+	wl_list_remove(&view->transform.dirty_link);
+	wl_list_init(&view->transform.dirty_link);
+	view->surface->compositor->view_list_stats.transforms++;
 
 	weston_view_damage_below(view);
 
@@ -1385,6 +1395,9 @@ weston_view_update_transform(struct weston_view *view)
 		}
 	}
 
+	weston_view_index_update(view->surface->compositor->view_index, view);
+	view->surface->compositor->repick_needed = true;
+
 	weston_view_damage_below(view);
 
 	weston_view_assign_output(view);
@@ -1409,6 +1422,8 @@ weston_view_geometry_dirty(struct weston_view *view)
 		return;
 
 	view->transform.dirty = 1;
+	wl_list_insert(&view->surface->compositor->dirty_view_list,
+		       &view->transform.dirty_link);
 
 	wl_list_for_each(child, &view->geometry.child_list,
 			 geometry.parent_link)
@@ -1844,53 +1859,109 @@ weston_compositor_get_time(struct timespec *time)
 	clock_gettime(CLOCK_REALTIME, time);
 }
 
+/* Whether the view is in compositor->view_list, making its
+ * view_list_order meaningful */
+static bool
+view_is_listed(struct weston_view *view)
+{
+	struct weston_compositor *compositor = view->surface->compositor;
+
+	return view->view_list_serial == compositor->view_list_serial &&
+	       !wl_list_empty(&view->link);
+}
+
+static bool
+view_accepts_point(struct weston_view *view, wl_fixed_t x, wl_fixed_t y,
+		   wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	wl_fixed_t view_x, view_y;
+	int view_ix, view_iy;
+	int ix = wl_fixed_to_int(x);
+	int iy = wl_fixed_to_int(y);
+
+	if (!pixman_region32_contains_point(&view->transform.boundingbox,
+					    ix, iy, NULL))
+		return false;
+
+	weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
+	view_ix = wl_fixed_to_int(view_x);
+	view_iy = wl_fixed_to_int(view_y);
+
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	*vx = view_x;
+	*vy = view_y;
+	return true;
+}
+
+/** Find the topmost view accepting input at a point
+ *
+ * Only the views the view index has around the point are considered,
+ * rather than the whole view list.
+ */
 WL_EXPORT struct weston_view *
 weston_compositor_pick_view(struct weston_compositor *compositor,
 			    wl_fixed_t x, wl_fixed_t y,
 			    wl_fixed_t *vx, wl_fixed_t *vy)
 {
-	struct weston_view *view;
+	struct weston_view *best = NULL, **view;
+	struct wl_array *candidates[2];
 	wl_fixed_t view_x, view_y;
-	int view_ix, view_iy;
-	int ix = wl_fixed_to_int(x);
-	int iy = wl_fixed_to_int(y);
+	unsigned int i;
 
-	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
+	candidates[0] = weston_view_index_get_cell(compositor->view_index,
+						   wl_fixed_to_int(x),
+						   wl_fixed_to_int(y));
+	candidates[1] = weston_view_index_get_oversized(compositor->view_index);
+
+	for (i = 0; i < ARRAY_LENGTH(candidates); i++) {
+		if (!candidates[i])
 			continue;
 
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
+		wl_array_for_each(view, candidates[i]) {
+			if (!view_is_listed(*view))
+				continue;
 
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
+			/* Topmost is first in the view list */
+			if (best &&
+			    (*view)->view_list_order >= best->view_list_order)
+				continue;
 
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
-			continue;
+			if (!view_accepts_point(*view, x, y, &view_x, &view_y))
+				continue;
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+			best = *view;
+			*vx = view_x;
+			*vy = view_y;
+		}
 	}
 
+	if (best)
+		return best;
+
 	*vx = wl_fixed_from_int(-1000000);
 	*vy = wl_fixed_from_int(-1000000);
 	return NULL;
 }
 
+/* Pointer motion picks as it goes, so only a changed scene needs the
+ * seats to pick again */
 static void
 weston_compositor_repick(struct weston_compositor *compositor)
 {
 	struct weston_seat *seat;
 
-	if (!compositor->session_active)
+	if (!compositor->session_active || !compositor->repick_needed)
 		return;
 
+	compositor->repick_needed = false;
 	wl_list_for_each(seat, &compositor->seat_list, link)
 		weston_seat_repick(seat);
 }
@@ -1910,6 +1981,8 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	/* Sub-surface views go with their parent on the next rebuild */
+	view->surface->compositor->view_list_needs_rebuild = true;
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -1966,6 +2039,8 @@ weston_view_destroy(struct weston_view *view)
 
 	wl_list_remove(&view->link);
 	weston_layer_entry_remove(&view->layer_link);
+	weston_view_index_remove(view);
+	wl_list_remove(&view->transform.dirty_link);
 
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->geometry.scissor);
@@ -2136,6 +2211,198 @@ weston_compositor_damage_all(struct weston_compositor *compositor)
 		weston_output_damage(output);
 }
 
+/** Read back pixels of the last repaint without waiting for the GPU
+ *
+ * \param output The output to read from.
+ * \param format Pixel format, as for weston_renderer::read_pixels.
+ * \param x,y,width,height The rectangle to read, in the coordinates
+ * weston_renderer::read_pixels uses.
+ * \param done Called with the pixels once they are available, or with
+ * NULL pixels if the read failed after all; it is always called exactly
+ * once when this function succeeds, including on output destruction.
+ * \param data User data passed to done.
+ * \return 0 on success, -1 on failure in which case done is not called.
+ *
+ * Meant to be called from the output's frame_signal. Renderers which can
+ * copy into a GPU buffer call done one frame or so later, in submission
+ * order; otherwise the pixels are read synchronously and done is called
+ * before this function returns.
+ */
+WL_EXPORT int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_done_func_t done,
+				void *data)
+{
+	struct weston_renderer *renderer = output->compositor->renderer;
+	int stride = width * (PIXMAN_FORMAT_BPP(format) / 8);
+	void *pixels;
+	int ret;
+
+	if (renderer->read_pixels_async &&
+	    renderer->read_pixels_async(output, format, x, y, width, height,
+					done, data) == 0)
+		return 0;
+
+	pixels = malloc(stride * height);
+	if (!pixels)
+		return -1;
+
+	ret = renderer->read_pixels(output, format, pixels,
+				    x, y, width, height);
+	if (ret == 0)
+		done(output, pixels, stride, data);
+
+	free(pixels);
+
+	return ret;
+}
+
+/** Prepare a capture frame for a backend to fill in
+ *
+ * The frame starts out with one reference and no fds.
+ */
+WL_EXPORT void
+weston_capture_frame_init(struct weston_capture_frame *frame,
+			  struct weston_output *output)
+{
+	int i;
+
+	memset(frame, 0, sizeof *frame);
+	frame->output = output;
+	frame->refcount = 1;
+	frame->fence_fd = -1;
+	for (i = 0; i < (int) ARRAY_LENGTH(frame->fd); i++)
+		frame->fd[i] = -1;
+}
+
+WL_EXPORT struct weston_capture_frame *
+weston_capture_frame_ref(struct weston_capture_frame *frame)
+{
+	frame->refcount++;
+
+	return frame;
+}
+
+WL_EXPORT void
+weston_capture_frame_unref(struct weston_capture_frame *frame)
+{
+	int i;
+
+	if (!frame)
+		return;
+
+	assert(frame->refcount > 0);
+	if (--frame->refcount > 0)
+		return;
+
+	for (i = 0; i < (int) ARRAY_LENGTH(frame->fd); i++)
+		if (frame->fd[i] >= 0)
+			close(frame->fd[i]);
+	if (frame->fence_fd >= 0)
+		close(frame->fence_fd);
+
+	frame->destroy(frame);
+}
+
+struct weston_capture_wait {
+	struct weston_capture_frame *frame;
+	struct wl_event_source *source;
+	int fence_fd;
+	weston_capture_frame_ready_func_t ready;
+	void *data;
+};
+
+static void
+capture_wait_destroy(struct weston_capture_wait *wait)
+{
+	wl_event_source_remove(wait->source);
+	close(wait->fence_fd);
+	weston_capture_frame_unref(wait->frame);
+	free(wait);
+}
+
+static int
+capture_wait_handler(int fd, uint32_t mask, void *data)
+{
+	struct weston_capture_wait *wait = data;
+	struct weston_capture_frame *frame;
+
+	frame = weston_capture_frame_ref(wait->frame);
+	wait->ready(frame, wait->data);
+	capture_wait_destroy(wait);
+	weston_capture_frame_unref(frame);
+
+	return 0;
+}
+
+/** Call ready once the GPU finished rendering the frame
+ *
+ * \param frame The frame to wait for, referenced until ready is called.
+ * \param ready Called from the event loop once the frame's fence
+ * signals, or right away if it has none.
+ * \param data User data passed to ready.
+ * \return A handle to cancel the wait with, or NULL if ready was called
+ * already or the wait could not be set up, in which case ready is called
+ * right away too.
+ *
+ * Consumers which cannot pass the fence on should wait with this rather
+ * than block on the fence, the compositor keeps running meanwhile.
+ */
+WL_EXPORT struct weston_capture_wait *
+weston_capture_frame_wait(struct weston_capture_frame *frame,
+			  weston_capture_frame_ready_func_t ready,
+			  void *data)
+{
+	struct weston_compositor *compositor = frame->output->compositor;
+	struct wl_event_loop *loop;
+	struct weston_capture_wait *wait;
+
+	if (frame->fence_fd < 0)
+		goto ready;
+
+	wait = zalloc(sizeof *wait);
+	if (!wait)
+		goto ready;
+
+	/* Each waiter needs its own fd in the event loop */
+	wait->fence_fd = fcntl(frame->fence_fd, F_DUPFD_CLOEXEC, 0);
+	if (wait->fence_fd < 0) {
+		free(wait);
+		goto ready;
+	}
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	wait->source = wl_event_loop_add_fd(loop, wait->fence_fd,
+					    WL_EVENT_READABLE,
+					    capture_wait_handler, wait);
+	if (!wait->source) {
+		close(wait->fence_fd);
+		free(wait);
+		goto ready;
+	}
+
+	wait->frame = weston_capture_frame_ref(frame);
+	wait->ready = ready;
+	wait->data = data;
+
+	return wait;
+
+ready:
+	ready(frame, data);
+	return NULL;
+}
+
+/** Stop waiting for a frame; ready is not called */
+WL_EXPORT void
+weston_capture_wait_cancel(struct weston_capture_wait *wait)
+{
+	if (wait)
+		capture_wait_destroy(wait);
+}
+
 WL_EXPORT void
 weston_output_damage(struct weston_output *output)
 {
@@ -2195,24 +2462,29 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 {
 	struct weston_plane *plane;
 	struct weston_view *ev;
-	pixman_region32_t opaque, clip;
-
-	pixman_region32_init(&clip);
+	pixman_region32_t clip;
 
 	wl_list_for_each(plane, &ec->plane_list, link) {
-		pixman_region32_copy(&plane->clip, &clip);
+		pixman_region32_clear(&plane->opaque);
+		plane->accumulating = true;
+	}
 
-		pixman_region32_init(&opaque);
+	/* A view is only occluded by views above it on the same plane, so
+	 * one walk of the view list does for all planes; views on planes
+	 * that are not stacked are left alone. */
+	wl_list_for_each(ev, &ec->view_list, link) {
+		if (!ev->plane || !ev->plane->accumulating)
+			continue;
 
-		wl_list_for_each(ev, &ec->view_list, link) {
-			if (ev->plane != plane)
-				continue;
+		view_accumulate_damage(ev, &ev->plane->opaque);
+	}
 
-			view_accumulate_damage(ev, &opaque);
-		}
+	pixman_region32_init(&clip);
 
-		pixman_region32_union(&clip, &clip, &opaque);
-		pixman_region32_fini(&opaque);
+	wl_list_for_each(plane, &ec->plane_list, link) {
+		pixman_region32_copy(&plane->clip, &clip);
+		pixman_region32_union(&clip, &clip, &plane->opaque);
+		plane->accumulating = false;
 	}
 
 	pixman_region32_fini(&clip);
@@ -2354,6 +2626,7 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
 	struct weston_view *view;
 	struct weston_layer *layer;
+	uint32_t order;
 
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
@@ -2366,11 +2639,70 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 		}
 	}
 
+	/* Stamp the stacking order for picking through the view index */
+	compositor->view_list_serial++;
+	order = 0;
+	wl_list_for_each(view, &compositor->view_list, link) {
+		view->view_list_serial = compositor->view_list_serial;
+		view->view_list_order = order++;
+	}
+
+	compositor->view_list_needs_rebuild = false;
+	compositor->repick_needed = true;
+	compositor->view_list_stats.rebuilt = true;
+	compositor->view_list_stats.views = order;
+
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
 }
 
+/** Bring the view list and view transforms up to date for a repaint
+ *
+ * The view list is only rebuilt when layers, sub-surface stacking or
+ * mapping changed since the last time. Otherwise only the transforms of
+ * views whose geometry changed are updated.
+ */
+static void
+weston_compositor_update_view_list(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+	struct timespec start, end;
+	struct wl_list dirty;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	compositor->view_list_stats.rebuilt = false;
+	compositor->view_list_stats.views = 0;
+	compositor->view_list_stats.transforms = 0;
+
+	if (compositor->view_list_needs_rebuild) {
+		weston_compositor_build_view_list(compositor);
+	} else {
+		/* Views dirtied from transform_signal handlers in here are
+		 * left for the next repaint, as they would be with a
+		 * rebuild if they came earlier in the list. */
+		wl_list_init(&dirty);
+		wl_list_insert_list(&dirty, &compositor->dirty_view_list);
+		wl_list_init(&compositor->dirty_view_list);
+
+		while (!wl_list_empty(&dirty)) {
+			view = container_of(dirty.next, struct weston_view,
+					    transform.dirty_link);
+			wl_list_remove(&view->transform.dirty_link);
+			wl_list_init(&view->transform.dirty_link);
+
+			/* Views out of the list get updated when added */
+			if (view_is_listed(view))
+				weston_view_update_transform(view);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	compositor->view_list_stats.usec =
+		timespec_sub_to_nsec(&end, &start) / 1000;
+}
+
 static void
 weston_output_take_feedback_list(struct weston_output *output,
 				 struct weston_surface *surface)
@@ -2396,6 +2728,166 @@ weston_output_take_feedback_list(struct weston_output *output,
 	wl_list_init(&surface->feedback_list);
 }
 
+/* Until this many repaints were measured, the adaptive window is not
+ * trusted and repaint_msec is used. */
+#define REPAINT_COST_MIN_SAMPLES 8
+/* The adaptive window never gets shorter than this */
+#define REPAINT_WINDOW_MIN_USEC 1000
+/* How the margin reacts to a missed and to a hit vblank */
+#define REPAINT_MARGIN_MISS_USEC 500
+#define REPAINT_MARGIN_HIT_USEC 20
+
+static int32_t
+weston_output_repaint_window_usec(struct weston_output *output)
+{
+	struct weston_compositor *compositor = output->compositor;
+
+	if (compositor->repaint_adaptive && output->repaint_window.window_usec)
+		return output->repaint_window.window_usec;
+
+	return compositor->repaint_msec * 1000;
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Picks the shortest window that would have let all but the target
+ * fraction of the recent repaints finish in time, plus the margin. */
+static void
+repaint_window_update(struct weston_output *output, int32_t refresh_nsec)
+{
+	struct weston_compositor *compositor = output->compositor;
+	uint32_t sorted[WESTON_REPAINT_COST_SAMPLES];
+	unsigned n = output->repaint_window.n_samples;
+	unsigned i;
+	int64_t window;
+
+	if (n < REPAINT_COST_MIN_SAMPLES || refresh_nsec <= 0)
+		return;
+
+	memcpy(sorted, output->repaint_window.cost_usec, n * sizeof sorted[0]);
+	qsort(sorted, n, sizeof sorted[0], compare_uint32);
+
+	i = ceil((1.0 - compositor->repaint_miss_target) * n);
+	if (i > 0)
+		i--;
+	if (i >= n)
+		i = n - 1;
+
+	window = (int64_t) sorted[i] + output->repaint_window.margin_usec;
+	window = MAX(window, REPAINT_WINDOW_MIN_USEC);
+	window = MIN(window, refresh_nsec / 1000);
+
+	output->repaint_window.window_usec = window;
+}
+
+static void
+repaint_window_add_sample(struct weston_output *output)
+{
+	struct timespec done = output->repaint_window.flushed;
+	int64_t cost;
+	unsigned i;
+
+	if (timespec_sub_to_nsec(&output->repaint_window.gpu_done, &done) > 0)
+		done = output->repaint_window.gpu_done;
+
+	cost = timespec_sub_to_nsec(&done, &output->repaint_window.start);
+	cost = MAX(cost / 1000, 0);
+	cost = MIN(cost, UINT32_MAX);
+
+	i = output->repaint_window.next_sample;
+	output->repaint_window.cost_usec[i] = cost;
+	output->repaint_window.next_sample = (i + 1) %
+					     WESTON_REPAINT_COST_SAMPLES;
+	if (output->repaint_window.n_samples < WESTON_REPAINT_COST_SAMPLES)
+		output->repaint_window.n_samples++;
+
+	output->repaint_window.pending = false;
+}
+
+/* Takes the sample once both the flush and the GPU are done, if the
+ * renderer tells about the latter */
+static void
+repaint_window_try_sample(struct weston_output *output)
+{
+	if (!output->repaint_window.pending ||
+	    timespec_is_zero(&output->repaint_window.flushed))
+		return;
+
+	if (output->repaint_window.gpu_reports &&
+	    timespec_is_zero(&output->repaint_window.gpu_done))
+		return;
+
+	repaint_window_add_sample(output);
+}
+
+static void
+repaint_window_present(struct weston_output *output,
+		       const struct timespec *stamp, int32_t refresh_nsec)
+{
+	struct weston_compositor *compositor = output->compositor;
+	bool missed;
+
+	/* Not a repaint of ours, e.g. restarting the repaint loop */
+	if (timespec_is_zero(&output->repaint_window.target))
+		return;
+
+	/* The GPU report may come after the flip; do with what we have */
+	if (output->repaint_window.pending &&
+	    !timespec_is_zero(&output->repaint_window.flushed))
+		repaint_window_add_sample(output);
+
+	missed = timespec_sub_to_nsec(stamp, &output->repaint_window.target) >
+		 refresh_nsec / 2;
+	output->repaint_window.target = (struct timespec) { 0 };
+
+	output->repaint_window.miss_rate +=
+		((missed ? 1.0 : 0.0) - output->repaint_window.miss_rate) /
+		WESTON_REPAINT_COST_SAMPLES;
+
+	if (missed) {
+		output->repaint_window.margin_usec =
+			MIN(output->repaint_window.margin_usec +
+			    REPAINT_MARGIN_MISS_USEC, refresh_nsec / 2000);
+	} else if (output->repaint_window.miss_rate <
+		   compositor->repaint_miss_target) {
+		output->repaint_window.margin_usec =
+			MAX(output->repaint_window.margin_usec -
+			    REPAINT_MARGIN_HIT_USEC, 0);
+	}
+
+	repaint_window_update(output, refresh_nsec);
+}
+
+/** Tell when the GPU finished rendering the last repaint of the output
+ *
+ * \param output The output.
+ * \param done The completion time, in the presentation clock domain.
+ *
+ * Renderers that can tell call this after each repaint, so that an
+ * adaptive repaint window accounts for GPU time too. Otherwise only the
+ * time until the repaint was flushed to the backend is measured.
+ *
+ * \memberof weston_output
+ */
+WL_EXPORT void
+weston_output_render_done(struct weston_output *output,
+			  const struct timespec *done)
+{
+	output->repaint_window.gpu_reports = true;
+
+	if (!output->repaint_window.pending)
+		return;
+
+	output->repaint_window.gpu_done = *done;
+	repaint_window_try_sample(output);
+}
+
 static int
 weston_output_repaint(struct weston_output *output, void *repaint_data)
 {
@@ -2407,14 +2899,17 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 	pixman_region32_t output_damage;
 	int r;
 	uint32_t frame_time_msec;
+	struct timespec begin, end, target;
 
 	if (output->destroying)
 		return 0;
 
 	TL_POINT("core_repaint_begin", TLP_OUTPUT(output), TLP_END);
 
-	/* Rebuild the surface list and update surface transforms up front. */
-	weston_compositor_build_view_list(ec);
+	weston_compositor_read_presentation_clock(ec, &begin);
+
+	/* Update the surface list and surface transforms up front. */
+	weston_compositor_update_view_list(ec);
 
 	if (output->assign_planes && !output->disable_planes) {
 		output->assign_planes(output, repaint_data);
@@ -2455,9 +2950,23 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 	pixman_region32_fini(&output_damage);
 
 	output->repaint_needed = false;
-	if (r == 0)
+	if (r == 0) {
 		output->repaint_status = REPAINT_AWAITING_COMPLETION;
 
+		weston_compositor_read_presentation_clock(ec, &end);
+		timespec_add_nsec(&target, &output->next_repaint,
+				  weston_output_repaint_window_usec(output) *
+				  1000LL);
+		weston_frame_stats_repaint(output->frame_stats,
+					   &begin, &end, &target);
+
+		output->repaint_window.pending = true;
+		output->repaint_window.start = output->next_repaint;
+		output->repaint_window.target = target;
+		output->repaint_window.flushed = (struct timespec) { 0 };
+		output->repaint_window.gpu_done = (struct timespec) { 0 };
+	}
+
 	weston_compositor_repick(ec);
 
 	frame_time_msec = timespec_to_msec(&output->frame_time);
@@ -2481,6 +2990,7 @@ static void
 weston_output_schedule_repaint_reset(struct weston_output *output)
 {
 	output->repaint_status = REPAINT_NOT_SCHEDULED;
+	weston_frame_stats_loop_exit(output->frame_stats);
 	TL_POINT("core_repaint_exit_loop", TLP_OUTPUT(output), TLP_END);
 }
 
@@ -2592,10 +3102,23 @@ output_repaint_timer_handler(void *data)
 		if (compositor->backend->repaint_flush)
 			compositor->backend->repaint_flush(compositor,
 							   repaint_data);
+
+		weston_compositor_read_presentation_clock(compositor, &now);
+		wl_list_for_each(output, &compositor->output_list, link) {
+			if (!output->repainted)
+				continue;
+
+			output->repaint_window.flushed = now;
+			repaint_window_try_sample(output);
+		}
 	} else {
 		wl_list_for_each(output, &compositor->output_list, link) {
-			if (output->repainted)
-				weston_output_schedule_repaint_reset(output);
+			if (!output->repainted)
+				continue;
+
+			output->repaint_window.pending = false;
+			output->repaint_window.target = (struct timespec) { 0 };
+			weston_output_schedule_repaint_reset(output);
 		}
 
 		if (compositor->backend->repaint_cancel)
@@ -2644,11 +3167,18 @@ weston_output_finish_frame(struct weston_output *output,
 						  output->msc,
 						  presented_flags);
 
+	if (!(presented_flags & WP_PRESENTATION_FEEDBACK_INVALID)) {
+		weston_frame_stats_present(output->frame_stats, stamp,
+					   output->msc, refresh_nsec);
+		if (compositor->repaint_adaptive)
+			repaint_window_present(output, stamp, refresh_nsec);
+	}
+
 	output->frame_time = *stamp;
 
 	timespec_add_nsec(&output->next_repaint, stamp, refresh_nsec);
-	timespec_add_msec(&output->next_repaint, &output->next_repaint,
-			  -compositor->repaint_msec);
+	timespec_add_nsec(&output->next_repaint, &output->next_repaint,
+			  -weston_output_repaint_window_usec(output) * 1000LL);
 	msec_rel = timespec_sub_to_msec(&output->next_repaint, &now);
 
 	if (msec_rel < -1000 || msec_rel > 1000) {
@@ -2697,11 +3227,17 @@ weston_layer_entry_insert(struct weston_layer_entry *list,
 {
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+
+	if (entry->layer)
+		entry->layer->compositor->view_list_needs_rebuild = true;
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	if (entry->layer)
+		entry->layer->compositor->view_list_needs_rebuild = true;
+
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -2739,6 +3275,7 @@ weston_layer_set_position(struct weston_layer *layer,
 	struct weston_layer *below;
 
 	wl_list_remove(&layer->link);
+	layer->compositor->view_list_needs_rebuild = true;
 
 	/* layer_list is ordered from top to bottom, the last layer being the
 	 * background with the smallest position value */
@@ -2763,6 +3300,7 @@ weston_layer_unset_position(struct weston_layer *layer)
 {
 	wl_list_remove(&layer->link);
 	wl_list_init(&layer->link);
+	layer->compositor->view_list_needs_rebuild = true;
 }
 
 WL_EXPORT void
@@ -2996,8 +3534,10 @@ weston_surface_commit_subsurface_order(struct weston_surface *surface)
 		wl_list_remove(&sub->parent_link);
 		wl_list_insert(&surface->subsurface_list, &sub->parent_link);
 
-		if (sub->reordered)
+		if (sub->reordered) {
 			weston_surface_damage_subsurfaces(sub);
+			surface->compositor->view_list_needs_rebuild = true;
+		}
 	}
 }
 
@@ -3204,6 +3744,7 @@ weston_surface_commit_state(struct weston_surface *surface,
 {
 	struct weston_view *view;
 	pixman_region32_t opaque;
+	pixman_region32_t input;
 
 	/* wl_surface.set_buffer_transform */
 	/* wl_surface.set_buffer_scale */
@@ -3211,6 +3752,10 @@ weston_surface_commit_state(struct weston_surface *surface,
 	/* wp_viewport.set_destination */
 	surface->buffer_viewport = state->buffer_viewport;
 
+	/* The renderer picks the YUV conversion of a buffer when it is
+	 * attached, so the colorspace of the same commit must be in place */
+	surface->colorspace = surface->pending.colorspace;
+
 	/* wl_surface.attach */
 	if (state->newly_attached)
 		weston_surface_attach(surface, state->buffer);
@@ -3233,11 +3778,20 @@ weston_surface_commit_state(struct weston_surface *surface,
 	state->buffer_viewport.changed = 0;
 
 	/* wl_surface.damage and wl_surface.damage_buffer */
-	if (weston_timeline_enabled_ &&
-	    (pixman_region32_not_empty(&state->damage_surface) ||
-	     pixman_region32_not_empty(&state->damage_buffer)))
+	if (pixman_region32_not_empty(&state->damage_surface) ||
+	    pixman_region32_not_empty(&state->damage_buffer)) {
 		TL_POINT("core_commit_damage", TLP_SURFACE(surface), TLP_END);
 
+		if (surface->output) {
+			struct timespec now;
+
+			weston_compositor_read_presentation_clock(
+				surface->compositor, &now);
+			weston_frame_stats_commit(surface->output->frame_stats,
+						  &now);
+		}
+	}
+
 	pixman_region32_union(&surface->damage, &surface->damage,
 			      &state->damage_surface);
 
@@ -3261,8 +3815,14 @@ weston_surface_commit_state(struct weston_surface *surface,
 	pixman_region32_fini(&opaque);
 
 	/* wl_surface.set_input_region */
-	pixman_region32_intersect_rect(&surface->input, &state->input,
+	pixman_region32_init(&input);
+	pixman_region32_intersect_rect(&input, &state->input,
 				       0, 0, surface->width, surface->height);
+	if (!pixman_region32_equal(&input, &surface->input)) {
+		pixman_region32_copy(&surface->input, &input);
+		surface->compositor->repick_needed = true;
+	}
+	pixman_region32_fini(&input);
 
 	/* wl_surface.frame */
 	wl_list_insert_list(&surface->frame_callback_list,
@@ -3279,7 +3839,7 @@ weston_surface_commit_state(struct weston_surface *surface,
 			    &state->feedback_list);
 	wl_list_init(&state->feedback_list);
 
-	//Apply colorspace and HDR metadata state
+	//Apply HDR metadata state
 	if (surface->pending.hdr_metadata) {
 		if (!surface->hdr_metadata)
 			surface->hdr_metadata =
@@ -3292,8 +3852,6 @@ weston_surface_commit_state(struct weston_surface *surface,
 		surface->hdr_metadata = NULL;
 	}
 
-	surface->colorspace = surface->pending.colorspace;
-
 	wl_signal_emit(&surface->commit_signal, surface);
 }
 
@@ -3679,6 +4237,7 @@ subsurface_committed(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 	if (!weston_surface_is_mapped(surface)) {
 		surface->is_mapped = true;
+		surface->compositor->view_list_needs_rebuild = true;
 
 		/* Cannot call weston_view_update_transform(),
 		 * because that would call it also for the parent surface,
@@ -4019,6 +4578,7 @@ weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
+	sub->parent->compositor->view_list_needs_rebuild = true;
 	sub->parent = NULL;
 }
 
@@ -4082,6 +4642,7 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	parent->compositor->view_list_needs_rebuild = true;
 }
 
 static void
@@ -4409,6 +4970,7 @@ weston_plane_init(struct weston_plane *plane,
 {
 	pixman_region32_init(&plane->damage);
 	pixman_region32_init(&plane->clip);
+	pixman_region32_init(&plane->opaque);
 	plane->x = x;
 	plane->y = y;
 	plane->compositor = ec;
@@ -4425,6 +4987,7 @@ weston_plane_release(struct weston_plane *plane)
 
 	pixman_region32_fini(&plane->damage);
 	pixman_region32_fini(&plane->clip);
+	pixman_region32_fini(&plane->opaque);
 
 	wl_list_for_each(view, &plane->compositor->view_list, link) {
 		if (view->plane == plane)
@@ -5662,6 +6225,13 @@ weston_output_init(struct weston_output *output,
 	/* Can't use -1 on uint32_t and 0 is valid enum value */
 	output->transform = UINT32_MAX;
 
+	/* Plain SDR unless the backend knows better */
+	output->colorspace = WESTON_CS_BT709;
+	output->eotf = EOTF_TRADITIONAL_GAMMA_SDR;
+	output->max_luminance = 0;
+
+	output->repaint_window.margin_usec = REPAINT_WINDOW_MIN_USEC;
+
 	pixman_region32_init(&output->previous_damage);
 	pixman_region32_init(&output->region);
 	wl_list_init(&output->mode_list);
@@ -5791,6 +6361,17 @@ weston_output_enable(struct weston_output *output)
 	/* Make sure we have a transform set */
 	assert(output->transform != UINT32_MAX);
 
+	/* Kept over disable and enable, so re-enabled outputs keep
+	 * counting */
+	if (!output->frame_stats) {
+		output->frame_stats = weston_frame_stats_create();
+		if (!output->frame_stats) {
+			weston_log("Error: out of memory enabling output '%s'.\n",
+				   output->name);
+			return -1;
+		}
+	}
+
 	output->x = x;
 	output->y = y;
 	output->dirty = 1;
@@ -5804,6 +6385,7 @@ weston_output_enable(struct weston_output *output)
 
 	wl_signal_init(&output->frame_signal);
 	wl_signal_init(&output->destroy_signal);
+	wl_signal_init(&output->capture_signal);
 	wl_list_init(&output->animation_list);
 	wl_list_init(&output->feedback_list);
 
@@ -5968,6 +6550,7 @@ weston_output_release(struct weston_output *output)
 	wl_list_for_each_safe(head, tmp, &output->head_list, output_link)
 		weston_head_detach(head);
 
+	weston_frame_stats_destroy(output->frame_stats);
 	free(output->name);
 }
 
@@ -6561,6 +7144,16 @@ weston_compositor_print_scene_graph(struct weston_compositor *ec)
 
 		fprintf(fp, "\trepaint status: %s\n",
 			output_repaint_status_text(output));
+		fprintf(fp, "\tlast repaint: %u draw calls, %u vertices\n",
+			output->render_stats.draw_calls,
+			output->render_stats.vertices);
+		if (output->render_stats.damaged_pixels > 0)
+			fprintf(fp, "\tlast repaint fill: %" PRIu64 " pixels "
+				"damaged, %" PRIu64 " opaque and %" PRIu64
+				" blended drawn\n",
+				output->render_stats.damaged_pixels,
+				output->render_stats.opaque_pixels,
+				output->render_stats.blended_pixels);
 		if (output->repaint_status == REPAINT_SCHEDULED)
 			fprintf(fp, "\tnext repaint: %ld.%09ld\n",
 				output->next_repaint.tv_sec,
@@ -6573,7 +7166,11 @@ weston_compositor_print_scene_graph(struct weston_compositor *ec)
 		}
 	}
 
-	fprintf(fp, "\n");
+	fprintf(fp, "View list update in last repaint: %s, %u views, "
+		"%u transforms, %u us\n\n",
+		ec->view_list_stats.rebuilt ? "rebuilt" : "incremental",
+		ec->view_list_stats.views, ec->view_list_stats.transforms,
+		ec->view_list_stats.usec);
 
 	wl_list_for_each(layer, &ec->layer_list, link) {
 		struct weston_view *view;
@@ -6619,6 +7216,100 @@ debug_scene_graph_cb(struct weston_debug_stream *stream, void *data)
 	weston_debug_stream_complete(stream);
 }
 
+#define FRAME_STATS_INTERVAL_MSEC 1000
+
+static char *
+frame_stats_print(struct weston_compositor *ec, bool interval)
+{
+	struct weston_output *output;
+	char timestr[128];
+	FILE *fp;
+	char *ret;
+	size_t len;
+
+	fp = open_memstream(&ret, &len);
+	if (!fp)
+		return NULL;
+
+	weston_debug_scope_timestamp(ec->debug_frame_stats,
+				     timestr, sizeof timestr);
+
+	wl_list_for_each(output, &ec->output_list, link) {
+		fprintf(fp, "%s output '%s', %s:\n", timestr, output->name,
+			interval ? "last interval" : "since enabled");
+		weston_frame_stats_print(output->frame_stats, fp, interval);
+
+		/* Occlusion is only counted while this scope is subscribed,
+		 * so the last repaint is the one to show */
+		if (output->render_stats.damaged_pixels > 0)
+			fprintf(fp, "\tlast repaint fill: %" PRIu64 " pixels "
+				"damaged, %" PRIu64 " opaque and %" PRIu64
+				" blended drawn, %" PRIu64 " of them occluded, "
+				"overdraw %.2f\n",
+				output->render_stats.damaged_pixels,
+				output->render_stats.opaque_pixels,
+				output->render_stats.blended_pixels,
+				output->render_stats.occluded_pixels,
+				(double) (output->render_stats.opaque_pixels +
+					  output->render_stats.blended_pixels -
+					  output->render_stats.occluded_pixels) /
+				output->render_stats.damaged_pixels);
+
+		if (ec->repaint_adaptive)
+			fprintf(fp, "\trepaint window %.3f ms, margin %.3f ms, "
+				"miss rate %.2f%%\n",
+				weston_output_repaint_window_usec(output) / 1000.0,
+				output->repaint_window.margin_usec / 1000.0,
+				output->repaint_window.miss_rate * 100.0);
+	}
+
+	fclose(fp);
+
+	return ret;
+}
+
+static int
+frame_stats_timer_handler(void *data)
+{
+	struct weston_compositor *ec = data;
+	char *str;
+
+	/* The last subscriber is gone; wait for the next one */
+	if (!weston_debug_scope_is_enabled(ec->debug_frame_stats))
+		return 0;
+
+	str = frame_stats_print(ec, true);
+	if (str) {
+		weston_debug_scope_printf(ec->debug_frame_stats, "%s", str);
+		free(str);
+	}
+
+	wl_event_source_timer_update(ec->frame_stats_timer,
+				     FRAME_STATS_INTERVAL_MSEC);
+
+	return 0;
+}
+
+/**
+ * Called when the 'frame-stats' debug scope is bound by a client. The
+ * stream gets a summary of everything recorded so far right away, and
+ * then a summary of each interval while it stays open.
+ */
+static void
+debug_frame_stats_cb(struct weston_debug_stream *stream, void *data)
+{
+	struct weston_compositor *ec = data;
+	char *str = frame_stats_print(ec, false);
+
+	if (str) {
+		weston_debug_stream_printf(stream, "%s", str);
+		free(str);
+	}
+
+	wl_event_source_timer_update(ec->frame_stats_timer,
+				     FRAME_STATS_INTERVAL_MSEC);
+}
+
 /** Create the compositor.
  *
  * This functions creates and initializes a compositor instance.
@@ -6662,6 +7353,7 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 
 	ec->output_id_pool = 0;
 	ec->repaint_msec = DEFAULT_REPAINT_WINDOW;
+	ec->repaint_miss_target = 0.01;
 
 	ec->activate_serial = 1;
 
@@ -6689,7 +7381,14 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	if (weston_input_init(ec) != 0)
 		goto fail;
 
+	ec->view_index = weston_view_index_create();
+	if (!ec->view_index)
+		goto fail;
+
 	wl_list_init(&ec->view_list);
+	wl_list_init(&ec->dirty_view_list);
+	ec->view_list_needs_rebuild = true;
+	ec->repick_needed = true;
 	wl_list_init(&ec->plane_list);
 	wl_list_init(&ec->layer_list);
 	wl_list_init(&ec->seat_list);
@@ -6728,12 +7427,23 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	weston_compositor_add_debug_binding(ec, KEY_T,
 					    timeline_key_binding_handler, ec);
 
+	if (getenv("WESTON_TIMELINE"))
+		weston_timeline_open(ec);
+
 	ec->debug_scene =
 		weston_compositor_add_debug_scope(ec, "scene-graph",
 						  "Scene graph details\n",
 					  	  debug_scene_graph_cb,
 					  	  ec);
 
+	ec->frame_stats_timer =
+		wl_event_loop_add_timer(loop, frame_stats_timer_handler, ec);
+	ec->debug_frame_stats =
+		weston_compositor_add_debug_scope(ec, "frame-stats",
+			"Per-output frame latency, repaint duration and "
+			"deadline slack percentiles, every second\n",
+			debug_frame_stats_cb, ec);
+
 	return ec;
 
 fail:
@@ -7035,8 +7745,15 @@ weston_compositor_destroy(struct weston_compositor *compositor)
 
 	weston_debug_scope_destroy(compositor->debug_scene);
 	compositor->debug_scene = NULL;
+
+	weston_debug_scope_destroy(compositor->debug_frame_stats);
+	compositor->debug_frame_stats = NULL;
+	if (compositor->frame_stats_timer)
+		wl_event_source_remove(compositor->frame_stats_timer);
 	weston_debug_compositor_destroy(compositor);
 
+	weston_view_index_destroy(compositor->view_index);
+
 	free(compositor);
 }
 
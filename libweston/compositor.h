@@ -201,6 +201,9 @@ struct weston_head {
 	bool non_desktop;		/**< non-desktop display, e.g. HMD */
 };
 
+/** Repaint costs an adaptive repaint window is picked from */
+#define WESTON_REPAINT_COST_SAMPLES 64
+
 struct weston_output {
 	uint32_t id;
 	char *name;
@@ -252,6 +255,12 @@ struct weston_output {
 	int dirty;
 	struct wl_signal frame_signal;
 	struct wl_signal destroy_signal;	/**< sent when disabled */
+
+	/** Sent with a struct weston_capture_frame after repaints, or
+	 *  with NULL for a repaint whose frame is not shared, when
+	 *  capture_dmabuf is set; see weston_capture_frame */
+	struct wl_signal capture_signal;
+	bool capture_dmabuf;
 	int move_x, move_y;
 	struct timespec frame_time; /* presentation timestamp */
 	uint64_t msc;        /* media stream counter */
@@ -291,6 +300,50 @@ struct weston_output {
 			  uint16_t *g,
 			  uint16_t *b);
 
+	/** Colorimetry the renderer composites into */
+	uint32_t colorspace; /**< enum weston_colorspace_enums */
+	enum hdr_metadata_eotf eotf;
+	uint16_t max_luminance; /**< peak luminance in cd/m², 0 if unknown */
+
+	/** Renderer statistics for the last repaint */
+	struct {
+		uint32_t draw_calls;
+		uint32_t vertices;
+		/** Pixels repainted, and pixels drawn over them without
+		 * and with blending. Of those drawn, the pixels the depth
+		 * test rejects as hidden behind opaque views, which are
+		 * not shaded, only counted while the frame-stats debug
+		 * scope is subscribed. Shaded over repainted is the
+		 * overdraw. */
+		uint64_t damaged_pixels;
+		uint64_t opaque_pixels;
+		uint64_t blended_pixels;
+		uint64_t occluded_pixels;
+	} render_stats;
+
+	/** Repaint loop latency statistics, see frame-stats.h */
+	struct weston_frame_stats *frame_stats;
+
+	/** Adaptive repaint window, see weston_compositor::repaint_adaptive.
+	 *  Costs are measured from the scheduled repaint start to when the
+	 *  frame was both flushed and rendered by the GPU. */
+	struct {
+		uint32_t cost_usec[WESTON_REPAINT_COST_SAMPLES];
+		unsigned next_sample;
+		unsigned n_samples;
+		int32_t margin_usec;	/**< added for what is not measured */
+		int32_t window_usec;	/**< 0 until there are enough samples */
+		double miss_rate;	/**< moving average */
+		bool gpu_reports;	/**< renderer reports GPU completion */
+
+		/* The repaint in flight */
+		bool pending;
+		struct timespec start;
+		struct timespec target;
+		struct timespec flushed;
+		struct timespec gpu_done;
+	} repaint_window;
+
 	struct weston_timeline_object timeline;
 
 	bool enabled; /**< is in the output_list, not pending list */
@@ -589,6 +642,8 @@ weston_pointer_send_motion(struct weston_pointer *pointer,
 			   struct weston_pointer_motion_event *event);
 bool
 weston_pointer_has_focus_resource(struct weston_pointer *pointer);
+bool
+weston_pointer_wants_motion_stream(struct weston_pointer *pointer);
 void
 weston_pointer_send_button(struct weston_pointer *pointer,
 			   const struct timespec *time,
@@ -888,13 +943,72 @@ struct weston_plane {
 	pixman_region32_t clip;
 	int32_t x, y;
 	struct wl_list link;
+
+	/* Scratch state of compositor_accumulate_damage() */
+	pixman_region32_t opaque;
+	bool accumulating;
+};
+
+/** Receives the result of weston_output_read_pixels_async()
+ *
+ * \param pixels The rectangle in the layout read_pixels() uses, or NULL
+ * if reading failed. Only valid for the duration of the call.
+ * \param stride Bytes from one row of pixels to the next.
+ */
+typedef void (*weston_read_pixels_done_func_t)(struct weston_output *output,
+					       void *pixels, int stride,
+					       void *data);
+
+/** A repainted output frame, shared as a dmabuf
+ *
+ * Backends which render into buffers they can export send one on
+ * weston_output::capture_signal right after each repaint, so consumers
+ * can pass the frame on to another process or device without a copy.
+ * Taking a reference keeps the backend from rendering into the buffer
+ * again. A backend skips frames rather than run out of buffers, sending
+ * NULL instead, so consumers must not hold on to more than a couple of
+ * frames, and should schedule a repaint once they release one after a
+ * frame was skipped.
+ *
+ * The fds belong to the frame and are closed with its last reference.
+ */
+struct weston_capture_frame {
+	struct weston_output *output;
+	int32_t width, height;
+	uint32_t format;	/**< DRM fourcc */
+	uint64_t modifier;
+	int n_planes;
+	int fd[4];
+	uint32_t offset[4];
+	uint32_t stride[4];
+	/** Signals once rendering into the buffer is complete; -1 if
+	 *  it is known to be complete or the renderer cannot tell */
+	int fence_fd;
+
+	int refcount;
+	/** Set by the backend, called when the last reference is gone */
+	void (*destroy)(struct weston_capture_frame *frame);
 };
 
+struct weston_capture_wait;
+
+typedef void (*weston_capture_frame_ready_func_t)(
+					struct weston_capture_frame *frame,
+					void *data);
+
 struct weston_renderer {
 	int (*read_pixels)(struct weston_output *output,
 			       pixman_format_code_t format, void *pixels,
 			       uint32_t x, uint32_t y,
 			       uint32_t width, uint32_t height);
+
+	/** See weston_output_read_pixels_async(); may be NULL */
+	int (*read_pixels_async)(struct weston_output *output,
+				 pixman_format_code_t format,
+				 uint32_t x, uint32_t y,
+				 uint32_t width, uint32_t height,
+				 weston_read_pixels_done_func_t done,
+				 void *data);
 	void (*repaint_output)(struct weston_output *output,
 			       pixman_region32_t *output_damage);
 	void (*flush_damage)(struct weston_surface *surface);
@@ -1096,6 +1210,20 @@ struct weston_compositor {
 	struct wl_list seat_list;
 	struct wl_list layer_list;	/* struct weston_layer::link */
 	struct wl_list view_list;	/* struct weston_view::link */
+	uint32_t view_list_serial;
+	bool view_list_needs_rebuild;
+	/** Views moved or changed input since the seats last repicked */
+	bool repick_needed;
+	struct wl_list dirty_view_list;	/* struct weston_view::dirty_link */
+
+	/** Cost of bringing the view list up to date in the last repaint */
+	struct {
+		bool rebuilt;
+		uint32_t views;		/**< views added by the rebuild */
+		uint32_t transforms;	/**< view transforms updated */
+		uint32_t usec;
+	} view_list_stats;
+	struct weston_view_index *view_index; /* for picking views */
 	struct wl_list plane_list;
 	struct wl_list key_binding_list;
 	struct wl_list modifier_binding_list;
@@ -1139,6 +1267,16 @@ struct weston_compositor {
 
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
+	/** Learn each output's repaint window from its recent repaint
+	 *  costs instead of using repaint_msec */
+	bool repaint_adaptive;
+	/** Fraction of frames the adaptive window may let miss their
+	 *  target vblank */
+	double repaint_miss_target;
+
+	/** Backends merge the relative pointer motion they read in one go
+	 *  into a single motion event */
+	bool coalesce_pointer_motion;
 
 	unsigned int activate_serial;
 
@@ -1167,6 +1305,8 @@ struct weston_compositor {
 
 	struct weston_debug_compositor *weston_debug;
 	struct weston_debug_scope *debug_scene;
+	struct weston_debug_scope *debug_frame_stats;
+	struct wl_event_source *frame_stats_timer;
 };
 
 struct weston_buffer {
@@ -1294,6 +1434,8 @@ struct weston_view {
 	 */
 	struct {
 		int dirty;
+		/* weston_compositor::dirty_view_list, while dirty */
+		struct wl_list dirty_link;
 
 		/* Approximations in global coordinates:
 		 * - boundingbox is guaranteed to include the whole view in
@@ -1332,6 +1474,18 @@ struct weston_view {
 	uint32_t psf_flags;
 
 	bool is_mapped;
+
+	/* Stacking position, set when the view list is built. Only valid if
+	 * view_list_serial matches weston_compositor::view_list_serial. */
+	uint32_t view_list_serial;
+	uint32_t view_list_order;
+
+	/* Cells of the view index the view is in, managed by view-index.c */
+	struct {
+		struct weston_view_index *index;
+		int32_t x1, y1, x2, y2;
+		bool oversized;
+	} index_cells;
 };
 
 struct weston_surface_state {
@@ -1721,9 +1875,34 @@ weston_output_finish_frame(struct weston_output *output,
 			   const struct timespec *stamp,
 			   uint32_t presented_flags);
 void
+weston_output_render_done(struct weston_output *output,
+			  const struct timespec *done);
+void
 weston_output_schedule_repaint(struct weston_output *output);
 void
 weston_output_damage(struct weston_output *output);
+int
+weston_output_read_pixels_async(struct weston_output *output,
+				pixman_format_code_t format,
+				uint32_t x, uint32_t y,
+				uint32_t width, uint32_t height,
+				weston_read_pixels_done_func_t done,
+				void *data);
+
+void
+weston_capture_frame_init(struct weston_capture_frame *frame,
+			  struct weston_output *output);
+struct weston_capture_frame *
+weston_capture_frame_ref(struct weston_capture_frame *frame);
+void
+weston_capture_frame_unref(struct weston_capture_frame *frame);
+struct weston_capture_wait *
+weston_capture_frame_wait(struct weston_capture_frame *frame,
+			  weston_capture_frame_ready_func_t ready,
+			  void *data);
+void
+weston_capture_wait_cancel(struct weston_capture_wait *wait);
+
 void
 weston_compositor_schedule_repaint(struct weston_compositor *compositor);
 void
@@ -2359,6 +2538,8 @@ void
 weston_buffer_send_server_error(struct weston_buffer *buffer,
 				      const char *msg);
 int weston_hdr_metadata_setup(struct weston_compositor *compositor);
+enum hdr_metadata_eotf
+weston_surface_get_eotf(struct weston_surface *surface);
 int weston_colorspace_setup(struct weston_compositor *compositor);
 
 
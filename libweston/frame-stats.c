@@ -0,0 +1,276 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "frame-stats.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "shared/zalloc.h"
+
+#define SUB_BUCKETS (1 << WESTON_HISTOGRAM_SUB_BITS)
+
+static unsigned
+histogram_bucket(uint64_t usec)
+{
+	unsigned msb, shift;
+
+	if (usec < 2 * SUB_BUCKETS)
+		return usec;
+
+	if (usec > UINT32_MAX)
+		usec = UINT32_MAX;
+
+	msb = 63 - __builtin_clzll(usec);
+	shift = msb - WESTON_HISTOGRAM_SUB_BITS;
+
+	return (shift << WESTON_HISTOGRAM_SUB_BITS) + (usec >> shift);
+}
+
+/* The highest value that lands in the bucket */
+static uint64_t
+histogram_bucket_value(unsigned bucket)
+{
+	unsigned shift;
+	uint64_t top;
+
+	if (bucket < 2 * SUB_BUCKETS)
+		return bucket;
+
+	shift = (bucket >> WESTON_HISTOGRAM_SUB_BITS) - 1;
+	top = bucket - (shift << WESTON_HISTOGRAM_SUB_BITS);
+
+	return ((top + 1) << shift) - 1;
+}
+
+void
+weston_histogram_record(struct weston_histogram *h, uint64_t usec)
+{
+	__atomic_fetch_add(&h->buckets[histogram_bucket(usec)], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+/** Return the value at or below which the given percentage of the
+ * recorded values lie, rounded up to the histogram precision */
+uint64_t
+weston_histogram_percentile(const struct weston_histogram *h,
+			    double percentile)
+{
+	uint64_t target, seen = 0;
+	unsigned i;
+
+	if (h->count == 0)
+		return 0;
+
+	target = (uint64_t) (h->count * percentile / 100.0 + 0.5);
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < WESTON_HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			return histogram_bucket_value(i);
+	}
+
+	return histogram_bucket_value(WESTON_HISTOGRAM_BUCKETS - 1);
+}
+
+static void
+histogram_sub(struct weston_histogram *out,
+	      const struct weston_histogram *a,
+	      const struct weston_histogram *b)
+{
+	unsigned i;
+
+	out->count = 0;
+	for (i = 0; i < WESTON_HISTOGRAM_BUCKETS; i++) {
+		out->buckets[i] = a->buckets[i] - b->buckets[i];
+		out->count += out->buckets[i];
+	}
+}
+
+struct weston_frame_stats *
+weston_frame_stats_create(void)
+{
+	return zalloc(sizeof(struct weston_frame_stats));
+}
+
+void
+weston_frame_stats_destroy(struct weston_frame_stats *stats)
+{
+	free(stats);
+}
+
+static void
+counter_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/** Note a surface commit with damage destined for the output */
+void
+weston_frame_stats_commit(struct weston_frame_stats *stats,
+			  const struct timespec *now)
+{
+	if (timespec_is_zero(&stats->oldest_commit))
+		stats->oldest_commit = *now;
+}
+
+/** Record a repaint running from begin to end, aimed at the vblank
+ * at target */
+void
+weston_frame_stats_repaint(struct weston_frame_stats *stats,
+			   const struct timespec *begin,
+			   const struct timespec *end,
+			   const struct timespec *target)
+{
+	int64_t slack;
+
+	weston_histogram_record(&stats->counters.repaint,
+				timespec_sub_to_nsec(end, begin) / 1000);
+
+	slack = timespec_sub_to_nsec(target, end) / 1000;
+	if (slack < 0) {
+		counter_add(&stats->counters.late_repaints, 1);
+		slack = 0;
+	}
+	weston_histogram_record(&stats->counters.slack, slack);
+
+	/* A failed repaint leaves an older commit in flight */
+	if (timespec_is_zero(&stats->frame_commit))
+		stats->frame_commit = stats->oldest_commit;
+	stats->oldest_commit = (struct timespec) { 0 };
+}
+
+/** Record the presentation of a repainted frame */
+void
+weston_frame_stats_present(struct weston_frame_stats *stats,
+			   const struct timespec *stamp, uint64_t msc,
+			   int32_t refresh_nsec)
+{
+	int64_t missed = 0;
+	int64_t elapsed;
+
+	counter_add(&stats->counters.frames, 1);
+
+	if (!timespec_is_zero(&stats->frame_commit)) {
+		weston_histogram_record(&stats->counters.latency,
+			timespec_sub_to_nsec(stamp, &stats->frame_commit) / 1000);
+		stats->frame_commit = (struct timespec) { 0 };
+	}
+
+	if (stats->last_presented_valid) {
+		if (msc != 0 && stats->last_msc != 0 && msc > stats->last_msc) {
+			missed = msc - stats->last_msc - 1;
+		} else if (refresh_nsec > 0) {
+			elapsed = timespec_sub_to_nsec(stamp,
+						       &stats->last_presented);
+			missed = (elapsed + refresh_nsec / 2) / refresh_nsec - 1;
+		}
+
+		if (missed > 0)
+			counter_add(&stats->counters.missed_vblanks, missed);
+	}
+
+	stats->last_presented = *stamp;
+	stats->last_msc = msc;
+	stats->last_presented_valid = true;
+}
+
+/** The repaint loop went idle, so the next frame skips vblanks on
+ * purpose */
+void
+weston_frame_stats_loop_exit(struct weston_frame_stats *stats)
+{
+	stats->last_presented_valid = false;
+}
+
+static void
+print_histogram(FILE *fp, const char *name, const struct weston_histogram *h)
+{
+	static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9, 100.0 };
+	static const char *labels[] = { "p50", "p90", "p99", "p99.9", "max" };
+	unsigned i;
+
+	fprintf(fp, "\t%-8s %8" PRIu64 " samples", name, h->count);
+	if (h->count == 0) {
+		fprintf(fp, "\n");
+		return;
+	}
+
+	for (i = 0; i < ARRAY_LENGTH(percentiles); i++)
+		fprintf(fp, ", %s %.3f", labels[i],
+			weston_histogram_percentile(h, percentiles[i]) / 1000.0);
+	fprintf(fp, " ms\n");
+}
+
+/** Print a percentile summary of the statistics
+ *
+ * \param stats The statistics.
+ * \param fp Where to print.
+ * \param interval If true, summarize what was recorded since the last
+ * interval summary, otherwise everything since the output was enabled.
+ */
+void
+weston_frame_stats_print(struct weston_frame_stats *stats, FILE *fp,
+			 bool interval)
+{
+	struct weston_frame_counters *c = &stats->counters;
+	struct weston_frame_counters *sum = NULL;
+
+	if (interval) {
+		sum = zalloc(sizeof *sum);
+		if (!sum)
+			return;
+
+		histogram_sub(&sum->latency, &c->latency,
+			      &stats->reported.latency);
+		histogram_sub(&sum->repaint, &c->repaint,
+			      &stats->reported.repaint);
+		histogram_sub(&sum->slack, &c->slack, &stats->reported.slack);
+		sum->frames = c->frames - stats->reported.frames;
+		sum->missed_vblanks = c->missed_vblanks -
+				      stats->reported.missed_vblanks;
+		sum->late_repaints = c->late_repaints -
+				     stats->reported.late_repaints;
+
+		stats->reported = *c;
+		c = sum;
+	}
+
+	fprintf(fp, "\t%" PRIu64 " frames, %" PRIu64 " missed vblanks, "
+		"%" PRIu64 " late repaints\n",
+		c->frames, c->missed_vblanks, c->late_repaints);
+	print_histogram(fp, "latency", &c->latency);
+	print_histogram(fp, "repaint", &c->repaint);
+	print_histogram(fp, "slack", &c->slack);
+
+	free(sum);
+}
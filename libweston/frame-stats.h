@@ -0,0 +1,115 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_FRAME_STATS_H
+#define WESTON_FRAME_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Each power of two is split in 2^WESTON_HISTOGRAM_SUB_BITS buckets,
+ * which keeps values to about 3% precision up to 2^32 microseconds. */
+#define WESTON_HISTOGRAM_SUB_BITS 5
+#define WESTON_HISTOGRAM_BUCKETS \
+	((32 - WESTON_HISTOGRAM_SUB_BITS + 1) << WESTON_HISTOGRAM_SUB_BITS)
+
+/** A log-linear histogram of microsecond values
+ *
+ * Recording only does relaxed atomic increments, so it needs no lock
+ * and readers see a consistent enough picture for percentiles.
+ */
+struct weston_histogram {
+	uint64_t count;
+	uint64_t buckets[WESTON_HISTOGRAM_BUCKETS];
+};
+
+void
+weston_histogram_record(struct weston_histogram *h, uint64_t usec);
+
+uint64_t
+weston_histogram_percentile(const struct weston_histogram *h,
+			    double percentile);
+
+/** Repaint loop statistics of an output
+ *
+ * All times are in microseconds.
+ */
+struct weston_frame_counters {
+	/** From the oldest surface commit in a frame to its presentation */
+	struct weston_histogram latency;
+	/** Time spent in weston_output_repaint() */
+	struct weston_histogram repaint;
+	/** Time left until the target vblank when the repaint was posted */
+	struct weston_histogram slack;
+
+	uint64_t frames;		/**< frames presented */
+	uint64_t missed_vblanks;	/**< vblanks skipped while repainting */
+	uint64_t late_repaints;		/**< posted after the target vblank */
+};
+
+struct weston_frame_stats {
+	struct weston_frame_counters counters;
+	/** Counters as of the last periodic report */
+	struct weston_frame_counters reported;
+
+	/* Repaint loop book-keeping */
+	struct timespec oldest_commit;	/**< of the frame being composed */
+	struct timespec frame_commit;	/**< of the frame in flight */
+	struct timespec last_presented;
+	uint64_t last_msc;
+	bool last_presented_valid;
+};
+
+struct weston_frame_stats *
+weston_frame_stats_create(void);
+
+void
+weston_frame_stats_destroy(struct weston_frame_stats *stats);
+
+void
+weston_frame_stats_commit(struct weston_frame_stats *stats,
+			  const struct timespec *now);
+
+void
+weston_frame_stats_repaint(struct weston_frame_stats *stats,
+			   const struct timespec *begin,
+			   const struct timespec *end,
+			   const struct timespec *target);
+
+void
+weston_frame_stats_present(struct weston_frame_stats *stats,
+			   const struct timespec *stamp, uint64_t msc,
+			   int32_t refresh_nsec);
+
+void
+weston_frame_stats_loop_exit(struct weston_frame_stats *stats);
+
+void
+weston_frame_stats_print(struct weston_frame_stats *stats, FILE *fp,
+			 bool interval);
+
+#endif /* WESTON_FRAME_STATS_H */
@@ -32,15 +32,19 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <float.h>
+#include <math.h>
 #include <assert.h>
 #include <linux/input.h>
 #include <drm_fourcc.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 
 #ifdef HAVE_LINUX_SYNC_FILE_H
 #include <linux/sync_file.h>
@@ -55,9 +59,11 @@
 #include "linux-dmabuf.h"
 #include "linux-dmabuf-unstable-v1-server-protocol.h"
 #include "pixel-formats.h"
+#include "weston-debug.h"
 
 #include "shared/helpers.h"
 #include "shared/platform.h"
+#include "shared/string-helpers.h"
 #include "shared/timespec-util.h"
 #include "weston-egl-ext.h"
 
@@ -67,16 +73,138 @@
 #define GR_GL_VERSION_INVALID \
 	GR_GL_VERSION(0, 0)
 
+enum gl_shader_texture_variant {
+	SHADER_VARIANT_NONE = 0,
+	SHADER_VARIANT_RGBX,
+	SHADER_VARIANT_RGBA,
+	SHADER_VARIANT_Y_U_V,
+	SHADER_VARIANT_Y_UV,
+	SHADER_VARIANT_Y_XUXV,
+	SHADER_VARIANT_EXTERNAL,
+	SHADER_VARIANT_SOLID,
+};
+
+/* The matrix coefficients YUV content was encoded with */
+enum gl_yuv_coefficients {
+	YUV_COEFFICIENTS_BT601 = 0,
+	YUV_COEFFICIENTS_BT709,
+	YUV_COEFFICIENTS_BT2020,
+};
+
+struct gl_yuv_color {
+	enum gl_yuv_coefficients coefficients;
+	bool full_range;
+};
+
+/* Everything a fragment shader is generated from. Programs are cached by
+ * it, compared with memcmp(), and it is stored as is in the program
+ * binary cache file, hence the fixed-size fields. */
+struct gl_shader_requirements {
+	uint32_t variant;	/* enum gl_shader_texture_variant */
+	uint32_t alpha;		/* multiply by the view alpha */
+	uint32_t debug;		/* tint for the fragment shader debug binding */
+
+	/* How YUV variants convert to RGB, zero for the others */
+	uint32_t yuv_coefficients;	/* enum gl_yuv_coefficients */
+	uint32_t yuv_full_range;
+
+	/* Decode the surface's transfer function, convert its primaries
+	 * and tone map it into the output's colorimetry. */
+	uint32_t hdr;
+	uint32_t eotf;		/* enum hdr_metadata_eotf */
+	uint32_t src_colorspace;
+	uint32_t dst_colorspace;
+	uint32_t dst_eotf;	/* enum hdr_metadata_eotf */
+};
+
 struct gl_shader {
-	GLuint program;
-	GLuint vertex_shader, fragment_shader;
+	struct gl_shader_requirements key;
+	GLuint program;		/* 0 if the program failed to build */
 	GLint proj_uniform;
+	GLint depth_uniform;
 	GLint tex_uniforms[3];
 	GLint alpha_uniform;
 	GLint color_uniform;
-	const char *vertex_source, *fragment_source;
+	GLint hdr_src_scale_uniform;
+	GLint hdr_src_white_uniform;
+	GLint hdr_dst_scale_uniform;
+	struct wl_list link; /* gl_renderer::shader_list */
+};
+
+/* A linked program as retrieved with GL_OES_get_program_binary */
+struct gl_program_binary {
+	struct gl_shader_requirements key;
+	uint64_t source_hash;	/* of the shader sources it was built from */
+	GLenum format;
+	GLsizei length;
+	void *data;
+	struct wl_list link; /* gl_renderer::program_binaries */
+};
+
+/* Layout of the program binary cache file: a header, then per program
+ * an entry directly followed by the binary. */
+#define GL_PROGRAM_CACHE_MAGIC "WGLPRG02"
+
+struct gl_program_cache_header {
+	char magic[8];
+	uint32_t key_size;
+	uint32_t count;
+	uint64_t driver_hash;	/* of GL_VENDOR, GL_RENDERER and GL_VERSION */
+};
+
+struct gl_program_cache_entry {
+	struct gl_shader_requirements key;
+	uint64_t source_hash;
+	uint32_t format;
+	uint32_t length;
+};
+
+#define GL_PROGRAM_BINARY_MAX_SIZE (16 * 1024 * 1024)
+
+/* FNV-1a offset basis */
+#define GL_PROGRAM_HASH_INIT 0xcbf29ce484222325ull
+
+/* GL state shared by all the geometry in one batched draw call */
+struct gl_batch_key {
+	struct gl_shader *shader;
+	GLenum target;
+	GLuint textures[3];
+	int num_textures;
+	GLint filter;
+	bool blend;
+	GLfloat color[4];
+	GLfloat alpha;
+	GLfloat depth;
+	/* Source of the HDR uniforms, NULL for plain shaders */
+	struct weston_surface *hdr_surface;
+};
+
+/* A buffer object streamed into with glBufferSubData, and orphaned with
+ * glBufferData once it fills up so we never wait on in-flight draws. */
+struct gl_stream_buffer {
+	GLuint name;
+	GLsizeiptr size;
+	GLintptr offset;
 };
 
+#define GL_STREAM_BUFFER_MIN_SIZE (256 * 1024)
+
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#endif
+
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
+
+#ifndef GL_MAP_READ_BIT
+#define GL_MAP_READ_BIT 0x0001
+#endif
+
+/* At most this many reads per output wait on the GPU; the oldest one is
+ * completed synchronously to make room for another. */
+#define GL_READBACK_MAX_PENDING 2
+
 #define BUFFER_DAMAGE_COUNT 2
 
 enum gl_border_status {
@@ -108,8 +236,36 @@ struct gl_output_state {
 
 	EGLSyncKHR begin_render_sync, end_render_sync;
 
+	/* Bits of the surface's depth buffer, -1 until queried */
+	GLint depth_bits;
+
 	/* struct timeline_render_point::link */
 	struct wl_list timeline_render_point_list;
+
+	/* struct gl_readback::link, oldest first */
+	struct wl_list readbacks;
+	int num_readbacks;
+	/* struct gl_readback::link, idle pixel-pack buffers */
+	struct wl_list free_readbacks;
+};
+
+/* An asynchronous read_pixels, copied into a pixel-pack buffer by the GPU
+ * and mapped once the fence after it has signalled. */
+struct gl_readback {
+	struct weston_output *output;
+	struct wl_list link;
+
+	GLuint pbo;
+	GLsizeiptr pbo_size;
+	int stride;
+	uint32_t height;
+
+	EGLSyncKHR sync;
+	int fence_fd;
+	struct wl_event_source *source;
+
+	weston_read_pixels_done_func_t done;
+	void *data;
 };
 
 enum buffer_type {
@@ -141,7 +297,7 @@ struct dmabuf_image {
 
 	enum import_type import_type;
 	GLenum target;
-	struct gl_shader *shader;
+	enum gl_shader_texture_variant shader_variant;
 };
 
 struct yuv_plane_descriptor {
@@ -161,7 +317,7 @@ struct yuv_format_descriptor {
 
 struct gl_surface_state {
 	GLfloat color[4];
-	struct gl_shader *shader;
+	enum gl_shader_texture_variant shader_variant;
 
 	GLuint textures[3];
 	int num_textures;
@@ -197,6 +353,7 @@ struct gl_surface_state {
 
 struct gl_renderer {
 	struct weston_renderer base;
+	struct weston_compositor *compositor;
 	int fragment_shader_debug;
 	int fan_debug;
 	struct weston_binding *fragment_binding;
@@ -212,6 +369,34 @@ struct gl_renderer {
 
 	struct wl_array vertices;
 	struct wl_array vtxcnt;
+	struct wl_array indices;
+
+	struct gl_batch_key batch_key;
+	bool batch_key_valid;
+	struct gl_stream_buffer vertex_stream;
+	struct gl_stream_buffer index_stream;
+
+	/* Since the start of the current output repaint */
+	uint32_t draw_calls;
+	uint32_t drawn_vertices;
+	double opaque_area;	/* in global coordinates */
+	double blended_area;
+	double occluded_area;	/* of the above, rejected by the depth test,
+				 * only while count_occluded */
+
+	/* Draw opaque regions front to back against a depth buffer,
+	 * WESTON_GL_FRONT_TO_BACK */
+	bool front_to_back;
+	/* Depth of the view being drawn */
+	GLfloat view_depth;
+	/* Front to back: index of the view being drawn, front first */
+	int view_index;
+	/* Whether to count the occluded area, only done for the frame-stats
+	 * debug scope as it is costly. occluders[i] is then the union of
+	 * the opaque fans of the views in front of view i. */
+	bool count_occluded;
+	struct wl_array occluders;	/* pixman_region32_t */
+	struct wl_array spans;		/* pixman_box32_t, for fan_to_region() */
 
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
 	PFNEGLCREATEIMAGEKHRPROC create_image;
@@ -241,16 +426,19 @@ struct gl_renderer {
 
 	int has_gl_texture_rg;
 
-	struct gl_shader texture_shader_rgba;
-	struct gl_shader texture_shader_rgbx;
-	struct gl_shader texture_shader_egl_external;
-	struct gl_shader texture_shader_y_uv;
-	struct gl_shader texture_shader_y_u_v;
-	struct gl_shader texture_shader_y_xuxv;
-	struct gl_shader invert_color_shader;
-	struct gl_shader solid_shader;
+	/* struct gl_shader::link, generated on demand */
+	struct wl_list shader_list;
 	struct gl_shader *current_shader;
 
+	int has_program_binary;
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
+	uint64_t driver_hash;
+	/* struct gl_program_binary::link */
+	struct wl_list program_binaries;
+	char *program_cache_path;
+	struct wl_event_source *program_cache_idle;
+
 	struct wl_signal destroy_signal;
 
 	struct wl_listener output_destroy_listener;
@@ -259,6 +447,10 @@ struct gl_renderer {
 	PFNEGLQUERYDMABUFFORMATSEXTPROC query_dmabuf_formats;
 	PFNEGLQUERYDMABUFMODIFIERSEXTPROC query_dmabuf_modifiers;
 
+	int has_pack_buffer;
+	PFNGLMAPBUFFERRANGEEXTPROC map_buffer_range;
+	PFNGLUNMAPBUFFEROESPROC unmap_buffer;
+
 	int has_native_fence_sync;
 	PFNEGLCREATESYNCKHRPROC create_sync;
 	PFNEGLDESTROYSYNCKHRPROC destroy_sync;
@@ -354,12 +546,18 @@ timeline_render_point_handler(int fd, uint32_t mask, void *data)
 		uint64_t ts;
 
 		if (linux_sync_file_read_timestamp(trp->fd, &ts) == 0) {
+			struct weston_compositor *ec = trp->output->compositor;
 			struct timespec tspec = { 0 };
 
 			timespec_add_nsec(&tspec, &tspec, ts);
 
 			TL_POINT(tp_name, TLP_GPU(&tspec),
 				 TLP_OUTPUT(trp->output), TLP_END);
+
+			/* Sync file timestamps are CLOCK_MONOTONIC */
+			if (trp->type == TIMELINE_RENDER_POINT_TYPE_END &&
+			    ec->presentation_clock == CLOCK_MONOTONIC)
+				weston_output_render_done(trp->output, &tspec);
 		}
 	}
 
@@ -392,9 +590,13 @@ timeline_submit_render_sync(struct gl_renderer *gr,
 	int fd;
 	struct timeline_render_point *trp;
 
-	if (!weston_timeline_enabled_ ||
-	    !gr->has_native_fence_sync ||
-	    sync == EGL_NO_SYNC_KHR)
+	/* The end of rendering also feeds the adaptive repaint window */
+	if (!weston_timeline_enabled_ &&
+	    !(ec->repaint_adaptive &&
+	      type == TIMELINE_RENDER_POINT_TYPE_END))
+		return;
+
+	if (!gr->has_native_fence_sync || sync == EGL_NO_SYNC_KHR)
 		return;
 
 	go = get_output_state(output);
@@ -739,11 +941,31 @@ texture_region(struct weston_view *ev, pixman_region32_t *region,
 	return nvtx;
 }
 
+static struct gl_shader *
+get_view_shader(struct gl_renderer *gr,
+		enum gl_shader_texture_variant variant,
+		struct weston_view *view, struct weston_output *output);
+
+static struct gl_shader *
+gl_renderer_get_shader(struct gl_renderer *gr,
+		       const struct gl_shader_requirements *req);
+
+static void
+shader_requirements_init(struct gl_shader_requirements *req,
+			 struct gl_renderer *gr,
+			 enum gl_shader_texture_variant variant);
+
+static void
+shader_requirements_set_yuv(struct gl_shader_requirements *req,
+			    struct weston_surface *surface);
+
 static void
 triangle_fan_debug(struct weston_view *view, int first, int count)
 {
 	struct weston_compositor *compositor = view->surface->compositor;
 	struct gl_renderer *gr = get_renderer(compositor);
+	struct gl_shader_requirements req;
+	struct gl_shader *solid;
 	int i;
 	GLushort *buffer;
 	GLushort *index;
@@ -771,23 +993,278 @@ triangle_fan_debug(struct weston_view *view, int first, int count)
 		*index++ = first + i;
 	}
 
-	glUseProgram(gr->solid_shader.program);
-	glUniform4fv(gr->solid_shader.color_uniform, 1,
-			color[color_idx++ % ARRAY_LENGTH(color)]);
-	glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
-	glUseProgram(gr->current_shader->program);
+	/* The same program draw_view() set the uniforms of */
+	shader_requirements_init(&req, gr, SHADER_VARIANT_SOLID);
+	solid = gl_renderer_get_shader(gr, &req);
+	if (solid) {
+		glUseProgram(solid->program);
+		glUniform4fv(solid->color_uniform, 1,
+			     color[color_idx++ % ARRAY_LENGTH(color)]);
+		glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
+		glUseProgram(gr->current_shader->program);
+	}
 	free(buffer);
 }
 
+static GLintptr
+stream_buffer_upload(struct gl_stream_buffer *sb, GLenum target,
+		     const void *data, GLsizeiptr size)
+{
+	GLintptr offset;
+
+	if (!sb->name)
+		glGenBuffers(1, &sb->name);
+	glBindBuffer(target, sb->name);
+
+	if (sb->offset + size > sb->size) {
+		/* Orphan the storage: draws still in flight keep the old
+		 * copy alive and we carry on without waiting for them. */
+		if (size > sb->size)
+			sb->size = MAX(size * 2, GL_STREAM_BUFFER_MIN_SIZE);
+		glBufferData(target, sb->size, NULL, GL_STREAM_DRAW);
+		sb->offset = 0;
+	}
+
+	glBufferSubData(target, sb->offset, size, data);
+	offset = sb->offset;
+	sb->offset += (size + 3) & ~3;
+
+	return offset;
+}
+
+/* Draw the batched triangles, whose indices only reference the first
+ * 'count' vertices, and drop them from the batch. */
+static void
+batch_draw(struct gl_renderer *gr, unsigned int count)
+{
+	const size_t stride = 4 * sizeof(GLfloat);
+	GLsizei nindices = gr->indices.size / sizeof(GLushort);
+	GLintptr vtx_offset, idx_offset;
+
+	if (nindices > 0) {
+		vtx_offset = stream_buffer_upload(&gr->vertex_stream,
+						  GL_ARRAY_BUFFER,
+						  gr->vertices.data,
+						  count * stride);
+		idx_offset = stream_buffer_upload(&gr->index_stream,
+						  GL_ELEMENT_ARRAY_BUFFER,
+						  gr->indices.data,
+						  gr->indices.size);
+
+		/* position: */
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride,
+				      (void *) vtx_offset);
+		glEnableVertexAttribArray(0);
+
+		/* texcoord: */
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride,
+				      (void *) (vtx_offset + 2 * sizeof(GLfloat)));
+		glEnableVertexAttribArray(1);
+
+		glDrawElements(GL_TRIANGLES, nindices, GL_UNSIGNED_SHORT,
+			       (void *) idx_offset);
+
+		glDisableVertexAttribArray(1);
+		glDisableVertexAttribArray(0);
+
+		/* Everything else still draws from client-side arrays */
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+		gr->draw_calls++;
+		gr->drawn_vertices += count;
+	}
+
+	memmove(gr->vertices.data, (char *) gr->vertices.data + count * stride,
+		gr->vertices.size - count * stride);
+	gr->vertices.size -= count * stride;
+	gr->indices.size = 0;
+}
+
+static void
+batch_flush(struct gl_renderer *gr)
+{
+	batch_draw(gr, gr->vertices.size / (4 * sizeof(GLfloat)));
+}
+
+/* Add the fans texture_region() emitted from vertex 'first' onwards to
+ * the batch, as indexed triangles. */
+static void
+batch_add_fans(struct gl_renderer *gr, unsigned int first,
+	       const unsigned int *vtxcnt, int nfans)
+{
+	GLushort *index;
+	unsigned int k;
+	int i;
+
+	for (i = 0; i < nfans; i++) {
+		/* GLES2 only guarantees 16-bit indices */
+		if (first + vtxcnt[i] > 0x10000) {
+			batch_draw(gr, first);
+			first = 0;
+		}
+
+		index = wl_array_add(&gr->indices,
+				     (vtxcnt[i] - 2) * 3 * sizeof *index);
+		for (k = 1; k + 1 < vtxcnt[i]; k++) {
+			*index++ = first;
+			*index++ = first + k;
+			*index++ = first + k + 1;
+		}
+
+		first += vtxcnt[i];
+	}
+}
+
+/* Fan debugging outlines every fan, so it draws them one at a time. */
+static void
+draw_fans(struct weston_view *ev, const unsigned int *vtxcnt, int nfans)
+{
+	struct gl_renderer *gr = get_renderer(ev->surface->compositor);
+	GLfloat *v = gr->vertices.data;
+	int i, first;
+
+	/* position: */
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
+	glEnableVertexAttribArray(0);
+
+	/* texcoord: */
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
+	glEnableVertexAttribArray(1);
+
+	for (i = 0, first = 0; i < nfans; i++) {
+		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
+		triangle_fan_debug(ev, first, vtxcnt[i]);
+		first += vtxcnt[i];
+	}
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+
+	gr->draw_calls += nfans;
+	gr->drawn_vertices += first;
+	gr->vertices.size = 0;
+}
+
+/* Area of a convex fan of vertices as laid out by texture_region() */
+static double
+fan_area(const GLfloat *v, unsigned int count)
+{
+	double area = 0.0;
+	unsigned int k, next;
+
+	for (k = 0; k < count; k++) {
+		next = (k + 1) % count;
+		area += v[k * 4] * v[next * 4 + 1] -
+			v[next * 4] * v[k * 4 + 1];
+	}
+
+	return fabs(area) / 2.0;
+}
+
+static uint64_t
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	uint64_t area = 0;
+	int i, nrects;
+
+	rects = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; i++)
+		area += (uint64_t) (rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
+/* The pixels whose centers are inside a convex fan of vertices as laid
+ * out by texture_region() */
+static void
+fan_to_region(struct gl_renderer *gr, const GLfloat *v, unsigned int count,
+	      pixman_region32_t *region)
+{
+	GLfloat ymin = v[1], ymax = v[1], xmin, xmax, x, yc;
+	const GLfloat *p, *q;
+	pixman_box32_t *box;
+	unsigned int k;
+	int y;
+
+	for (k = 1; k < count; k++) {
+		ymin = MIN(ymin, v[k * 4 + 1]);
+		ymax = MAX(ymax, v[k * 4 + 1]);
+	}
+
+	gr->spans.size = 0;
+	for (y = ceilf(ymin - 0.5f); y + 0.5f < ymax; y++) {
+		yc = y + 0.5f;
+		xmin = FLT_MAX;
+		xmax = -FLT_MAX;
+
+		for (k = 0; k < count; k++) {
+			p = &v[k * 4];
+			q = &v[(k + 1) % count * 4];
+			if ((p[1] <= yc) == (q[1] <= yc))
+				continue;
+
+			x = p[0] + (yc - p[1]) * (q[0] - p[0]) / (q[1] - p[1]);
+			xmin = MIN(xmin, x);
+			xmax = MAX(xmax, x);
+		}
+
+		if (ceilf(xmin - 0.5f) >= ceilf(xmax - 0.5f))
+			continue;
+
+		box = wl_array_add(&gr->spans, sizeof *box);
+		if (!box)
+			break;
+		box->x1 = ceilf(xmin - 0.5f);
+		box->x2 = ceilf(xmax - 0.5f);
+		box->y1 = y;
+		box->y2 = y + 1;
+	}
+
+	pixman_region32_init_rects(region, gr->spans.data,
+				   gr->spans.size / sizeof *box);
+}
+
+/* Counts the pixels of a fan of the view being drawn that opaque views in
+ * front of it hide from the depth test. If the fan is opaque, it hides
+ * the views behind in turn. */
 static void
+count_occluded_fan(struct gl_renderer *gr, const GLfloat *v,
+		   unsigned int count, bool occluding)
+{
+	pixman_region32_t *occluders = gr->occluders.data;
+	unsigned int next = gr->view_index + 1;
+	pixman_region32_t fan, hidden;
+
+	fan_to_region(gr, v, count, &fan);
+
+	pixman_region32_init(&hidden);
+	pixman_region32_intersect(&hidden, &fan, &occluders[gr->view_index]);
+	gr->occluded_area += region_area(&hidden);
+	pixman_region32_fini(&hidden);
+
+	if (occluding && next < gr->occluders.size / sizeof fan)
+		pixman_region32_union(&occluders[next], &occluders[next], &fan);
+
+	pixman_region32_fini(&fan);
+}
+
+/* Returns the area drawn, in global coordinates. When drawing against
+ * the depth buffer, also counts what the depth test will reject if
+ * asked to, see count_occluded_fan(). */
+static double
 repaint_region(struct weston_view *ev, pixman_region32_t *region,
-		pixman_region32_t *surf_region)
+		pixman_region32_t *surf_region, bool occluding)
 {
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
-	GLfloat *v;
+	const size_t stride = 4 * sizeof(GLfloat);
 	unsigned int *vtxcnt;
-	int i, first, nfans;
+	unsigned int first, nvtx = 0;
+	double area = 0.0;
+	int i, nfans;
 
 	/* The final region to be painted is the intersection of
 	 * 'region' and 'surf_region'. However, 'region' is in the global
@@ -797,31 +1274,31 @@ repaint_region(struct weston_view *ev, pixman_region32_t *region,
 	 * polygon for each pair, and store it as a triangle fan if
 	 * it has a non-zero area (at least 3 vertices, actually).
 	 */
+	first = gr->vertices.size / stride;
 	nfans = texture_region(ev, region, surf_region);
-
-	v = gr->vertices.data;
 	vtxcnt = gr->vtxcnt.data;
 
-	/* position: */
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
-	glEnableVertexAttribArray(0);
+	/* texture_region() reserves room for the worst case; trim it so
+	 * the next region's vertices follow on directly. */
+	for (i = 0; i < nfans; i++) {
+		GLfloat *v = (GLfloat *) gr->vertices.data + (first + nvtx) * 4;
 
-	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
-	glEnableVertexAttribArray(1);
+		if (gr->count_occluded && gr->view_index >= 0)
+			count_occluded_fan(gr, v, vtxcnt[i], occluding);
 
-	for (i = 0, first = 0; i < nfans; i++) {
-		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
-		if (gr->fan_debug)
-			triangle_fan_debug(ev, first, vtxcnt[i]);
-		first += vtxcnt[i];
+		area += fan_area(v, vtxcnt[i]);
+		nvtx += vtxcnt[i];
 	}
+	gr->vertices.size = (first + nvtx) * stride;
 
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(0);
+	if (gr->fan_debug)
+		draw_fans(ev, vtxcnt, nfans);
+	else
+		batch_add_fans(gr, first, vtxcnt, nfans);
 
-	gr->vertices.size = 0;
 	gr->vtxcnt.size = 0;
+
+	return area;
 }
 
 static int
@@ -847,24 +1324,14 @@ use_output(struct weston_output *output)
 	return 0;
 }
 
-static int
-shader_init(struct gl_shader *shader, struct gl_renderer *gr,
-		   const char *vertex_source, const char *fragment_source);
+static void
+hdr_shader_uniforms(struct gl_shader *shader,
+		    struct weston_surface *surface,
+		    struct weston_output *output);
 
 static void
 use_shader(struct gl_renderer *gr, struct gl_shader *shader)
 {
-	if (!shader->program) {
-		int ret;
-
-		ret =  shader_init(shader, gr,
-				   shader->vertex_source,
-				   shader->fragment_source);
-
-		if (ret < 0)
-			weston_log("warning: failed to compile shader\n");
-	}
-
 	if (gr->current_shader == shader)
 		return;
 	glUseProgram(shader->program);
@@ -887,28 +1354,97 @@ shader_uniforms(struct gl_shader *shader,
 
 	for (i = 0; i < gs->num_textures; i++)
 		glUniform1i(shader->tex_uniforms[i], i);
+
+	hdr_shader_uniforms(shader, view->surface, output);
+}
+
+static void
+batch_key_init(struct gl_batch_key *key, struct gl_shader *shader,
+	       struct weston_view *ev, GLint filter, bool blend)
+{
+	struct gl_renderer *gr = get_renderer(ev->surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	int i;
+
+	memset(key, 0, sizeof *key);
+	key->shader = shader;
+	key->target = gs->target;
+	for (i = 0; i < gs->num_textures; i++)
+		key->textures[i] = gs->textures[i];
+	key->num_textures = gs->num_textures;
+	key->filter = filter;
+	key->blend = blend;
+	memcpy(key->color, gs->color, sizeof key->color);
+	key->alpha = ev->alpha;
+	key->depth = gr->view_depth;
+	key->hdr_surface = shader->key.hdr ? ev->surface : NULL;
+}
+
+/* Set up the GL state for drawing with 'key', first flushing the pending
+ * batch unless it was drawn with the very same state. */
+static void
+batch_bind(struct gl_renderer *gr, const struct gl_batch_key *key,
+	   struct weston_view *ev, struct weston_output *output)
+{
+	int i;
+
+	if (gr->batch_key_valid &&
+	    memcmp(&gr->batch_key, key, sizeof *key) == 0)
+		return;
+
+	batch_flush(gr);
+
+	use_shader(gr, key->shader);
+	shader_uniforms(key->shader, ev, output);
+	glUniform1f(key->shader->depth_uniform, key->depth);
+
+	for (i = 0; i < key->num_textures; i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(key->target, key->textures[i]);
+		glTexParameteri(key->target, GL_TEXTURE_MIN_FILTER, key->filter);
+		glTexParameteri(key->target, GL_TEXTURE_MAG_FILTER, key->filter);
+	}
+
+	if (key->blend)
+		glEnable(GL_BLEND);
+	else
+		glDisable(GL_BLEND);
+
+	gr->batch_key = *key;
+	gr->batch_key_valid = true;
 }
 
+/* Which parts of a view draw_view() draws */
+enum draw_pass {
+	DRAW_PASS_ALL,
+	DRAW_PASS_OPAQUE,	/* what needs no blending */
+	DRAW_PASS_BLENDED,	/* everything else */
+};
+
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
-	  pixman_region32_t *damage) /* in global coordinates */
+	  pixman_region32_t *damage, /* in global coordinates */
+	  enum draw_pass pass)
 {
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
 	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	struct gl_shader *shader;
+	struct gl_batch_key key;
 	/* repaint bounding region in global coordinates: */
 	pixman_region32_t repaint;
 	/* opaque region in surface coordinates: */
 	pixman_region32_t surface_opaque;
 	/* non-opaque region in surface coordinates: */
 	pixman_region32_t surface_blend;
+	bool translucent = ev->alpha < 1.0;
+	double area;
 	GLint filter;
-	int i;
 
 	/* In case of a runtime switch of renderers, we may not have received
 	 * an attach for this surface since the switch. In that case we don't
 	 * have a valid buffer or a proper shader set up so skip rendering. */
-	if (!gs->shader)
+	if (gs->shader_variant == SHADER_VARIANT_NONE)
 		return;
 
 	pixman_region32_init(&repaint);
@@ -919,15 +1455,22 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!pixman_region32_not_empty(&repaint))
 		goto out;
 
-	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-
 	if (gr->fan_debug) {
-		use_shader(gr, &gr->solid_shader);
-		shader_uniforms(&gr->solid_shader, ev, output);
+		struct gl_shader_requirements req;
+
+		batch_flush(gr);
+		gr->batch_key_valid = false;
+		shader_requirements_init(&req, gr, SHADER_VARIANT_SOLID);
+		shader = gl_renderer_get_shader(gr, &req);
+		if (shader) {
+			use_shader(gr, shader);
+			shader_uniforms(shader, ev, output);
+		}
 	}
 
-	use_shader(gr, gs->shader);
-	shader_uniforms(gs->shader, ev, output);
+	shader = get_view_shader(gr, gs->shader_variant, ev, output);
+	if (!shader)
+		goto out;
 
 	if (ev->transform.enabled || output->zoom.active ||
 	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
@@ -935,13 +1478,6 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	else
 		filter = GL_NEAREST;
 
-	for (i = 0; i < gs->num_textures; i++) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
-	}
-
 	/* blended region is whole surface minus opaque region: */
 	pixman_region32_init_rect(&surface_blend, 0, 0,
 				  ev->surface->width, ev->surface->height);
@@ -960,29 +1496,42 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	else
 		pixman_region32_copy(&surface_opaque, &ev->surface->opaque);
 
-	if (pixman_region32_not_empty(&surface_opaque)) {
-		if (gs->shader == &gr->texture_shader_rgba) {
+	/* The opaque region of a translucent view still blends */
+	if (pixman_region32_not_empty(&surface_opaque) &&
+	    (pass == DRAW_PASS_ALL ||
+	     (pass == DRAW_PASS_OPAQUE) == !translucent)) {
+		if (gs->shader_variant == SHADER_VARIANT_RGBA) {
+			struct gl_shader *rgbx;
+
 			/* Special case for RGBA textures with possibly
 			 * bad data in alpha channel: use the shader
 			 * that forces texture alpha = 1.0.
 			 * Xwayland surfaces need this.
 			 */
-			use_shader(gr, &gr->texture_shader_rgbx);
-			shader_uniforms(&gr->texture_shader_rgbx, ev, output);
+			rgbx = get_view_shader(gr, SHADER_VARIANT_RGBX,
+					       ev, output);
+			batch_key_init(&key, rgbx ?: shader,
+				       ev, filter, translucent);
+		} else {
+			batch_key_init(&key, shader,
+				       ev, filter, translucent);
 		}
 
-		if (ev->alpha < 1.0)
-			glEnable(GL_BLEND);
+		batch_bind(gr, &key, ev, output);
+		area = repaint_region(ev, &repaint, &surface_opaque,
+				      pass == DRAW_PASS_OPAQUE);
+		if (translucent)
+			gr->blended_area += area;
 		else
-			glDisable(GL_BLEND);
-
-		repaint_region(ev, &repaint, &surface_opaque);
+			gr->opaque_area += area;
 	}
 
-	if (pixman_region32_not_empty(&surface_blend)) {
-		use_shader(gr, gs->shader);
-		glEnable(GL_BLEND);
-		repaint_region(ev, &repaint, &surface_blend);
+	if (pixman_region32_not_empty(&surface_blend) &&
+	    pass != DRAW_PASS_OPAQUE) {
+		batch_key_init(&key, shader, ev, filter, true);
+		batch_bind(gr, &key, ev, output);
+		gr->blended_area += repaint_region(ev, &repaint,
+						   &surface_blend, false);
 	}
 
 	pixman_region32_fini(&surface_blend);
@@ -993,37 +1542,151 @@ out:
 }
 
 static void
-repaint_views(struct weston_output *output, pixman_region32_t *damage)
+occluders_init(struct gl_renderer *gr, int count)
 {
-	struct weston_compositor *compositor = output->compositor;
-	struct weston_view *view;
+	pixman_region32_t *occluders;
+	int i;
 
-	wl_list_for_each_reverse(view, &compositor->view_list, link)
-		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+	gr->occluders.size = 0;
+	if (!gr->count_occluded)
+		return;
+
+	occluders = wl_array_add(&gr->occluders, count * sizeof *occluders);
+	if (!occluders) {
+		gr->count_occluded = false;
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		pixman_region32_init(&occluders[i]);
 }
 
 static void
-draw_output_border_texture(struct gl_output_state *go,
-			   enum gl_renderer_border_side side,
-			   int32_t x, int32_t y,
-			   int32_t width, int32_t height)
+occluders_fini(struct gl_renderer *gr)
 {
-	struct gl_border_image *img = &go->borders[side];
-	static GLushort indices [] = { 0, 1, 3, 3, 1, 2 };
+	pixman_region32_t *occluder;
 
-	if (!img->data) {
-		if (img->tex) {
-			glDeleteTextures(1, &img->tex);
-			img->tex = 0;
-		}
+	wl_array_for_each(occluder, &gr->occluders)
+		pixman_region32_fini(occluder);
+	gr->occluders.size = 0;
+}
 
-		return;
+/* Views get depths in (-1, 1), nearer the front the lower */
+static GLfloat
+view_depth(int index, int count)
+{
+	return -1.0f + 2.0f * (index + 1) / (count + 2);
+}
+
+/* Draw the opaque regions first, front to back, writing the depth of
+ * their view. The depth test then rejects the fragments they hide,
+ * before they are shaded, even those of transformed views that the
+ * clip regions cannot account for. The blended regions follow back to
+ * front, tested against the opaque ones but not writing depth. */
+static void
+repaint_views_front_to_back(struct weston_output *output,
+			    pixman_region32_t *damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
+	struct weston_view *view;
+	pixman_region32_t *occluders;
+	int count = 0, i;
+
+	wl_list_for_each(view, &compositor->view_list, link)
+		if (view->plane == &compositor->primary_plane)
+			count++;
+
+	glClearDepthf(1.0f);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glEnable(GL_DEPTH_TEST);
+	glDepthFunc(GL_LESS);
+
+	occluders_init(gr, count);
+	occluders = gr->occluders.data;
+
+	i = 0;
+	wl_list_for_each(view, &compositor->view_list, link) {
+		if (view->plane != &compositor->primary_plane)
+			continue;
+
+		/* Hidden by what hides the view in front, and by that view */
+		if (gr->count_occluded && i > 0)
+			pixman_region32_union(&occluders[i], &occluders[i],
+					      &occluders[i - 1]);
+
+		gr->view_index = i;
+		gr->view_depth = view_depth(i++, count);
+		draw_view(view, output, damage, DRAW_PASS_OPAQUE);
 	}
+	batch_flush(gr);
 
-	if (!img->tex) {
-		glGenTextures(1, &img->tex);
-		glBindTexture(GL_TEXTURE_2D, img->tex);
+	glDepthMask(GL_FALSE);
+	wl_list_for_each_reverse(view, &compositor->view_list, link) {
+		if (view->plane != &compositor->primary_plane)
+			continue;
+
+		gr->view_depth = view_depth(--i, count);
+		gr->view_index = i;
+		draw_view(view, output, damage, DRAW_PASS_BLENDED);
+	}
+	batch_flush(gr);
+	gr->batch_key_valid = false;
+
+	glDepthMask(GL_TRUE);
+	glDisable(GL_DEPTH_TEST);
+	gr->view_depth = 0.0f;
+	gr->view_index = -1;
+	occluders_fini(gr);
+}
+
+static void
+repaint_views(struct weston_output *output, pixman_region32_t *damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct weston_view *view;
+
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	gr->batch_key_valid = false;
+	gr->view_depth = 0.0f;
+	gr->view_index = -1;
+
+	if (gr->front_to_back && go->depth_bits > 0 && !gr->fan_debug) {
+		repaint_views_front_to_back(output, damage);
+		return;
+	}
+
+	wl_list_for_each_reverse(view, &compositor->view_list, link)
+		if (view->plane == &compositor->primary_plane)
+			draw_view(view, output, damage, DRAW_PASS_ALL);
+
+	batch_flush(gr);
+	gr->batch_key_valid = false;
+}
+
+static void
+draw_output_border_texture(struct gl_output_state *go,
+			   enum gl_renderer_border_side side,
+			   int32_t x, int32_t y,
+			   int32_t width, int32_t height)
+{
+	struct gl_border_image *img = &go->borders[side];
+	static GLushort indices [] = { 0, 1, 3, 3, 1, 2 };
+
+	if (!img->data) {
+		if (img->tex) {
+			glDeleteTextures(1, &img->tex);
+			img->tex = 0;
+		}
+
+		return;
+	}
+
+	if (!img->tex) {
+		glGenTextures(1, &img->tex);
+		glBindTexture(GL_TEXTURE_2D, img->tex);
 
 		glTexParameteri(GL_TEXTURE_2D,
 				GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -1088,7 +1751,8 @@ draw_output_borders(struct weston_output *output,
 {
 	struct gl_output_state *go = get_output_state(output);
 	struct gl_renderer *gr = get_renderer(output->compositor);
-	struct gl_shader *shader = &gr->texture_shader_rgba;
+	struct gl_shader_requirements req;
+	struct gl_shader *shader;
 	struct gl_border_image *top, *bottom, *left, *right;
 	struct weston_matrix matrix;
 	int full_width, full_height;
@@ -1096,6 +1760,11 @@ draw_output_borders(struct weston_output *output,
 	if (border_status == BORDER_STATUS_CLEAN)
 		return; /* Clean. Nothing to do. */
 
+	shader_requirements_init(&req, gr, SHADER_VARIANT_RGBA);
+	shader = gl_renderer_get_shader(gr, &req);
+	if (!shader)
+		return;
+
 	top = &go->borders[GL_RENDERER_BORDER_TOP];
 	bottom = &go->borders[GL_RENDERER_BORDER_BOTTOM];
 	left = &go->borders[GL_RENDERER_BORDER_LEFT];
@@ -1115,7 +1784,6 @@ draw_output_borders(struct weston_output *output,
 	glUniformMatrix4fv(shader->proj_uniform, 1, GL_FALSE, matrix.d);
 
 	glUniform1i(shader->tex_uniforms[0], 0);
-	glUniform1f(shader->alpha_uniform, 1);
 	glActiveTexture(GL_TEXTURE0);
 
 	if (border_status & BORDER_TOP_DIRTY)
@@ -1253,6 +1921,8 @@ gl_renderer_repaint_output(struct weston_output *output,
 	pixman_box32_t *rects;
 	pixman_region32_t buffer_damage, total_damage;
 	enum gl_border_status border_damage = BORDER_STATUS_CLEAN;
+	uint64_t damaged_area;
+	int32_t scale;
 
 	if (use_output(output) < 0)
 		return;
@@ -1264,6 +1934,17 @@ gl_renderer_repaint_output(struct weston_output *output,
 
 	go->begin_render_sync = create_render_sync(gr);
 
+	gr->draw_calls = 0;
+	gr->drawn_vertices = 0;
+	gr->opaque_area = 0.0;
+	gr->blended_area = 0.0;
+	gr->occluded_area = 0.0;
+	gr->count_occluded =
+		weston_debug_scope_is_enabled(compositor->debug_frame_stats);
+
+	if (gr->front_to_back && go->depth_bits < 0)
+		glGetIntegerv(GL_DEPTH_BITS, &go->depth_bits);
+
 	/* Calculate the viewport */
 	glViewport(go->borders[GL_RENDERER_BORDER_LEFT].width,
 		   go->borders[GL_RENDERER_BORDER_BOTTOM].height,
@@ -1303,12 +1984,21 @@ gl_renderer_repaint_output(struct weston_output *output,
 	border_damage |= go->border_status;
 
 	repaint_views(output, &total_damage);
+	damaged_area = region_area(&total_damage);
 
 	pixman_region32_fini(&total_damage);
 	pixman_region32_fini(&buffer_damage);
 
 	draw_output_borders(output, border_damage);
 
+	output->render_stats.draw_calls = gr->draw_calls;
+	output->render_stats.vertices = gr->drawn_vertices;
+	scale = output->current_scale * output->current_scale;
+	output->render_stats.damaged_pixels = damaged_area * scale;
+	output->render_stats.opaque_pixels = gr->opaque_area * scale;
+	output->render_stats.blended_pixels = gr->blended_area * scale;
+	output->render_stats.occluded_pixels = gr->occluded_area * scale;
+
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
 
@@ -1403,6 +2093,172 @@ gl_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+static void
+gl_readback_complete(struct gl_readback *rb)
+{
+	struct gl_renderer *gr = get_renderer(rb->output->compositor);
+	struct gl_output_state *go = get_output_state(rb->output);
+	void *pixels = NULL;
+
+	wl_list_remove(&rb->link);
+	go->num_readbacks--;
+
+	if (rb->source)
+		wl_event_source_remove(rb->source);
+	rb->source = NULL;
+	if (rb->fence_fd >= 0)
+		close(rb->fence_fd);
+	rb->fence_fd = -1;
+	if (rb->sync != EGL_NO_SYNC_KHR)
+		gr->destroy_sync(gr->egl_display, rb->sync);
+	rb->sync = EGL_NO_SYNC_KHR;
+
+	if (use_output(rb->output) == 0) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+		pixels = gr->map_buffer_range(GL_PIXEL_PACK_BUFFER, 0,
+					      rb->stride * rb->height,
+					      GL_MAP_READ_BIT);
+	}
+
+	rb->done(rb->output, pixels, rb->stride, rb->data);
+
+	if (pixels)
+		gr->unmap_buffer(GL_PIXEL_PACK_BUFFER);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	wl_list_insert(go->free_readbacks.prev, &rb->link);
+}
+
+/* Reads complete in the order they were made, so everything submitted
+ * before this one is finished off first. */
+static int
+gl_readback_handler(int fd, uint32_t mask, void *data)
+{
+	struct gl_readback *rb = data;
+	struct gl_output_state *go = get_output_state(rb->output);
+	struct gl_readback *first;
+
+	do {
+		first = container_of(go->readbacks.next,
+				     struct gl_readback, link);
+		gl_readback_complete(first);
+	} while (first != rb);
+
+	return 0;
+}
+
+static int
+gl_readback_timer_handler(void *data)
+{
+	return gl_readback_handler(-1, 0, data);
+}
+
+static int
+gl_renderer_read_pixels_async(struct weston_output *output,
+			      pixman_format_code_t format,
+			      uint32_t x, uint32_t y,
+			      uint32_t width, uint32_t height,
+			      weston_read_pixels_done_func_t done,
+			      void *data)
+{
+	static const EGLint attribs[] = { EGL_NONE };
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	struct gl_output_state *go = get_output_state(output);
+	struct wl_event_loop *loop =
+		wl_display_get_event_loop(output->compositor->wl_display);
+	struct gl_readback *rb;
+	GLenum gl_format;
+	int refresh;
+
+	if (!gr->has_pack_buffer)
+		return -1;
+
+	switch (format) {
+	case PIXMAN_a8r8g8b8:
+		gl_format = GL_BGRA_EXT;
+		break;
+	case PIXMAN_a8b8g8r8:
+		gl_format = GL_RGBA;
+		break;
+	default:
+		return -1;
+	}
+
+	if (go->num_readbacks >= GL_READBACK_MAX_PENDING)
+		gl_readback_complete(container_of(go->readbacks.next,
+						  struct gl_readback, link));
+
+	if (use_output(output) < 0)
+		return -1;
+
+	if (!wl_list_empty(&go->free_readbacks)) {
+		rb = container_of(go->free_readbacks.next,
+				  struct gl_readback, link);
+		wl_list_remove(&rb->link);
+	} else {
+		rb = zalloc(sizeof *rb);
+		if (!rb)
+			return -1;
+		rb->output = output;
+		glGenBuffers(1, &rb->pbo);
+	}
+
+	rb->stride = width * 4;
+	rb->height = height;
+	rb->done = done;
+	rb->data = data;
+	rb->sync = EGL_NO_SYNC_KHR;
+	rb->fence_fd = -1;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, rb->pbo);
+	if (rb->pbo_size < rb->stride * height) {
+		rb->pbo_size = rb->stride * height;
+		glBufferData(GL_PIXEL_PACK_BUFFER, rb->pbo_size, NULL,
+			     GL_STREAM_READ);
+	}
+
+	x += go->borders[GL_RENDERER_BORDER_LEFT].width;
+	y += go->borders[GL_RENDERER_BORDER_BOTTOM].height;
+
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(x, y, width, height, gl_format, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	/* The fence fd only becomes valid once the commands are flushed. */
+	if (gr->has_native_fence_sync) {
+		rb->sync = gr->create_sync(gr->egl_display,
+					   EGL_SYNC_NATIVE_FENCE_ANDROID,
+					   attribs);
+		glFlush();
+		if (rb->sync != EGL_NO_SYNC_KHR)
+			rb->fence_fd = gr->dup_native_fence_fd(gr->egl_display,
+							       rb->sync);
+	}
+
+	if (rb->fence_fd >= 0) {
+		rb->source = wl_event_loop_add_fd(loop, rb->fence_fd,
+						  WL_EVENT_READABLE,
+						  gl_readback_handler, rb);
+	} else {
+		/* Without a fence to wait on, give the GPU a frame. */
+		refresh = MAX(output->current_mode->refresh, 1);
+		rb->source = wl_event_loop_add_timer(loop,
+						     gl_readback_timer_handler,
+						     rb);
+		if (rb->source)
+			wl_event_source_timer_update(rb->source,
+						     MAX(1000000 / refresh, 1));
+	}
+
+	wl_list_insert(go->readbacks.prev, &rb->link);
+	go->num_readbacks++;
+
+	if (!rb->source)
+		gl_readback_complete(rb);
+
+	return 0;
+}
+
 static GLenum gl_format_from_internal(GLenum internal_format)
 {
 	switch (internal_format) {
@@ -1571,28 +2427,28 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 
 	switch (wl_shm_buffer_get_format(shm_buffer)) {
 	case WL_SHM_FORMAT_XRGB8888:
-		gs->shader = &gr->texture_shader_rgbx;
+		gs->shader_variant = SHADER_VARIANT_RGBX;
 		pitch = wl_shm_buffer_get_stride(shm_buffer) / 4;
 		gl_format[0] = GL_BGRA_EXT;
 		gl_pixel_type = GL_UNSIGNED_BYTE;
 		es->is_opaque = true;
 		break;
 	case WL_SHM_FORMAT_ARGB8888:
-		gs->shader = &gr->texture_shader_rgba;
+		gs->shader_variant = SHADER_VARIANT_RGBA;
 		pitch = wl_shm_buffer_get_stride(shm_buffer) / 4;
 		gl_format[0] = GL_BGRA_EXT;
 		gl_pixel_type = GL_UNSIGNED_BYTE;
 		es->is_opaque = false;
 		break;
 	case WL_SHM_FORMAT_RGB565:
-		gs->shader = &gr->texture_shader_rgbx;
+		gs->shader_variant = SHADER_VARIANT_RGBX;
 		pitch = wl_shm_buffer_get_stride(shm_buffer) / 2;
 		gl_format[0] = GL_RGB;
 		gl_pixel_type = GL_UNSIGNED_SHORT_5_6_5;
 		es->is_opaque = true;
 		break;
 	case WL_SHM_FORMAT_YUV420:
-		gs->shader = &gr->texture_shader_y_u_v;
+		gs->shader_variant = SHADER_VARIANT_Y_U_V;
 		pitch = wl_shm_buffer_get_stride(shm_buffer);
 		gl_pixel_type = GL_UNSIGNED_BYTE;
 		num_planes = 3;
@@ -1624,18 +2480,18 @@ gl_renderer_attach_shm(struct weston_surface *es, struct weston_buffer *buffer,
 		gs->hsub[1] = 2;
 		gs->vsub[1] = 2;
 		if (gr->has_gl_texture_rg) {
-			gs->shader = &gr->texture_shader_y_uv;
+			gs->shader_variant = SHADER_VARIANT_Y_UV;
 			gl_format[0] = GL_R8_EXT;
 			gl_format[1] = GL_RG8_EXT;
 		} else {
-			gs->shader = &gr->texture_shader_y_xuxv;
+			gs->shader_variant = SHADER_VARIANT_Y_XUXV;
 			gl_format[0] = GL_LUMINANCE;
 			gl_format[1] = GL_LUMINANCE_ALPHA;
 		}
 		es->is_opaque = true;
 		break;
 	case WL_SHM_FORMAT_YUYV:
-		gs->shader = &gr->texture_shader_y_xuxv;
+		gs->shader_variant = SHADER_VARIANT_Y_XUXV;
 		pitch = wl_shm_buffer_get_stride(shm_buffer) / 2;
 		gl_pixel_type = GL_UNSIGNED_BYTE;
 		num_planes = 2;
@@ -1714,26 +2570,26 @@ gl_renderer_attach_egl(struct weston_surface *es, struct weston_buffer *buffer,
 	case EGL_TEXTURE_RGBA:
 	default:
 		num_planes = 1;
-		gs->shader = &gr->texture_shader_rgba;
+		gs->shader_variant = SHADER_VARIANT_RGBA;
 		break;
 	case EGL_TEXTURE_EXTERNAL_WL:
 		num_planes = 1;
 		gs->target = GL_TEXTURE_EXTERNAL_OES;
-		gs->shader = &gr->texture_shader_egl_external;
+		gs->shader_variant = SHADER_VARIANT_EXTERNAL;
 		break;
 	case EGL_TEXTURE_Y_UV_WL:
 		num_planes = 2;
-		gs->shader = &gr->texture_shader_y_uv;
+		gs->shader_variant = SHADER_VARIANT_Y_UV;
 		es->is_opaque = true;
 		break;
 	case EGL_TEXTURE_Y_U_V_WL:
 		num_planes = 3;
-		gs->shader = &gr->texture_shader_y_u_v;
+		gs->shader_variant = SHADER_VARIANT_Y_U_V;
 		es->is_opaque = true;
 		break;
 	case EGL_TEXTURE_Y_XUXV_WL:
 		num_planes = 2;
-		gs->shader = &gr->texture_shader_y_xuxv;
+		gs->shader_variant = SHADER_VARIANT_Y_XUXV;
 		es->is_opaque = true;
 		break;
 	}
@@ -1773,12 +2629,68 @@ gl_renderer_destroy_dmabuf(struct linux_dmabuf_buffer *dmabuf)
 	dmabuf_image_destroy(image);
 }
 
+/** Derive how a surface's YUV buffers convert to RGB from its colorspace
+ *
+ * No protocol in use carries the quantization range, so it follows the
+ * usual convention: video is limited range, except sRGB content which is
+ * encoded the way JFIF does it, BT.601 at full range. Surfaces that do not
+ * say anything keep the BT.601 limited range conversion.
+ */
+static void
+yuv_color_from_colorspace(struct gl_yuv_color *color, uint32_t colorspace)
+{
+	color->full_range = false;
+
+	switch (colorspace) {
+	case WESTON_CS_BT470M:
+	case WESTON_CS_BT470BG:
+	case WESTON_CS_SMPTE170M:
+	case WESTON_CS_UNDEFINED:
+		color->coefficients = YUV_COEFFICIENTS_BT601;
+		break;
+	case WESTON_CS_SRGB:
+		color->coefficients = YUV_COEFFICIENTS_BT601;
+		color->full_range = true;
+		break;
+	case WESTON_CS_BT2020:
+		color->coefficients = YUV_COEFFICIENTS_BT2020;
+		break;
+	default:
+		color->coefficients = YUV_COEFFICIENTS_BT709;
+		break;
+	}
+}
+
+static bool
+dmabuf_format_is_yuv(uint32_t format)
+{
+	const struct pixel_format_info *info;
+
+	if (format == DRM_FORMAT_AYUV)
+		return true;
+
+	info = pixel_format_get_info(format & ~DRM_FORMAT_BIG_ENDIAN);
+
+	return info && info->sampler_type != 0;
+}
+
+/** Import a dmabuf as a single EGLImage
+ *
+ * \param color If not NULL and the buffer is YUV, tell the driver how to
+ * convert it to RGB, for when it samples YUV natively.
+ */
 static struct egl_image *
 import_simple_dmabuf(struct gl_renderer *gr,
-                     struct dmabuf_attributes *attributes)
+                     struct dmabuf_attributes *attributes,
+                     const struct gl_yuv_color *color)
 {
+	static const EGLint color_space_hints[] = {
+		[YUV_COEFFICIENTS_BT601] = EGL_ITU_REC601_EXT,
+		[YUV_COEFFICIENTS_BT709] = EGL_ITU_REC709_EXT,
+		[YUV_COEFFICIENTS_BT2020] = EGL_ITU_REC2020_EXT,
+	};
 	struct egl_image *image;
-	EGLint attribs[50];
+	EGLint attribs[54];
 	int atti = 0;
 	bool has_modifier;
 
@@ -1865,6 +2777,14 @@ import_simple_dmabuf(struct gl_renderer *gr,
 		}
 	}
 
+	if (color && dmabuf_format_is_yuv(attributes->format)) {
+		attribs[atti++] = EGL_YUV_COLOR_SPACE_HINT_EXT;
+		attribs[atti++] = color_space_hints[color->coefficients];
+		attribs[atti++] = EGL_SAMPLE_RANGE_HINT_EXT;
+		attribs[atti++] = color->full_range ? EGL_YUV_FULL_RANGE_EXT :
+						      EGL_YUV_NARROW_RANGE_EXT;
+	}
+
 	attribs[atti++] = EGL_NONE;
 
 	image = egl_image_create(gr, EGL_LINUX_DMA_BUF_EXT, NULL,
@@ -1981,7 +2901,7 @@ import_dmabuf_single_plane(struct gl_renderer *gr,
 	plane.stride[0] = attributes->stride[descriptor->plane_index];
 	plane.modifier[0] = attributes->modifier[descriptor->plane_index];
 
-	image = import_simple_dmabuf(gr, &plane);
+	image = import_simple_dmabuf(gr, &plane, NULL);
 	if (!image) {
 		weston_log("Failed to import plane %d as %.4s\n",
 		           descriptor->plane_index,
@@ -2042,13 +2962,13 @@ import_yuv_dmabuf(struct gl_renderer *gr,
 
 	switch (format->texture_type) {
 	case EGL_TEXTURE_Y_XUXV_WL:
-		image->shader = &gr->texture_shader_y_xuxv;
+		image->shader_variant = SHADER_VARIANT_Y_XUXV;
 		break;
 	case EGL_TEXTURE_Y_UV_WL:
-		image->shader = &gr->texture_shader_y_uv;
+		image->shader_variant = SHADER_VARIANT_Y_UV;
 		break;
 	case EGL_TEXTURE_Y_U_V_WL:
-		image->shader = &gr->texture_shader_y_u_v;
+		image->shader_variant = SHADER_VARIANT_Y_U_V;
 		break;
 	default:
 		assert(false);
@@ -2081,11 +3001,15 @@ import_dmabuf(struct gl_renderer *gr,
 {
 	struct egl_image *egl_image;
 	struct dmabuf_image *image;
+	struct gl_yuv_color color;
 
 	image = dmabuf_image_create();
 	image->dmabuf = dmabuf;
 
-	egl_image = import_simple_dmabuf(gr, &dmabuf->attributes);
+	/* The surface is not known yet, attaching imports it again with
+	 * its own colorimetry. */
+	yuv_color_from_colorspace(&color, WESTON_CS_UNDEFINED);
+	egl_image = import_simple_dmabuf(gr, &dmabuf->attributes, &color);
 	if (egl_image) {
 		image->num_images = 1;
 		image->images[0] = egl_image;
@@ -2094,10 +3018,10 @@ import_dmabuf(struct gl_renderer *gr,
 
 		switch (image->target) {
 		case GL_TEXTURE_2D:
-			image->shader = &gr->texture_shader_rgba;
+			image->shader_variant = SHADER_VARIANT_RGBA;
 			break;
 		default:
-			image->shader = &gr->texture_shader_egl_external;
+			image->shader_variant = SHADER_VARIANT_EXTERNAL;
 		}
 	} else {
 		if (!import_yuv_dmabuf(gr, image)) {
@@ -2227,11 +3151,14 @@ gl_renderer_import_dmabuf(struct weston_compositor *ec,
 
 static bool
 import_known_dmabuf(struct gl_renderer *gr,
-                    struct dmabuf_image *image)
+                    struct dmabuf_image *image,
+                    const struct gl_yuv_color *color)
 {
 	switch (image->import_type) {
 	case IMPORT_TYPE_DIRECT:
-		image->images[0] = import_simple_dmabuf(gr, &image->dmabuf->attributes);
+		image->images[0] = import_simple_dmabuf(gr,
+							&image->dmabuf->attributes,
+							color);
 		if (!image->images[0])
 			return false;
 		image->num_images = 1;
@@ -2271,6 +3198,7 @@ gl_renderer_attach_dmabuf(struct weston_surface *surface,
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(surface);
 	struct dmabuf_image *image;
+	struct gl_yuv_color color;
 	int i;
 	int ret;
 
@@ -2313,7 +3241,8 @@ gl_renderer_attach_dmabuf(struct weston_surface *surface,
 		assert(ret == 0);
 	}
 
-	if (!import_known_dmabuf(gr, image)) {
+	yuv_color_from_colorspace(&color, surface->colorspace);
+	if (!import_known_dmabuf(gr, image, &color)) {
 		linux_dmabuf_buffer_send_server_error(dmabuf, "EGL dmabuf import failed");
 		return;
 	}
@@ -2330,7 +3259,7 @@ gl_renderer_attach_dmabuf(struct weston_surface *surface,
 		gr->image_target_texture_2d(gs->target, gs->images[i]->image);
 	}
 
-	gs->shader = image->shader;
+	gs->shader_variant = image->shader_variant;
 	gs->pitch = buffer->width;
 	gs->height = buffer->height;
 	gs->buffer_type = BUFFER_TYPE_EGL;
@@ -2395,7 +3324,6 @@ gl_renderer_surface_set_color(struct weston_surface *surface,
 		 float red, float green, float blue, float alpha)
 {
 	struct gl_surface_state *gs = get_surface_state(surface);
-	struct gl_renderer *gr = get_renderer(surface->compositor);
 
 	gs->color[0] = red;
 	gs->color[1] = green;
@@ -2405,7 +3333,7 @@ gl_renderer_surface_set_color(struct weston_surface *surface,
 	gs->pitch = 1;
 	gs->height = 1;
 
-	gs->shader = &gr->solid_shader;
+	gs->shader_variant = SHADER_VARIANT_SOLID;
 }
 
 static void
@@ -2469,6 +3397,8 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	const GLenum gl_format = GL_RGBA; /* PIXMAN_a8b8g8r8 little-endian */
 	struct gl_renderer *gr = get_renderer(surface->compositor);
 	struct gl_surface_state *gs = get_surface_state(surface);
+	struct gl_shader_requirements req;
+	struct gl_shader *shader;
 	int cw, ch;
 	GLuint fbo;
 	GLuint tex;
@@ -2491,6 +3421,12 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 		break;
 	}
 
+	shader_requirements_init(&req, gr, gs->shader_variant);
+	shader_requirements_set_yuv(&req, surface);
+	shader = gl_renderer_get_shader(gr, &req);
+	if (!shader)
+		return -1;
+
 	glGenTextures(1, &tex);
 	glBindTexture(GL_TEXTURE_2D, tex);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, cw, ch,
@@ -2512,17 +3448,16 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 
 	glViewport(0, 0, cw, ch);
 	glDisable(GL_BLEND);
-	use_shader(gr, gs->shader);
+	use_shader(gr, shader);
 	if (gs->y_inverted)
 		proj = projmat_normal;
 	else
 		proj = projmat_yinvert;
 
-	glUniformMatrix4fv(gs->shader->proj_uniform, 1, GL_FALSE, proj);
-	glUniform1f(gs->shader->alpha_uniform, 1.0f);
+	glUniformMatrix4fv(shader->proj_uniform, 1, GL_FALSE, proj);
 
 	for (i = 0; i < gs->num_textures; i++) {
-		glUniform1i(gs->shader->tex_uniforms[i], i);
+		glUniform1i(shader->tex_uniforms[i], i);
 
 		glActiveTexture(GL_TEXTURE0 + i);
 		glBindTexture(gs->target, gs->textures[i]);
@@ -2550,285 +3485,1027 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 	glDeleteFramebuffers(1, &fbo);
 	glDeleteTextures(1, &tex);
 
-	return 0;
+	return 0;
+}
+
+static void
+surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
+{
+	int i;
+
+	wl_list_remove(&gs->surface_destroy_listener.link);
+	wl_list_remove(&gs->renderer_destroy_listener.link);
+
+	gs->surface->renderer_state = NULL;
+
+	glDeleteTextures(gs->num_textures, gs->textures);
+
+	for (i = 0; i < gs->num_images; i++)
+		egl_image_unref(gs->images[i]);
+
+	weston_buffer_reference(&gs->buffer_ref, NULL);
+	pixman_region32_fini(&gs->texture_damage);
+	free(gs);
+}
+
+static void
+surface_state_handle_surface_destroy(struct wl_listener *listener, void *data)
+{
+	struct gl_surface_state *gs;
+	struct gl_renderer *gr;
+
+	gs = container_of(listener, struct gl_surface_state,
+			  surface_destroy_listener);
+
+	gr = get_renderer(gs->surface->compositor);
+
+	surface_state_destroy(gs, gr);
+}
+
+static void
+surface_state_handle_renderer_destroy(struct wl_listener *listener, void *data)
+{
+	struct gl_surface_state *gs;
+	struct gl_renderer *gr;
+
+	gr = data;
+
+	gs = container_of(listener, struct gl_surface_state,
+			  renderer_destroy_listener);
+
+	surface_state_destroy(gs, gr);
+}
+
+static int
+gl_renderer_create_surface(struct weston_surface *surface)
+{
+	struct gl_surface_state *gs;
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+
+	gs = zalloc(sizeof *gs);
+	if (gs == NULL)
+		return -1;
+
+	/* A buffer is never attached to solid color surfaces, yet
+	 * they still go through texcoord computations. Do not divide
+	 * by zero there.
+	 */
+	gs->pitch = 1;
+	gs->y_inverted = 1;
+
+	gs->surface = surface;
+
+	pixman_region32_init(&gs->texture_damage);
+	surface->renderer_state = gs;
+
+	gs->surface_destroy_listener.notify =
+		surface_state_handle_surface_destroy;
+	wl_signal_add(&surface->destroy_signal,
+		      &gs->surface_destroy_listener);
+
+	gs->renderer_destroy_listener.notify =
+		surface_state_handle_renderer_destroy;
+	wl_signal_add(&gr->destroy_signal,
+		      &gs->renderer_destroy_listener);
+
+	if (surface->buffer_ref.buffer) {
+		gl_renderer_attach(surface, surface->buffer_ref.buffer);
+		gl_renderer_flush_damage(surface);
+	}
+
+	return 0;
+}
+
+static const char vertex_shader[] =
+	"uniform mat4 proj;\n"
+	"uniform float depth;\n"
+	"attribute vec2 position;\n"
+	"attribute vec2 texcoord;\n"
+	"varying vec2 v_texcoord;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_Position = proj * vec4(position, 0.0, 1.0);\n"
+	"   gl_Position.z = depth;\n"
+	"   v_texcoord = texcoord;\n"
+	"}\n";
+
+/* Per texture variant, the uniforms it samples and how it computes the
+ * premultiplied color c of a fragment. YUV variants sample into y, u and
+ * v, which shader_generate_yuv() converts. */
+static const struct {
+	const char *declarations;
+	const char *sample;
+	bool yuv;
+} shader_variants[] = {
+	[SHADER_VARIANT_RGBX] = {
+		"uniform sampler2D tex;\n",
+		"   c.rgb = texture2D(tex, v_texcoord).rgb;\n"
+		"   c.a = 1.0;\n"
+	},
+	[SHADER_VARIANT_RGBA] = {
+		"uniform sampler2D tex;\n",
+		"   c = texture2D(tex, v_texcoord);\n"
+	},
+	[SHADER_VARIANT_Y_U_V] = {
+		"uniform sampler2D tex;\n"
+		"uniform sampler2D tex1;\n"
+		"uniform sampler2D tex2;\n",
+		"   float y = texture2D(tex, v_texcoord).x;\n"
+		"   float u = texture2D(tex1, v_texcoord).x;\n"
+		"   float v = texture2D(tex2, v_texcoord).x;\n",
+		true
+	},
+	[SHADER_VARIANT_Y_UV] = {
+		"uniform sampler2D tex;\n"
+		"uniform sampler2D tex1;\n",
+		"   float y = texture2D(tex, v_texcoord).x;\n"
+		"   float u = texture2D(tex1, v_texcoord).r;\n"
+		"   float v = texture2D(tex1, v_texcoord).g;\n",
+		true
+	},
+	[SHADER_VARIANT_Y_XUXV] = {
+		"uniform sampler2D tex;\n"
+		"uniform sampler2D tex1;\n",
+		"   float y = texture2D(tex, v_texcoord).x;\n"
+		"   float u = texture2D(tex1, v_texcoord).g;\n"
+		"   float v = texture2D(tex1, v_texcoord).a;\n",
+		true
+	},
+	[SHADER_VARIANT_EXTERNAL] = {
+		"uniform samplerExternalOES tex;\n",
+		"   c = texture2D(tex, v_texcoord);\n"
+	},
+	[SHADER_VARIANT_SOLID] = {
+		"uniform vec4 color;\n",
+		"   c = color;\n"
+	},
+};
+
+/* Luma weights of red and blue, from ITU-R BT.601, BT.709 and BT.2020 */
+static const struct {
+	float kr, kb;
+} yuv_coefficients[] = {
+	[YUV_COEFFICIENTS_BT601] = { 0.299f, 0.114f },
+	[YUV_COEFFICIENTS_BT709] = { 0.2126f, 0.0722f },
+	[YUV_COEFFICIENTS_BT2020] = { 0.2627f, 0.0593f },
+};
+
+/* Emits the conversion of the sampled y, u and v into the color c */
+static void
+shader_generate_yuv(FILE *fp, const struct gl_shader_requirements *req)
+{
+	float kr = yuv_coefficients[req->yuv_coefficients].kr;
+	float kb = yuv_coefficients[req->yuv_coefficients].kb;
+	float kg = 1.0f - kr - kb;
+	float y_scale, y_offset, c_scale;
+
+	/* Samples are 8 bit codes over 255. Full range spans luma over
+	 * 0..255 and chroma over 0..255 around 128, as EGL imports
+	 * EGL_YUV_FULL_RANGE_EXT; limited range puts black at 16 and white
+	 * at 235, and spans chroma over 16..240. */
+	if (req->yuv_full_range) {
+		y_scale = 1.0f;
+		y_offset = 0.0f;
+		c_scale = 1.0f;
+	} else {
+		y_scale = 255.0f / 219.0f;
+		y_offset = 16.0f / 255.0f;
+		c_scale = 255.0f / 224.0f;
+	}
+
+	fprintf(fp, "   y = %f * (y - %f);\n"
+		"   u = %f * (u - %f);\n"
+		"   v = %f * (v - %f);\n"
+		"   c.r = y + %f * v;\n"
+		"   c.g = y - %f * u - %f * v;\n"
+		"   c.b = y + %f * u;\n"
+		"   c.a = 1.0;\n",
+		y_scale, y_offset,
+		c_scale, 128.0f / 255.0f,
+		c_scale, 128.0f / 255.0f,
+		2.0f * (1.0f - kr),
+		2.0f * (1.0f - kb) * kb / kg, 2.0f * (1.0f - kr) * kr / kg,
+		2.0f * (1.0f - kb));
+}
+
+static const char fragment_debug[] =
+	"   c = vec4(0.0, 0.3, 0.0, 0.2) + c * 0.8;\n";
+
+static GLuint
+compile_shader(GLenum type, int count, const char **sources)
+{
+	GLuint s;
+	char msg[512];
+	GLint status;
+
+	s = glCreateShader(type);
+	glShaderSource(s, count, sources, NULL);
+	glCompileShader(s);
+	glGetShaderiv(s, GL_COMPILE_STATUS, &status);
+	if (!status) {
+		glGetShaderInfoLog(s, sizeof msg, NULL, msg);
+		weston_log("shader info: %s\n", msg);
+		glDeleteShader(s);
+		return GL_NONE;
+	}
+
+	return s;
+}
+
+/* Building blocks for the HDR shader variants. Colors are handled in linear
+ * light where 1.0 is the peak luminance of the output.
+ */
+/* Pastes a constant from colorspace.h into shader source */
+#define GLSL_CONST_(x) #x
+#define GLSL_CONST(x) GLSL_CONST_(x)
+
+static const char hdr_fragment_header[] =
+	"#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+	"precision highp float;\n"
+	"#else\n"
+	"precision mediump float;\n"
+	"#endif\n"
+	"uniform float hdr_src_scale;\n"
+	"uniform float hdr_src_white;\n"
+	"uniform float hdr_dst_scale;\n"
+	"const float pq_m1 = " GLSL_CONST(WESTON_PQ_M1) ";\n"
+	"const float pq_m2 = " GLSL_CONST(WESTON_PQ_M2) ";\n"
+	"const float pq_c1 = " GLSL_CONST(WESTON_PQ_C1) ";\n"
+	"const float pq_c2 = " GLSL_CONST(WESTON_PQ_C2) ";\n"
+	"const float pq_c3 = " GLSL_CONST(WESTON_PQ_C3) ";\n"
+	"const float hlg_a = " GLSL_CONST(WESTON_HLG_A) ";\n"
+	"const float hlg_b = " GLSL_CONST(WESTON_HLG_B) ";\n"
+	"const float hlg_c = " GLSL_CONST(WESTON_HLG_C) ";\n"
+	"const vec3 hlg_luma = vec3(" GLSL_CONST(WESTON_BT2020_LUMA_R) ", "
+		GLSL_CONST(WESTON_BT2020_LUMA_G) ", "
+		GLSL_CONST(WESTON_BT2020_LUMA_B) ");\n"
+	"vec3 hdr_tonemap(vec3 c)\n"
+	"{\n"
+	"   float peak = max(max(c.r, c.g), c.b);\n"
+	"   float w2 = hdr_src_white * hdr_src_white;\n"
+	"   if (hdr_src_white <= 1.0 || peak <= 0.0)\n"
+	"      return c;\n"
+	"   return c * ((1.0 + peak / w2) / (1.0 + peak));\n"
+	"}\n";
+
+static const char hdr_eotf_sdr[] =
+	"vec3 hdr_eotf(vec3 e)\n"
+	"{\n"
+	"   return pow(max(e, 0.0), vec3(2.2));\n"
+	"}\n";
+
+static const char hdr_eotf_pq[] =
+	"vec3 hdr_eotf(vec3 e)\n"
+	"{\n"
+	"   vec3 p = pow(clamp(e, 0.0, 1.0), vec3(1.0 / pq_m2));\n"
+	"   return pow(max(p - pq_c1, 0.0) / (pq_c2 - pq_c3 * p),\n"
+	"              vec3(1.0 / pq_m1));\n"
+	"}\n";
+
+static const char hdr_eotf_hlg[] =
+	"float hlg_inv_oetf(float e)\n"
+	"{\n"
+	"   if (e <= 0.5)\n"
+	"      return e * e / 3.0;\n"
+	"   return (exp((e - hlg_c) / hlg_a) + hlg_b) / 12.0;\n"
+	"}\n"
+	"vec3 hdr_eotf(vec3 e)\n"
+	"{\n"
+	"   vec3 s = vec3(hlg_inv_oetf(e.r), hlg_inv_oetf(e.g),\n"
+	"                 hlg_inv_oetf(e.b));\n"
+	"   return s * pow(max(dot(hlg_luma, s), 1e-6), 0.2);\n"
+	"}\n";
+
+static const char hdr_oetf_sdr[] =
+	"vec3 hdr_oetf(vec3 c)\n"
+	"{\n"
+	"   return pow(clamp(c, 0.0, 1.0), vec3(1.0 / 2.2));\n"
+	"}\n";
+
+static const char hdr_oetf_pq[] =
+	"vec3 hdr_oetf(vec3 c)\n"
+	"{\n"
+	"   vec3 y = pow(clamp(c * hdr_dst_scale, 0.0, 1.0), vec3(pq_m1));\n"
+	"   return pow((pq_c1 + pq_c2 * y) / (1.0 + pq_c3 * y), vec3(pq_m2));\n"
+	"}\n";
+
+static const char hdr_oetf_hlg[] =
+	"float hlg_oetf(float s)\n"
+	"{\n"
+	"   if (s <= 1.0 / 12.0)\n"
+	"      return sqrt(3.0 * s);\n"
+	"   return hlg_a * log(12.0 * s - hlg_b) + hlg_c;\n"
+	"}\n"
+	"vec3 hdr_oetf(vec3 c)\n"
+	"{\n"
+	"   vec3 d = clamp(c * hdr_dst_scale, 0.0, 1.0);\n"
+	"   vec3 s = d * pow(max(dot(hlg_luma, d), 1e-6), -0.2 / 1.2);\n"
+	"   return vec3(hlg_oetf(s.r), hlg_oetf(s.g), hlg_oetf(s.b));\n"
+	"}\n";
+
+static const char hdr_fragment_process[] =
+	"vec4 hdr_process(vec4 c)\n"
+	"{\n"
+	"   vec3 rgb;\n"
+	"   if (c.a <= 0.0)\n"
+	"      return c;\n"
+	"   rgb = hdr_eotf(c.rgb / c.a) * hdr_src_scale;\n"
+	"#ifdef HDR_GAMUT\n"
+	"   rgb = max(hdr_gamut * rgb, 0.0);\n"
+	"#endif\n"
+	"   rgb = hdr_oetf(hdr_tonemap(rgb));\n"
+	"   return vec4(rgb * c.a, c.a);\n"
+	"}\n";
+
+/* Reference white levels in cd/m², from ITU-R BT.2408 for HDR outputs */
+#define HDR_SDR_WHITE 100.0f
+#define HDR_REFERENCE_WHITE 203.0f
+#define HDR_DEFAULT_PEAK 1000.0f
+#define HDR_PQ_PEAK 10000.0f
+#define HDR_HLG_PEAK 1000.0f
+
+/* Surfaces and outputs that do not say are BT.709, as the DRM backend
+ * takes them for planes. Only the YUV conversion keeps its own default,
+ * see yuv_color_from_colorspace(). */
+static uint32_t
+colorspace_primaries(uint32_t colorspace)
+{
+	if (colorspace == WESTON_CS_UNDEFINED)
+		return WESTON_CS_BT709;
+
+	return colorspace;
+}
+
+static bool
+colorspace_primaries_equal(uint32_t a, uint32_t b)
+{
+	const struct weston_colorspace *ca = weston_colorspace_get(a);
+	const struct weston_colorspace *cb = weston_colorspace_get(b);
+
+	/* Unknown colorimetry is passed through untouched */
+	if (!ca || !cb || ca == cb)
+		return true;
+
+	return memcmp(&ca->r, &cb->r, sizeof ca->r) == 0 &&
+	       memcmp(&ca->g, &cb->g, sizeof ca->g) == 0 &&
+	       memcmp(&ca->b, &cb->b, sizeof ca->b) == 0 &&
+	       memcmp(&ca->whitepoint, &cb->whitepoint,
+		      sizeof ca->whitepoint) == 0;
+}
+
+static float
+output_peak_luminance(struct weston_output *output)
+{
+	if (output->eotf == EOTF_TRADITIONAL_GAMMA_SDR)
+		return HDR_SDR_WHITE;
+
+	if (output->max_luminance)
+		return output->max_luminance;
+
+	return HDR_DEFAULT_PEAK;
+}
+
+static void
+shader_generate_hdr(FILE *fp, const struct gl_shader_requirements *req)
+{
+	const char *eotf, *oetf;
+
+	switch (req->eotf) {
+	case EOTF_ST2084:
+		eotf = hdr_eotf_pq;
+		break;
+	case EOTF_HLG:
+		eotf = hdr_eotf_hlg;
+		break;
+	default:
+		eotf = hdr_eotf_sdr;
+		break;
+	}
+
+	switch (req->dst_eotf) {
+	case EOTF_ST2084:
+		oetf = hdr_oetf_pq;
+		break;
+	case EOTF_HLG:
+		oetf = hdr_oetf_hlg;
+		break;
+	default:
+		oetf = hdr_oetf_sdr;
+		break;
+	}
+
+	fputs(hdr_fragment_header, fp);
+
+	if (!colorspace_primaries_equal(req->src_colorspace,
+					req->dst_colorspace)) {
+		float m[9];
+
+		weston_colorspace_conversion_matrix(
+			weston_colorspace_get(req->dst_colorspace),
+			weston_colorspace_get(req->src_colorspace), m);
+		fprintf(fp, "#define HDR_GAMUT\n"
+			"const mat3 hdr_gamut = mat3(%f, %f, %f,\n"
+			"                            %f, %f, %f,\n"
+			"                            %f, %f, %f);\n",
+			m[0], m[1], m[2], m[3], m[4], m[5], m[6], m[7], m[8]);
+	}
+
+	fputs(eotf, fp);
+	fputs(oetf, fp);
+	fputs(hdr_fragment_process, fp);
+}
+
+/** Compose the fragment shader for the given requirements
+ *
+ * Only the steps a view needs end up in the shader: a view at full
+ * opacity does not multiply by alpha, and SDR content on an SDR output
+ * skips the color conversion entirely.
+ */
+static char *
+shader_generate_fragment(const struct gl_shader_requirements *req)
+{
+	char *str = NULL;
+	size_t size = 0;
+	FILE *fp;
+
+	fp = open_memstream(&str, &size);
+	if (!fp)
+		return NULL;
+
+	/* #extension directives must precede everything else */
+	if (req->variant == SHADER_VARIANT_EXTERNAL)
+		fputs("#extension GL_OES_EGL_image_external : require\n", fp);
+
+	if (req->hdr)
+		shader_generate_hdr(fp, req);
+	else
+		fputs("precision mediump float;\n", fp);
+
+	fputs("varying vec2 v_texcoord;\n", fp);
+	if (req->alpha)
+		fputs("uniform float alpha;\n", fp);
+	fputs(shader_variants[req->variant].declarations, fp);
+
+	fputs("void main()\n"
+	      "{\n"
+	      "   vec4 c;\n", fp);
+	fputs(shader_variants[req->variant].sample, fp);
+	if (shader_variants[req->variant].yuv)
+		shader_generate_yuv(fp, req);
+	if (req->hdr)
+		fputs("   c = hdr_process(c);\n", fp);
+	if (req->alpha)
+		fputs("   c *= alpha;\n", fp);
+	if (req->debug)
+		fputs(fragment_debug, fp);
+	fputs("   gl_FragColor = c;\n"
+	      "}\n", fp);
+
+	if (fclose(fp) != 0) {
+		free(str);
+		return NULL;
+	}
+
+	return str;
+}
+
+static int
+shader_link(struct gl_shader *shader, const char *fragment_source)
+{
+	const char *vertex_source = vertex_shader;
+	GLuint vs, fs;
+	char msg[512];
+	GLint status;
+
+	vs = compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
+	fs = compile_shader(GL_FRAGMENT_SHADER, 1, &fragment_source);
+
+	if (vs == GL_NONE || fs == GL_NONE) {
+		glDeleteShader(vs);
+		glDeleteShader(fs);
+		return -1;
+	}
+
+	glAttachShader(shader->program, vs);
+	glAttachShader(shader->program, fs);
+	glBindAttribLocation(shader->program, 0, "position");
+	glBindAttribLocation(shader->program, 1, "texcoord");
+
+	glLinkProgram(shader->program);
+
+	/* The linked program does not need them anymore */
+	glDetachShader(shader->program, vs);
+	glDetachShader(shader->program, fs);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+
+	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+	if (!status) {
+		glGetProgramInfoLog(shader->program, sizeof msg, NULL, msg);
+		weston_log("link info: %s\n", msg);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+program_binary_destroy(struct gl_program_binary *pb)
+{
+	wl_list_remove(&pb->link);
+	free(pb->data);
+	free(pb);
+}
+
+static char *
+program_cache_get_path(void)
+{
+	const char *path = getenv("WESTON_GL_PROGRAM_CACHE");
+	const char *dir;
+	char *str;
+
+	if (path)
+		return *path ? strdup(path) : NULL;
+
+	dir = getenv("XDG_CACHE_HOME");
+	if (dir && dir[0] == '/') {
+		if (asprintf(&str, "%s/weston-gl-programs", dir) < 0)
+			return NULL;
+		return str;
+	}
+
+	dir = getenv("HOME");
+	if (!dir)
+		return NULL;
+
+	if (asprintf(&str, "%s/.cache/weston-gl-programs", dir) < 0)
+		return NULL;
+	return str;
+}
+
+static uint64_t
+program_cache_hash_string(uint64_t hash, const char *str)
+{
+	/* FNV-1a, including the terminating NUL as a separator */
+	do {
+		hash ^= (uint8_t) *str;
+		hash *= 0x100000001b3ull;
+	} while (*str++);
+
+	return hash;
+}
+
+static void
+program_cache_load(struct gl_renderer *gr)
+{
+	struct gl_program_cache_header header;
+	struct gl_program_cache_entry entry;
+	struct gl_program_binary *pb;
+	uint32_t i;
+	FILE *fp;
+
+	fp = fopen(gr->program_cache_path, "rb");
+	if (!fp)
+		return;
+
+	/* Binaries only work with the driver that produced them */
+	if (fread(&header, sizeof header, 1, fp) != 1 ||
+	    memcmp(header.magic, GL_PROGRAM_CACHE_MAGIC,
+		   sizeof header.magic) != 0 ||
+	    header.key_size != sizeof(struct gl_shader_requirements) ||
+	    header.driver_hash != gr->driver_hash)
+		goto out;
+
+	for (i = 0; i < header.count; i++) {
+		if (fread(&entry, sizeof entry, 1, fp) != 1 ||
+		    entry.length == 0 ||
+		    entry.length > GL_PROGRAM_BINARY_MAX_SIZE)
+			break;
+
+		pb = zalloc(sizeof *pb);
+		if (!pb)
+			break;
+
+		pb->data = malloc(entry.length);
+		if (!pb->data ||
+		    fread(pb->data, entry.length, 1, fp) != 1) {
+			free(pb->data);
+			free(pb);
+			break;
+		}
+
+		pb->key = entry.key;
+		pb->source_hash = entry.source_hash;
+		pb->format = entry.format;
+		pb->length = entry.length;
+		wl_list_insert(gr->program_binaries.prev, &pb->link);
+	}
+
+	weston_log("GL program cache: loaded %d programs from %s\n",
+		   wl_list_length(&gr->program_binaries),
+		   gr->program_cache_path);
+
+out:
+	fclose(fp);
+}
+
+static void
+program_cache_save(struct gl_renderer *gr)
+{
+	struct gl_program_cache_header header;
+	struct gl_program_cache_entry entry;
+	struct gl_program_binary *pb;
+	char *tmp, *dir, *slash;
+	bool ok;
+	FILE *fp;
+
+	if (asprintf(&tmp, "%s.tmp", gr->program_cache_path) < 0)
+		return;
+
+	fp = fopen(tmp, "wb");
+	if (!fp && errno == ENOENT) {
+		/* Create the cache directory, but not its parents */
+		dir = strdup(gr->program_cache_path);
+		slash = dir ? strrchr(dir, '/') : NULL;
+		if (slash && slash != dir) {
+			*slash = '\0';
+			mkdir(dir, 0700);
+		}
+		free(dir);
+
+		fp = fopen(tmp, "wb");
+	}
+	if (!fp) {
+		weston_log("warning: cannot write GL program cache %s: %s\n",
+			   tmp, strerror(errno));
+		free(tmp);
+		return;
+	}
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, GL_PROGRAM_CACHE_MAGIC, sizeof header.magic);
+	header.key_size = sizeof(struct gl_shader_requirements);
+	header.count = wl_list_length(&gr->program_binaries);
+	header.driver_hash = gr->driver_hash;
+	ok = fwrite(&header, sizeof header, 1, fp) == 1;
+
+	wl_list_for_each(pb, &gr->program_binaries, link) {
+		memset(&entry, 0, sizeof entry);
+		entry.key = pb->key;
+		entry.source_hash = pb->source_hash;
+		entry.format = pb->format;
+		entry.length = pb->length;
+		ok = ok && fwrite(&entry, sizeof entry, 1, fp) == 1 &&
+		     fwrite(pb->data, pb->length, 1, fp) == 1;
+	}
+
+	if (fclose(fp) != 0)
+		ok = false;
+
+	/* Replace the cache atomically, a reader never sees half of it */
+	if (!ok || rename(tmp, gr->program_cache_path) < 0) {
+		weston_log("warning: cannot write GL program cache %s\n",
+			   gr->program_cache_path);
+		unlink(tmp);
+	}
+
+	free(tmp);
 }
 
 static void
-surface_state_destroy(struct gl_surface_state *gs, struct gl_renderer *gr)
+program_cache_save_idle(void *data)
 {
-	int i;
-
-	wl_list_remove(&gs->surface_destroy_listener.link);
-	wl_list_remove(&gs->renderer_destroy_listener.link);
+	struct gl_renderer *gr = data;
 
-	gs->surface->renderer_state = NULL;
+	gr->program_cache_idle = NULL;
+	program_cache_save(gr);
+}
 
-	glDeleteTextures(gs->num_textures, gs->textures);
+/* Programs get built during repaint, write them out once it is over */
+static void
+program_cache_schedule_save(struct gl_renderer *gr)
+{
+	struct wl_event_loop *loop;
 
-	for (i = 0; i < gs->num_images; i++)
-		egl_image_unref(gs->images[i]);
+	if (gr->program_cache_idle)
+		return;
 
-	weston_buffer_reference(&gs->buffer_ref, NULL);
-	pixman_region32_fini(&gs->texture_damage);
-	free(gs);
+	loop = wl_display_get_event_loop(gr->compositor->wl_display);
+	gr->program_cache_idle =
+		wl_event_loop_add_idle(loop, program_cache_save_idle, gr);
 }
 
 static void
-surface_state_handle_surface_destroy(struct wl_listener *listener, void *data)
+program_cache_init(struct gl_renderer *gr)
 {
-	struct gl_surface_state *gs;
-	struct gl_renderer *gr;
+	uint64_t hash = GL_PROGRAM_HASH_INIT;
 
-	gs = container_of(listener, struct gl_surface_state,
-			  surface_destroy_listener);
+	if (!gr->has_program_binary)
+		return;
 
-	gr = get_renderer(gs->surface->compositor);
+	gr->program_cache_path = program_cache_get_path();
+	if (!gr->program_cache_path)
+		return;
 
-	surface_state_destroy(gs, gr);
+	hash = program_cache_hash_string(hash,
+				(const char *) glGetString(GL_VENDOR));
+	hash = program_cache_hash_string(hash,
+				(const char *) glGetString(GL_RENDERER));
+	hash = program_cache_hash_string(hash,
+				(const char *) glGetString(GL_VERSION));
+	gr->driver_hash = hash;
+
+	program_cache_load(gr);
 }
 
 static void
-surface_state_handle_renderer_destroy(struct wl_listener *listener, void *data)
+program_cache_release(struct gl_renderer *gr)
 {
-	struct gl_surface_state *gs;
-	struct gl_renderer *gr;
+	struct gl_program_binary *pb, *pb_next;
 
-	gr = data;
+	if (gr->program_cache_idle) {
+		wl_event_source_remove(gr->program_cache_idle);
+		program_cache_save_idle(gr);
+	}
 
-	gs = container_of(listener, struct gl_surface_state,
-			  renderer_destroy_listener);
+	wl_list_for_each_safe(pb, pb_next, &gr->program_binaries, link)
+		program_binary_destroy(pb);
 
-	surface_state_destroy(gs, gr);
+	free(gr->program_cache_path);
+	gr->program_cache_path = NULL;
 }
 
-static int
-gl_renderer_create_surface(struct weston_surface *surface)
+/* Restore the program from the binary cache, false if it has to be
+ * built from source. Binaries of other sources for the same key, from
+ * another version of the renderer, are ignored. */
+static bool
+shader_load_binary(struct gl_renderer *gr, struct gl_shader *shader,
+		   uint64_t source_hash)
 {
-	struct gl_surface_state *gs;
-	struct gl_renderer *gr = get_renderer(surface->compositor);
-
-	gs = zalloc(sizeof *gs);
-	if (gs == NULL)
-		return -1;
-
-	/* A buffer is never attached to solid color surfaces, yet
-	 * they still go through texcoord computations. Do not divide
-	 * by zero there.
-	 */
-	gs->pitch = 1;
-	gs->y_inverted = 1;
-
-	gs->surface = surface;
+	struct gl_program_binary *pb;
+	GLint status;
 
-	pixman_region32_init(&gs->texture_damage);
-	surface->renderer_state = gs;
+	if (!gr->program_cache_path)
+		return false;
 
-	gs->surface_destroy_listener.notify =
-		surface_state_handle_surface_destroy;
-	wl_signal_add(&surface->destroy_signal,
-		      &gs->surface_destroy_listener);
+	wl_list_for_each(pb, &gr->program_binaries, link) {
+		if (memcmp(&pb->key, &shader->key, sizeof pb->key) != 0 ||
+		    pb->source_hash != source_hash)
+			continue;
 
-	gs->renderer_destroy_listener.notify =
-		surface_state_handle_renderer_destroy;
-	wl_signal_add(&gr->destroy_signal,
-		      &gs->renderer_destroy_listener);
+		gr->program_binary(shader->program, pb->format,
+				   pb->data, pb->length);
+		glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
+		if (status)
+			return true;
 
-	if (surface->buffer_ref.buffer) {
-		gl_renderer_attach(surface, surface->buffer_ref.buffer);
-		gl_renderer_flush_damage(surface);
+		/* The driver rejected it, rebuild and replace it */
+		program_binary_destroy(pb);
+		return false;
 	}
 
-	return 0;
+	return false;
 }
 
-static const char vertex_shader[] =
-	"uniform mat4 proj;\n"
-	"attribute vec2 position;\n"
-	"attribute vec2 texcoord;\n"
-	"varying vec2 v_texcoord;\n"
-	"void main()\n"
-	"{\n"
-	"   gl_Position = proj * vec4(position, 0.0, 1.0);\n"
-	"   v_texcoord = texcoord;\n"
-	"}\n";
-
-/* Declare common fragment shader uniforms */
-#define FRAGMENT_CONVERT_YUV						\
-	"  y *= alpha;\n"						\
-	"  u *= alpha;\n"						\
-	"  v *= alpha;\n"						\
-	"  gl_FragColor.r = y + 1.59602678 * v;\n"			\
-	"  gl_FragColor.g = y - 0.39176229 * u - 0.81296764 * v;\n"	\
-	"  gl_FragColor.b = y + 2.01723214 * u;\n"			\
-	"  gl_FragColor.a = alpha;\n"
-
-static const char fragment_debug[] =
-	"  gl_FragColor = vec4(0.0, 0.3, 0.0, 0.2) + gl_FragColor * 0.8;\n";
-
-static const char fragment_brace[] =
-	"}\n";
-
-static const char texture_fragment_shader_rgba[] =
-	"precision mediump float;\n"
-	"varying vec2 v_texcoord;\n"
-	"uniform sampler2D tex;\n"
-	"uniform float alpha;\n"
-	"void main()\n"
-	"{\n"
-	"   gl_FragColor = alpha * texture2D(tex, v_texcoord)\n;"
-	;
+static void
+shader_store_binary(struct gl_renderer *gr, struct gl_shader *shader,
+		    uint64_t source_hash)
+{
+	struct gl_program_binary *pb;
+	GLint length = 0;
 
-static const char texture_fragment_shader_rgbx[] =
-	"precision mediump float;\n"
-	"varying vec2 v_texcoord;\n"
-	"uniform sampler2D tex;\n"
-	"uniform float alpha;\n"
-	"void main()\n"
-	"{\n"
-	"   gl_FragColor.rgb = alpha * texture2D(tex, v_texcoord).rgb\n;"
-	"   gl_FragColor.a = alpha;\n"
-	;
+	if (!gr->program_cache_path)
+		return;
 
-static const char texture_fragment_shader_egl_external[] =
-	"#extension GL_OES_EGL_image_external : require\n"
-	"precision mediump float;\n"
-	"varying vec2 v_texcoord;\n"
-	"uniform samplerExternalOES tex;\n"
-	"uniform float alpha;\n"
-	"void main()\n"
-	"{\n"
-	"   gl_FragColor = alpha * texture2D(tex, v_texcoord)\n;"
-	;
+	glGetProgramiv(shader->program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0 || length > GL_PROGRAM_BINARY_MAX_SIZE)
+		return;
 
-static const char texture_fragment_shader_y_uv[] =
-	"precision mediump float;\n"
-	"uniform sampler2D tex;\n"
-	"uniform sampler2D tex1;\n"
-	"varying vec2 v_texcoord;\n"
-	"uniform float alpha;\n"
-	"void main() {\n"
-	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
-	"  float u = texture2D(tex1, v_texcoord).r - 0.5;\n"
-	"  float v = texture2D(tex1, v_texcoord).g - 0.5;\n"
-	FRAGMENT_CONVERT_YUV
-	;
-
-static const char texture_fragment_shader_y_u_v[] =
-	"precision mediump float;\n"
-	"uniform sampler2D tex;\n"
-	"uniform sampler2D tex1;\n"
-	"uniform sampler2D tex2;\n"
-	"varying vec2 v_texcoord;\n"
-	"uniform float alpha;\n"
-	"void main() {\n"
-	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
-	"  float u = texture2D(tex1, v_texcoord).x - 0.5;\n"
-	"  float v = texture2D(tex2, v_texcoord).x - 0.5;\n"
-	FRAGMENT_CONVERT_YUV
-	;
-
-static const char texture_fragment_shader_y_xuxv[] =
-	"precision mediump float;\n"
-	"uniform sampler2D tex;\n"
-	"uniform sampler2D tex1;\n"
-	"varying vec2 v_texcoord;\n"
-	"uniform float alpha;\n"
-	"void main() {\n"
-	"  float y = 1.16438356 * (texture2D(tex, v_texcoord).x - 0.0625);\n"
-	"  float u = texture2D(tex1, v_texcoord).g - 0.5;\n"
-	"  float v = texture2D(tex1, v_texcoord).a - 0.5;\n"
-	FRAGMENT_CONVERT_YUV
-	;
-
-static const char solid_fragment_shader[] =
-	"precision mediump float;\n"
-	"uniform vec4 color;\n"
-	"uniform float alpha;\n"
-	"void main()\n"
-	"{\n"
-	"   gl_FragColor = alpha * color\n;"
-	;
+	pb = zalloc(sizeof *pb);
+	if (!pb)
+		return;
 
-static int
-compile_shader(GLenum type, int count, const char **sources)
-{
-	GLuint s;
-	char msg[512];
-	GLint status;
+	pb->data = malloc(length);
+	if (!pb->data) {
+		free(pb);
+		return;
+	}
 
-	s = glCreateShader(type);
-	glShaderSource(s, count, sources, NULL);
-	glCompileShader(s);
-	glGetShaderiv(s, GL_COMPILE_STATUS, &status);
-	if (!status) {
-		glGetShaderInfoLog(s, sizeof msg, NULL, msg);
-		weston_log("shader info: %s\n", msg);
-		return GL_NONE;
+	gr->get_program_binary(shader->program, length, &pb->length,
+			       &pb->format, pb->data);
+	if (pb->length <= 0) {
+		free(pb->data);
+		free(pb);
+		return;
 	}
 
-	return s;
+	pb->key = shader->key;
+	pb->source_hash = source_hash;
+	wl_list_insert(&gr->program_binaries, &pb->link);
+	program_cache_schedule_save(gr);
 }
 
-static int
-shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
-		   const char *vertex_source, const char *fragment_source)
+static struct gl_shader *
+shader_create(struct gl_renderer *gr, const struct gl_shader_requirements *req)
 {
-	char msg[512];
-	GLint status;
-	int count;
-	const char *sources[3];
+	struct gl_shader *shader;
+	char *fragment_source;
+	uint64_t source_hash;
 
-	shader->vertex_shader =
-		compile_shader(GL_VERTEX_SHADER, 1, &vertex_source);
+	shader = zalloc(sizeof *shader);
+	if (!shader)
+		return NULL;
 
-	if (renderer->fragment_shader_debug) {
-		sources[0] = fragment_source;
-		sources[1] = fragment_debug;
-		sources[2] = fragment_brace;
-		count = 3;
-	} else {
-		sources[0] = fragment_source;
-		sources[1] = fragment_brace;
-		count = 2;
+	fragment_source = shader_generate_fragment(req);
+	if (!fragment_source) {
+		free(shader);
+		return NULL;
 	}
 
-	shader->fragment_shader =
-		compile_shader(GL_FRAGMENT_SHADER, count, sources);
+	source_hash = program_cache_hash_string(GL_PROGRAM_HASH_INIT,
+						vertex_shader);
+	source_hash = program_cache_hash_string(source_hash, fragment_source);
 
+	shader->key = *req;
 	shader->program = glCreateProgram();
-	glAttachShader(shader->program, shader->vertex_shader);
-	glAttachShader(shader->program, shader->fragment_shader);
-	glBindAttribLocation(shader->program, 0, "position");
-	glBindAttribLocation(shader->program, 1, "texcoord");
 
-	glLinkProgram(shader->program);
-	glGetProgramiv(shader->program, GL_LINK_STATUS, &status);
-	if (!status) {
-		glGetProgramInfoLog(shader->program, sizeof msg, NULL, msg);
-		weston_log("link info: %s\n", msg);
-		return -1;
+	if (!shader_load_binary(gr, shader, source_hash)) {
+		if (shader_link(shader, fragment_source) < 0) {
+			/* Kept with no program, so that it is not tried
+			 * again on every repaint */
+			weston_log("warning: failed to compile shader\n");
+			glDeleteProgram(shader->program);
+			shader->program = 0;
+			free(fragment_source);
+			return shader;
+		}
+
+		shader_store_binary(gr, shader, source_hash);
 	}
+	free(fragment_source);
 
 	shader->proj_uniform = glGetUniformLocation(shader->program, "proj");
+	shader->depth_uniform = glGetUniformLocation(shader->program, "depth");
 	shader->tex_uniforms[0] = glGetUniformLocation(shader->program, "tex");
 	shader->tex_uniforms[1] = glGetUniformLocation(shader->program, "tex1");
 	shader->tex_uniforms[2] = glGetUniformLocation(shader->program, "tex2");
 	shader->alpha_uniform = glGetUniformLocation(shader->program, "alpha");
 	shader->color_uniform = glGetUniformLocation(shader->program, "color");
+	shader->hdr_src_scale_uniform =
+		glGetUniformLocation(shader->program, "hdr_src_scale");
+	shader->hdr_src_white_uniform =
+		glGetUniformLocation(shader->program, "hdr_src_white");
+	shader->hdr_dst_scale_uniform =
+		glGetUniformLocation(shader->program, "hdr_dst_scale");
+
+	return shader;
+}
 
-	return 0;
+/* The GL programs go away with the context */
+static void
+shader_destroy(struct gl_shader *shader)
+{
+	wl_list_remove(&shader->link);
+	free(shader);
+}
+
+static void
+shader_requirements_init(struct gl_shader_requirements *req,
+			 struct gl_renderer *gr,
+			 enum gl_shader_texture_variant variant)
+{
+	memset(req, 0, sizeof *req);
+	req->variant = variant;
+	req->debug = gr->fragment_shader_debug;
+}
+
+/* YUV variants convert to RGB as the surface's colorimetry says */
+static void
+shader_requirements_set_yuv(struct gl_shader_requirements *req,
+			    struct weston_surface *surface)
+{
+	struct gl_yuv_color color;
+
+	if (!shader_variants[req->variant].yuv)
+		return;
+
+	yuv_color_from_colorspace(&color, surface->colorspace);
+	req->yuv_coefficients = color.coefficients;
+	req->yuv_full_range = color.full_range;
+}
+
+/** Get the shader program for the given requirements
+ *
+ * Programs are generated on first use and cached for the lifetime of the
+ * renderer. Returns NULL if the program could not be built.
+ */
+static struct gl_shader *
+gl_renderer_get_shader(struct gl_renderer *gr,
+		       const struct gl_shader_requirements *req)
+{
+	struct gl_shader *shader;
+
+	wl_list_for_each(shader, &gr->shader_list, link) {
+		if (memcmp(&shader->key, req, sizeof *req) == 0)
+			return shader->program ? shader : NULL;
+	}
+
+	shader = shader_create(gr, req);
+	if (!shader)
+		return NULL;
+
+	wl_list_insert(&gr->shader_list, &shader->link);
+
+	return shader->program ? shader : NULL;
+}
+
+/** Pick the shader to draw a view's surface with on an output
+ *
+ * The shader samples the given texture variant, applies the view alpha
+ * only if the view is translucent, and converts the surface's transfer
+ * function and primaries into those of the output only if they differ.
+ */
+static struct gl_shader *
+get_view_shader(struct gl_renderer *gr,
+		enum gl_shader_texture_variant variant,
+		struct weston_view *view, struct weston_output *output)
+{
+	struct weston_surface *surface = view->surface;
+	struct gl_shader_requirements req;
+	enum hdr_metadata_eotf eotf = weston_surface_get_eotf(surface);
+	uint32_t src = colorspace_primaries(surface->colorspace);
+	uint32_t dst = colorspace_primaries(output->colorspace);
+
+	shader_requirements_init(&req, gr, variant);
+	shader_requirements_set_yuv(&req, surface);
+	req.alpha = view->alpha < 1.0;
+
+	if (eotf != EOTF_TRADITIONAL_GAMMA_SDR ||
+	    output->eotf != EOTF_TRADITIONAL_GAMMA_SDR ||
+	    !colorspace_primaries_equal(src, dst)) {
+		req.hdr = 1;
+		req.eotf = eotf;
+		req.src_colorspace = src;
+		req.dst_colorspace = dst;
+		req.dst_eotf = output->eotf;
+	}
+
+	return gl_renderer_get_shader(gr, &req);
 }
 
 static void
-shader_release(struct gl_shader *shader)
+hdr_shader_uniforms(struct gl_shader *shader,
+		    struct weston_surface *surface,
+		    struct weston_output *output)
 {
-	glDeleteShader(shader->vertex_shader);
-	glDeleteShader(shader->fragment_shader);
-	glDeleteProgram(shader->program);
+	struct weston_hdr_metadata *md = surface->hdr_metadata;
+	float dst_peak = output_peak_luminance(output);
+	float ref_white, src_peak, src_scale;
+	float exposure = 1.0f;
+	uint16_t max_cll = 0, max_fall = 0, max_lum = 0;
+
+	if (shader->hdr_src_scale_uniform < 0)
+		return;
+
+	if (md && md->metadata_type == HDR_METADATA_TYPE1) {
+		max_cll = md->metadata.static_metadata.max_cll;
+		max_fall = md->metadata.static_metadata.max_fall;
+		max_lum = md->metadata.static_metadata.max_luminance;
+	}
+
+	ref_white = output->eotf == EOTF_TRADITIONAL_GAMMA_SDR ?
+		    HDR_SDR_WHITE : HDR_REFERENCE_WHITE;
 
-	shader->vertex_shader = 0;
-	shader->fragment_shader = 0;
-	shader->program = 0;
+	switch (weston_surface_get_eotf(surface)) {
+	case EOTF_ST2084:
+		src_scale = HDR_PQ_PEAK;
+		src_peak = max_cll ? max_cll :
+			   max_lum ? max_lum : HDR_DEFAULT_PEAK;
+		break;
+	case EOTF_HLG:
+		src_scale = HDR_HLG_PEAK;
+		src_peak = max_cll ? max_cll : HDR_HLG_PEAK;
+		break;
+	default:
+		src_scale = ref_white;
+		src_peak = ref_white;
+		break;
+	}
+
+	/* Content whose average light level exceeds the output's reference
+	 * white would look washed out after peak compression alone, so
+	 * expose it down to keep the frame average at reference white.
+	 */
+	if (max_fall > ref_white)
+		exposure = ref_white / max_fall;
+
+	glUniform1f(shader->hdr_src_scale_uniform,
+		    src_scale * exposure / dst_peak);
+	glUniform1f(shader->hdr_src_white_uniform,
+		    src_peak * exposure / dst_peak);
+	glUniform1f(shader->hdr_dst_scale_uniform,
+		    dst_peak / (output->eotf == EOTF_HLG ?
+				HDR_HLG_PEAK : HDR_PQ_PEAK));
 }
 
 static void
@@ -2941,9 +4618,9 @@ match_config_to_visual(EGLDisplay egl_display,
 }
 
 static int
-egl_choose_config(struct gl_renderer *gr, const EGLint *attribs,
-		  const EGLint *visual_id, const int n_ids,
-		  EGLConfig *config_out)
+egl_choose_config_from(struct gl_renderer *gr, const EGLint *attribs,
+		       const EGLint *visual_id, const int n_ids,
+		       EGLConfig *config_out)
 {
 	EGLint count = 0;
 	EGLint matched = 0;
@@ -2988,6 +4665,58 @@ out:
 	return 0;
 }
 
+/* Copy of attribs that also asks for a depth buffer */
+static EGLint *
+config_attribs_add_depth(const EGLint *attribs)
+{
+	EGLint *out;
+	int i, n = 0, len = 0;
+
+	while (attribs && attribs[len] != EGL_NONE)
+		len += 2;
+
+	out = calloc(len + 3, sizeof *out);
+	if (!out)
+		return NULL;
+
+	for (i = 0; i < len; i += 2) {
+		if (attribs[i] == EGL_DEPTH_SIZE)
+			continue;
+		out[n++] = attribs[i];
+		out[n++] = attribs[i + 1];
+	}
+	out[n++] = EGL_DEPTH_SIZE;
+	out[n++] = 16;
+	out[n] = EGL_NONE;
+
+	return out;
+}
+
+static int
+egl_choose_config(struct gl_renderer *gr, const EGLint *attribs,
+		  const EGLint *visual_id, const int n_ids,
+		  EGLConfig *config_out)
+{
+	EGLint *depth_attribs;
+	int ret;
+
+	/* Outputs without a depth buffer get drawn back to front */
+	if (gr->front_to_back) {
+		depth_attribs = config_attribs_add_depth(attribs);
+		if (depth_attribs) {
+			ret = egl_choose_config_from(gr, depth_attribs,
+						     visual_id, n_ids,
+						     config_out);
+			free(depth_attribs);
+			if (ret == 0)
+				return 0;
+		}
+	}
+
+	return egl_choose_config_from(gr, attribs, visual_id, n_ids,
+				      config_out);
+}
+
 static void
 gl_renderer_output_set_border(struct weston_output *output,
 			      enum gl_renderer_border_side side,
@@ -3074,9 +4803,12 @@ gl_renderer_output_create(struct weston_output *output,
 		pixman_region32_init(&go->buffer_damage[i]);
 
 	wl_list_init(&go->timeline_render_point_list);
+	wl_list_init(&go->readbacks);
+	wl_list_init(&go->free_readbacks);
 
 	go->begin_render_sync = EGL_NO_SYNC_KHR;
 	go->end_render_sync = EGL_NO_SYNC_KHR;
+	go->depth_bits = -1;
 
 	output->renderer_state = go;
 
@@ -3119,11 +4851,22 @@ gl_renderer_output_destroy(struct weston_output *output)
 	struct gl_renderer *gr = get_renderer(output->compositor);
 	struct gl_output_state *go = get_output_state(output);
 	struct timeline_render_point *trp, *tmp;
+	struct gl_readback *rb, *rb_tmp;
 	int i;
 
 	for (i = 0; i < 2; i++)
 		pixman_region32_fini(&go->buffer_damage[i]);
 
+	/* Hand out pending reads while the surface is still there */
+	while (!wl_list_empty(&go->readbacks))
+		gl_readback_complete(container_of(go->readbacks.next,
+						  struct gl_readback, link));
+
+	wl_list_for_each_safe(rb, rb_tmp, &go->free_readbacks, link) {
+		glDeleteBuffers(1, &rb->pbo);
+		free(rb);
+	}
+
 	eglMakeCurrent(gr->egl_display,
 		       EGL_NO_SURFACE, EGL_NO_SURFACE,
 		       EGL_NO_CONTEXT);
@@ -3173,6 +4916,7 @@ gl_renderer_destroy(struct weston_compositor *ec)
 {
 	struct gl_renderer *gr = get_renderer(ec);
 	struct dmabuf_image *image, *next;
+	struct gl_shader *shader, *shader_next;
 
 	wl_signal_emit(&gr->destroy_signal, gr);
 
@@ -3188,6 +4932,10 @@ gl_renderer_destroy(struct weston_compositor *ec)
 	wl_list_for_each_safe(image, next, &gr->dmabuf_images, link)
 		dmabuf_image_destroy(image);
 
+	wl_list_for_each_safe(shader, shader_next, &gr->shader_list, link)
+		shader_destroy(shader);
+	program_cache_release(gr);
+
 	if (gr->dummy_surface != EGL_NO_SURFACE)
 		weston_platform_destroy_egl_surface(gr->egl_display,
 						    gr->dummy_surface);
@@ -3199,6 +4947,9 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->occluders);
+	wl_array_release(&gr->spans);
+	wl_array_release(&gr->indices);
 
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
@@ -3474,6 +5225,17 @@ gl_renderer_create_pbuffer_surface(struct gl_renderer *gr) {
 	return 0;
 }
 
+/* WESTON_GL_FRONT_TO_BACK=1 draws opaque regions front to back, see
+ * repaint_views_front_to_back() */
+static bool
+front_to_back_enabled(void)
+{
+	const char *str = getenv("WESTON_GL_FRONT_TO_BACK");
+	int32_t value;
+
+	return str && safe_strtoint(str, &value) && value > 0;
+}
+
 static int
 gl_renderer_display_create(struct weston_compositor *ec, EGLenum platform,
 	void *native_window, const EGLint *platform_attribs,
@@ -3495,15 +5257,18 @@ gl_renderer_display_create(struct weston_compositor *ec, EGLenum platform,
 		return -1;
 
 	gr->base.read_pixels = gl_renderer_read_pixels;
+	gr->base.read_pixels_async = gl_renderer_read_pixels_async;
 	gr->base.repaint_output = gl_renderer_repaint_output;
 	gr->base.flush_damage = gl_renderer_flush_damage;
 	gr->base.attach = gl_renderer_attach;
 	gr->base.surface_set_color = gl_renderer_surface_set_color;
 	gr->base.destroy = gl_renderer_destroy;
+	gr->compositor = ec;
 	gr->base.surface_get_content_size =
 		gl_renderer_surface_get_content_size;
 	gr->base.surface_copy_content = gl_renderer_surface_copy_content;
 	gr->egl_display = NULL;
+	gr->front_to_back = front_to_back_enabled();
 
 	/* extension_suffix is supported */
 	if (supports) {
@@ -3557,6 +5322,8 @@ gl_renderer_display_create(struct weston_compositor *ec, EGLenum platform,
 		goto fail_with_error;
 
 	wl_list_init(&gr->dmabuf_images);
+	wl_list_init(&gr->shader_list);
+	wl_list_init(&gr->program_binaries);
 	if (gr->has_dmabuf_import) {
 		gr->base.import_dmabuf = gl_renderer_import_dmabuf;
 		gr->base.query_dmabuf_formats =
@@ -3607,38 +5374,6 @@ gl_renderer_display(struct weston_compositor *ec)
 	return get_renderer(ec)->egl_display;
 }
 
-static int
-compile_shaders(struct weston_compositor *ec)
-{
-	struct gl_renderer *gr = get_renderer(ec);
-
-	gr->texture_shader_rgba.vertex_source = vertex_shader;
-	gr->texture_shader_rgba.fragment_source = texture_fragment_shader_rgba;
-
-	gr->texture_shader_rgbx.vertex_source = vertex_shader;
-	gr->texture_shader_rgbx.fragment_source = texture_fragment_shader_rgbx;
-
-	gr->texture_shader_egl_external.vertex_source = vertex_shader;
-	gr->texture_shader_egl_external.fragment_source =
-		texture_fragment_shader_egl_external;
-
-	gr->texture_shader_y_uv.vertex_source = vertex_shader;
-	gr->texture_shader_y_uv.fragment_source = texture_fragment_shader_y_uv;
-
-	gr->texture_shader_y_u_v.vertex_source = vertex_shader;
-	gr->texture_shader_y_u_v.fragment_source =
-		texture_fragment_shader_y_u_v;
-
-	gr->texture_shader_y_xuxv.vertex_source = vertex_shader;
-	gr->texture_shader_y_xuxv.fragment_source =
-		texture_fragment_shader_y_xuxv;
-
-	gr->solid_shader.vertex_source = vertex_shader;
-	gr->solid_shader.fragment_source = solid_fragment_shader;
-
-	return 0;
-}
-
 static void
 fragment_debug_binding(struct weston_keyboard *keyboard,
 		       const struct timespec *time,
@@ -3648,20 +5383,10 @@ fragment_debug_binding(struct weston_keyboard *keyboard,
 	struct gl_renderer *gr = get_renderer(ec);
 	struct weston_output *output;
 
+	/* The tinted programs are separate cache entries, so toggling
+	 * back does not recompile anything. */
 	gr->fragment_shader_debug ^= 1;
 
-	shader_release(&gr->texture_shader_rgba);
-	shader_release(&gr->texture_shader_rgbx);
-	shader_release(&gr->texture_shader_egl_external);
-	shader_release(&gr->texture_shader_y_uv);
-	shader_release(&gr->texture_shader_y_u_v);
-	shader_release(&gr->texture_shader_y_xuxv);
-	shader_release(&gr->solid_shader);
-
-	/* Force use_shader() to call glUseProgram(), since we need to use
-	 * the recompiled version of the shader. */
-	gr->current_shader = NULL;
-
 	wl_list_for_each(output, &ec->output_list, link)
 		weston_output_damage(output);
 }
@@ -3807,13 +5532,33 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	    weston_check_egl_extension(extensions, "GL_EXT_texture_rg"))
 		gr->has_gl_texture_rg = 1;
 
+	if (gr->gl_version >= GR_GL_VERSION(3, 0)) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->unmap_buffer = (void *) eglGetProcAddress("glUnmapBuffer");
+		gr->has_pack_buffer = gr->map_buffer_range && gr->unmap_buffer;
+	}
+
 	if (weston_check_egl_extension(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = 1;
 
+	if (weston_check_egl_extension(extensions,
+				       "GL_OES_get_program_binary")) {
+		GLint formats = 0;
+
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+		gr->get_program_binary =
+			(void *) eglGetProcAddress("glGetProgramBinaryOES");
+		gr->program_binary =
+			(void *) eglGetProcAddress("glProgramBinaryOES");
+		gr->has_program_binary = formats > 0 &&
+					 gr->get_program_binary &&
+					 gr->program_binary;
+	}
+
 	glActiveTexture(GL_TEXTURE0);
 
-	if (compile_shaders(ec))
-		return -1;
+	program_cache_init(gr);
 
 	gr->fragment_binding =
 		weston_compositor_add_debug_binding(ec, KEY_S,
@@ -3835,6 +5580,10 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 			    gr->has_unpack_subimage ? "yes" : "no");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
+	weston_log_continue(STAMP_SPACE "program binary cache: %s\n",
+			    gr->program_cache_path ?: "no");
+	weston_log_continue(STAMP_SPACE "front-to-back opaque drawing: %s\n",
+			    gr->front_to_back ? "yes" : "no");
 
 
 	return 0;
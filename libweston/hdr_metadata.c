@@ -192,6 +192,30 @@ bind_hdr_metadata(struct wl_client *client,
 				       NULL, NULL);
 }
 
+/** Get the transfer function of the content a surface last committed
+ *
+ * \param surface The surface to query.
+ * \return The EOTF from the committed HDR metadata, or
+ * EOTF_TRADITIONAL_GAMMA_SDR for surfaces which have none.
+ */
+WL_EXPORT enum hdr_metadata_eotf
+weston_surface_get_eotf(struct weston_surface *surface)
+{
+	struct weston_hdr_metadata *md = surface->hdr_metadata;
+
+	if (!md || md->metadata_type != HDR_METADATA_TYPE1)
+		return EOTF_TRADITIONAL_GAMMA_SDR;
+
+	switch (md->metadata.static_metadata.eotf) {
+	case EOTF_ST2084:
+		return EOTF_ST2084;
+	case EOTF_HLG:
+		return EOTF_HLG;
+	default:
+		return EOTF_TRADITIONAL_GAMMA_SDR;
+	}
+}
+
 WL_EXPORT int
 weston_hdr_metadata_setup(struct weston_compositor *compositor)
 {
@@ -576,6 +576,23 @@ weston_pointer_has_focus_resource(struct weston_pointer *pointer)
 	return true;
 }
 
+/** Check if the client with pointer focus wants every motion event.
+ *
+ * \param pointer The pointer to check.
+ * \return Whether backends should not coalesce the pointer motion
+ *
+ * Clients listening for relative motion, games mostly, get the full
+ * stream even when backends merge motion events otherwise.
+ */
+WL_EXPORT bool
+weston_pointer_wants_motion_stream(struct weston_pointer *pointer)
+{
+	if (!pointer->focus_client)
+		return false;
+
+	return !wl_list_empty(&pointer->focus_client->relative_pointer_resources);
+}
+
 /** Send wl_pointer.button events to focused resources.
  *
  * \param pointer The pointer where the button events originates from.
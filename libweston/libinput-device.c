@@ -40,9 +40,26 @@
 
 #include "compositor.h"
 #include "libinput-device.h"
+#include "libinput-seat.h"
 #include "shared/helpers.h"
 #include "shared/timespec-util.h"
 
+/* libinput is driven from the input thread, if there is one, so calls
+ * made from elsewhere than event processing need the lock */
+static void
+evdev_device_lock(struct evdev_device *device)
+{
+	if (device->input)
+		udev_input_lock(device->input);
+}
+
+static void
+evdev_device_unlock(struct evdev_device *device)
+{
+	if (device->input)
+		udev_input_unlock(device->input);
+}
+
 void
 evdev_led_update(struct evdev_device *device, enum weston_led weston_leds)
 {
@@ -55,7 +72,9 @@ evdev_led_update(struct evdev_device *device, enum weston_led weston_leds)
 	if (weston_leds & LED_SCROLL_LOCK)
 		leds |= LIBINPUT_LED_SCROLL_LOCK;
 
+	evdev_device_lock(device);
 	libinput_device_led_update(device->device, leds);
+	evdev_device_unlock(device);
 }
 
 static void
@@ -85,6 +104,17 @@ handle_keyboard_key(struct libinput_device *libinput_device,
 		   key_state, STATE_UPDATE_AUTOMATIC);
 }
 
+static bool
+pointer_motion_coalesces(struct evdev_device *device)
+{
+	struct weston_pointer *pointer = weston_seat_get_pointer(device->seat);
+
+	if (!device->seat->compositor->coalesce_pointer_motion)
+		return false;
+
+	return pointer && !weston_pointer_wants_motion_stream(pointer);
+}
+
 static bool
 handle_pointer_motion(struct libinput_device *libinput_device,
 		      struct libinput_event_pointer *pointer_event)
@@ -110,9 +140,42 @@ handle_pointer_motion(struct libinput_device *libinput_device,
 		.dy_unaccel = dy_unaccel,
 	};
 
-	notify_motion(device->seat, &time, &event);
+	if (!pointer_motion_coalesces(device)) {
+		evdev_device_flush_motion(device);
+		notify_motion(device->seat, &time, &event);
+		return true;
+	}
 
-	return true;
+	/* The sums stay exact for relative pointer clients */
+	if (device->motion_pending) {
+		device->pending_motion.time = event.time;
+		device->pending_motion.dx += event.dx;
+		device->pending_motion.dy += event.dy;
+		device->pending_motion.dx_unaccel += event.dx_unaccel;
+		device->pending_motion.dy_unaccel += event.dy_unaccel;
+	} else {
+		device->pending_motion = event;
+		device->motion_pending = true;
+	}
+
+	return false;
+}
+
+/** Send the relative motion coalesced so far
+ *
+ * The motion is sent as a single event, with the time of the last one
+ * merged, so that the pointer moves and picks a view only once.
+ */
+void
+evdev_device_flush_motion(struct evdev_device *device)
+{
+	if (!device->motion_pending)
+		return;
+
+	device->motion_pending = false;
+	notify_motion(device->seat, &device->pending_motion.time,
+		      &device->pending_motion);
+	notify_pointer_frame(device->seat);
 }
 
 static bool
@@ -336,8 +399,10 @@ touch_get_calibration(struct weston_touch_device *device,
 {
 	struct evdev_device *evdev_device = device->backend_data;
 
+	evdev_device_lock(evdev_device);
 	libinput_device_config_calibration_get_matrix(evdev_device->device,
 						      cal->m);
+	evdev_device_unlock(evdev_device);
 }
 
 static void
@@ -370,7 +435,9 @@ touch_set_calibration(struct weston_touch_device *device,
 	 */
 	evdev_device->override_wl_calibration = true;
 
+	evdev_device_lock(evdev_device);
 	do_set_calibration(evdev_device, cal);
+	evdev_device_unlock(evdev_device);
 }
 
 static const struct weston_touch_device_ops touch_calibration_ops = {
@@ -684,7 +751,10 @@ evdev_device_set_output(struct evdev_device *device,
 	device->output_destroy_listener.notify = notify_output_destroy;
 	wl_signal_add(&output->destroy_signal,
 		      &device->output_destroy_listener);
+
+	evdev_device_lock(device);
 	evdev_device_set_calibration(device);
+	evdev_device_unlock(device);
 }
 
 struct evdev_device *
@@ -35,6 +35,8 @@
 
 #include "compositor.h"
 
+struct udev_input;
+
 enum evdev_device_seat_capability {
 	EVDEV_SEAT_POINTER = (1 << 0),
 	EVDEV_SEAT_KEYBOARD = (1 << 1),
@@ -52,6 +54,12 @@ struct evdev_device {
 	char *output_name;
 	int fd;
 	bool override_wl_calibration;
+	/* Locked around libinput calls made outside event processing */
+	struct udev_input *input;
+
+	/* Relative motion not sent yet, see evdev_device_flush_motion() */
+	struct weston_pointer_motion_event pending_motion;
+	bool motion_pending;
 };
 
 void
@@ -64,6 +72,9 @@ evdev_device_create(struct libinput_device *libinput_device,
 int
 evdev_device_process_event(struct libinput_event *event);
 
+void
+evdev_device_flush_motion(struct evdev_device *device);
+
 void
 evdev_device_set_output(struct evdev_device *device,
 			struct weston_output *output);
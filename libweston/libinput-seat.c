@@ -26,11 +26,15 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
 #include <libinput.h>
 #include <libudev.h>
 
@@ -42,6 +46,8 @@
 
 static void
 process_events(struct udev_input *input);
+static void
+udev_input_stop_thread(struct udev_input *input);
 static struct udev_seat *
 udev_seat_create(struct udev_input *input, const char *seat_name);
 static void
@@ -107,6 +113,7 @@ device_added(struct udev_input *input, struct libinput_device *libinput_device)
 	device = evdev_device_create(libinput_device, seat);
 	if (device == NULL)
 		return;
+	device->input = input;
 
 	if (input->configure_device != NULL)
 		input->configure_device(c, device->device);
@@ -161,8 +168,12 @@ udev_input_disable(struct udev_input *input)
 	if (input->suspended)
 		return;
 
-	wl_event_source_remove(input->libinput_source);
-	input->libinput_source = NULL;
+	if (input->libinput_source) {
+		wl_event_source_remove(input->libinput_source);
+		input->libinput_source = NULL;
+	}
+	udev_input_stop_thread(input);
+
 	libinput_suspend(input->libinput);
 	process_events(input);
 	input->suspended = 1;
@@ -192,12 +203,38 @@ udev_input_process_event(struct libinput_event *event)
 }
 
 static void
-process_event(struct libinput_event *event)
+flush_motion(struct udev_input *input)
 {
+	if (!input->motion_device)
+		return;
+
+	evdev_device_flush_motion(input->motion_device);
+	input->motion_device = NULL;
+}
+
+static void
+process_event(struct udev_input *input, struct libinput_event *event)
+{
+	struct libinput_device *libinput_device;
+	struct evdev_device *device;
+
+	/* Coalesced motion goes out before any other event, so that
+	 * nothing is reordered */
+	libinput_device = libinput_event_get_device(event);
+	if (input->motion_device &&
+	    (libinput_event_get_type(event) != LIBINPUT_EVENT_POINTER_MOTION ||
+	     input->motion_device->device != libinput_device))
+		flush_motion(input);
+
 	if (udev_input_process_event(event))
 		return;
-	if (evdev_device_process_event(event))
+
+	if (evdev_device_process_event(event)) {
+		device = libinput_device_get_user_data(libinput_device);
+		if (device && device->motion_pending)
+			input->motion_device = device;
 		return;
+	}
 }
 
 static void
@@ -206,9 +243,303 @@ process_events(struct udev_input *input)
 	struct libinput_event *event;
 
 	while ((event = libinput_get_event(input->libinput))) {
-		process_event(event);
+		process_event(input, event);
 		libinput_event_destroy(event);
 	}
+
+	flush_motion(input);
+}
+
+/* Runs the launcher request the input thread is waiting on, if any.
+ * Called on the compositor thread with request_mutex held. */
+static void
+serve_request(struct udev_input *input)
+{
+	struct udev_input_request *request = input->request;
+	struct weston_launcher *launcher = input->compositor->launcher;
+
+	if (!request)
+		return;
+
+	if (request->open)
+		request->fd = weston_launcher_open(launcher, request->path,
+						   request->flags);
+	else
+		weston_launcher_close(launcher, request->fd);
+
+	request->done = true;
+	input->request = NULL;
+	pthread_cond_broadcast(&input->request_cond);
+}
+
+/* Called on the input thread, with libinput locked. The compositor
+ * thread serves the request from its event loop, or while it waits for
+ * the lock or for the thread to exit, so this cannot dead-lock. */
+static void
+run_request(struct udev_input *input, struct udev_input_request *request)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&input->request_mutex);
+	input->request = request;
+	pthread_cond_broadcast(&input->request_cond);
+	(void) !write(input->event_fd, &one, sizeof one);
+	while (!request->done)
+		pthread_cond_wait(&input->request_cond, &input->request_mutex);
+	pthread_mutex_unlock(&input->request_mutex);
+}
+
+/* Writes out what libinput logged on the input thread */
+static void
+flush_log(struct udev_input *input)
+{
+	struct udev_input_log *entry, *next;
+	struct wl_list list;
+
+	wl_list_init(&list);
+	pthread_mutex_lock(&input->request_mutex);
+	wl_list_insert_list(&list, &input->log_list);
+	wl_list_init(&input->log_list);
+	pthread_mutex_unlock(&input->request_mutex);
+
+	wl_list_for_each_safe(entry, next, &list, link) {
+		weston_log("%s", entry->message);
+		free(entry->message);
+		free(entry);
+	}
+}
+
+void
+udev_input_lock(struct udev_input *input)
+{
+	if (!input->thread_running) {
+		pthread_mutex_lock(&input->libinput_lock);
+		return;
+	}
+
+	/* The input thread may hold the lock while it waits for us to
+	 * open or close a device */
+	pthread_mutex_lock(&input->request_mutex);
+	while (pthread_mutex_trylock(&input->libinput_lock) != 0) {
+		if (input->request)
+			serve_request(input);
+		else
+			pthread_cond_wait(&input->request_cond,
+					  &input->request_mutex);
+	}
+	pthread_mutex_unlock(&input->request_mutex);
+}
+
+void
+udev_input_unlock(struct udev_input *input)
+{
+	pthread_mutex_unlock(&input->libinput_lock);
+}
+
+/* Processes what the input thread queued, then gives the events back
+ * to libinput. libinput is locked throughout, the input thread only
+ * gets to dispatch in between. */
+static void
+process_queued_events(struct udev_input *input)
+{
+	uint32_t head, tail, i;
+	uint64_t one = 1;
+
+	tail = input->queue_tail;
+	head = __atomic_load_n(&input->queue_head, __ATOMIC_ACQUIRE);
+
+	udev_input_lock(input);
+	for (i = tail; i != head; i++)
+		process_event(input, input->queue[i % UDEV_INPUT_QUEUE_SIZE]);
+	flush_motion(input);
+
+	for (i = tail; i != head; i++)
+		libinput_event_destroy(input->queue[i % UDEV_INPUT_QUEUE_SIZE]);
+	udev_input_unlock(input);
+
+	__atomic_store_n(&input->queue_tail, head, __ATOMIC_SEQ_CST);
+
+	if (__atomic_exchange_n(&input->stalled, false, __ATOMIC_SEQ_CST) &&
+	    write(input->thread_fd, &one, sizeof one) < 0)
+		weston_log("libinput: failed to wake the input thread\n");
+}
+
+/* Moves events from libinput to the queue, until libinput has no more
+ * or the compositor has not made room in the queue */
+static void
+input_thread_dispatch(struct udev_input *input)
+{
+	struct libinput_event *event;
+	uint32_t head, tail;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&input->libinput_lock);
+
+	libinput_dispatch(input->libinput);
+
+	head = input->queue_head;
+	for (;;) {
+		tail = __atomic_load_n(&input->queue_tail, __ATOMIC_SEQ_CST);
+		while (head - tail < UDEV_INPUT_QUEUE_SIZE &&
+		       (event = libinput_get_event(input->libinput)))
+			input->queue[head++ % UDEV_INPUT_QUEUE_SIZE] = event;
+
+		if (libinput_next_event_type(input->libinput) ==
+		    LIBINPUT_EVENT_NONE)
+			break;
+
+		/* The compositor wakes us up once it made room, unless it
+		 * did so before seeing the flag */
+		__atomic_store_n(&input->stalled, true, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&input->queue_tail, __ATOMIC_SEQ_CST) == tail)
+			break;
+		__atomic_store_n(&input->stalled, false, __ATOMIC_SEQ_CST);
+	}
+
+	pthread_mutex_unlock(&input->libinput_lock);
+
+	/* The compositor may be waiting for the lock */
+	pthread_mutex_lock(&input->request_mutex);
+	pthread_cond_broadcast(&input->request_cond);
+	pthread_mutex_unlock(&input->request_mutex);
+
+	if (head != input->queue_head) {
+		__atomic_store_n(&input->queue_head, head, __ATOMIC_RELEASE);
+		/* Nothing to do if the counter is already non-zero */
+		(void) !write(input->event_fd, &one, sizeof one);
+	}
+}
+
+static void *
+input_thread_main(void *data)
+{
+	struct udev_input *input = data;
+	struct pollfd fds[2];
+	uint64_t count;
+
+	fds[0].fd = libinput_get_fd(input->libinput);
+	fds[0].events = POLLIN;
+	fds[1].fd = input->thread_fd;
+	fds[1].events = POLLIN;
+
+	while (!__atomic_load_n(&input->quit, __ATOMIC_ACQUIRE)) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents & POLLIN)
+			(void) !read(input->thread_fd, &count, sizeof count);
+
+		if (__atomic_load_n(&input->quit, __ATOMIC_ACQUIRE))
+			break;
+
+		input_thread_dispatch(input);
+	}
+
+	pthread_mutex_lock(&input->request_mutex);
+	input->thread_exited = true;
+	pthread_cond_broadcast(&input->request_cond);
+	pthread_mutex_unlock(&input->request_mutex);
+
+	return NULL;
+}
+
+static int
+input_thread_events(int fd, uint32_t mask, void *data)
+{
+	struct udev_input *input = data;
+	uint64_t count;
+
+	(void) !read(fd, &count, sizeof count);
+
+	pthread_mutex_lock(&input->request_mutex);
+	serve_request(input);
+	pthread_mutex_unlock(&input->request_mutex);
+
+	flush_log(input);
+	process_queued_events(input);
+
+	return 0;
+}
+
+static int
+udev_input_start_thread(struct udev_input *input)
+{
+	struct wl_event_loop *loop;
+
+	input->thread_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	input->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (input->thread_fd < 0 || input->event_fd < 0)
+		goto err_fds;
+
+	loop = wl_display_get_event_loop(input->compositor->wl_display);
+	input->event_source =
+		wl_event_loop_add_fd(loop, input->event_fd, WL_EVENT_READABLE,
+				     input_thread_events, input);
+	if (!input->event_source)
+		goto err_fds;
+
+	input->queue_head = 0;
+	input->queue_tail = 0;
+	input->quit = false;
+	input->stalled = false;
+	input->thread_exited = false;
+	if (pthread_create(&input->thread, NULL, input_thread_main, input) != 0)
+		goto err_source;
+
+	input->thread_running = true;
+
+	return 0;
+
+err_source:
+	wl_event_source_remove(input->event_source);
+	input->event_source = NULL;
+err_fds:
+	if (input->thread_fd >= 0)
+		close(input->thread_fd);
+	if (input->event_fd >= 0)
+		close(input->event_fd);
+	weston_log("libinput: failed to start the input thread\n");
+	return -1;
+}
+
+static void
+udev_input_stop_thread(struct udev_input *input)
+{
+	uint64_t one = 1;
+
+	if (!input->thread_running)
+		return;
+
+	__atomic_store_n(&input->quit, true, __ATOMIC_RELEASE);
+	if (write(input->thread_fd, &one, sizeof one) < 0)
+		weston_log("libinput: failed to wake the input thread\n");
+
+	/* Serve the thread until it is out of libinput_dispatch() */
+	pthread_mutex_lock(&input->request_mutex);
+	while (!input->thread_exited) {
+		if (input->request)
+			serve_request(input);
+		else
+			pthread_cond_wait(&input->request_cond,
+					  &input->request_mutex);
+	}
+	pthread_mutex_unlock(&input->request_mutex);
+
+	pthread_join(input->thread, NULL);
+	input->thread_running = false;
+
+	flush_log(input);
+
+	/* What is still in libinput is for the caller to process */
+	process_queued_events(input);
+
+	wl_event_source_remove(input->event_source);
+	input->event_source = NULL;
+	close(input->thread_fd);
+	close(input->event_fd);
 }
 
 static int
@@ -235,8 +566,20 @@ open_restricted(const char *path, int flags, void *user_data)
 {
 	struct udev_input *input = user_data;
 	struct weston_launcher *launcher = input->compositor->launcher;
+	struct udev_input_request request = {
+		.open = true,
+		.path = path,
+		.flags = flags,
+		.fd = -1,
+	};
 
-	return weston_launcher_open(launcher, path, flags);
+	/* The launcher belongs to the compositor thread */
+	if (pthread_equal(pthread_self(), input->main_thread))
+		return weston_launcher_open(launcher, path, flags);
+
+	run_request(input, &request);
+
+	return request.fd;
 }
 
 static void
@@ -244,8 +587,17 @@ close_restricted(int fd, void *user_data)
 {
 	struct udev_input *input = user_data;
 	struct weston_launcher *launcher = input->compositor->launcher;
+	struct udev_input_request request = {
+		.open = false,
+		.fd = fd,
+	};
 
-	weston_launcher_close(launcher, fd);
+	if (pthread_equal(pthread_self(), input->main_thread)) {
+		weston_launcher_close(launcher, fd);
+		return;
+	}
+
+	run_request(input, &request);
 }
 
 const struct libinput_interface libinput_interface = {
@@ -262,18 +614,21 @@ udev_input_enable(struct udev_input *input)
 	struct udev_seat *seat;
 	int devices_found = 0;
 
-	loop = wl_display_get_event_loop(c->wl_display);
-	fd = libinput_get_fd(input->libinput);
-	input->libinput_source =
-		wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
-				     libinput_source_dispatch, input);
-	if (!input->libinput_source) {
-		return -1;
+	if (!input->threaded) {
+		loop = wl_display_get_event_loop(c->wl_display);
+		fd = libinput_get_fd(input->libinput);
+		input->libinput_source =
+			wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE,
+					     libinput_source_dispatch, input);
+		if (!input->libinput_source) {
+			return -1;
+		}
 	}
 
 	if (input->suspended) {
 		if (libinput_resume(input->libinput) != 0) {
-			wl_event_source_remove(input->libinput_source);
+			if (input->libinput_source)
+				wl_event_source_remove(input->libinput_source);
 			input->libinput_source = NULL;
 			return -1;
 		}
@@ -281,6 +636,9 @@ udev_input_enable(struct udev_input *input)
 		process_events(input);
 	}
 
+	if (input->threaded && udev_input_start_thread(input) < 0)
+		return -1;
+
 	wl_list_for_each(seat, &input->compositor->seat_list, base.link) {
 		evdev_notify_keyboard_focus(&seat->base, &seat->devices_list);
 
@@ -313,7 +671,29 @@ libinput_log_func(struct libinput *libinput,
 		  enum libinput_log_priority priority,
 		  const char *format, va_list args)
 {
-	weston_vlog(format, args);
+	struct udev_input *input = libinput_get_user_data(libinput);
+	struct udev_input_log *entry;
+	uint64_t one = 1;
+
+	if (pthread_equal(pthread_self(), input->main_thread)) {
+		weston_vlog(format, args);
+		return;
+	}
+
+	/* Logging may reach debug streams, which are not thread-safe, so
+	 * the compositor writes it out */
+	entry = zalloc(sizeof *entry);
+	if (!entry)
+		return;
+	if (vasprintf(&entry->message, format, args) < 0) {
+		free(entry);
+		return;
+	}
+
+	pthread_mutex_lock(&input->request_mutex);
+	wl_list_insert(input->log_list.prev, &entry->link);
+	pthread_mutex_unlock(&input->request_mutex);
+	(void) !write(input->event_fd, &one, sizeof one);
 }
 
 int
@@ -323,13 +703,18 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 {
 	enum libinput_log_priority priority = LIBINPUT_LOG_PRIORITY_INFO;
 	const char *log_priority = NULL;
+	const char *threaded = NULL;
+	pthread_mutexattr_t attr;
 
 	memset(input, 0, sizeof *input);
 
 	input->compositor = c;
 	input->configure_device = configure_device;
+	input->main_thread = pthread_self();
 
 	log_priority = getenv("WESTON_LIBINPUT_LOG_PRIORITY");
+	threaded = getenv("WESTON_LIBINPUT_THREAD");
+	input->threaded = threaded && strcmp(threaded, "1") == 0;
 
 	input->libinput = libinput_udev_create_context(&libinput_interface,
 						       input, udev);
@@ -337,6 +722,14 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 		return -1;
 	}
 
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&input->libinput_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_mutex_init(&input->request_mutex, NULL);
+	pthread_cond_init(&input->request_cond, NULL);
+	wl_list_init(&input->log_list);
+
 	libinput_log_set_handler(input->libinput, &libinput_log_func);
 
 	if (log_priority) {
@@ -352,6 +745,9 @@ udev_input_init(struct udev_input *input, struct weston_compositor *c,
 	libinput_log_set_priority(input->libinput, priority);
 
 	if (libinput_udev_assign_seat(input->libinput, seat_id) != 0) {
+		pthread_cond_destroy(&input->request_cond);
+		pthread_mutex_destroy(&input->request_mutex);
+		pthread_mutex_destroy(&input->libinput_lock);
 		libinput_unref(input->libinput);
 		return -1;
 	}
@@ -368,9 +764,13 @@ udev_input_destroy(struct udev_input *input)
 
 	if (input->libinput_source)
 		wl_event_source_remove(input->libinput_source);
+	udev_input_stop_thread(input);
 	wl_list_for_each_safe(seat, next, &input->compositor->seat_list, base.link)
 		udev_seat_destroy(seat);
 	libinput_unref(input->libinput);
+	pthread_cond_destroy(&input->request_cond);
+	pthread_mutex_destroy(&input->request_mutex);
+	pthread_mutex_destroy(&input->libinput_lock);
 }
 
 static void
@@ -30,10 +30,13 @@
 #include "config.h"
 
 #include <libudev.h>
+#include <pthread.h>
+#include <stdbool.h>
 
 #include "compositor.h"
 
 struct libinput_device;
+struct evdev_device;
 
 struct udev_seat {
 	struct weston_seat base;
@@ -45,12 +48,58 @@ struct udev_seat {
 typedef void (*udev_configure_device_t)(struct weston_compositor *compositor,
 					struct libinput_device *device);
 
+/* A launcher call the input thread waits on the compositor for */
+struct udev_input_request {
+	bool open;
+	const char *path;
+	int flags;
+	int fd;
+	bool done;
+};
+
+struct udev_input_log {
+	struct wl_list link;
+	char *message;
+};
+
+/* Must be a power of two */
+#define UDEV_INPUT_QUEUE_SIZE 1024
+
 struct udev_input {
 	struct libinput *libinput;
 	struct wl_event_source *libinput_source;
 	struct weston_compositor *compositor;
 	int suspended;
 	udev_configure_device_t configure_device;
+	/* Holds coalesced pointer motion until the end of the dispatch */
+	struct evdev_device *motion_device;
+
+	/* Recursive, serializes libinput calls with the input thread */
+	pthread_mutex_t libinput_lock;
+
+	/* Input thread, enabled with WESTON_LIBINPUT_THREAD */
+	bool threaded;
+	bool thread_running;
+	pthread_t thread;
+	int thread_fd;		/* eventfd waking the input thread */
+	int event_fd;		/* eventfd waking the compositor */
+	struct wl_event_source *event_source;
+	bool quit;
+	bool stalled;		/* events left in libinput, queue full */
+
+	/* Events from the input thread, single producer single consumer */
+	struct libinput_event *queue[UDEV_INPUT_QUEUE_SIZE];
+	uint32_t queue_head;	/* only written by the input thread */
+	uint32_t queue_tail;	/* only written by the compositor */
+
+	/* Device open/close and logging from the input thread go through
+	 * the compositor thread, under request_mutex */
+	pthread_t main_thread;
+	pthread_mutex_t request_mutex;
+	pthread_cond_t request_cond;
+	struct udev_input_request *request;
+	struct wl_list log_list;
+	bool thread_exited;
 };
 
 int
@@ -66,6 +115,11 @@ udev_input_init(struct udev_input *input,
 void
 udev_input_destroy(struct udev_input *input);
 
+void
+udev_input_lock(struct udev_input *input);
+void
+udev_input_unlock(struct udev_input *input);
+
 struct udev_seat *
 udev_seat_get_named(struct udev_input *u,
 		    const char *seat_name);
@@ -31,9 +31,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "pixman-renderer.h"
 #include "shared/helpers.h"
+#include "shared/string-helpers.h"
 
 #include <linux/input.h>
 
@@ -55,6 +59,48 @@ struct pixman_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* Damage is split into square tiles of this many pixels a side when
+ * compositing on several threads. */
+#define PIXMAN_TILE_SIZE 128
+
+/* Upper bound for WESTON_PIXMAN_THREADS */
+#define PIXMAN_MAX_THREADS 64
+
+/** A composite operation recorded for replay on the worker threads
+ *
+ * The images are private to the operation or no longer modified once
+ * recorded, so the workers only ever read them.
+ */
+struct pixman_draw_op {
+	pixman_op_t op;
+	pixman_image_t *src;
+	pixman_image_t *mask;
+	struct wl_shm_buffer *shm_buffer;
+	pixman_region32_t clip; /* in output coordinates */
+};
+
+struct pixman_job {
+	pixman_image_t *target;
+	struct pixman_draw_op *ops;
+	int n_ops;
+	pixman_box32_t *tiles;
+	int n_tiles;
+	int next_tile;
+};
+
+struct pixman_worker_pool {
+	pthread_t *threads;
+	int n_threads;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct pixman_job *job;
+	uint32_t generation;
+	int busy;
+	bool stop;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -63,6 +109,13 @@ struct pixman_renderer {
 	struct weston_binding *debug_binding;
 
 	struct wl_signal destroy_signal;
+
+	/* NULL unless compositing is spread over several threads */
+	struct pixman_worker_pool *pool;
+	bool recording;
+	struct wl_array ops;
+	struct wl_array tiles;
+	pixman_image_t *scratch;
 };
 
 static inline struct pixman_output_state *
@@ -246,6 +299,56 @@ composite_whole(pixman_op_t op,
 				 dest_width, dest_height);
 }
 
+/** Wrap part of a source image with its own transform and filter
+ *
+ * \param src The source image, which must have its bits in memory.
+ * \param box The part of src to use, in source image coordinates.
+ * \param transform The view transform for the whole of src.
+ * \param filter The filter to sample with.
+ * \return A new image sharing the bits of src.
+ */
+static pixman_image_t *
+create_box_image(pixman_image_t *src, const pixman_box32_t *box,
+		 const pixman_transform_t *transform, pixman_filter_t filter)
+{
+	pixman_format_code_t src_format = pixman_image_get_format(src);
+	int src_stride = pixman_image_get_stride(src);
+	int bitspp = PIXMAN_FORMAT_BPP(src_format);
+	uint8_t *ptr = (uint8_t *) pixman_image_get_data(src);
+	pixman_image_t *boximg;
+	pixman_transform_t adj = *transform;
+
+	assert(src_format);
+
+	ptr += box->y1 * src_stride;
+	ptr += box->x1 * bitspp / 8;
+	boximg = pixman_image_create_bits_no_clear(src_format,
+						   box->x2 - box->x1,
+						   box->y2 - box->y1,
+						   (uint32_t *)ptr, src_stride);
+	if (!boximg)
+		return NULL;
+
+	pixman_transform_translate(&adj, NULL,
+				   pixman_int_to_fixed(-box->x1),
+				   pixman_int_to_fixed(-box->y1));
+	pixman_image_set_transform(boximg, &adj);
+	pixman_image_set_filter(boximg, filter, NULL, 0);
+
+	return boximg;
+}
+
+static void
+warn_overdraw(int n_box)
+{
+	static bool warned = false;
+
+	if (n_box > 1 && !warned) {
+		weston_log("Pixman-renderer warning: %dx overdraw\n", n_box);
+		warned = true;
+	}
+}
+
 static void
 composite_clipped(pixman_image_t *src,
 		  pixman_image_t *mask,
@@ -258,10 +361,6 @@ composite_clipped(pixman_image_t *src,
 	pixman_box32_t *boxes;
 	int32_t dest_width;
 	int32_t dest_height;
-	int src_stride;
-	int bitspp;
-	pixman_format_code_t src_format;
-	void *src_data;
 	int i;
 
 	/* Hardcoded to use PIXMAN_OP_OVER, because sampling outside of
@@ -271,33 +370,16 @@ composite_clipped(pixman_image_t *src,
 
 	dest_width = pixman_image_get_width(dest);
 	dest_height = pixman_image_get_height(dest);
-	src_format = pixman_image_get_format(src);
-	src_stride = pixman_image_get_stride(src);
-	bitspp = PIXMAN_FORMAT_BPP(src_format);
-	src_data = pixman_image_get_data(src);
-
-	assert(src_format);
 
 	/* This would be massive overdraw, except when n_box is 1. */
 	boxes = pixman_region32_rectangles(src_clip, &n_box);
 	for (i = 0; i < n_box; i++) {
-		uint8_t *ptr = src_data;
 		pixman_image_t *boximg;
-		pixman_transform_t adj = *transform;
-
-		ptr += boxes[i].y1 * src_stride;
-		ptr += boxes[i].x1 * bitspp / 8;
-		boximg = pixman_image_create_bits_no_clear(src_format,
-					boxes[i].x2 - boxes[i].x1,
-					boxes[i].y2 - boxes[i].y1,
-					(uint32_t *)ptr, src_stride);
 
-		pixman_transform_translate(&adj, NULL,
-					   pixman_int_to_fixed(-boxes[i].x1),
-					   pixman_int_to_fixed(-boxes[i].y1));
-		pixman_image_set_transform(boximg, &adj);
+		boximg = create_box_image(src, &boxes[i], transform, filter);
+		if (!boximg)
+			continue;
 
-		pixman_image_set_filter(boximg, filter, NULL, 0);
 		pixman_image_composite32(PIXMAN_OP_OVER, boximg, mask, dest,
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
@@ -307,14 +389,378 @@ composite_clipped(pixman_image_t *src,
 		pixman_image_unref(boximg);
 	}
 
-	if (n_box > 1) {
-		static bool warned = false;
+	warn_overdraw(n_box);
+}
 
-		if (!warned)
-			weston_log("Pixman-renderer warning: %dx overdraw\n",
-				   n_box);
-		warned = true;
+/** Record a composite operation for the worker threads
+ *
+ * \param pr The renderer, which must be recording.
+ * \param pixman_op Compositing operator.
+ * \param src Source image; the operation takes over this reference.
+ * \param mask Mask image or NULL; a new reference is taken.
+ * \param shm_buffer The buffer backing src, if any.
+ * \param clip The region to paint, in output coordinates.
+ */
+static void
+record_op(struct pixman_renderer *pr, pixman_op_t pixman_op,
+	  pixman_image_t *src, pixman_image_t *mask,
+	  struct wl_shm_buffer *shm_buffer, pixman_region32_t *clip)
+{
+	struct pixman_draw_op *op;
+
+	if (!src)
+		return;
+
+	op = wl_array_add(&pr->ops, sizeof *op);
+	if (!op) {
+		pixman_image_unref(src);
+		return;
+	}
+
+	op->op = pixman_op;
+	op->src = src;
+	op->mask = mask ? pixman_image_ref(mask) : NULL;
+	op->shm_buffer = shm_buffer;
+	pixman_region32_init(&op->clip);
+	pixman_region32_copy(&op->clip, clip);
+
+	/* Pixman validates images lazily, writing to them on their first
+	 * use after a change. Do that here with an empty composite, so the
+	 * workers sharing these images only ever read them. */
+	pixman_image_composite32(op->op, op->src, op->mask, pr->scratch,
+				 0, 0, 0, 0, 0, 0, 0, 0);
+}
+
+static void
+draw_op_run(struct pixman_draw_op *op, pixman_image_t *dest,
+	    pixman_region32_t *clip)
+{
+	pixman_box32_t *ext = pixman_region32_extents(clip);
+
+	pixman_image_set_clip_region32(dest, clip);
+
+	if (op->shm_buffer)
+		wl_shm_buffer_begin_access(op->shm_buffer);
+
+	/* Source and mask coordinates equal destination coordinates, as
+	 * when compositing the whole destination, so only the part under
+	 * the clip is touched. */
+	pixman_image_composite32(op->op, op->src, op->mask, dest,
+				 ext->x1, ext->y1, /* src_x, src_y */
+				 ext->x1, ext->y1, /* mask_x, mask_y */
+				 ext->x1, ext->y1, /* dest_x, dest_y */
+				 ext->x2 - ext->x1, ext->y2 - ext->y1);
+
+	if (op->shm_buffer)
+		wl_shm_buffer_end_access(op->shm_buffer);
+
+	pixman_image_set_clip_region32(dest, NULL);
+}
+
+static pixman_box32_t *
+job_next_tile(struct pixman_job *job, struct pixman_worker_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	i = job->next_tile++;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return i < job->n_tiles ? &job->tiles[i] : NULL;
+}
+
+/** Replay all operations of a job tile by tile, until no tiles are left
+ *
+ * \param job The job to work on.
+ * \param pool The pool handing out the tiles.
+ * \param dest The image to draw into, or NULL to create a private one
+ * sharing the bits of the job's target.
+ *
+ * Every tile is drawn by exactly one thread, front to back order being
+ * kept within the tile, so the result matches drawing on one thread.
+ */
+static void
+job_run(struct pixman_job *job, struct pixman_worker_pool *pool,
+	pixman_image_t *dest)
+{
+	pixman_image_t *image = dest;
+	pixman_region32_t clip;
+	pixman_box32_t *tile;
+	int i;
+
+	if (!image) {
+		/* The clip region lives in the image, so it can't be shared */
+		image = pixman_image_create_bits_no_clear(
+				pixman_image_get_format(job->target),
+				pixman_image_get_width(job->target),
+				pixman_image_get_height(job->target),
+				pixman_image_get_data(job->target),
+				pixman_image_get_stride(job->target));
+		if (!image)
+			return;
+	}
+
+	pixman_region32_init(&clip);
+	while ((tile = job_next_tile(job, pool))) {
+		for (i = 0; i < job->n_ops; i++) {
+			pixman_region32_intersect_rect(&clip,
+						       &job->ops[i].clip,
+						       tile->x1, tile->y1,
+						       tile->x2 - tile->x1,
+						       tile->y2 - tile->y1);
+			if (pixman_region32_not_empty(&clip))
+				draw_op_run(&job->ops[i], image, &clip);
+		}
+	}
+	pixman_region32_fini(&clip);
+
+	if (image != dest)
+		pixman_image_unref(image);
+}
+
+static void *
+worker_thread(void *data)
+{
+	struct pixman_worker_pool *pool = data;
+	struct pixman_job *job;
+	uint32_t generation = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->stop && pool->generation == generation)
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+		if (pool->stop)
+			break;
+
+		generation = pool->generation;
+		job = pool->job;
+		pthread_mutex_unlock(&pool->mutex);
+
+		job_run(job, pool, NULL);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+/** Run the recorded operations into target, split over the worker pool
+ *
+ * \param pr The renderer.
+ * \param target The image to draw into.
+ * \param region The region covered by the operations, in output
+ * coordinates.
+ *
+ * The recorded operations are released afterwards.
+ */
+static void
+pixman_renderer_run_ops(struct pixman_renderer *pr, pixman_image_t *target,
+			pixman_region32_t *region)
+{
+	struct pixman_worker_pool *pool = pr->pool;
+	struct pixman_draw_op *op;
+	pixman_box32_t *ext, box, *tile;
+	struct pixman_job job;
+
+	pr->tiles.size = 0;
+	ext = pixman_region32_extents(region);
+	for (box.y1 = ext->y1 - ext->y1 % PIXMAN_TILE_SIZE;
+	     box.y1 < ext->y2; box.y1 += PIXMAN_TILE_SIZE) {
+		box.y2 = MIN(box.y1 + PIXMAN_TILE_SIZE, ext->y2);
+		for (box.x1 = ext->x1 - ext->x1 % PIXMAN_TILE_SIZE;
+		     box.x1 < ext->x2; box.x1 += PIXMAN_TILE_SIZE) {
+			box.x2 = MIN(box.x1 + PIXMAN_TILE_SIZE, ext->x2);
+			if (pixman_region32_contains_rectangle(region, &box) ==
+			    PIXMAN_REGION_OUT)
+				continue;
+
+			tile = wl_array_add(&pr->tiles, sizeof *tile);
+			if (tile)
+				*tile = box;
+		}
+	}
+
+	job.target = target;
+	job.ops = pr->ops.data;
+	job.n_ops = pr->ops.size / sizeof *op;
+	job.tiles = pr->tiles.data;
+	job.n_tiles = pr->tiles.size / sizeof *tile;
+	job.next_tile = 0;
+
+	if (job.n_ops > 0 && job.n_tiles > 1) {
+		pthread_mutex_lock(&pool->mutex);
+		pool->job = &job;
+		pool->generation++;
+		pool->busy = pool->n_threads;
+		pthread_cond_broadcast(&pool->work_cond);
+		pthread_mutex_unlock(&pool->mutex);
+
+		job_run(&job, pool, target);
+
+		pthread_mutex_lock(&pool->mutex);
+		while (pool->busy > 0)
+			pthread_cond_wait(&pool->done_cond, &pool->mutex);
+		pool->job = NULL;
+		pthread_mutex_unlock(&pool->mutex);
+	} else if (job.n_ops > 0) {
+		job_run(&job, pool, target);
 	}
+
+	wl_array_for_each(op, &pr->ops) {
+		pixman_image_unref(op->src);
+		if (op->mask)
+			pixman_image_unref(op->mask);
+		pixman_region32_fini(&op->clip);
+	}
+	pr->ops.size = 0;
+}
+
+static void
+pixman_worker_pool_destroy(struct pixman_worker_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->n_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+static struct pixman_worker_pool *
+pixman_worker_pool_create(int n_threads)
+{
+	struct pixman_worker_pool *pool;
+	sigset_t set, old;
+	int i, ret = 0;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->threads = calloc(n_threads, sizeof *pool->threads);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	/* Leave the compositor's signals to the main loop; faults raised
+	 * while reading client buffers still reach the thread causing them
+	 * so wl_shm_buffer_begin_access() can deal with them. */
+	sigfillset(&set);
+	sigdelset(&set, SIGBUS);
+	sigdelset(&set, SIGSEGV);
+	sigdelset(&set, SIGFPE);
+	sigdelset(&set, SIGILL);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+
+	for (i = 0; i < n_threads; i++) {
+		ret = pthread_create(&pool->threads[i], NULL,
+				     worker_thread, pool);
+		if (ret != 0)
+			break;
+		pool->n_threads++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret != 0) {
+		weston_log("Pixman renderer: failed to start worker thread: "
+			   "%s\n", strerror(ret));
+		pixman_worker_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/** Record the operations painting an intersected region
+ *
+ * Like repaint_region(), but every operation gets a source image of its
+ * own instead of changing the transform of the surface's image.
+ */
+static void
+record_region(struct weston_view *ev, struct weston_output *output,
+	      pixman_region32_t *repaint_output,
+	      pixman_region32_t *source_clip, pixman_op_t pixman_op)
+{
+	struct pixman_renderer *pr =
+		(struct pixman_renderer *) output->compositor->renderer;
+	struct pixman_surface_state *ps = get_surface_state(ev->surface);
+	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
+	struct wl_shm_buffer *shm_buffer = NULL;
+	pixman_transform_t transform;
+	pixman_filter_t filter;
+	pixman_image_t *mask_image;
+	pixman_color_t mask = { 0, };
+	pixman_box32_t *boxes, whole;
+	pixman_image_t *src;
+	int n_box, i;
+
+	pixman_renderer_compute_transform(&transform, ev, output);
+
+	if (ev->transform.enabled || output->current_scale != vp->buffer.scale)
+		filter = PIXMAN_FILTER_BILINEAR;
+	else
+		filter = PIXMAN_FILTER_NEAREST;
+
+	if (ps->buffer_ref.buffer)
+		shm_buffer = ps->buffer_ref.buffer->shm_buffer;
+
+	if (ev->alpha < 1.0) {
+		mask.alpha = 0xffff * ev->alpha;
+		mask_image = pixman_image_create_solid_fill(&mask);
+	} else {
+		mask_image = NULL;
+	}
+
+	if (source_clip) {
+		boxes = pixman_region32_rectangles(source_clip, &n_box);
+		for (i = 0; i < n_box; i++) {
+			src = create_box_image(ps->image, &boxes[i],
+					       &transform, filter);
+			record_op(pr, PIXMAN_OP_OVER, src, mask_image,
+				  shm_buffer, repaint_output);
+		}
+		warn_overdraw(n_box);
+	} else if (pixman_image_get_data(ps->image)) {
+		whole.x1 = 0;
+		whole.y1 = 0;
+		whole.x2 = pixman_image_get_width(ps->image);
+		whole.y2 = pixman_image_get_height(ps->image);
+		src = create_box_image(ps->image, &whole, &transform, filter);
+		record_op(pr, pixman_op, src, mask_image, shm_buffer,
+			  repaint_output);
+	} else {
+		/* Solid colour; sampled the same whatever the transform */
+		src = pixman_image_ref(ps->image);
+		pixman_image_set_transform(src, &transform);
+		pixman_image_set_filter(src, filter, NULL, 0);
+		record_op(pr, pixman_op, src, mask_image, NULL,
+			  repaint_output);
+	}
+
+	if (mask_image)
+		pixman_image_unref(mask_image);
+
+	if (pr->repaint_debug)
+		record_op(pr, PIXMAN_OP_OVER, pixman_image_ref(pr->debug_color),
+			  NULL, NULL, repaint_output);
 }
 
 /** Paint an intersected region
@@ -348,6 +794,12 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	else
 		target_image = po->hw_buffer;
 
+	if (pr->recording) {
+		record_region(ev, output, repaint_output, source_clip,
+			      pixman_op);
+		return;
+	}
+
  	/* Clip rendering to the damaged output region */
 	pixman_image_set_clip_region32(target_image, repaint_output);
 
@@ -526,16 +978,36 @@ static void
 repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
+	struct pixman_renderer *pr = get_renderer(compositor);
+	struct pixman_output_state *po = get_output_state(output);
 	struct weston_view *view;
+	pixman_region32_t output_damage;
+
+	/* With worker threads, record what to draw and then draw it tile
+	 * by tile on all threads. */
+	pr->recording = pr->pool != NULL;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
 			draw_view(view, output, damage);
+
+	if (!pr->recording)
+		return;
+
+	pr->recording = false;
+
+	pixman_region32_init(&output_damage);
+	pixman_region32_copy(&output_damage, damage);
+	region_global_to_output(output, &output_damage);
+	pixman_renderer_run_ops(pr, po->shadow_image ?: po->hw_buffer,
+				&output_damage);
+	pixman_region32_fini(&output_damage);
 }
 
 static void
 copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 {
+	struct pixman_renderer *pr = get_renderer(output->compositor);
 	struct pixman_output_state *po = get_output_state(output);
 	pixman_region32_t output_region;
 
@@ -544,6 +1016,16 @@ copy_to_hw_buffer(struct weston_output *output, pixman_region32_t *region)
 
 	region_global_to_output(output, &output_region);
 
+	if (pr->pool) {
+		pr->recording = true;
+		record_op(pr, PIXMAN_OP_SRC, pixman_image_ref(po->shadow_image),
+			  NULL, NULL, &output_region);
+		pr->recording = false;
+		pixman_renderer_run_ops(pr, po->hw_buffer, &output_region);
+		pixman_region32_fini(&output_region);
+		return;
+	}
+
 	pixman_image_set_clip_region32 (po->hw_buffer, &output_region);
 	pixman_region32_fini(&output_region);
 
@@ -781,6 +1263,13 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
+
+	if (pr->pool)
+		pixman_worker_pool_destroy(pr->pool);
+	if (pr->scratch)
+		pixman_image_unref(pr->scratch);
+	wl_array_release(&pr->ops);
+	wl_array_release(&pr->tiles);
 	free(pr);
 
 	ec->renderer = NULL;
@@ -854,6 +1343,34 @@ debug_binding(struct weston_keyboard *keyboard, const struct timespec *time,
 	}
 }
 
+/* WESTON_PIXMAN_THREADS sets the number of threads compositing, the
+ * compositor's own included; by default it is done on one thread only. */
+static void
+pixman_renderer_init_workers(struct pixman_renderer *pr)
+{
+	const char *str = getenv("WESTON_PIXMAN_THREADS");
+	int32_t n_threads;
+
+	if (!str || !safe_strtoint(str, &n_threads) || n_threads <= 1)
+		return;
+
+	n_threads = MIN(n_threads, PIXMAN_MAX_THREADS);
+
+	pr->scratch = pixman_image_create_bits(PIXMAN_a8r8g8b8, 1, 1,
+					       NULL, 0);
+	if (!pr->scratch)
+		return;
+
+	pr->pool = pixman_worker_pool_create(n_threads - 1);
+	if (!pr->pool) {
+		pixman_image_unref(pr->scratch);
+		pr->scratch = NULL;
+		return;
+	}
+
+	weston_log("Pixman renderer compositing on %d threads\n", n_threads);
+}
+
 WL_EXPORT int
 pixman_renderer_init(struct weston_compositor *ec)
 {
@@ -888,6 +1405,10 @@ pixman_renderer_init(struct weston_compositor *ec)
 
 	wl_signal_init(&renderer->destroy_signal);
 
+	wl_array_init(&renderer->ops);
+	wl_array_init(&renderer->tiles);
+	pixman_renderer_init_workers(renderer);
+
 	return 0;
 }
 
@@ -27,11 +27,13 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <linux/input.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/uio.h>
 
 #include "compositor.h"
@@ -39,6 +41,7 @@
 #include "shared/timespec-util.h"
 
 #include "wcap/wcap-decode.h"
+#include "wcap-encode.h"
 
 struct screenshooter_frame_listener {
 	struct wl_listener listener;
@@ -209,50 +212,205 @@ weston_screenshooter_shoot(struct weston_output *output,
 	return 0;
 }
 
+/* Frames waiting for the encoder beyond this make the compositor wait,
+ * rather than use memory without bounds when the disk cannot keep up */
+#define RECORDER_QUEUE_MAX_BYTES (64 * 1024 * 1024)
+
+/* The encoder thread owns the reference frame, the encode buffer and the
+ * file; everything under mutex is shared with the compositor thread. */
 struct weston_recorder {
 	struct weston_output *output;
 	uint32_t *frame, *rect;
-	uint32_t *tmpbuf;
+	int width;
 	uint32_t total;
 	int fd;
 	struct wl_listener frame_listener;
 	int count, destroying;
+	int pending_reads;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t queue_cond;	/* a frame was queued, or quit */
+	pthread_cond_t space_cond;	/* the encoder took a frame */
+	struct wl_list queue;		/* weston_recorder_read::link */
+	size_t queued_bytes;
+	bool quit;
+};
+
+/* Damage of one repainted frame, waiting for its pixels to be read back
+ * and then for the encoder */
+struct weston_recorder_read {
+	struct weston_recorder *recorder;
+	struct wl_list link;
+	uint32_t msecs;
+	pixman_box32_t extents;
+
+	/* The extents, copied from the read back pixels; bottom-up if
+	 * yflip is set */
+	uint32_t *pixels;
+	size_t size;
+	bool yflip;
+
+	int nrects;
+	pixman_box32_t rects[];
 };
 
-static uint32_t *
-output_run(uint32_t *p, uint32_t delta, int run)
+/* Runs in the encoder thread */
+static void
+weston_recorder_encode(struct weston_recorder *recorder,
+		       struct weston_recorder_read *read)
 {
-	int i;
+	pixman_box32_t *r = read->rects, *e = &read->extents;
+	int i, j, width, height, run, row, y_orig, pixels_stride;
+	uint32_t prev, *d, *s, *p;
+	struct {
+		uint32_t msecs;
+		uint32_t nrects;
+	} header;
+	struct iovec v[2];
+
+	header.msecs = read->msecs;
+	header.nrects = read->nrects;
+	v[0].iov_base = &header;
+	v[0].iov_len = sizeof header;
+	v[1].iov_base = r;
+	v[1].iov_len = read->nrects * sizeof *r;
+	recorder->total += writev(recorder->fd, v, 2);
 
-	while (run > 0) {
-		if (run <= 0xe0) {
-			*p++ = delta | ((run - 1) << 24);
-			break;
+	pixels_stride = e->x2 - e->x1;
+
+	for (i = 0; i < read->nrects; i++) {
+		width = r[i].x2 - r[i].x1;
+		height = r[i].y2 - r[i].y1;
+
+		p = recorder->rect;
+		run = prev = 0; /* quiet gcc */
+		for (j = 0; j < height; j++) {
+			y_orig = r[i].y2 - j - 1;
+
+			/* The extents were read bottom-up when y-flipped */
+			if (read->yflip)
+				row = e->y2 - y_orig - 1;
+			else
+				row = y_orig - e->y1;
+			s = read->pixels + pixels_stride * row;
+			s += r[i].x1 - e->x1;
+			d = recorder->frame + recorder->width * y_orig + r[i].x1;
+
+			p = wcap_encode_row(p, d, s, width, &prev, &run);
 		}
 
-		i = 24 - __builtin_clz(run);
-		*p++ = delta | ((i + 0xe0) << 24);
-		run -= 1 << (7 + i);
+		p = wcap_output_run(p, prev, run);
+
+		recorder->total += write(recorder->fd,
+					 recorder->rect,
+					 (p - recorder->rect) * 4);
+
+#if 0
+		fprintf(stderr,
+			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
+			width, height, r[i].x1, r[i].y1,
+			width * height * 4, (int) (p - recorder->rect) * 4,
+			(float) (p - recorder->rect) / (width * height),
+			recorder->total / 1024 / 1024);
+#endif
 	}
 
-	return p;
+	recorder->count++;
+}
+
+static void
+weston_recorder_read_free(struct weston_recorder_read *read)
+{
+	free(read->pixels);
+	free(read);
 }
 
-static uint32_t
-component_delta(uint32_t next, uint32_t prev)
+static void *
+weston_recorder_thread(void *data)
 {
-	unsigned char dr, dg, db;
+	struct weston_recorder *recorder = data;
+	struct weston_recorder_read *read;
+
+	pthread_mutex_lock(&recorder->mutex);
+
+	/* Frames still queued when quitting are written out first */
+	for (;;) {
+		if (wl_list_empty(&recorder->queue)) {
+			if (recorder->quit)
+				break;
+			pthread_cond_wait(&recorder->queue_cond,
+					  &recorder->mutex);
+			continue;
+		}
+
+		read = container_of(recorder->queue.next,
+				    struct weston_recorder_read, link);
+		wl_list_remove(&read->link);
+		recorder->queued_bytes -= read->size;
+		pthread_cond_signal(&recorder->space_cond);
+		pthread_mutex_unlock(&recorder->mutex);
 
-	dr = (next >> 16) - (prev >> 16);
-	dg = (next >>  8) - (prev >>  8);
-	db = (next >>  0) - (prev >>  0);
+		weston_recorder_encode(recorder, read);
+		weston_recorder_read_free(read);
+
+		pthread_mutex_lock(&recorder->mutex);
+	}
 
-	return (dr << 16) | (dg << 8) | (db << 0);
+	pthread_mutex_unlock(&recorder->mutex);
+
+	return NULL;
 }
 
 static void
 weston_recorder_destroy(struct weston_recorder *recorder);
 
+static void
+weston_recorder_read_done(struct weston_output *output, void *pixels,
+			  int pixels_stride, void *data)
+{
+	struct weston_recorder_read *read = data;
+	struct weston_recorder *recorder = read->recorder;
+	struct weston_compositor *compositor = output->compositor;
+	pixman_box32_t *e = &read->extents;
+	int width, height, j;
+
+	recorder->pending_reads--;
+	if (!pixels)
+		goto err;
+
+	/* The pixels only live for this call; the encoder gets a copy of
+	 * the extents, which is all the compositor thread spends on it. */
+	width = e->x2 - e->x1;
+	height = e->y2 - e->y1;
+	read->size = (size_t) width * height * 4;
+	read->pixels = malloc(read->size);
+	if (!read->pixels)
+		goto err;
+
+	for (j = 0; j < height; j++)
+		memcpy(read->pixels + width * j,
+		       (char *) pixels + pixels_stride * j, width * 4);
+	read->yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+
+	pthread_mutex_lock(&recorder->mutex);
+	while (recorder->queued_bytes > 0 &&
+	       recorder->queued_bytes + read->size > RECORDER_QUEUE_MAX_BYTES)
+		pthread_cond_wait(&recorder->space_cond, &recorder->mutex);
+	wl_list_insert(recorder->queue.prev, &read->link);
+	recorder->queued_bytes += read->size;
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
+
+	goto out;
+
+err:
+	weston_recorder_read_free(read);
+out:
+	if (recorder->destroying && recorder->pending_reads == 0)
+		weston_recorder_destroy(recorder);
+}
+
 static void
 weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 {
@@ -260,25 +418,10 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 		container_of(listener, struct weston_recorder, frame_listener);
 	struct weston_output *output = data;
 	struct weston_compositor *compositor = output->compositor;
-	uint32_t msecs = timespec_to_msec(&output->frame_time);
-	pixman_box32_t *r;
 	pixman_region32_t damage, transformed_damage;
-	int i, j, k, n, width, height, run, stride;
-	uint32_t delta, prev, *d, *s, *p, next;
-	struct {
-		uint32_t msecs;
-		uint32_t nrects;
-	} header;
-	struct iovec v[2];
-	int do_yflip;
-	int y_orig;
-	uint32_t *outbuf;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-	if (do_yflip)
-		outbuf = recorder->rect;
-	else
-		outbuf = recorder->tmpbuf;
+	struct weston_recorder_read *read;
+	pixman_box32_t *r, *e;
+	int n, y_orig;
 
 	pixman_region32_init(&damage);
 	pixman_region32_init(&transformed_damage);
@@ -291,76 +434,46 @@ weston_recorder_frame_notify(struct wl_listener *listener, void *data)
 	pixman_region32_fini(&damage);
 
 	r = pixman_region32_rectangles(&transformed_damage, &n);
-	if (n == 0) {
+	read = n > 0 ? zalloc(sizeof *read + n * sizeof *r) : NULL;
+	if (read == NULL) {
 		pixman_region32_fini(&transformed_damage);
-		return;
+		goto out;
 	}
 
-	header.msecs = msecs;
-	header.nrects = n;
-	v[0].iov_base = &header;
-	v[0].iov_len = sizeof header;
-	v[1].iov_base = r;
-	v[1].iov_len = n * sizeof *r;
-	recorder->total += writev(recorder->fd, v, 2);
-	stride = output->current_mode->width;
-
-	for (i = 0; i < n; i++) {
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
-
-		if (do_yflip)
-			y_orig = output->current_mode->height - r[i].y2;
-		else
-			y_orig = r[i].y1;
-
-		compositor->renderer->read_pixels(output,
-				compositor->read_format, recorder->rect,
-				r[i].x1, y_orig, width, height);
-
-		p = outbuf;
-		run = prev = 0; /* quiet gcc */
-		for (j = 0; j < height; j++) {
-			if (do_yflip)
-				s = recorder->rect + width * j;
-			else
-				s = recorder->rect + width * (height - j - 1);
-			y_orig = r[i].y2 - j - 1;
-			d = recorder->frame + stride * y_orig + r[i].x1;
-
-			for (k = 0; k < width; k++) {
-				next = *s++;
-				delta = component_delta(next, *d);
-				*d++ = next;
-				if (run == 0 || delta == prev) {
-					run++;
-				} else {
-					p = output_run(p, prev, run);
-					run = 1;
-				}
-				prev = delta;
-			}
-		}
-
-		p = output_run(p, prev, run);
-
-		recorder->total += write(recorder->fd,
-					 outbuf, (p - outbuf) * 4);
+	read->recorder = recorder;
+	read->msecs = timespec_to_msec(&output->frame_time);
+	read->nrects = n;
+	memcpy(read->rects, r, n * sizeof *r);
+	read->extents = *pixman_region32_extents(&transformed_damage);
+	pixman_region32_fini(&transformed_damage);
 
-#if 0
-		fprintf(stderr,
-			"%dx%d at %d,%d rle from %d to %d bytes (%f) total %dM\n",
-			width, height, r[i].x1, r[i].y1,
-			width * height * 4, (int) (p - outbuf) * 4,
-			(float) (p - outbuf) / (width * height),
-			recorder->total / 1024 / 1024);
-#endif
+	/* Read the damage extents in one go, rather than stalling on every
+	 * rectangle, and encode the frame once the pixels arrive. */
+	e = &read->extents;
+	if (compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP)
+		y_orig = output->current_mode->height - e->y2;
+	else
+		y_orig = e->y1;
+
+	recorder->pending_reads++;
+	if (weston_output_read_pixels_async(output, compositor->read_format,
+					    e->x1, y_orig,
+					    e->x2 - e->x1, e->y2 - e->y1,
+					    weston_recorder_read_done,
+					    read) < 0) {
+		recorder->pending_reads--;
+		weston_recorder_read_free(read);
 	}
 
-	pixman_region32_fini(&transformed_damage);
-	recorder->count++;
+out:
+	if (!recorder->destroying)
+		return;
 
-	if (recorder->destroying)
+	/* Stop recording now, but keep the file open until the reads
+	 * already in flight have been written out. */
+	wl_list_remove(&recorder->frame_listener.link);
+	wl_list_init(&recorder->frame_listener.link);
+	if (recorder->pending_reads == 0)
 		weston_recorder_destroy(recorder);
 }
 
@@ -370,7 +483,6 @@ weston_recorder_free(struct weston_recorder *recorder)
 	if (recorder == NULL)
 		return;
 
-	free(recorder->tmpbuf);
 	free(recorder->rect);
 	free(recorder->frame);
 	free(recorder);
@@ -383,9 +495,6 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	struct weston_recorder *recorder;
 	int stride, size;
 	struct { uint32_t magic, format, width, height; } header;
-	int do_yflip;
-
-	do_yflip = !!(compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
 
 	recorder = zalloc(sizeof *recorder);
 	if (recorder == NULL) {
@@ -397,6 +506,7 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	size = stride * 4 * output->current_mode->height;
 	recorder->frame = zalloc(size);
 	recorder->rect = malloc(size);
+	recorder->width = stride;
 	recorder->output = output;
 
 	if ((recorder->frame == NULL) || (recorder->rect == NULL)) {
@@ -404,14 +514,6 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 		goto err_recorder;
 	}
 
-	if (!do_yflip) {
-		recorder->tmpbuf = malloc(size);
-		if (recorder->tmpbuf == NULL) {
-			weston_log("%s: out of memory\n", __func__);
-			goto err_recorder;
-		}
-	}
-
 	header.magic = WCAP_HEADER_MAGIC;
 
 	switch (compositor->read_format) {
@@ -439,6 +541,20 @@ weston_recorder_create(struct weston_output *output, const char *filename)
 	header.height = output->current_mode->height;
 	recorder->total += write(recorder->fd, &header, sizeof header);
 
+	wl_list_init(&recorder->queue);
+	pthread_mutex_init(&recorder->mutex, NULL);
+	pthread_cond_init(&recorder->queue_cond, NULL);
+	pthread_cond_init(&recorder->space_cond, NULL);
+	if (pthread_create(&recorder->thread, NULL,
+			   weston_recorder_thread, recorder) != 0) {
+		weston_log("cannot start the recorder thread\n");
+		pthread_cond_destroy(&recorder->space_cond);
+		pthread_cond_destroy(&recorder->queue_cond);
+		pthread_mutex_destroy(&recorder->mutex);
+		close(recorder->fd);
+		goto err_recorder;
+	}
+
 	recorder->frame_listener.notify = weston_recorder_frame_notify;
 	wl_signal_add(&output->frame_signal, &recorder->frame_listener);
 	output->disable_planes++;
@@ -454,6 +570,19 @@ err_recorder:
 static void
 weston_recorder_destroy(struct weston_recorder *recorder)
 {
+	pthread_mutex_lock(&recorder->mutex);
+	recorder->quit = true;
+	pthread_cond_signal(&recorder->queue_cond);
+	pthread_mutex_unlock(&recorder->mutex);
+
+	pthread_join(recorder->thread, NULL);
+	pthread_cond_destroy(&recorder->space_cond);
+	pthread_cond_destroy(&recorder->queue_cond);
+	pthread_mutex_destroy(&recorder->mutex);
+
+	weston_log("recorder stopped, total file size %dM, %d frames\n",
+		   recorder->total / (1024 * 1024), recorder->count);
+
 	wl_list_remove(&recorder->frame_listener.link);
 	close(recorder->fd);
 	recorder->output->disable_planes--;
@@ -481,8 +610,8 @@ weston_recorder_start(struct weston_output *output, const char *filename)
 WL_EXPORT void
 weston_recorder_stop(struct weston_recorder *recorder)
 {
-	weston_log("stopping recorder, total file size %dM, %d frames\n",
-		   recorder->total / (1024 * 1024), recorder->count);
+	weston_log("stopping recorder for output %s\n",
+		   recorder->output->name);
 
 	recorder->destroying = 1;
 	weston_output_schedule_repaint(recorder->output);
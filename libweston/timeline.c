@@ -27,25 +27,113 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "timeline.h"
 #include "compositor.h"
 #include "file-util.h"
+#include "shared/timeline-ring.h"
+
+/* Record slots in a binary timeline, 32 MiB worth */
+#define TIMELINE_RING_RECORDS (1 << 20)
+
+/* Point names a binary timeline makes room for at first */
+#define TIMELINE_INITIAL_POINTS 64
 
 struct timeline_log {
 	clock_t clk_id;
 	FILE *file;
 	unsigned series;
 	struct wl_listener compositor_destroy_listener;
+
+	/* In binary mode, points are recorded in the ring, and file only
+	 * gets the object descriptions and point names. */
+	struct weston_timeline_ring_header *ring;
+	size_t ring_size;
+	const char **points;
+	unsigned n_points;
+	unsigned points_size;
 };
 
 WL_EXPORT int weston_timeline_enabled_;
 static struct timeline_log timeline_ = { CLOCK_MONOTONIC, NULL, 0 };
 
+static bool
+timeline_binary_requested(void)
+{
+	const char *mode = getenv("WESTON_TIMELINE");
+
+	return mode && strcmp(mode, "binary") == 0;
+}
+
+static int
+timeline_open_ring(void)
+{
+	const char *prefix = "weston-timeline-";
+	const char *suffix = ".bin";
+	struct weston_timeline_ring_header *ring;
+	char fname[1000];
+	size_t size;
+	FILE *fp;
+	int fd;
+
+	fp = file_create_dated(NULL, prefix, suffix, fname, sizeof(fname));
+	if (!fp) {
+		weston_log("Cannot open '%s*%s' for writing: %s\n",
+			   prefix, suffix, strerror(errno));
+		return -1;
+	}
+
+	size = sizeof *ring +
+	       TIMELINE_RING_RECORDS * sizeof(struct weston_timeline_record);
+	fd = fileno(fp);
+	if (ftruncate(fd, size) < 0) {
+		weston_log("Cannot size timeline file '%s': %s\n",
+			   fname, strerror(errno));
+		fclose(fp);
+		return -1;
+	}
+
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	fclose(fp);
+	if (ring == MAP_FAILED) {
+		weston_log("Cannot map timeline file '%s': %s\n",
+			   fname, strerror(errno));
+		return -1;
+	}
+
+	memcpy(ring->magic, WESTON_TIMELINE_RING_MAGIC, sizeof ring->magic);
+	ring->version = WESTON_TIMELINE_RING_VERSION;
+	ring->record_size = sizeof(struct weston_timeline_record);
+	ring->capacity = TIMELINE_RING_RECORDS;
+	ring->head = 0;
+
+	/* The descriptions go next to it, in the usual format */
+	strcpy(fname + strlen(fname) - strlen(suffix), ".log");
+	timeline_.file = fopen(fname, "w");
+	if (!timeline_.file) {
+		weston_log("Cannot open '%s' for writing: %s\n",
+			   fname, strerror(errno));
+		munmap(ring, size);
+		return -1;
+	}
+
+	timeline_.ring = ring;
+	timeline_.ring_size = size;
+	timeline_.n_points = 0;
+
+	weston_log("Opened binary timeline '%.*s.bin'\n",
+		   (int) (strlen(fname) - strlen(".log")), fname);
+
+	return 0;
+}
+
 static int
 weston_timeline_do_open(void)
 {
@@ -88,8 +176,12 @@ weston_timeline_open(struct weston_compositor *compositor)
 	if (weston_timeline_enabled_)
 		return;
 
-	if (weston_timeline_do_open() < 0)
+	if (timeline_binary_requested()) {
+		if (timeline_open_ring() < 0)
+			return;
+	} else if (weston_timeline_do_open() < 0) {
 		return;
+	}
 
 	timeline_.compositor_destroy_listener.notify = timeline_notify_destroy;
 	wl_signal_add(&compositor->destroy_signal,
@@ -113,6 +205,16 @@ weston_timeline_close(void)
 
 	fclose(timeline_.file);
 	timeline_.file = NULL;
+
+	if (timeline_.ring) {
+		munmap(timeline_.ring, timeline_.ring_size);
+		timeline_.ring = NULL;
+	}
+	free(timeline_.points);
+	timeline_.points = NULL;
+	timeline_.n_points = 0;
+	timeline_.points_size = 0;
+
 	weston_log("Timeline log file closed.\n");
 }
 
@@ -162,19 +264,26 @@ fprint_quoted_string(FILE *fp, const char *str)
 	fprintf(fp, "\"%s\"", str);
 }
 
+static void
+check_weston_output_description(struct timeline_emit_context *ctx,
+				struct weston_output *o)
+{
+	if (!check_series(ctx, &o->timeline))
+		return;
+
+	fprintf(ctx->out, "{ \"id\":%u, "
+		"\"type\":\"weston_output\", \"name\":",
+		o->timeline.id);
+	fprint_quoted_string(ctx->out, o->name);
+	fprintf(ctx->out, " }\n");
+}
+
 static int
 emit_weston_output(struct timeline_emit_context *ctx, void *obj)
 {
 	struct weston_output *o = obj;
 
-	if (check_series(ctx, &o->timeline)) {
-		fprintf(ctx->out, "{ \"id\":%u, "
-			"\"type\":\"weston_output\", \"name\":",
-			o->timeline.id);
-		fprint_quoted_string(ctx->out, o->name);
-		fprintf(ctx->out, " }\n");
-	}
-
+	check_weston_output_description(ctx, o);
 	fprintf(ctx->cur, "\"wo\":%u", o->timeline.id);
 
 	return 1;
@@ -252,6 +361,104 @@ static const type_func type_dispatch[] = {
 	[TLT_GPU] = emit_gpu_timestamp,
 };
 
+static uint32_t
+timeline_point_id(struct timeline_emit_context *ctx, const char *name)
+{
+	unsigned i;
+
+	/* Names are string literals, so mostly the pointer matches */
+	for (i = 0; i < timeline_.n_points; i++)
+		if (timeline_.points[i] == name)
+			return i + 1;
+
+	for (i = 0; i < timeline_.n_points; i++)
+		if (strcmp(timeline_.points[i], name) == 0)
+			return i + 1;
+
+	if (timeline_.n_points == timeline_.points_size) {
+		unsigned size = timeline_.points_size ?
+				timeline_.points_size * 2 :
+				TIMELINE_INITIAL_POINTS;
+		const char **points;
+
+		points = realloc(timeline_.points, size * sizeof *points);
+		if (!points) {
+			weston_log("timeline: out of memory, dropping point "
+				   "'%s'\n", name);
+			return 0;
+		}
+		timeline_.points = points;
+		timeline_.points_size = size;
+	}
+
+	timeline_.points[timeline_.n_points++] = name;
+	fprintf(ctx->out, "{ \"point\":%u, \"name\":", timeline_.n_points);
+	fprint_quoted_string(ctx->out, name);
+	fprintf(ctx->out, " }\n");
+
+	return timeline_.n_points;
+}
+
+static uint64_t
+timespec_to_timeline_nsec(const struct timespec *ts)
+{
+	return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static void
+timeline_ring_point(const char *name, const struct timespec *ts,
+		    va_list argp)
+{
+	struct weston_timeline_ring_header *ring = timeline_.ring;
+	struct weston_timeline_record rec = { 0 };
+	struct timeline_emit_context ctx;
+	enum timeline_type otype;
+	void *obj;
+
+	ctx.cur = NULL;
+	ctx.out = timeline_.file;
+	ctx.series = timeline_.series;
+
+	rec.timestamp = timespec_to_timeline_nsec(ts);
+	rec.point = timeline_point_id(&ctx, name);
+	if (rec.point == 0)
+		return;
+
+	while (1) {
+		otype = va_arg(argp, enum timeline_type);
+		if (otype == TLT_END)
+			break;
+
+		obj = va_arg(argp, void *);
+		switch (otype) {
+		case TLT_OUTPUT:
+			check_weston_output_description(&ctx, obj);
+			rec.output = ((struct weston_output *) obj)->timeline.id;
+			break;
+		case TLT_SURFACE:
+			check_weston_surface_description(&ctx, obj);
+			rec.surface = ((struct weston_surface *) obj)->timeline.id;
+			break;
+		case TLT_VBLANK:
+			rec.extra = timespec_to_timeline_nsec(obj);
+			rec.flags |= WESTON_TIMELINE_RECORD_VBLANK;
+			break;
+		case TLT_GPU:
+			rec.extra = timespec_to_timeline_nsec(obj);
+			rec.flags |= WESTON_TIMELINE_RECORD_GPU;
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* Descriptions are rare; get them out before the records using
+	 * them, in case the compositor does not exit cleanly. */
+	fflush(ctx.out);
+
+	weston_timeline_ring_append(ring, &rec);
+}
+
 WL_EXPORT void
 weston_timeline_point(const char *name, ...)
 {
@@ -264,6 +471,13 @@ weston_timeline_point(const char *name, ...)
 
 	clock_gettime(timeline_.clk_id, &ts);
 
+	if (timeline_.ring) {
+		va_start(argp, name);
+		timeline_ring_point(name, &ts, argp);
+		va_end(argp);
+		return;
+	}
+
 	ctx.out = timeline_.file;
 	ctx.cur = fmemopen(buf, sizeof(buf), "w");
 	ctx.series = timeline_.series;
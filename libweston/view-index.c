@@ -0,0 +1,295 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compositor.h"
+#include "view-index.h"
+#include "shared/helpers.h"
+
+/*
+ * A uniform grid over the global coordinate space. Every cell lists the
+ * views whose transform.boundingbox overlaps it, so finding the views
+ * under a point only looks at the handful sharing its cell rather than
+ * at the whole view list. Cells are hashed, as the space is unbounded
+ * and mostly empty.
+ *
+ * Views covering too many cells to be worth it, typically huge scaled
+ * or far out surfaces, are kept in a separate list that every query
+ * looks at.
+ */
+
+#define VIEW_INDEX_CELL_SHIFT 8 /* 256 pixel cells */
+#define VIEW_INDEX_BUCKETS 256
+#define VIEW_INDEX_MAX_CELLS 256
+
+struct view_index_cell {
+	struct wl_list link;
+	int32_t x, y;
+	struct wl_array views; /* struct weston_view * */
+};
+
+struct weston_view_index {
+	struct wl_list buckets[VIEW_INDEX_BUCKETS];
+	struct wl_array oversized; /* struct weston_view * */
+};
+
+static struct wl_list *
+cell_bucket(struct weston_view_index *index, int32_t x, int32_t y)
+{
+	uint32_t hash = (uint32_t) x * 73856093u ^ (uint32_t) y * 19349663u;
+
+	return &index->buckets[hash % VIEW_INDEX_BUCKETS];
+}
+
+static struct view_index_cell *
+cell_find(struct weston_view_index *index, int32_t x, int32_t y)
+{
+	struct wl_list *bucket = cell_bucket(index, x, y);
+	struct view_index_cell *cell;
+
+	wl_list_for_each(cell, bucket, link)
+		if (cell->x == x && cell->y == y)
+			return cell;
+
+	return NULL;
+}
+
+static void
+cell_destroy(struct view_index_cell *cell)
+{
+	wl_list_remove(&cell->link);
+	wl_array_release(&cell->views);
+	free(cell);
+}
+
+static bool
+view_array_add(struct wl_array *array, struct weston_view *view)
+{
+	struct weston_view **p;
+
+	p = wl_array_add(array, sizeof *p);
+	if (!p)
+		return false;
+
+	*p = view;
+	return true;
+}
+
+static void
+view_array_remove(struct wl_array *array, struct weston_view *view)
+{
+	struct weston_view **views = array->data;
+	size_t n = array->size / sizeof *views;
+	size_t i;
+
+	/* Order does not matter, callers sort out the stacking */
+	for (i = 0; i < n; i++) {
+		if (views[i] != view)
+			continue;
+
+		views[i] = views[n - 1];
+		array->size -= sizeof *views;
+		return;
+	}
+}
+
+static void
+view_index_remove_cells(struct weston_view *view)
+{
+	struct weston_view_index *index = view->index_cells.index;
+	struct view_index_cell *cell;
+	int32_t x, y;
+
+	if (!index)
+		return;
+
+	for (y = view->index_cells.y1; y < view->index_cells.y2; y++) {
+		for (x = view->index_cells.x1; x < view->index_cells.x2; x++) {
+			cell = cell_find(index, x, y);
+			if (!cell)
+				continue;
+
+			view_array_remove(&cell->views, view);
+			if (cell->views.size == 0)
+				cell_destroy(cell);
+		}
+	}
+
+	if (view->index_cells.oversized)
+		view_array_remove(&index->oversized, view);
+
+	memset(&view->index_cells, 0, sizeof view->index_cells);
+}
+
+struct weston_view_index *
+weston_view_index_create(void)
+{
+	struct weston_view_index *index;
+	int i;
+
+	index = zalloc(sizeof *index);
+	if (!index)
+		return NULL;
+
+	for (i = 0; i < VIEW_INDEX_BUCKETS; i++)
+		wl_list_init(&index->buckets[i]);
+	wl_array_init(&index->oversized);
+
+	return index;
+}
+
+void
+weston_view_index_destroy(struct weston_view_index *index)
+{
+	struct view_index_cell *cell, *next;
+	struct weston_view **view;
+	int i;
+
+	/* Views may outlive the index; make sure they forget about it */
+	for (i = 0; i < VIEW_INDEX_BUCKETS; i++) {
+		wl_list_for_each_safe(cell, next, &index->buckets[i], link) {
+			wl_array_for_each(view, &cell->views)
+				memset(&(*view)->index_cells, 0,
+				       sizeof (*view)->index_cells);
+			cell_destroy(cell);
+		}
+	}
+
+	wl_array_for_each(view, &index->oversized)
+		memset(&(*view)->index_cells, 0, sizeof (*view)->index_cells);
+	wl_array_release(&index->oversized);
+
+	free(index);
+}
+
+/** Move a view to the cells under its current bounding box
+ *
+ * \param index The compositor's view index.
+ * \param view The view, whose transform.boundingbox has changed.
+ *
+ * On allocation failure the view is kept with the oversized views, so
+ * queries still find it.
+ */
+void
+weston_view_index_update(struct weston_view_index *index,
+			 struct weston_view *view)
+{
+	pixman_box32_t *box = pixman_region32_extents(&view->transform.boundingbox);
+	struct view_index_cell *cell;
+	int32_t x1, y1, x2, y2, x, y;
+
+	view_index_remove_cells(view);
+
+	if (!pixman_region32_not_empty(&view->transform.boundingbox))
+		return;
+
+	view->index_cells.index = index;
+
+	x1 = box->x1 >> VIEW_INDEX_CELL_SHIFT;
+	y1 = box->y1 >> VIEW_INDEX_CELL_SHIFT;
+	x2 = ((box->x2 - 1) >> VIEW_INDEX_CELL_SHIFT) + 1;
+	y2 = ((box->y2 - 1) >> VIEW_INDEX_CELL_SHIFT) + 1;
+
+	if ((int64_t) (x2 - x1) * (y2 - y1) > VIEW_INDEX_MAX_CELLS)
+		goto oversized;
+
+	for (y = y1; y < y2; y++) {
+		for (x = x1; x < x2; x++) {
+			cell = cell_find(index, x, y);
+			if (!cell) {
+				cell = zalloc(sizeof *cell);
+				if (!cell)
+					goto fail;
+
+				cell->x = x;
+				cell->y = y;
+				wl_array_init(&cell->views);
+				wl_list_insert(cell_bucket(index, x, y),
+					       &cell->link);
+			}
+
+			if (!view_array_add(&cell->views, view)) {
+				if (cell->views.size == 0)
+					cell_destroy(cell);
+				goto fail;
+			}
+
+			/* Keep the range consistent for removal */
+			view->index_cells.x1 = x1;
+			view->index_cells.y1 = y1;
+			view->index_cells.x2 = x2;
+			view->index_cells.y2 = y + 1;
+		}
+	}
+
+	return;
+
+fail:
+	view_index_remove_cells(view);
+	view->index_cells.index = index;
+oversized:
+	if (view_array_add(&index->oversized, view))
+		view->index_cells.oversized = true;
+	else
+		view->index_cells.index = NULL;
+}
+
+/** Take a view out of the index it is in, if any */
+void
+weston_view_index_remove(struct weston_view *view)
+{
+	view_index_remove_cells(view);
+}
+
+/** Get the views whose bounding box may contain a point
+ *
+ * \param index The compositor's view index.
+ * \param x,y The point in global coordinates.
+ * \return The views in no particular order, or NULL if there are none.
+ * Views in weston_view_index_get_oversized() need to be checked as well.
+ */
+struct wl_array *
+weston_view_index_get_cell(struct weston_view_index *index,
+			   int32_t x, int32_t y)
+{
+	struct view_index_cell *cell;
+
+	cell = cell_find(index, x >> VIEW_INDEX_CELL_SHIFT,
+			 y >> VIEW_INDEX_CELL_SHIFT);
+
+	return cell ? &cell->views : NULL;
+}
+
+struct wl_array *
+weston_view_index_get_oversized(struct weston_view_index *index)
+{
+	return &index->oversized;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_VIEW_INDEX_H
+#define WESTON_VIEW_INDEX_H
+
+#include <stdint.h>
+#include <wayland-util.h>
+
+struct weston_view;
+struct weston_view_index;
+
+struct weston_view_index *
+weston_view_index_create(void);
+
+void
+weston_view_index_destroy(struct weston_view_index *index);
+
+void
+weston_view_index_update(struct weston_view_index *index,
+			 struct weston_view *view);
+
+void
+weston_view_index_remove(struct weston_view *view);
+
+struct wl_array *
+weston_view_index_get_cell(struct weston_view_index *index,
+			   int32_t x, int32_t y);
+
+struct wl_array *
+weston_view_index_get_oversized(struct weston_view_index *index);
+
+#endif /* WESTON_VIEW_INDEX_H */
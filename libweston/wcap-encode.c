@@ -0,0 +1,140 @@
+/*
+ * Copyright © 2008-2011 Kristian Høgsberg
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "wcap-encode.h"
+
+/** Write a run of pixels with the same delta
+ *
+ * \param p Where to write the run.
+ * \param delta The delta of the pixels to the reference frame.
+ * \param run Pixels in the run, 0 for none.
+ * \return Where the next run goes.
+ */
+uint32_t *
+wcap_output_run(uint32_t *p, uint32_t delta, int run)
+{
+	int i;
+
+	while (run > 0) {
+		if (run <= 0xe0) {
+			*p++ = delta | ((run - 1) << 24);
+			break;
+		}
+
+		i = 24 - __builtin_clz(run);
+		*p++ = delta | ((i + 0xe0) << 24);
+		run -= 1 << (7 + i);
+	}
+
+	return p;
+}
+
+static uint32_t
+component_delta(uint32_t next, uint32_t prev)
+{
+	unsigned char dr, dg, db;
+
+	dr = (next >> 16) - (prev >> 16);
+	dg = (next >>  8) - (prev >>  8);
+	db = (next >>  0) - (prev >>  0);
+
+	return (dr << 16) | (dg << 8) | (db << 0);
+}
+
+/* Generic vectors, which the compiler maps onto SSE2, AVX or NEON */
+typedef uint32_t recorder_v4u32 __attribute__((vector_size(16)));
+typedef uint8_t recorder_v16u8 __attribute__((vector_size(16)));
+
+/** Run-length encode the deltas of a row against the reference frame
+ *
+ * \param p Where to write runs.
+ * \param d The reference row, updated to the new pixels.
+ * \param s The new pixels.
+ * \param width Pixels in the row.
+ * \param prev The delta of the run in progress, carried across rows.
+ * \param run The length of that run, 0 if none.
+ * \return Where the next run goes.
+ *
+ * Four pixels go at once; the per-pixel path only runs where a run ends,
+ * so unchanged areas, all zero deltas, cost a compare per four pixels.
+ */
+uint32_t *
+wcap_encode_row(uint32_t *p, uint32_t *d, const uint32_t *s, int width,
+		uint32_t *prev, int *run)
+{
+	const recorder_v4u32 rgb_mask = {
+		0x00ffffff, 0x00ffffff, 0x00ffffff, 0x00ffffff
+	};
+	recorder_v4u32 next, ref, delta, same;
+	uint32_t lanes[4];
+	int k, l;
+
+	for (k = 0; k + 4 <= width; k += 4) {
+		memcpy(&next, s + k, sizeof next);
+		memcpy(&ref, d + k, sizeof ref);
+		memcpy(d + k, &next, sizeof next);
+
+		/* Bytewise differences, as component_delta() computes */
+		delta = (recorder_v4u32) ((recorder_v16u8) next -
+					  (recorder_v16u8) ref) & rgb_mask;
+
+		same = (recorder_v4u32) (delta == *prev);
+		if (*run > 0 && (same[0] & same[1] & same[2] & same[3])) {
+			*run += 4;
+			continue;
+		}
+
+		memcpy(lanes, &delta, sizeof lanes);
+		for (l = 0; l < 4; l++) {
+			if (*run == 0 || lanes[l] == *prev) {
+				(*run)++;
+			} else {
+				p = wcap_output_run(p, *prev, *run);
+				*run = 1;
+			}
+			*prev = lanes[l];
+		}
+	}
+
+	for (; k < width; k++) {
+		lanes[0] = component_delta(s[k], d[k]);
+		d[k] = s[k];
+		if (*run == 0 || lanes[0] == *prev) {
+			(*run)++;
+		} else {
+			p = wcap_output_run(p, *prev, *run);
+			*run = 1;
+		}
+		*prev = lanes[0];
+	}
+
+	return p;
+}
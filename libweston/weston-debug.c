@@ -37,8 +37,14 @@
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 #include <sys/time.h>
 
+/** Bytes a stream buffers for a subscriber that does not keep up */
+#define STREAM_BUFFER_SIZE (1024 * 1024)
+
 /** Main weston-debug context
  *
  * One per weston_compositor.
@@ -79,6 +85,31 @@ struct weston_debug_stream {
 	int fd;				/**< client provided fd */
 	struct wl_resource *resource;	/**< weston_debug_stream_v1 object */
 	struct wl_list scope_link;
+	struct weston_debug_compositor *wdc;
+
+	/* Writing happens on a thread of its own, started on the first
+	 * write, so that a subscriber not reading cannot stall the
+	 * compositor. The messages go through a bounded ring; what does
+	 * not fit is dropped, and a marker says how much. */
+	struct {
+		bool running;
+		pthread_t thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+
+		char *ring;
+		size_t head;		/**< first byte not yet written */
+		size_t len;		/**< bytes waiting to be written */
+		size_t lost;		/**< bytes dropped since the marker */
+
+		bool draining;		/**< complete the stream once empty */
+		bool quit;
+		int error;		/**< errno of a failed write */
+
+		/* The thread tells about its end through this eventfd */
+		int done_fd;
+		struct wl_event_source *done_source;
+	} writer;
 };
 
 static struct weston_debug_scope *
@@ -93,9 +124,87 @@ get_scope(struct weston_debug_compositor *wdc, const char *name)
 	return NULL;
 }
 
+static void *
+stream_writer_thread(void *data)
+{
+	struct weston_debug_stream *stream = data;
+	uint64_t one = 1;
+	size_t chunk;
+	ssize_t ret;
+	int state;
+
+	/* Cancellation only interrupts a write that may block forever */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
+	pthread_mutex_lock(&stream->writer.mutex);
+	for (;;) {
+		while (stream->writer.len == 0 &&
+		       !stream->writer.draining && !stream->writer.quit)
+			pthread_cond_wait(&stream->writer.cond,
+					  &stream->writer.mutex);
+
+		if (stream->writer.quit || stream->writer.len == 0)
+			break;
+
+		/* Only the compositor appends, after len; the bytes being
+		 * written are left alone. */
+		chunk = MIN(stream->writer.len,
+			    STREAM_BUFFER_SIZE - stream->writer.head);
+		pthread_mutex_unlock(&stream->writer.mutex);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+		ret = write(stream->fd,
+			    stream->writer.ring + stream->writer.head, chunk);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
+		pthread_mutex_lock(&stream->writer.mutex);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			stream->writer.error = errno;
+			break;
+		}
+
+		stream->writer.head = (stream->writer.head + ret) %
+				      STREAM_BUFFER_SIZE;
+		stream->writer.len -= ret;
+	}
+	pthread_mutex_unlock(&stream->writer.mutex);
+
+	if (write(stream->writer.done_fd, &one, sizeof one) < 0)
+		weston_log("weston-debug: cannot signal stream writer end\n");
+
+	return NULL;
+}
+
+static void
+stream_writer_stop(struct weston_debug_stream *stream)
+{
+	if (!stream->writer.running)
+		return;
+
+	pthread_mutex_lock(&stream->writer.mutex);
+	stream->writer.quit = true;
+	pthread_cond_signal(&stream->writer.cond);
+	pthread_mutex_unlock(&stream->writer.mutex);
+
+	pthread_cancel(stream->writer.thread);
+	pthread_join(stream->writer.thread, NULL);
+
+	wl_event_source_remove(stream->writer.done_source);
+	close(stream->writer.done_fd);
+	pthread_cond_destroy(&stream->writer.cond);
+	pthread_mutex_destroy(&stream->writer.mutex);
+	free(stream->writer.ring);
+	stream->writer.running = false;
+}
+
 static void
 stream_close_unlink(struct weston_debug_stream *stream)
 {
+	stream_writer_stop(stream);
+
 	if (stream->fd != -1)
 		close(stream->fd);
 	stream->fd = -1;
@@ -127,6 +236,93 @@ stream_close_on_failure(struct weston_debug_stream *stream,
 	}
 }
 
+static int
+stream_writer_done(int fd, uint32_t mask, void *data)
+{
+	struct weston_debug_stream *stream = data;
+	int error = stream->writer.error;
+	bool draining = stream->writer.draining;
+
+	if (error) {
+		stream_close_on_failure(stream, "Error writing: %s (%d)",
+					strerror(error), error);
+	} else if (draining) {
+		stream_close_unlink(stream);
+		weston_debug_stream_v1_send_complete(stream->resource);
+	}
+
+	return 0;
+}
+
+static int
+stream_writer_start(struct weston_debug_stream *stream)
+{
+	struct wl_event_loop *loop;
+	sigset_t set, old;
+	int ret;
+
+	stream->writer.ring = malloc(STREAM_BUFFER_SIZE);
+	if (!stream->writer.ring)
+		return -1;
+
+	stream->writer.done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (stream->writer.done_fd < 0)
+		goto err_ring;
+
+	loop = wl_display_get_event_loop(stream->wdc->compositor->wl_display);
+	stream->writer.done_source =
+		wl_event_loop_add_fd(loop, stream->writer.done_fd,
+				     WL_EVENT_READABLE, stream_writer_done,
+				     stream);
+	if (!stream->writer.done_source)
+		goto err_fd;
+
+	stream->writer.head = 0;
+	stream->writer.len = 0;
+	stream->writer.lost = 0;
+	stream->writer.quit = false;
+	stream->writer.error = 0;
+	pthread_mutex_init(&stream->writer.mutex, NULL);
+	pthread_cond_init(&stream->writer.cond, NULL);
+
+	/* Leave the compositor's signals to the main loop, and get EPIPE
+	 * rather than SIGPIPE. */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &old);
+	ret = pthread_create(&stream->writer.thread, NULL,
+			     stream_writer_thread, stream);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0)
+		goto err_sync;
+
+	stream->writer.running = true;
+
+	return 0;
+
+err_sync:
+	pthread_cond_destroy(&stream->writer.cond);
+	pthread_mutex_destroy(&stream->writer.mutex);
+	wl_event_source_remove(stream->writer.done_source);
+err_fd:
+	close(stream->writer.done_fd);
+err_ring:
+	free(stream->writer.ring);
+	return -1;
+}
+
+static void
+stream_ring_append(struct weston_debug_stream *stream,
+		   const char *data, size_t len)
+{
+	size_t tail = (stream->writer.head + stream->writer.len) %
+		      STREAM_BUFFER_SIZE;
+	size_t first = MIN(len, STREAM_BUFFER_SIZE - tail);
+
+	memcpy(stream->writer.ring + tail, data, first);
+	memcpy(stream->writer.ring, data + first, len - first);
+	stream->writer.len += len;
+}
+
 static struct weston_debug_stream *
 stream_create(struct weston_debug_compositor *wdc, const char *name,
 	      int32_t streamfd, struct wl_resource *stream_resource)
@@ -140,6 +336,7 @@ stream_create(struct weston_debug_compositor *wdc, const char *name,
 
 	stream->fd = streamfd;
 	stream->resource = stream_resource;
+	stream->wdc = wdc;
 
 	scope = get_scope(wdc, name);
 	if (scope) {
@@ -164,6 +361,7 @@ stream_destroy(struct wl_resource *stream_resource)
 
 	stream = wl_resource_get_user_data(stream_resource);
 
+	stream_writer_stop(stream);
 	if (stream->fd != -1)
 		close(stream->fd);
 	wl_list_remove(&stream->scope_link);
@@ -320,9 +518,9 @@ weston_debug_compositor_destroy(struct weston_compositor *compositor)
  * This enables the weston_debug_v1 Wayland protocol extension which any client
  * can use to get debug messsages from the compositor.
  *
- * WARNING: This feature should not be used in production. If a client
- * provides a file descriptor that blocks writes, it will block the whole
- * compositor indefinitely.
+ * Streams are written from threads of their own, so a client that does
+ * not read its file descriptor cannot block the compositor. It loses the
+ * messages that do not fit in the stream's buffer instead.
  *
  * There is no control on which client is allowed to subscribe to debug
  * messages. Any and all clients are allowed.
@@ -516,12 +714,14 @@ weston_debug_scope_is_enabled(struct weston_debug_scope *scope)
  * \param len Number of bytes to write.
  *
  * Writes the given data (binary verbatim) into the debug stream.
- * If \c len is zero or negative, the write is silently dropped.
+ * If \c len is zero, the write is silently dropped.
  *
- * Writing is continued until all data has been written or
- * a write fails. If the write fails due to a signal, it is re-tried.
- * Otherwise on failure, the stream is closed and
- * \c weston_debug_stream_v1.failure event is sent to the client.
+ * The data is queued for the stream's writer thread, so this never
+ * blocks. If the client does not read fast enough and the stream's
+ * buffer is full, the data is dropped, and a line saying how many bytes
+ * were lost precedes the next data that fits. If writing fails, the
+ * stream is closed and \c weston_debug_stream_v1.failure event is sent
+ * to the client.
  *
  * \memberof weston_debug_stream
  */
@@ -529,29 +729,39 @@ WL_EXPORT void
 weston_debug_stream_write(struct weston_debug_stream *stream,
 			  const char *data, size_t len)
 {
-	ssize_t len_ = len;
-	ssize_t ret;
-	int e;
+	char marker[64];
+	int marker_len = 0;
+	size_t space;
 
-	if (stream->fd == -1)
+	if (stream->fd == -1 || len == 0)
 		return;
 
-	while (len_ > 0) {
-		ret = write(stream->fd, data, len_);
-		e = errno;
-		if (ret < 0) {
-			if (e == EINTR)
-				continue;
+	if (!stream->writer.running && stream_writer_start(stream) < 0) {
+		stream_close_on_failure(stream, "Out of memory");
+		return;
+	}
 
-			stream_close_on_failure(stream,
-					"Error writing %zd bytes: %s (%d)",
-					len_, strerror(e), e);
-			break;
+	pthread_mutex_lock(&stream->writer.mutex);
+
+	space = STREAM_BUFFER_SIZE - stream->writer.len;
+	if (stream->writer.lost > 0) {
+		marker_len = snprintf(marker, sizeof marker,
+				      "\n[weston-debug: %zu bytes lost]\n",
+				      stream->writer.lost);
+		if ((size_t) marker_len + len <= space) {
+			stream_ring_append(stream, marker, marker_len);
+			stream->writer.lost = 0;
 		}
+	}
 
-		len_ -= ret;
-		data += ret;
+	if (stream->writer.lost > 0 || len > space) {
+		stream->writer.lost += len;
+	} else {
+		stream_ring_append(stream, data, len);
+		pthread_cond_signal(&stream->writer.cond);
 	}
+
+	pthread_mutex_unlock(&stream->writer.mutex);
 }
 
 /** Write a formatted string into a specific debug stream (varargs)
@@ -613,8 +823,20 @@ weston_debug_stream_printf(struct weston_debug_stream *stream,
 WL_EXPORT void
 weston_debug_stream_complete(struct weston_debug_stream *stream)
 {
-	stream_close_unlink(stream);
-	weston_debug_stream_v1_send_complete(stream->resource);
+	if (!stream->writer.running) {
+		stream_close_unlink(stream);
+		weston_debug_stream_v1_send_complete(stream->resource);
+		return;
+	}
+
+	/* Let the writer finish first; see stream_writer_done() */
+	wl_list_remove(&stream->scope_link);
+	wl_list_init(&stream->scope_link);
+
+	pthread_mutex_lock(&stream->writer.mutex);
+	stream->writer.draining = true;
+	pthread_cond_signal(&stream->writer.cond);
+	pthread_mutex_unlock(&stream->writer.mutex);
 }
 
 /** Write debug data for a scope
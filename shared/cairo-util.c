@@ -485,28 +485,54 @@ create_layout(cairo_t *cr, const char *title)
 	cairo_show_text(cr, title)
 #endif
 
+/* Clears the surface and draws the shadow of a frame of the given size */
+void
+theme_render_shadow(struct theme *t, cairo_t *cr, int width, int height)
+{
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_rgba(cr, 0, 0, 0, 0);
+	cairo_paint(cr);
+
+	render_shadow(cr, t->shadow,
+		      2, 2, width + 8, height + 8,
+		      64, 64);
+}
+
 void
 theme_render_frame(struct theme *t,
 		   cairo_t *cr, int width, int height,
 		   const char *title, cairo_rectangle_int_t *title_rect,
 		   struct wl_list *buttons, uint32_t flags)
+{
+	if (flags & THEME_FRAME_MAXIMIZED) {
+		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_rgba(cr, 0, 0, 0, 0);
+		cairo_paint(cr);
+	} else {
+		theme_render_shadow(t, cr, width, height);
+	}
+
+	theme_render_frame_decoration(t, cr, width, height,
+				      title, title_rect, buttons, flags);
+}
+
+/* Draws the border and title bar of a frame over what is already on the
+ * surface, which is expected to be the shadow */
+void
+theme_render_frame_decoration(struct theme *t,
+			      cairo_t *cr, int width, int height,
+			      const char *title,
+			      cairo_rectangle_int_t *title_rect,
+			      struct wl_list *buttons, uint32_t flags)
 {
 	cairo_surface_t *source;
 	int x, y, margin, top_margin;
 	int text_width, text_height;
 
-	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-	cairo_set_source_rgba(cr, 0, 0, 0, 0);
-	cairo_paint(cr);
-
 	if (flags & THEME_FRAME_MAXIMIZED)
 		margin = 0;
-	else {
-		render_shadow(cr, t->shadow,
-			      2, 2, width + 8, height + 8,
-			      64, 64);
+	else
 		margin = t->margin;
-	}
 
 	if (flags & THEME_FRAME_ACTIVE)
 		source = t->active_frame;
@@ -77,6 +77,14 @@ theme_render_frame(struct theme *t,
 		   cairo_t *cr, int width, int height,
 		   const char *title, cairo_rectangle_int_t *title_rect,
 		   struct wl_list *buttons, uint32_t flags);
+void
+theme_render_shadow(struct theme *t, cairo_t *cr, int width, int height);
+void
+theme_render_frame_decoration(struct theme *t,
+			      cairo_t *cr, int width, int height,
+			      const char *title,
+			      cairo_rectangle_int_t *title_rect,
+			      struct wl_list *buttons, uint32_t flags);
 
 enum theme_location {
 	THEME_LOCATION_INTERIOR = 0,
@@ -230,4 +238,10 @@ frame_double_touch_up(struct frame *frame, void *data, int32_t id);
 void
 frame_repaint(struct frame *frame, cairo_t *cr);
 
+void
+frame_repaint_decoration(struct frame *frame, cairo_t *cr);
+
+void
+frame_repaint_titlebar(struct frame *frame, cairo_t *cr);
+
 #endif
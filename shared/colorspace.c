@@ -197,3 +197,100 @@ weston_colorspace_lookup(const char *name)
 
 	return NULL;
 }
+
+WL_EXPORT const struct weston_colorspace *
+weston_colorspace_get(enum weston_colorspace_enums cs)
+{
+	if ((unsigned)cs >= ARRAY_LENGTH(colorspaces))
+		return NULL;
+
+	return colorspaces[cs];
+}
+
+static void
+mat3_invert(double inv[3][3], double m[3][3])
+{
+	double det;
+
+	det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+	      m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+	      m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+
+	inv[0][0] =  (m[1][1] * m[2][2] - m[1][2] * m[2][1]) / det;
+	inv[0][1] = -(m[0][1] * m[2][2] - m[0][2] * m[2][1]) / det;
+	inv[0][2] =  (m[0][1] * m[1][2] - m[0][2] * m[1][1]) / det;
+	inv[1][0] = -(m[1][0] * m[2][2] - m[1][2] * m[2][0]) / det;
+	inv[1][1] =  (m[0][0] * m[2][2] - m[0][2] * m[2][0]) / det;
+	inv[1][2] = -(m[0][0] * m[1][2] - m[0][2] * m[1][0]) / det;
+	inv[2][0] =  (m[1][0] * m[2][1] - m[1][1] * m[2][0]) / det;
+	inv[2][1] = -(m[0][0] * m[2][1] - m[0][1] * m[2][0]) / det;
+	inv[2][2] =  (m[0][0] * m[1][1] - m[0][1] * m[1][0]) / det;
+}
+
+static void
+colorspace_rgb_to_xyz(const struct weston_colorspace *cs, double m[3][3])
+{
+	const struct weston_vector *prim[3] = { &cs->r, &cs->g, &cs->b };
+	const struct weston_vector *w = &cs->whitepoint;
+	double inv[3][3], s[3], wxyz[3];
+	int i, j;
+
+	/* Columns are the xyY -> XYZ of each primary with Y = 1 */
+	for (i = 0; i < 3; i++) {
+		double x = prim[i]->f[0], y = prim[i]->f[1];
+
+		m[0][i] = x / y;
+		m[1][i] = 1.0;
+		m[2][i] = (1.0 - x - y) / y;
+	}
+
+	wxyz[0] = w->f[0] / w->f[1];
+	wxyz[1] = 1.0;
+	wxyz[2] = (1.0 - w->f[0] - w->f[1]) / w->f[1];
+
+	mat3_invert(inv, m);
+
+	/* Scale the primaries so that RGB (1, 1, 1) maps to the white point */
+	for (i = 0; i < 3; i++)
+		s[i] = inv[i][0] * wxyz[0] + inv[i][1] * wxyz[1] +
+		       inv[i][2] * wxyz[2];
+
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++)
+			m[i][j] *= s[j];
+}
+
+/** Compute the matrix converting linear RGB from one colorspace to another
+ *
+ * \param dst The colorspace to convert to.
+ * \param src The colorspace to convert from.
+ * \param matrix The resulting 3x3 matrix, in column-major order as
+ * expected by glUniformMatrix3fv() and GLSL mat3 constructors.
+ *
+ * The conversion goes through CIE XYZ. No chromatic adaptation is done,
+ * which is exact for the common video colorspaces since they all share the
+ * D65 white point.
+ */
+WL_EXPORT void
+weston_colorspace_conversion_matrix(const struct weston_colorspace *dst,
+				    const struct weston_colorspace *src,
+				    float matrix[9])
+{
+	double s[3][3], d[3][3], dinv[3][3];
+	int i, j, k;
+
+	colorspace_rgb_to_xyz(src, s);
+	colorspace_rgb_to_xyz(dst, d);
+	mat3_invert(dinv, d);
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			double v = 0.0;
+
+			for (k = 0; k < 3; k++)
+				v += dinv[i][k] * s[k][j];
+
+			matrix[j * 3 + i] = v;
+		}
+	}
+}
@@ -60,6 +60,30 @@ enum weston_colorspace_enums {
 	WESTON_CS_UNDEFINED
 };
 
+const struct weston_colorspace *
+weston_colorspace_get(enum weston_colorspace_enums cs);
+
+void
+weston_colorspace_conversion_matrix(const struct weston_colorspace *dst,
+				    const struct weston_colorspace *src,
+				    float matrix[9]);
+
+/* SMPTE ST 2084 (PQ) constants, exact in binary and decimal */
+#define WESTON_PQ_M1 0.1593017578125	/* 2610 / 16384 */
+#define WESTON_PQ_M2 78.84375		/* 2523 / 4096 * 128 */
+#define WESTON_PQ_C1 0.8359375		/* 3424 / 4096 */
+#define WESTON_PQ_C2 18.8515625		/* 2413 / 4096 * 32 */
+#define WESTON_PQ_C3 18.6875		/* 2392 / 4096 * 32 */
+
+/* ITU-R BT.2100 HLG constants, and the BT.2020 luminance weights the
+ * HLG OOTF is applied with */
+#define WESTON_HLG_A 0.17883277
+#define WESTON_HLG_B 0.28466892		/* 1 - 4a */
+#define WESTON_HLG_C 0.55991073		/* 0.5 - a ln(4a) */
+#define WESTON_BT2020_LUMA_R 0.2627
+#define WESTON_BT2020_LUMA_G 0.6780
+#define WESTON_BT2020_LUMA_B 0.0593
+
 #ifdef  __cplusplus
 }
 #endif
@@ -433,6 +433,10 @@ frame_set_title(struct frame *frame, const char *title)
 {
 	char *dup = NULL;
 
+	if (title == frame->title ||
+	    (title && frame->title && strcmp(title, frame->title) == 0))
+		return 0;
+
 	if (title) {
 		dup = strdup(title);
 		if (!dup)
@@ -994,24 +998,56 @@ frame_double_touch_up(struct frame *frame, void *data, int32_t id)
 	}
 }
 
-void
-frame_repaint(struct frame *frame, cairo_t *cr)
+static uint32_t
+frame_theme_flags(struct frame *frame)
 {
-	struct frame_button *button;
 	uint32_t flags = 0;
 
-	frame_refresh_geometry(frame);
-
 	if (frame->flags & FRAME_FLAG_MAXIMIZED)
 		flags |= THEME_FRAME_MAXIMIZED;
 
 	if (frame->flags & FRAME_FLAG_ACTIVE)
 		flags |= THEME_FRAME_ACTIVE;
 
+	return flags;
+}
+
+void
+frame_repaint(struct frame *frame, cairo_t *cr)
+{
+	struct frame_button *button;
+
+	frame_refresh_geometry(frame);
+
 	cairo_save(cr);
 	theme_render_frame(frame->theme, cr, frame->width, frame->height,
 			   frame->title, &frame->title_rect,
-			   &frame->buttons, flags);
+			   &frame->buttons, frame_theme_flags(frame));
+	cairo_restore(cr);
+
+	wl_list_for_each(button, &frame->buttons, link)
+		frame_button_repaint(button, cr);
+
+	frame_status_clear(frame, FRAME_STATUS_REPAINT);
+}
+
+/** Repaint the frame without clearing the surface or drawing the shadow
+ *
+ * This is for callers that keep the shadow of a frame around and paint
+ * it themselves before calling this.
+ */
+void
+frame_repaint_decoration(struct frame *frame, cairo_t *cr)
+{
+	struct frame_button *button;
+
+	frame_refresh_geometry(frame);
+
+	cairo_save(cr);
+	theme_render_frame_decoration(frame->theme, cr,
+				      frame->width, frame->height,
+				      frame->title, &frame->title_rect,
+				      &frame->buttons, frame_theme_flags(frame));
 	cairo_restore(cr);
 
 	wl_list_for_each(button, &frame->buttons, link)
@@ -1019,3 +1055,28 @@ frame_repaint(struct frame *frame, cairo_t *cr)
 
 	frame_status_clear(frame, FRAME_STATUS_REPAINT);
 }
+
+/** Repaint only the title and the buttons of the frame
+ *
+ * The surface must already hold a repaint of the frame with the same
+ * size and flags, only the title or the state of the buttons may have
+ * changed since. Everything outside the title bar is left untouched.
+ */
+void
+frame_repaint_titlebar(struct frame *frame, cairo_t *cr)
+{
+	int x, y;
+
+	frame_refresh_geometry(frame);
+
+	/* The title bar without the border and its rounded corners, where
+	 * the frame is opaque and can be painted over */
+	x = frame->shadow_margin + frame->theme->width;
+	y = frame->shadow_margin;
+
+	cairo_save(cr);
+	cairo_rectangle(cr, x, y, frame->width - 2 * x, frame->interior.y - y);
+	cairo_clip(cr);
+	frame_repaint_decoration(frame, cr);
+	cairo_restore(cr);
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TIMELINE_RING_H
+#define WESTON_TIMELINE_RING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Binary timeline format
+ *
+ * A binary timeline is a file holding a header followed by a ring of
+ * fixed-size records, written through a shared memory mapping. Once the
+ * ring is full, the oldest records are overwritten. Object descriptions
+ * and point names go to a text file of the same name with a ".log"
+ * suffix, as JSON lines:
+ *
+ *   { "id":1, "type":"weston_output", "name":"HDMI-A-1" }
+ *   { "point":1, "name":"core_repaint_begin" }
+ *
+ * A record is complete when its seq is its index in the ring, counted
+ * from 1 like head. Writers clear seq before filling a record in and set
+ * it last, so a reader of a live ring compares seq before and after
+ * copying a record to detect one being written or overwritten.
+ *
+ * All fields are in host byte order.
+ */
+
+#define WESTON_TIMELINE_RING_MAGIC "WTLRING1"
+#define WESTON_TIMELINE_RING_VERSION 2
+
+enum weston_timeline_record_flags {
+	WESTON_TIMELINE_RECORD_VBLANK = 1 << 0, /* extra is a vblank time */
+	WESTON_TIMELINE_RECORD_GPU = 1 << 1, /* extra is a GPU time */
+};
+
+struct weston_timeline_ring_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;	/* number of record slots */
+	uint64_t head;		/* number of records ever written */
+};
+
+struct weston_timeline_record {
+	uint64_t seq;		/* record index + 1 once written, see above */
+	uint64_t timestamp;	/* CLOCK_MONOTONIC, in nanoseconds */
+	uint64_t extra;		/* see weston_timeline_record_flags */
+	uint32_t point;		/* id of the point name, never 0 */
+	uint32_t output;	/* timeline id of the output, 0 if none */
+	uint32_t surface;	/* timeline id of the surface, 0 if none */
+	uint32_t flags;		/* enum weston_timeline_record_flags */
+};
+
+static inline struct weston_timeline_record *
+weston_timeline_ring_slot(const struct weston_timeline_ring_header *ring,
+			  uint64_t index)
+{
+	return (struct weston_timeline_record *) (ring + 1) +
+	       index % ring->capacity;
+}
+
+/* Appends a copy of rec, with its seq ignored, to the ring. Writers only
+ * race for the slot index, so no locking is needed. */
+static inline void
+weston_timeline_ring_append(struct weston_timeline_ring_header *ring,
+			    const struct weston_timeline_record *rec)
+{
+	struct weston_timeline_record *slot;
+	uint64_t head;
+
+	head = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+	slot = weston_timeline_ring_slot(ring, head);
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->timestamp = rec->timestamp;
+	slot->extra = rec->extra;
+	slot->point = rec->point;
+	slot->output = rec->output;
+	slot->surface = rec->surface;
+	slot->flags = rec->flags;
+	__atomic_store_n(&slot->seq, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Index of the oldest record still in a ring holding head records */
+static inline uint64_t
+weston_timeline_ring_start(const struct weston_timeline_ring_header *ring,
+			   uint64_t head)
+{
+	return head > ring->capacity ? head - ring->capacity : 0;
+}
+
+/* Copies record index out of a possibly live ring. Returns false if the
+ * record is not complete yet, or got overwritten. */
+static inline bool
+weston_timeline_ring_read(const struct weston_timeline_ring_header *ring,
+			  uint64_t index, struct weston_timeline_record *rec)
+{
+	const struct weston_timeline_record *slot;
+
+	slot = weston_timeline_ring_slot(ring, index);
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != index + 1)
+		return false;
+	*rec = *slot;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == index + 1;
+}
+
+#endif /* WESTON_TIMELINE_RING_H */
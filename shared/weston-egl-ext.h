@@ -123,6 +123,13 @@ typedef struct wl_buffer * (EGLAPIENTRYP PFNEGLCREATEWAYLANDBUFFERFROMIMAGEWL) (
 #define EGL_DMA_BUF_PLANE2_FD_EXT				0x3278
 #define EGL_DMA_BUF_PLANE2_OFFSET_EXT				0x3279
 #define EGL_DMA_BUF_PLANE2_PITCH_EXT				0x327A
+#define EGL_YUV_COLOR_SPACE_HINT_EXT				0x327B
+#define EGL_SAMPLE_RANGE_HINT_EXT				0x327C
+#define EGL_ITU_REC601_EXT					0x327F
+#define EGL_ITU_REC709_EXT					0x3280
+#define EGL_ITU_REC2020_EXT					0x3281
+#define EGL_YUV_FULL_RANGE_EXT					0x3282
+#define EGL_YUV_NARROW_RANGE_EXT				0x3283
 #endif
 
 /* Define tokens from EGL_EXT_image_dma_buf_import_modifiers */
@@ -0,0 +1,207 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "shared/colorspace.h"
+
+/* Linear BT.709 to BT.2020 RGB, row-major, from ITU-R BT.2087 */
+static const double bt709_to_bt2020[3][3] = {
+	{ 0.6274, 0.3293, 0.0433 },
+	{ 0.0691, 0.9195, 0.0114 },
+	{ 0.0164, 0.0880, 0.8956 },
+};
+
+/* The inverse, BT.2020 to BT.709 */
+static const double bt2020_to_bt709[3][3] = {
+	{  1.6605, -0.5876, -0.0728 },
+	{ -0.1246,  1.1329, -0.0083 },
+	{ -0.0182, -0.1006,  1.1187 },
+};
+
+/* Conversion matrices are column-major, as GLSL wants them */
+static double
+elem(const float m[9], int row, int col)
+{
+	return m[col * 3 + row];
+}
+
+static void
+conversion(enum weston_colorspace_enums dst, enum weston_colorspace_enums src,
+	   float m[9])
+{
+	weston_colorspace_conversion_matrix(weston_colorspace_get(dst),
+					    weston_colorspace_get(src), m);
+}
+
+static void
+assert_matrix(const float m[9], const double ref[3][3], double tolerance)
+{
+	int i, j;
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			if (fabs(elem(m, i, j) - ref[i][j]) <= tolerance)
+				continue;
+
+			fprintf(stderr, "element (%d, %d) is %f, expected %f\n",
+				i, j, elem(m, i, j), ref[i][j]);
+			assert(0);
+		}
+	}
+}
+
+TEST(bt709_to_bt2020_matches_bt2087)
+{
+	float m[9];
+
+	conversion(WESTON_CS_BT2020, WESTON_CS_BT709, m);
+	assert_matrix(m, bt709_to_bt2020, 1e-3);
+}
+
+TEST(bt2020_to_bt709_matches_bt2087)
+{
+	float m[9];
+
+	conversion(WESTON_CS_BT709, WESTON_CS_BT2020, m);
+	assert_matrix(m, bt2020_to_bt709, 1e-3);
+}
+
+TEST(conversion_round_trip_is_identity)
+{
+	static const double identity[3][3] = {
+		{ 1.0, 0.0, 0.0 },
+		{ 0.0, 1.0, 0.0 },
+		{ 0.0, 0.0, 1.0 },
+	};
+	float a[9], b[9], p[9];
+	int i, j, k;
+
+	conversion(WESTON_CS_BT2020, WESTON_CS_BT709, a);
+	conversion(WESTON_CS_BT709, WESTON_CS_BT2020, b);
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			double v = 0.0;
+
+			for (k = 0; k < 3; k++)
+				v += elem(b, i, k) * elem(a, k, j);
+			p[j * 3 + i] = v;
+		}
+	}
+
+	assert_matrix(p, identity, 1e-5);
+}
+
+TEST(conversion_keeps_white)
+{
+	float m[9];
+	int i;
+
+	/* Both share D65, so RGB (1, 1, 1) stays white */
+	conversion(WESTON_CS_BT2020, WESTON_CS_BT709, m);
+	for (i = 0; i < 3; i++)
+		assert(fabs(elem(m, i, 0) + elem(m, i, 1) + elem(m, i, 2) -
+			    1.0) < 1e-5);
+}
+
+static double
+pq_oetf(double y)
+{
+	double p = pow(y, WESTON_PQ_M1);
+
+	return pow((WESTON_PQ_C1 + WESTON_PQ_C2 * p) /
+		   (1.0 + WESTON_PQ_C3 * p), WESTON_PQ_M2);
+}
+
+static double
+pq_eotf(double e)
+{
+	double p = pow(e, 1.0 / WESTON_PQ_M2);
+
+	return pow(fmax(p - WESTON_PQ_C1, 0.0) /
+		   (WESTON_PQ_C2 - WESTON_PQ_C3 * p), 1.0 / WESTON_PQ_M1);
+}
+
+TEST(pq_constants)
+{
+	/* The decimal constants are the exact ST 2084 rationals */
+	assert(WESTON_PQ_M1 == 2610.0 / 16384.0);
+	assert(WESTON_PQ_M2 == 2523.0 / 4096.0 * 128.0);
+	assert(WESTON_PQ_C1 == 3424.0 / 4096.0);
+	assert(WESTON_PQ_C2 == 2413.0 / 4096.0 * 32.0);
+	assert(WESTON_PQ_C3 == 2392.0 / 4096.0 * 32.0);
+	assert(WESTON_PQ_C3 - WESTON_PQ_C2 + 1.0 == WESTON_PQ_C1);
+}
+
+TEST(pq_curve)
+{
+	double y;
+
+	assert(fabs(pq_oetf(0.0) - pow(WESTON_PQ_C1, WESTON_PQ_M2)) < 1e-12);
+	assert(fabs(pq_oetf(1.0) - 1.0) < 1e-12);
+
+	/* 100 cd/m² is code value 0.5081 */
+	assert(fabs(pq_oetf(100.0 / 10000.0) - 0.5081) < 1e-4);
+
+	for (y = 0.0001; y <= 1.0; y *= 2.0)
+		assert(fabs(pq_eotf(pq_oetf(y)) - y) < 1e-9 * fmax(y, 1e-3));
+}
+
+static double
+hlg_oetf(double s)
+{
+	if (s <= 1.0 / 12.0)
+		return sqrt(3.0 * s);
+
+	return WESTON_HLG_A * log(12.0 * s - WESTON_HLG_B) + WESTON_HLG_C;
+}
+
+TEST(hlg_constants)
+{
+	assert(fabs(WESTON_HLG_B - (1.0 - 4.0 * WESTON_HLG_A)) < 1e-8);
+	assert(fabs(WESTON_HLG_C -
+		    (0.5 - WESTON_HLG_A * log(4.0 * WESTON_HLG_A))) < 1e-8);
+	assert(fabs(WESTON_BT2020_LUMA_R + WESTON_BT2020_LUMA_G +
+		    WESTON_BT2020_LUMA_B - 1.0) < 1e-12);
+}
+
+TEST(hlg_curve)
+{
+	double below = sqrt(3.0 / 12.0);
+	double above = WESTON_HLG_A * log(1.0 - WESTON_HLG_B) + WESTON_HLG_C;
+
+	/* Both segments meet at 1/12, and the top maps to 1 */
+	assert(fabs(below - 0.5) < 1e-12);
+	assert(fabs(above - 0.5) < 1e-7);
+	assert(fabs(hlg_oetf(1.0) - 1.0) < 1e-7);
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "weston-test-runner.h"
+#include "frame-stats.h"
+#include "shared/helpers.h"
+
+static struct weston_histogram *
+histogram_create(void)
+{
+	struct weston_histogram *h;
+
+	h = calloc(1, sizeof *h);
+	assert(h);
+
+	return h;
+}
+
+/* The value a histogram holding only usec reports for it */
+static uint64_t
+single_value(uint64_t usec)
+{
+	struct weston_histogram *h = histogram_create();
+	uint64_t value;
+
+	weston_histogram_record(h, usec);
+	assert(h->count == 1);
+
+	value = weston_histogram_percentile(h, 0.0);
+	assert(weston_histogram_percentile(h, 50.0) == value);
+	assert(weston_histogram_percentile(h, 100.0) == value);
+
+	free(h);
+
+	return value;
+}
+
+TEST(histogram_empty)
+{
+	struct weston_histogram *h = histogram_create();
+
+	assert(weston_histogram_percentile(h, 0.0) == 0);
+	assert(weston_histogram_percentile(h, 50.0) == 0);
+	assert(weston_histogram_percentile(h, 100.0) == 0);
+
+	free(h);
+}
+
+TEST(histogram_small_values_are_exact)
+{
+	uint64_t v;
+
+	for (v = 0; v < 2 << WESTON_HISTOGRAM_SUB_BITS; v++)
+		assert(single_value(v) == v);
+}
+
+TEST(histogram_bucket_edges)
+{
+	uint64_t prev = 0, v, value;
+	unsigned bit;
+	int d;
+
+	/* Around every power of two, values round up to the top of their
+	 * bucket, within the promised precision, and never go down */
+	for (bit = WESTON_HISTOGRAM_SUB_BITS + 1; bit < 32; bit++) {
+		for (d = -2; d <= 2; d++) {
+			v = (1ull << bit) + d;
+			value = single_value(v);
+
+			assert(value >= v);
+			assert(value - v < v >> WESTON_HISTOGRAM_SUB_BITS);
+			assert(value >= prev);
+			prev = value;
+		}
+
+		/* The power of two itself starts a new bucket */
+		assert(single_value((1ull << bit) - 1) == (1ull << bit) - 1);
+	}
+}
+
+TEST(histogram_overflow)
+{
+	/* Values past 2^32 - 1 all land in the last bucket */
+	assert(single_value(UINT32_MAX) == UINT32_MAX);
+	assert(single_value((uint64_t) UINT32_MAX + 1) == UINT32_MAX);
+	assert(single_value(UINT64_MAX) == UINT32_MAX);
+}
+
+TEST(histogram_percentiles)
+{
+	struct weston_histogram *h = histogram_create();
+	uint64_t v;
+
+	for (v = 1; v <= 100; v++)
+		weston_histogram_record(h, v);
+	assert(h->count == 100);
+
+	assert(weston_histogram_percentile(h, 0.0) == 1);
+	assert(weston_histogram_percentile(h, 1.0) == 1);
+	assert(weston_histogram_percentile(h, 50.0) == 50);
+	assert(weston_histogram_percentile(h, 90.0) == 91);
+	assert(weston_histogram_percentile(h, 99.0) == 99);
+	assert(weston_histogram_percentile(h, 100.0) == 101);
+
+	/* An outlier only shows at the very top */
+	weston_histogram_record(h, UINT64_MAX);
+	assert(weston_histogram_percentile(h, 99.0) == 101);
+	assert(weston_histogram_percentile(h, 100.0) == UINT32_MAX);
+
+	free(h);
+}
+
+static char *
+print_stats(struct weston_frame_stats *stats, bool interval)
+{
+	char *buf;
+	size_t len;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &len);
+	assert(fp);
+	weston_frame_stats_print(stats, fp, interval);
+	fclose(fp);
+
+	return buf;
+}
+
+TEST(frame_stats_intervals)
+{
+	struct weston_frame_stats *stats;
+	struct timespec begin = { 1, 0 };
+	struct timespec end = { 1, 2000000 };
+	struct timespec target = { 1, 1000000 };
+	char *out;
+
+	stats = weston_frame_stats_create();
+	assert(stats);
+
+	out = print_stats(stats, true);
+	assert(strstr(out, "\t0 frames, 0 missed vblanks, 0 late repaints\n"));
+	assert(strstr(out, "\trepaint         0 samples\n"));
+	free(out);
+
+	/* A repaint past its target is late, with no slack, and its
+	 * 2 ms round up to the top of their bucket */
+	weston_frame_stats_repaint(stats, &begin, &end, &target);
+	weston_frame_stats_present(stats, &end, 0, 16666666);
+
+	out = print_stats(stats, true);
+	assert(strstr(out, "\t1 frames, 0 missed vblanks, 1 late repaints\n"));
+	assert(strstr(out, "\trepaint         1 samples, p50 2.015"));
+	assert(strstr(out, "\tslack           1 samples, p50 0.000"));
+	free(out);
+
+	/* Nothing new since the last interval */
+	out = print_stats(stats, true);
+	assert(strstr(out, "\t0 frames, 0 missed vblanks, 0 late repaints\n"));
+	assert(strstr(out, "\trepaint         0 samples\n"));
+	free(out);
+
+	/* The totals keep everything */
+	out = print_stats(stats, false);
+	assert(strstr(out, "\t1 frames, 0 missed vblanks, 1 late repaints\n"));
+	free(out);
+
+	weston_frame_stats_destroy(stats);
+}
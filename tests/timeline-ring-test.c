@@ -0,0 +1,175 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "weston-test-runner.h"
+#include "shared/timeline-ring.h"
+
+#define CAPACITY 8
+
+static struct weston_timeline_ring_header *
+create_ring(void)
+{
+	struct weston_timeline_ring_header *ring;
+
+	ring = calloc(1, sizeof *ring +
+		      CAPACITY * sizeof(struct weston_timeline_record));
+	assert(ring);
+
+	memcpy(ring->magic, WESTON_TIMELINE_RING_MAGIC, sizeof ring->magic);
+	ring->version = WESTON_TIMELINE_RING_VERSION;
+	ring->record_size = sizeof(struct weston_timeline_record);
+	ring->capacity = CAPACITY;
+
+	return ring;
+}
+
+static void
+append(struct weston_timeline_ring_header *ring, uint64_t n)
+{
+	struct weston_timeline_record rec = { 0 };
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		rec.seq = 12345; /* to be ignored */
+		rec.timestamp = 1000 + ring->head;
+		rec.extra = 2000 + ring->head;
+		rec.point = 1 + ring->head % 3;
+		rec.output = 7;
+		rec.flags = WESTON_TIMELINE_RECORD_VBLANK;
+		weston_timeline_ring_append(ring, &rec);
+	}
+}
+
+/* Reads the ring back as the converter does, checking every record */
+static uint64_t
+check_read_back(struct weston_timeline_ring_header *ring, uint64_t first)
+{
+	struct weston_timeline_record rec;
+	uint64_t i, count = 0;
+
+	assert(weston_timeline_ring_start(ring, ring->head) == first);
+
+	for (i = first; i < ring->head; i++) {
+		if (!weston_timeline_ring_read(ring, i, &rec))
+			continue;
+
+		assert(rec.seq == i + 1);
+		assert(rec.timestamp == 1000 + i);
+		assert(rec.extra == 2000 + i);
+		assert(rec.point == 1 + i % 3);
+		assert(rec.output == 7);
+		assert(rec.surface == 0);
+		assert(rec.flags == WESTON_TIMELINE_RECORD_VBLANK);
+		count++;
+	}
+
+	return count;
+}
+
+TEST(ring_empty)
+{
+	struct weston_timeline_ring_header *ring = create_ring();
+
+	assert(check_read_back(ring, 0) == 0);
+
+	free(ring);
+}
+
+TEST(ring_not_full)
+{
+	struct weston_timeline_ring_header *ring = create_ring();
+
+	append(ring, CAPACITY - 3);
+	assert(ring->head == CAPACITY - 3);
+	assert(check_read_back(ring, 0) == CAPACITY - 3);
+
+	free(ring);
+}
+
+TEST(ring_exactly_full)
+{
+	struct weston_timeline_ring_header *ring = create_ring();
+
+	append(ring, CAPACITY);
+	assert(check_read_back(ring, 0) == CAPACITY);
+
+	free(ring);
+}
+
+TEST(ring_wraps_around)
+{
+	struct weston_timeline_ring_header *ring = create_ring();
+	struct weston_timeline_record rec;
+	uint64_t i;
+
+	/* Wrap a few times, ending in the middle of the slots */
+	append(ring, 3 * CAPACITY + 5);
+	assert(ring->head == 3 * CAPACITY + 5);
+	assert(check_read_back(ring, 2 * CAPACITY + 5) == CAPACITY);
+
+	/* Records older than the start were overwritten */
+	for (i = 0; i < 2 * CAPACITY + 5; i++)
+		assert(!weston_timeline_ring_read(ring, i, &rec));
+
+	free(ring);
+}
+
+TEST(ring_skips_uncommitted)
+{
+	struct weston_timeline_ring_header *ring = create_ring();
+	struct weston_timeline_record *slot;
+	uint64_t head;
+
+	append(ring, 2 * CAPACITY + 3);
+	head = ring->head;
+
+	/* A writer that claimed the next slot but did not commit it yet */
+	ring->head++;
+	slot = weston_timeline_ring_slot(ring, head);
+	slot->seq = 0;
+	slot->timestamp = 0;
+
+	/* The start moves on, the claimed slot and the record it is
+	 * overwriting are both skipped */
+	assert(check_read_back(ring, head + 1 - CAPACITY) == CAPACITY - 1);
+
+	/* Once committed, the new record reads back as well */
+	slot->timestamp = 1000 + head;
+	slot->extra = 2000 + head;
+	slot->point = 1 + head % 3;
+	slot->output = 7;
+	slot->surface = 0;
+	slot->flags = WESTON_TIMELINE_RECORD_VBLANK;
+	slot->seq = head + 1;
+	assert(check_read_back(ring, head + 1 - CAPACITY) == CAPACITY);
+
+	free(ring);
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "compositor.h"
+#include "compositor/weston.h"
+
+/*
+ * The view index is internal to libweston, so it is tested through
+ * weston_compositor_pick_view(), which only looks at the views the index
+ * has around the point. Picking also depends on the stacking order of the
+ * last view list build, which only happens on repaint, hence every check
+ * after a restacking waits for one.
+ */
+
+struct test_state {
+	struct weston_compositor *compositor;
+	struct wl_event_source *timer;
+	void (*next)(struct test_state *state);
+	struct weston_layer layer;
+	struct weston_layer background;
+	struct weston_view *a;
+	struct weston_view *b;
+	struct weston_view *big;
+};
+
+static struct weston_view *
+create_view(struct test_state *state, struct weston_layer *layer,
+	    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct weston_surface *surface;
+	struct weston_view *view;
+
+	surface = weston_surface_create(state->compositor);
+	assert(surface);
+	view = weston_view_create(surface);
+	assert(view);
+
+	surface->width = width;
+	surface->height = height;
+	surface->is_mapped = true;
+	view->is_mapped = true;
+
+	weston_view_set_position(view, x, y);
+	weston_layer_entry_insert(&layer->view_list, &view->layer_link);
+	weston_view_update_transform(view);
+
+	return view;
+}
+
+static void
+check_pick(struct test_state *state, int32_t x, int32_t y,
+	   struct weston_view *expected, int32_t ex, int32_t ey)
+{
+	struct weston_view *view;
+	wl_fixed_t vx, vy;
+
+	view = weston_compositor_pick_view(state->compositor,
+					   wl_fixed_from_int(x),
+					   wl_fixed_from_int(y),
+					   &vx, &vy);
+
+	fprintf(stderr, "%d,%d picks %p (expected %p)\n",
+		x, y, (void *) view, (void *) expected);
+	assert(view == expected);
+
+	if (expected) {
+		assert(wl_fixed_to_int(vx) == ex);
+		assert(wl_fixed_to_int(vy) == ey);
+	}
+}
+
+static int
+wait_timer_handler(void *data)
+{
+	struct test_state *state = data;
+
+	if (state->compositor->view_list_needs_rebuild) {
+		wl_event_source_timer_update(state->timer, 10);
+		return 0;
+	}
+
+	state->next(state);
+	return 0;
+}
+
+/* Run next once a repaint has rebuilt the view list */
+static void
+wait_for_view_list(struct test_state *state,
+		   void (*next)(struct test_state *state))
+{
+	state->next = next;
+	weston_compositor_schedule_repaint(state->compositor);
+	wl_event_source_timer_update(state->timer, 10);
+}
+
+static void
+check_removal(struct test_state *state)
+{
+	/* Destroying the views takes them out of the index */
+	weston_surface_destroy(state->big->surface);
+	check_pick(state, 250, 250, state->b, 10, 10);
+	check_pick(state, 100, 100, NULL, 0, 0);
+
+	weston_surface_destroy(state->b->surface);
+	check_pick(state, 250, 250, NULL, 0, 0);
+	check_pick(state, 1050, 1050, state->a, 50, 50);
+
+	weston_surface_destroy(state->a->surface);
+	check_pick(state, 1050, 1050, NULL, 0, 0);
+
+	wl_event_source_remove(state->timer);
+	weston_layer_unset_position(&state->layer);
+	weston_layer_unset_position(&state->background);
+	wl_display_terminate(state->compositor->wl_display);
+	free(state);
+}
+
+static void
+check_raised_layer(struct test_state *state)
+{
+	/* The oversized view now covers everything below it */
+	check_pick(state, 250, 250, state->big, 5250, 5250);
+	check_pick(state, 1050, 1050, state->big, 6050, 6050);
+
+	check_removal(state);
+}
+
+static void
+check_raised_view(struct test_state *state)
+{
+	check_pick(state, 250, 250, state->b, 10, 10);
+	check_pick(state, 210, 210, state->a, 10, 10);
+
+	/* Moving a view re-indexes it without any repaint */
+	weston_view_set_position(state->a, 1000, 1000);
+	weston_view_update_transform(state->a);
+	check_pick(state, 210, 210, state->big, 5210, 5210);
+	check_pick(state, 1050, 1050, state->a, 50, 50);
+
+	weston_layer_set_position(&state->background,
+				  WESTON_LAYER_POSITION_UI);
+	wait_for_view_list(state, check_raised_layer);
+}
+
+static void
+check_initial(struct test_state *state)
+{
+	/* a overlaps b, both straddling the 256 pixel cell boundary */
+	check_pick(state, 250, 250, state->a, 50, 50);
+	check_pick(state, 290, 290, state->a, 90, 90);
+	check_pick(state, 320, 320, state->b, 80, 80);
+
+	/* Only the oversized view is anywhere else */
+	check_pick(state, 100, 100, state->big, 5100, 5100);
+	check_pick(state, -4000, 3000, state->big, 1000, 8000);
+	check_pick(state, 6000, 6000, NULL, 0, 0);
+
+	weston_layer_entry_remove(&state->b->layer_link);
+	weston_layer_entry_insert(&state->layer.view_list,
+				  &state->b->layer_link);
+	wait_for_view_list(state, check_raised_view);
+}
+
+static void
+view_index_test(void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct wl_event_loop *loop;
+	struct test_state *state;
+
+	state = zalloc(sizeof *state);
+	assert(state);
+	state->compositor = compositor;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	state->timer = wl_event_loop_add_timer(loop, wait_timer_handler,
+					       state);
+	assert(state->timer);
+
+	weston_layer_init(&state->layer, compositor);
+	weston_layer_set_position(&state->layer,
+				  WESTON_LAYER_POSITION_NORMAL);
+	weston_layer_init(&state->background, compositor);
+	weston_layer_set_position(&state->background,
+				  WESTON_LAYER_POSITION_BACKGROUND);
+
+	/* Covers far more cells than worth indexing */
+	state->big = create_view(state, &state->background,
+				 -5000, -5000, 10000, 10000);
+
+	/* The last inserted view is on top */
+	state->b = create_view(state, &state->layer, 240, 240, 100, 100);
+	state->a = create_view(state, &state->layer, 200, 200, 100, 100);
+
+	wait_for_view_list(state, check_initial);
+}
+
+WL_EXPORT int
+wet_module_init(struct weston_compositor *compositor,
+		int *argc, char *argv[])
+{
+	struct wl_event_loop *loop;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+
+	wl_event_loop_add_idle(loop, view_index_test, compositor);
+
+	return 0;
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "weston-test-runner.h"
+#include "wcap-encode.h"
+
+#define MAX_WIDTH 67
+#define ROWS 5
+
+/* The encoding pixel by pixel, as the recorder did before
+ * wcap_encode_row() */
+static uint32_t
+scalar_delta(uint32_t next, uint32_t prev)
+{
+	unsigned char dr, dg, db;
+
+	dr = (next >> 16) - (prev >> 16);
+	dg = (next >>  8) - (prev >>  8);
+	db = (next >>  0) - (prev >>  0);
+
+	return (dr << 16) | (dg << 8) | (db << 0);
+}
+
+static uint32_t *
+scalar_encode_row(uint32_t *p, uint32_t *d, const uint32_t *s, int width,
+		  uint32_t *prev, int *run)
+{
+	uint32_t delta;
+	int k;
+
+	for (k = 0; k < width; k++) {
+		delta = scalar_delta(s[k], d[k]);
+		d[k] = s[k];
+		if (*run == 0 || delta == *prev) {
+			(*run)++;
+		} else {
+			p = wcap_output_run(p, *prev, *run);
+			*run = 1;
+		}
+		*prev = delta;
+	}
+
+	return p;
+}
+
+enum pattern {
+	PATTERN_RANDOM,
+	PATTERN_UNCHANGED,
+	PATTERN_ALPHA_ONLY,	/* the X byte is not encoded */
+	PATTERN_SPARSE,
+	PATTERN_STRIPES,
+};
+
+static uint32_t
+next_random(uint32_t *state)
+{
+	/* xorshift32 */
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+
+	return *state;
+}
+
+static void
+fill_rows(enum pattern pattern, uint32_t *ref, uint32_t *src, int n,
+	  uint32_t seed)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		ref[i] = next_random(&seed);
+
+		switch (pattern) {
+		case PATTERN_RANDOM:
+			src[i] = next_random(&seed);
+			break;
+		case PATTERN_UNCHANGED:
+			src[i] = ref[i];
+			break;
+		case PATTERN_ALPHA_ONLY:
+			src[i] = ref[i] ^ 0xff000000;
+			break;
+		case PATTERN_SPARSE:
+			src[i] = ref[i];
+			if (next_random(&seed) % 11 == 0)
+				src[i] += 0x00010203;
+			break;
+		case PATTERN_STRIPES:
+			/* Equal deltas in runs of 3, straddling vectors */
+			src[i] = ref[i] + 0x00101010 * (i / 3 % 2);
+			break;
+		default:
+			assert(0);
+		}
+	}
+}
+
+/* Encodes ROWS rows of width pixels both ways, carrying the run across
+ * rows as the recorder does, and compares the output and the updated
+ * reference frames */
+static void
+check_encoding(enum pattern pattern, int width, uint32_t seed)
+{
+	uint32_t ref_scalar[ROWS * MAX_WIDTH], ref_vector[ROWS * MAX_WIDTH];
+	uint32_t src[ROWS * MAX_WIDTH];
+	uint32_t out_scalar[ROWS * MAX_WIDTH + 1];
+	uint32_t out_vector[ROWS * MAX_WIDTH + 1];
+	uint32_t *ps = out_scalar, *pv = out_vector;
+	uint32_t prev_scalar = 0, prev_vector = 0;
+	int run_scalar = 0, run_vector = 0;
+	int j;
+
+	fill_rows(pattern, ref_scalar, src, ROWS * width, seed);
+	memcpy(ref_vector, ref_scalar, sizeof ref_vector);
+
+	for (j = 0; j < ROWS; j++) {
+		ps = scalar_encode_row(ps, ref_scalar + j * width,
+				       src + j * width, width,
+				       &prev_scalar, &run_scalar);
+		pv = wcap_encode_row(pv, ref_vector + j * width,
+				     src + j * width, width,
+				     &prev_vector, &run_vector);
+
+		assert(pv - out_vector == ps - out_scalar);
+		assert(run_vector == run_scalar);
+		if (run_scalar > 0)
+			assert(prev_vector == prev_scalar);
+	}
+
+	ps = wcap_output_run(ps, prev_scalar, run_scalar);
+	pv = wcap_output_run(pv, prev_vector, run_vector);
+
+	assert(pv - out_vector == ps - out_scalar);
+	assert(memcmp(out_vector, out_scalar,
+		      (ps - out_scalar) * sizeof *ps) == 0);
+	assert(memcmp(ref_vector, src, ROWS * width * sizeof *src) == 0);
+	assert(memcmp(ref_scalar, src, ROWS * width * sizeof *src) == 0);
+}
+
+static const enum pattern patterns[] = {
+	PATTERN_RANDOM,
+	PATTERN_UNCHANGED,
+	PATTERN_ALPHA_ONLY,
+	PATTERN_SPARSE,
+	PATTERN_STRIPES,
+};
+
+TEST_P(encode_row_matches_scalar, patterns)
+{
+	enum pattern pattern = *(const enum pattern *) data;
+	int width;
+
+	/* Every remainder of the vector width, on short and long rows */
+	for (width = 0; width <= MAX_WIDTH; width++) {
+		check_encoding(pattern, width, 1 + width);
+		check_encoding(pattern, width, 0x9e3779b9 ^ width);
+	}
+}
+
+TEST(long_runs)
+{
+	static uint32_t ref[4000], src[4000];
+	static uint32_t out[4000];
+	uint32_t prev = 0, delta, *p = out;
+	int run = 0, total = 0, i;
+
+	/* An unchanged area longer than a single run word covers */
+	for (i = 0; i < 3999; i++)
+		ref[i] = src[i] = i;
+	src[3999] = ref[3999] + 1;
+
+	p = wcap_encode_row(p, ref, src, 4000, &prev, &run);
+	p = wcap_output_run(p, prev, run);
+
+	/* Decode the lengths back, see wcap/README */
+	for (i = 0; i < p - out; i++) {
+		delta = out[i] & 0x00ffffff;
+		if (out[i] >> 24 < 0xe0)
+			run = (out[i] >> 24) + 1;
+		else
+			run = 1 << ((out[i] >> 24) - 0xe0 + 7);
+
+		if (total < 3999)
+			assert(delta == 0);
+		else
+			assert(delta == 0x000001);
+		total += run;
+	}
+
+	assert(total == 4000);
+}
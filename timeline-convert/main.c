@@ -0,0 +1,407 @@
+/*
+ * Copyright © 2026 agent
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shared/timeline-ring.h"
+
+/* Chrome trace thread for points without an output */
+#define CHROME_TID_COMPOSITOR 0
+/* Chrome trace threads for GPU points are offset from their output */
+#define CHROME_TID_GPU_BASE 100000
+
+struct timeline_name {
+	uint32_t id;
+	char *name;
+};
+
+struct timeline {
+	const struct weston_timeline_ring_header *ring;
+	size_t size;
+
+	FILE *log;
+
+	struct timeline_name *points;
+	unsigned n_points;
+
+	struct timeline_name *outputs;
+	unsigned n_outputs;
+};
+
+static void
+add_name(struct timeline_name **names, unsigned *count,
+	 uint32_t id, const char *name)
+{
+	struct timeline_name *n;
+
+	n = realloc(*names, (*count + 1) * sizeof **names);
+	if (!n) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	n[*count].id = id;
+	n[*count].name = strdup(name);
+	*names = n;
+	(*count)++;
+}
+
+static const char *
+find_name(const struct timeline_name *names, unsigned count, uint32_t id)
+{
+	unsigned i;
+
+	for (i = 0; i < count; i++)
+		if (names[i].id == id)
+			return names[i].name;
+
+	return NULL;
+}
+
+/* Picks the quoted string following key out of a log line. The names
+ * weston writes are plain enough that escapes can be kept as they are. */
+static bool
+get_string(const char *line, const char *key, char *out, size_t len)
+{
+	const char *p, *end;
+
+	p = strstr(line, key);
+	if (!p)
+		return false;
+
+	p += strlen(key);
+	if (*p != '"')
+		return false;
+	p++;
+
+	for (end = p; *end && *end != '"'; end++)
+		if (*end == '\\' && end[1])
+			end++;
+
+	if (*end != '"' || (size_t) (end - p) >= len)
+		return false;
+
+	memcpy(out, p, end - p);
+	out[end - p] = '\0';
+
+	return true;
+}
+
+static int
+load_log(struct timeline *tl, const char *filename)
+{
+	char line[1024];
+	char name[512];
+	uint32_t id;
+
+	tl->log = fopen(filename, "r");
+	if (!tl->log) {
+		fprintf(stderr, "cannot open %s: %s\n",
+			filename, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof line, tl->log)) {
+		if (sscanf(line, "{ \"point\":%" SCNu32, &id) == 1 &&
+		    get_string(line, "\"name\":", name, sizeof name))
+			add_name(&tl->points, &tl->n_points, id, name);
+		else if (sscanf(line, "{ \"id\":%" SCNu32, &id) == 1 &&
+			 strstr(line, "\"type\":\"weston_output\"") &&
+			 get_string(line, "\"name\":", name, sizeof name))
+			add_name(&tl->outputs, &tl->n_outputs, id, name);
+	}
+
+	return 0;
+}
+
+static int
+load_ring(struct timeline *tl, const char *filename)
+{
+	const struct weston_timeline_ring_header *ring;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "cannot open %s: %s\n",
+			filename, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof *ring) {
+		fprintf(stderr, "%s: not a binary timeline\n", filename);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "cannot map %s: %s\n",
+			filename, strerror(errno));
+		return -1;
+	}
+
+	ring = map;
+	if (memcmp(ring->magic, WESTON_TIMELINE_RING_MAGIC,
+		   sizeof ring->magic) != 0 ||
+	    ring->version != WESTON_TIMELINE_RING_VERSION ||
+	    ring->record_size != sizeof(struct weston_timeline_record) ||
+	    ring->capacity == 0 ||
+	    ring->capacity > (st.st_size - sizeof *ring) / ring->record_size) {
+		fprintf(stderr, "%s: not a binary timeline\n", filename);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	tl->ring = ring;
+	tl->size = st.st_size;
+
+	return 0;
+}
+
+typedef void (*record_func)(struct timeline *tl,
+			    const struct weston_timeline_record *rec,
+			    const char *name, bool *first);
+
+/* Calls func for the records still in the ring, oldest first */
+static void
+for_each_record(struct timeline *tl, record_func func, bool *first)
+{
+	struct weston_timeline_record rec;
+	uint64_t head, i;
+	const char *name;
+
+	head = __atomic_load_n(&tl->ring->head, __ATOMIC_ACQUIRE);
+
+	for (i = weston_timeline_ring_start(tl->ring, head); i < head; i++) {
+		/* Skip records claimed but not written yet, or overwritten
+		 * while being copied, when the ring is still in use */
+		if (!weston_timeline_ring_read(tl->ring, i, &rec))
+			continue;
+
+		name = find_name(tl->points, tl->n_points, rec.point);
+		if (!name)
+			continue;
+
+		func(tl, &rec, name, first);
+	}
+}
+
+static void
+print_json_time(const char *key, uint64_t nsec)
+{
+	printf(", \"%s\":[%" PRIu64 ", %" PRIu64 "]",
+	       key, nsec / 1000000000, nsec % 1000000000);
+}
+
+static void
+print_json_record(struct timeline *tl,
+		  const struct weston_timeline_record *rec,
+		  const char *name, bool *first)
+{
+	printf("{ \"T\":[%" PRIu64 ", %" PRIu64 "], \"N\":\"%s\"",
+	       rec->timestamp / 1000000000, rec->timestamp % 1000000000,
+	       name);
+
+	if (rec->output)
+		printf(", \"wo\":%" PRIu32, rec->output);
+	if (rec->surface)
+		printf(", \"ws\":%" PRIu32, rec->surface);
+	if (rec->flags & WESTON_TIMELINE_RECORD_VBLANK)
+		print_json_time("vblank", rec->extra);
+	if (rec->flags & WESTON_TIMELINE_RECORD_GPU)
+		print_json_time("gpu", rec->extra);
+
+	printf(" }\n");
+}
+
+/* Writes the timeline in the format weston writes in text mode */
+static void
+convert_json(struct timeline *tl)
+{
+	char line[1024];
+	bool first = true;
+
+	rewind(tl->log);
+	while (fgets(line, sizeof line, tl->log))
+		if (strncmp(line, "{ \"point\":", 10) != 0)
+			fputs(line, stdout);
+
+	for_each_record(tl, print_json_record, &first);
+}
+
+static void
+print_chrome_event(bool *first, const char *name, char phase,
+		   uint64_t nsec, uint32_t tid)
+{
+	printf("%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":0,\"tid\":%" PRIu32
+	       ",\"ts\":%" PRIu64 ".%03" PRIu64 "%s}",
+	       *first ? "" : ",", name, phase, tid,
+	       nsec / 1000, nsec % 1000, phase == 'i' ? ",\"s\":\"t\"" : "");
+	*first = false;
+}
+
+static void
+print_chrome_record(struct timeline *tl,
+		    const struct weston_timeline_record *rec,
+		    const char *name, bool *first)
+{
+	uint32_t tid = rec->output ? rec->output : CHROME_TID_COMPOSITOR;
+
+	if (rec->flags & WESTON_TIMELINE_RECORD_GPU) {
+		/* GPU work shows as a span at the GPU's own time */
+		if (strcmp(name, "renderer_gpu_begin") == 0)
+			print_chrome_event(first, "gpu", 'B', rec->extra,
+					   CHROME_TID_GPU_BASE + tid);
+		else if (strcmp(name, "renderer_gpu_end") == 0)
+			print_chrome_event(first, "gpu", 'E', rec->extra,
+					   CHROME_TID_GPU_BASE + tid);
+		else
+			print_chrome_event(first, name, 'i', rec->extra,
+					   CHROME_TID_GPU_BASE + tid);
+		return;
+	}
+
+	print_chrome_event(first, name, 'i', rec->timestamp, tid);
+
+	if (rec->flags & WESTON_TIMELINE_RECORD_VBLANK)
+		print_chrome_event(first, "vblank", 'i', rec->extra, tid);
+}
+
+static void
+print_chrome_thread_name(bool *first, uint32_t tid,
+			 const char *prefix, const char *name)
+{
+	printf("%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,"
+	       "\"tid\":%" PRIu32 ",\"args\":{\"name\":\"%s%s\"}}",
+	       *first ? "" : ",", tid, prefix, name);
+	*first = false;
+}
+
+/* Writes the timeline as Chrome trace events, one thread per output */
+static void
+convert_chrome(struct timeline *tl)
+{
+	const struct timeline_name *o;
+	bool first = true;
+	unsigned i;
+
+	printf("{\"traceEvents\":[");
+
+	print_chrome_thread_name(&first, CHROME_TID_COMPOSITOR,
+				 "", "compositor");
+	for (i = 0; i < tl->n_outputs; i++) {
+		o = &tl->outputs[i];
+		print_chrome_thread_name(&first, o->id, "", o->name);
+		print_chrome_thread_name(&first, CHROME_TID_GPU_BASE + o->id,
+					 "GPU ", o->name);
+	}
+
+	for_each_record(tl, print_chrome_record, &first);
+
+	printf("\n]}\n");
+}
+
+static void
+usage(const char *name, int status)
+{
+	fprintf(status == EXIT_SUCCESS ? stdout : stderr,
+		"usage: %s [--json|--chrome] weston-timeline-*.bin\n"
+		"\n"
+		"Converts a binary weston timeline and the .log file next\n"
+		"to it to text, printed on standard output.\n"
+		"\n"
+		"\t--json\t\tthe JSON format weston writes (default)\n"
+		"\t--chrome\tChrome trace event format\n"
+		"\t--help\t\tshow this help\n",
+		name);
+	exit(status);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct timeline tl = { 0 };
+	const char *input = NULL;
+	bool chrome = false;
+	char *logname;
+	size_t len;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--json") == 0)
+			chrome = false;
+		else if (strcmp(argv[i], "--chrome") == 0)
+			chrome = true;
+		else if (strcmp(argv[i], "--help") == 0)
+			usage(argv[0], EXIT_SUCCESS);
+		else if (argv[i][0] == '-' || input)
+			usage(argv[0], EXIT_FAILURE);
+		else
+			input = argv[i];
+	}
+
+	if (!input)
+		usage(argv[0], EXIT_FAILURE);
+
+	len = strlen(input);
+	if (len < 4 || strcmp(input + len - 4, ".bin") != 0) {
+		fprintf(stderr, "%s: expected a .bin file\n", input);
+		return EXIT_FAILURE;
+	}
+
+	logname = strdup(input);
+	if (!logname)
+		return EXIT_FAILURE;
+	strcpy(logname + len - 4, ".log");
+
+	if (load_ring(&tl, input) < 0 || load_log(&tl, logname) < 0)
+		return EXIT_FAILURE;
+
+	if (chrome)
+		convert_chrome(&tl);
+	else
+		convert_json(&tl);
+
+	free(logname);
+	fclose(tl.log);
+	munmap((void *) tl.ring, tl.size);
+
+	return EXIT_SUCCESS;
+}
@@ -25,6 +25,7 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,18 +41,61 @@
 #define wm_log(...) do {} while (0)
 #endif
 
+/* Selections are moved between the X server and the fds in chunks of at
+ * most this size, which bounds what is buffered in the compositor */
+static const size_t incr_chunk_size = 64 * 1024;
+
+/* Reads the next chunk of the selection property, from
+ * wm->property_offset on */
+static xcb_get_property_reply_t *
+weston_wm_get_property_chunk(struct weston_wm *wm)
+{
+	xcb_get_property_cookie_t cookie;
+	xcb_get_property_reply_t *reply;
+	FILE *fp;
+	char *logstr;
+	size_t logsize;
+
+	cookie = xcb_get_property(wm->conn,
+				  0, /* delete */
+				  wm->selection_window,
+				  wm->atom.wl_selection,
+				  XCB_GET_PROPERTY_TYPE_ANY,
+				  wm->property_offset / 4,
+				  incr_chunk_size / 4);
+
+	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	if (reply == NULL)
+		return NULL;
+
+	fp = open_memstream(&logstr, &logsize);
+	if (fp) {
+		dump_property(fp, wm, wm->atom.wl_selection, reply);
+		if (fclose(fp) == 0)
+			wm_log("%s", logstr);
+		free(logstr);
+	}
+
+	wm->property_offset += xcb_get_property_value_length(reply);
+
+	return reply;
+}
+
 static int
 writable_callback(int fd, uint32_t mask, void *data)
 {
 	struct weston_wm *wm = data;
 	unsigned char *property;
 	int len, remainder;
+	bool more;
 
 	property = xcb_get_property_value(wm->property_reply);
 	remainder = xcb_get_property_value_length(wm->property_reply) -
 		wm->property_start;
 
 	len = write(fd, property + wm->property_start, remainder);
+	if (len == -1 && errno == EAGAIN)
+		return 1;
 	if (len == -1) {
 		free(wm->property_reply);
 		wm->property_reply = NULL;
@@ -63,28 +107,43 @@ writable_callback(int fd, uint32_t mask, void *data)
 		return 1;
 	}
 
-	weston_log("wrote %d (chunk size %d) of %d bytes\n",
-		wm->property_start + len,
-		len, xcb_get_property_value_length(wm->property_reply));
+	wm_log("wrote %d (chunk size %d) of %d bytes\n",
+	       wm->property_start + len,
+	       len, xcb_get_property_value_length(wm->property_reply));
 
 	wm->property_start += len;
-	if (len == remainder) {
-		free(wm->property_reply);
-		wm->property_reply = NULL;
-		if (wm->property_source)
-			wl_event_source_remove(wm->property_source);
-		wm->property_source = NULL;
+	if (len < remainder)
+		return 1;
 
-		if (wm->incr) {
-			xcb_delete_property(wm->conn,
-					    wm->selection_window,
-					    wm->atom.wl_selection);
-		} else {
-			weston_log("transfer complete\n");
-			close(fd);
-		}
+	/* The rest of the property is only read once the fd took this
+	 * chunk, so a slow reader holds the transfer back */
+	more = wm->property_reply->bytes_after > 0;
+	free(wm->property_reply);
+	wm->property_reply = NULL;
+	wm->property_start = 0;
+
+	if (more) {
+		wm->property_reply = weston_wm_get_property_chunk(wm);
+		if (wm->property_reply)
+			return 1;
+		weston_log("failed to read selection property\n");
+		wm->incr = 0;
 	}
 
+	if (wm->property_source)
+		wl_event_source_remove(wm->property_source);
+	wm->property_source = NULL;
+
+	/* Deleting the property asks an INCR owner for the next chunk */
+	xcb_delete_property(wm->conn,
+			    wm->selection_window,
+			    wm->atom.wl_selection);
+	if (!wm->incr) {
+		weston_log("transfer complete\n");
+		close(fd);
+	}
+	xcb_flush(wm->conn);
+
 	return 1;
 }
 
@@ -106,32 +165,13 @@ weston_wm_write_property(struct weston_wm *wm, xcb_get_property_reply_t *reply)
 static void
 weston_wm_get_incr_chunk(struct weston_wm *wm)
 {
-	xcb_get_property_cookie_t cookie;
 	xcb_get_property_reply_t *reply;
-	FILE *fp;
-	char *logstr;
-	size_t logsize;
-
-	cookie = xcb_get_property(wm->conn,
-				  0, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
 
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
+	wm->property_offset = 0;
+	reply = weston_wm_get_property_chunk(wm);
 	if (reply == NULL)
 		return;
 
-	fp = open_memstream(&logstr, &logsize);
-	if (fp) {
-		dump_property(fp, wm, wm->atom.wl_selection, reply);
-		if (fclose(fp) == 0)
-			wm_log("%s", logstr);
-		free(logstr);
-	}
-
 	if (xcb_get_property_value_length(reply) > 0) {
 		/* reply's ownership is transferred to wm, which is responsible
 		 * for freeing it */
@@ -254,35 +294,21 @@ weston_wm_get_selection_targets(struct weston_wm *wm)
 static void
 weston_wm_get_selection_data(struct weston_wm *wm)
 {
-	xcb_get_property_cookie_t cookie;
 	xcb_get_property_reply_t *reply;
-	FILE *fp;
-	char *logstr;
-	size_t logsize;
-
-	cookie = xcb_get_property(wm->conn,
-				  1, /* delete */
-				  wm->selection_window,
-				  wm->atom.wl_selection,
-				  XCB_GET_PROPERTY_TYPE_ANY,
-				  0, /* offset */
-				  0x1fffffff /* length */);
-
-	reply = xcb_get_property_reply(wm->conn, cookie, NULL);
 
-	fp = open_memstream(&logstr, &logsize);
-	if (fp) {
-		dump_property(fp, wm, wm->atom.wl_selection, reply);
-		if (fclose(fp) == 0)
-			wm_log("%s", logstr);
-		free(logstr);
-	}
+	wm->property_offset = 0;
+	reply = weston_wm_get_property_chunk(wm);
 
 	if (reply == NULL) {
 		return;
 	} else if (reply->type == wm->atom.incr) {
 		wm->incr = 1;
 		free(reply);
+		/* Start the transfer */
+		xcb_delete_property(wm->conn,
+				    wm->selection_window,
+				    wm->atom.wl_selection);
+		xcb_flush(wm->conn);
 	} else {
 		wm->incr = 0;
 		/* reply's ownership is transferred to wm, which is responsible
@@ -307,8 +333,6 @@ weston_wm_handle_selection_notify(struct weston_wm *wm,
 	}
 }
 
-static const size_t incr_chunk_size = 64 * 1024;
-
 static void
 weston_wm_send_selection_notify(struct weston_wm *wm, xcb_atom_t property)
 {
@@ -408,10 +432,11 @@ weston_wm_read_data_source(int fd, uint32_t mask, void *data)
 		wm->property_source = NULL;
 		close(fd);
 		wl_array_release(&wm->source_data);
+		return 1;
 	}
 
-	weston_log("read %d (available %d, mask 0x%x) bytes: \"%.*s\"\n",
-		len, available, mask, len, (char *) p);
+	wm_log("read %d (available %d, mask 0x%x) bytes: \"%.*s\"\n",
+	       len, available, mask, len, (char *) p);
 
 	wm->source_data.size = current + len;
 	if (wm->source_data.size >= incr_chunk_size) {
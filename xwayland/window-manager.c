@@ -133,12 +133,45 @@ struct weston_output_weak_ref {
 	struct wl_listener destroy_listener;
 };
 
+/* Number of properties weston_wm_window_read_properties() reads */
+#define WM_WINDOW_PROPERTIES 11
+
+/* What the frame window of a weston_wm_window was last drawn with */
+enum decoration_state {
+	DECORATION_DRAWN = 1 << 0,
+	DECORATION_FULLSCREEN = 1 << 1,
+	DECORATION_FRAME = 1 << 2,
+	DECORATION_ACTIVE = 1 << 3,
+	DECORATION_MAXIMIZED = 1 << 4,
+};
+
+/* Requests sent for a window created in the event batch being processed,
+ * before weston_wm_window_create() gets to it */
+struct weston_wm_window_prefetch {
+	struct wl_list link;	/* weston_wm::window_prefetch_list */
+	xcb_window_t id;
+	xcb_get_geometry_cookie_t geometry_cookie;
+	xcb_get_property_cookie_t property_cookies[WM_WINDOW_PROPERTIES];
+};
+
+/* A shadow only depends on the frame size and on the theme, which is the
+ * same for all windows of a WM, so windows of the same size share one */
+struct weston_wm_shadow {
+	struct wl_list link;	/* weston_wm::shadow_list */
+	int refcount;
+	int width, height;
+	cairo_surface_t *surface;	/* server side, frame sized */
+};
+
 struct weston_wm_window {
 	struct weston_wm *wm;
 	xcb_window_t id;
 	xcb_window_t frame_id;
 	struct frame *frame;
 	cairo_surface_t *cairo_surface;
+	struct weston_wm_shadow *shadow;
+	uint32_t drawn_state;		/* enum decoration_state */
+	int drawn_width, drawn_height;
 	uint32_t surface_id;
 	struct weston_surface *surface;
 	struct weston_desktop_xwayland_surface *shsurf;
@@ -146,6 +179,9 @@ struct weston_wm_window {
 	struct wl_event_source *repaint_source;
 	struct wl_event_source *configure_source;
 	int properties_dirty;
+	/* Requested but not read yet, see weston_wm_window_fetch_properties() */
+	bool properties_pending;
+	xcb_get_property_cookie_t property_cookies[WM_WINDOW_PROPERTIES];
 	int pid;
 	char *machine;
 	char *class;
@@ -499,50 +535,93 @@ read_and_dump_property(FILE *fp, struct weston_wm *wm,
 #define TYPE_NET_WM_STATE	XCB_ATOM_CUT_BUFFER2
 #define TYPE_WM_NORMAL_HINTS	XCB_ATOM_CUT_BUFFER3
 
+/* Sends the requests for the properties the window manager tracks, in the
+ * order weston_wm_window_apply_properties() expects the replies */
 static void
-weston_wm_window_read_properties(struct weston_wm_window *window)
+weston_wm_request_properties(struct weston_wm *wm, xcb_window_t id,
+			     xcb_get_property_cookie_t *cookie)
+{
+	const xcb_atom_t atoms[WM_WINDOW_PROPERTIES] = {
+		XCB_ATOM_WM_CLASS,
+		XCB_ATOM_WM_NAME,
+		XCB_ATOM_WM_TRANSIENT_FOR,
+		wm->atom.wm_protocols,
+		wm->atom.wm_normal_hints,
+		wm->atom.net_wm_state,
+		wm->atom.net_wm_window_type,
+		wm->atom.net_wm_name,
+		wm->atom.net_wm_pid,
+		wm->atom.motif_wm_hints,
+		wm->atom.wm_client_machine,
+	};
+	uint32_t i;
+
+	for (i = 0; i < WM_WINDOW_PROPERTIES; i++)
+		cookie[i] = xcb_get_property(wm->conn,
+					     0, /* delete */
+					     id,
+					     atoms[i],
+					     XCB_ATOM_ANY, 0, 2048);
+}
+
+static void
+weston_wm_discard_properties(struct weston_wm *wm,
+			     xcb_get_property_cookie_t *cookie)
+{
+	uint32_t i;
+
+	for (i = 0; i < WM_WINDOW_PROPERTIES; i++)
+		xcb_discard_reply(wm->conn, cookie[i].sequence);
+}
+
+/* Sends the property requests of a window whose properties changed,
+ * without waiting for the replies. Fetching for many windows before
+ * reading any of them takes a single round trip. */
+static void
+weston_wm_window_fetch_properties(struct weston_wm_window *window)
+{
+	if (!window->properties_dirty || window->properties_pending)
+		return;
+
+	weston_wm_request_properties(window->wm, window->id,
+				     window->property_cookies);
+	window->properties_dirty = 0;
+	window->properties_pending = true;
+}
+
+static void
+weston_wm_window_apply_properties(struct weston_wm_window *window)
 {
 	struct weston_wm *wm = window->wm;
 
 #define F(field) (&window->field)
+	/* In the order of weston_wm_request_properties() */
 	const struct {
-		xcb_atom_t atom;
 		xcb_atom_t type;
 		void *ptr;
-	} props[] = {
-		{ XCB_ATOM_WM_CLASS,           XCB_ATOM_STRING,            F(class) },
-		{ XCB_ATOM_WM_NAME,            XCB_ATOM_STRING,            F(name) },
-		{ XCB_ATOM_WM_TRANSIENT_FOR,   XCB_ATOM_WINDOW,            F(transient_for) },
-		{ wm->atom.wm_protocols,       TYPE_WM_PROTOCOLS,          NULL },
-		{ wm->atom.wm_normal_hints,    TYPE_WM_NORMAL_HINTS,       NULL },
-		{ wm->atom.net_wm_state,       TYPE_NET_WM_STATE,          NULL },
-		{ wm->atom.net_wm_window_type, XCB_ATOM_ATOM,              F(type) },
-		{ wm->atom.net_wm_name,        XCB_ATOM_STRING,            F(name) },
-		{ wm->atom.net_wm_pid,         XCB_ATOM_CARDINAL,          F(pid) },
-		{ wm->atom.motif_wm_hints,     TYPE_MOTIF_WM_HINTS,        NULL },
-		{ wm->atom.wm_client_machine,  XCB_ATOM_WM_CLIENT_MACHINE, F(machine) },
+	} props[WM_WINDOW_PROPERTIES] = {
+		{ XCB_ATOM_STRING,             F(class)          }, /* WM_CLASS */
+		{ XCB_ATOM_STRING,             F(name)           }, /* WM_NAME */
+		{ XCB_ATOM_WINDOW,             F(transient_for)  }, /* WM_TRANSIENT_FOR */
+		{ TYPE_WM_PROTOCOLS,           NULL              }, /* WM_PROTOCOLS */
+		{ TYPE_WM_NORMAL_HINTS,        NULL              }, /* WM_NORMAL_HINTS */
+		{ TYPE_NET_WM_STATE,           NULL              }, /* _NET_WM_STATE */
+		{ XCB_ATOM_ATOM,               F(type)           }, /* _NET_WM_WINDOW_TYPE */
+		{ XCB_ATOM_STRING,             F(name)           }, /* _NET_WM_NAME */
+		{ XCB_ATOM_CARDINAL,           F(pid)            }, /* _NET_WM_PID */
+		{ TYPE_MOTIF_WM_HINTS,         NULL              }, /* _MOTIF_WM_HINTS */
+		{ XCB_ATOM_WM_CLIENT_MACHINE,  F(machine)        }, /* WM_CLIENT_MACHINE */
 	};
 #undef F
 
-	xcb_get_property_cookie_t cookie[ARRAY_LENGTH(props)];
+	xcb_get_property_cookie_t *cookie = window->property_cookies;
 	xcb_get_property_reply_t *reply;
 	void *p;
 	uint32_t *xid;
 	xcb_atom_t *atom;
-	uint32_t i;
+	uint32_t i, j;
 	char name[1024];
 
-	if (!window->properties_dirty)
-		return;
-	window->properties_dirty = 0;
-
-	for (i = 0; i < ARRAY_LENGTH(props); i++)
-		cookie[i] = xcb_get_property(wm->conn,
-					     0, /* delete */
-					     window->id,
-					     props[i].atom,
-					     XCB_ATOM_ANY, 0, 2048);
-
 	window->decorate = window->override_redirect ? 0 : MWM_DECOR_EVERYTHING;
 	window->size_hints.flags = 0;
 	window->motif_hints.flags = 0;
@@ -586,8 +665,8 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 			break;
 		case TYPE_WM_PROTOCOLS:
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++)
-				if (atom[i] == wm->atom.wm_delete_window) {
+			for (j = 0; j < reply->value_len; j++)
+				if (atom[j] == wm->atom.wm_delete_window) {
 					window->delete_window = 1;
 					break;
 				}
@@ -600,12 +679,12 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 		case TYPE_NET_WM_STATE:
 			window->fullscreen = 0;
 			atom = xcb_get_property_value(reply);
-			for (i = 0; i < reply->value_len; i++) {
-				if (atom[i] == wm->atom.net_wm_state_fullscreen)
+			for (j = 0; j < reply->value_len; j++) {
+				if (atom[j] == wm->atom.net_wm_state_fullscreen)
 					window->fullscreen = 1;
-				if (atom[i] == wm->atom.net_wm_state_maximized_vert)
+				if (atom[j] == wm->atom.net_wm_state_maximized_vert)
 					window->maximized_vert = 1;
-				if (atom[i] == wm->atom.net_wm_state_maximized_horz)
+				if (atom[j] == wm->atom.net_wm_state_maximized_horz)
 					window->maximized_horz = 1;
 			}
 			break;
@@ -646,6 +725,21 @@ weston_wm_window_read_properties(struct weston_wm_window *window)
 	}
 }
 
+static void
+weston_wm_window_read_properties(struct weston_wm_window *window)
+{
+	weston_wm_window_fetch_properties(window);
+
+	while (window->properties_pending) {
+		window->properties_pending = false;
+		weston_wm_window_apply_properties(window);
+
+		/* The properties changed again while the replies were
+		 * in flight */
+		weston_wm_window_fetch_properties(window);
+	}
+}
+
 #undef TYPE_WM_PROTOCOLS
 #undef TYPE_MOTIF_WM_HINTS
 #undef TYPE_NET_WM_STATE
@@ -1064,6 +1158,7 @@ weston_wm_window_create_frame(struct weston_wm_window *window)
 							     window->frame_id,
 							     &wm->format_rgba,
 							     width, height);
+	window->drawn_state = 0;
 
 	hash_table_insert(wm->window_hash, window->frame_id, window);
 }
@@ -1212,38 +1307,145 @@ weston_wm_handle_unmap_notify(struct weston_wm *wm, xcb_generic_event_t *event)
 	weston_wm_window_set_virtual_desktop(window, -1);
 
 	xcb_unmap_window(wm->conn, window->frame_id);
+
+	/* The frame window loses its contents, draw it again when the
+	 * window is mapped again */
+	window->drawn_state = 0;
+}
+
+static void
+weston_wm_window_put_shadow(struct weston_wm_window *window)
+{
+	struct weston_wm_shadow *shadow = window->shadow;
+
+	window->shadow = NULL;
+	if (!shadow || --shadow->refcount > 0)
+		return;
+
+	cairo_surface_destroy(shadow->surface);
+	wl_list_remove(&shadow->link);
+	free(shadow);
+}
+
+/* The shadow is drawn once per frame size into a pixmap, shared by all
+ * windows of that size and copied from there on the X server. */
+static cairo_surface_t *
+weston_wm_window_get_shadow(struct weston_wm_window *window,
+			    int width, int height)
+{
+	struct weston_wm *wm = window->wm;
+	struct weston_wm_shadow *shadow;
+	cairo_t *cr;
+
+	if (window->shadow &&
+	    window->shadow->width == width && window->shadow->height == height)
+		return window->shadow->surface;
+
+	weston_wm_window_put_shadow(window);
+
+	wl_list_for_each(shadow, &wm->shadow_list, link) {
+		if (shadow->width == width && shadow->height == height) {
+			shadow->refcount++;
+			window->shadow = shadow;
+			return shadow->surface;
+		}
+	}
+
+	shadow = zalloc(sizeof *shadow);
+	if (!shadow)
+		return NULL;
+
+	shadow->surface =
+		cairo_surface_create_similar(window->cairo_surface,
+					     CAIRO_CONTENT_COLOR_ALPHA,
+					     width, height);
+	shadow->width = width;
+	shadow->height = height;
+	shadow->refcount = 1;
+	wl_list_insert(&wm->shadow_list, &shadow->link);
+	window->shadow = shadow;
+
+	cr = cairo_create(shadow->surface);
+	theme_render_shadow(wm->theme, cr, width, height);
+	cairo_destroy(cr);
+
+	return shadow->surface;
+}
+
+static inline bool
+weston_wm_window_is_maximized(struct weston_wm_window *window)
+{
+	return window->maximized_horz && window->maximized_vert;
 }
 
 static void
 weston_wm_window_draw_decoration(struct weston_wm_window *window)
 {
+	cairo_surface_t *shadow;
 	cairo_t *cr;
 	int width, height;
-
-	wm_printf(window->wm, "XWM: draw decoration, win %d\n", window->id);
+	uint32_t state = DECORATION_DRAWN;
+	bool same;
 
 	weston_wm_window_get_frame_size(window, &width, &height);
 
+	if (window->fullscreen) {
+		state |= DECORATION_FULLSCREEN;
+	} else if (window->decorate) {
+		state |= DECORATION_FRAME;
+		if (window->wm->focus_window == window)
+			state |= DECORATION_ACTIVE;
+		if (weston_wm_window_is_maximized(window))
+			state |= DECORATION_MAXIMIZED;
+		frame_set_title(window->frame, window->name);
+	}
+
+	same = state == window->drawn_state &&
+	       width == window->drawn_width &&
+	       height == window->drawn_height;
+
+	/* The frame window still shows what we would draw */
+	if (same && (!(state & DECORATION_FRAME) ||
+		     !(frame_status(window->frame) & FRAME_STATUS_REPAINT)))
+		return;
+
+	wm_printf(window->wm, "XWM: draw decoration, win %d\n", window->id);
+
 	cairo_xcb_surface_set_size(window->cairo_surface, width, height);
 	cr = cairo_create(window->cairo_surface);
 
 	if (window->fullscreen) {
 		/* nothing */
-	} else if (window->decorate) {
-		frame_set_title(window->frame, window->name);
-		frame_repaint(window->frame, cr);
+	} else if (same) {
+		/* Only the title or the buttons changed */
+		frame_repaint_titlebar(window->frame, cr);
 	} else {
+		/* Maximized frames have no shadow, only the border */
 		cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-		cairo_set_source_rgba(cr, 0, 0, 0, 0);
+		if (state & DECORATION_MAXIMIZED) {
+			weston_wm_window_put_shadow(window);
+			shadow = NULL;
+		} else {
+			shadow = weston_wm_window_get_shadow(window,
+							     width, height);
+		}
+		if (shadow)
+			cairo_set_source_surface(cr, shadow, 0, 0);
+		else
+			cairo_set_source_rgba(cr, 0, 0, 0, 0);
 		cairo_paint(cr);
 
-		render_shadow(cr, window->wm->theme->shadow,
-			      2, 2, width + 8, height + 8, 64, 64);
+		if (window->decorate)
+			frame_repaint_decoration(window->frame, cr);
 	}
 
 	cairo_destroy(cr);
 	cairo_surface_flush(window->cairo_surface);
 	xcb_flush(window->wm->conn);
+
+	window->drawn_state = state;
+	window->drawn_width = width;
+	window->drawn_height = height;
 }
 
 static void
@@ -1369,11 +1571,10 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 	size_t logsize;
 	char timestr[128];
 
+	/* weston_wm_prefetch_events() marked the properties dirty */
 	if (!wm_lookup_window(wm, property_notify->window, &window))
 		return;
 
-	window->properties_dirty = 1;
-
 	if (wm_debug_is_enabled(wm))
 		fp = open_memstream(&logstr, &logsize);
 
@@ -1393,12 +1594,6 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 			weston_debug_scope_write(wm->server->wm_debug,
 						 logstr, logsize);
 		free(logstr);
-	} else {
-		/* read_and_dump_property() is a X11 roundtrip.
-		 * Mimic it to maintain ordering semantics between debug
-		 * and non-debug paths.
-		 */
-		get_atom_name(wm->conn, property_notify->atom);
 	}
 
 	if (property_notify->atom == wm->atom.net_wm_name ||
@@ -1406,12 +1601,37 @@ weston_wm_handle_property_notify(struct weston_wm *wm, xcb_generic_event_t *even
 		weston_wm_window_schedule_repaint(window);
 }
 
+static void
+weston_wm_select_window_input(struct weston_wm *wm, xcb_window_t id)
+{
+	uint32_t values[1];
+
+	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE |
+                    XCB_EVENT_MASK_FOCUS_CHANGE;
+	xcb_change_window_attributes(wm->conn, id, XCB_CW_EVENT_MASK, values);
+}
+
+static struct weston_wm_window_prefetch *
+weston_wm_take_prefetch(struct weston_wm *wm, xcb_window_t id)
+{
+	struct weston_wm_window_prefetch *prefetch;
+
+	wl_list_for_each(prefetch, &wm->window_prefetch_list, link) {
+		if (prefetch->id == id) {
+			wl_list_remove(&prefetch->link);
+			return prefetch;
+		}
+	}
+
+	return NULL;
+}
+
 static void
 weston_wm_window_create(struct weston_wm *wm,
 			xcb_window_t id, int width, int height, int x, int y, int override)
 {
 	struct weston_wm_window *window;
-	uint32_t values[1];
+	struct weston_wm_window_prefetch *prefetch;
 	xcb_get_geometry_cookie_t geometry_cookie;
 	xcb_get_geometry_reply_t *geometry_reply;
 
@@ -1421,15 +1641,23 @@ weston_wm_window_create(struct weston_wm *wm,
 		return;
 	}
 
-	geometry_cookie = xcb_get_geometry(wm->conn, id);
-
-	values[0] = XCB_EVENT_MASK_PROPERTY_CHANGE |
-                    XCB_EVENT_MASK_FOCUS_CHANGE;
-	xcb_change_window_attributes(wm->conn, id, XCB_CW_EVENT_MASK, values);
+	prefetch = weston_wm_take_prefetch(wm, id);
+	if (prefetch) {
+		/* Input was selected before the properties were requested,
+		 * so no change in between is missed */
+		geometry_cookie = prefetch->geometry_cookie;
+		memcpy(window->property_cookies, prefetch->property_cookies,
+		       sizeof window->property_cookies);
+		window->properties_pending = true;
+		free(prefetch);
+	} else {
+		geometry_cookie = xcb_get_geometry(wm->conn, id);
+		weston_wm_select_window_input(wm, id);
+		window->properties_dirty = 1;
+	}
 
 	window->wm = wm;
 	window->id = id;
-	window->properties_dirty = 1;
 	window->override_redirect = override;
 	window->width = width;
 	window->height = height;
@@ -1459,6 +1687,9 @@ weston_wm_window_destroy(struct weston_wm_window *window)
 
 	if (window->repaint_source)
 		wl_event_source_remove(window->repaint_source);
+	if (window->properties_pending)
+		weston_wm_discard_properties(wm, window->property_cookies);
+	weston_wm_window_put_shadow(window);
 	if (window->cairo_surface)
 		cairo_surface_destroy(window->cairo_surface);
 
@@ -1679,12 +1910,6 @@ weston_wm_window_set_toplevel(struct weston_wm_window *window)
 	weston_wm_window_configure(window);
 }
 
-static inline bool
-weston_wm_window_is_maximized(struct weston_wm_window *window)
-{
-	return window->maximized_horz && window->maximized_vert;
-}
-
 static void
 weston_wm_window_handle_state(struct weston_wm_window *window,
 			      xcb_client_message_event_t *client_message)
@@ -2174,81 +2399,203 @@ weston_wm_handle_focus_in(struct weston_wm *wm, xcb_generic_event_t *event)
 		weston_wm_send_focus_window(wm, wm->focus_window);
 }
 
+static void
+weston_wm_dispatch_event(struct weston_wm *wm, xcb_generic_event_t *event)
+{
+	if (weston_wm_handle_selection_event(wm, event))
+		return;
+
+	if (weston_wm_handle_dnd_event(wm, event))
+		return;
+
+	switch (EVENT_TYPE(event)) {
+	case XCB_BUTTON_PRESS:
+	case XCB_BUTTON_RELEASE:
+		weston_wm_handle_button(wm, event);
+		break;
+	case XCB_ENTER_NOTIFY:
+		weston_wm_handle_enter(wm, event);
+		break;
+	case XCB_LEAVE_NOTIFY:
+		weston_wm_handle_leave(wm, event);
+		break;
+	case XCB_MOTION_NOTIFY:
+		weston_wm_handle_motion(wm, event);
+		break;
+	case XCB_CREATE_NOTIFY:
+		weston_wm_handle_create_notify(wm, event);
+		break;
+	case XCB_MAP_REQUEST:
+		weston_wm_handle_map_request(wm, event);
+		break;
+	case XCB_MAP_NOTIFY:
+		weston_wm_handle_map_notify(wm, event);
+		break;
+	case XCB_UNMAP_NOTIFY:
+		weston_wm_handle_unmap_notify(wm, event);
+		break;
+	case XCB_REPARENT_NOTIFY:
+		weston_wm_handle_reparent_notify(wm, event);
+		break;
+	case XCB_CONFIGURE_REQUEST:
+		weston_wm_handle_configure_request(wm, event);
+		break;
+	case XCB_CONFIGURE_NOTIFY:
+		weston_wm_handle_configure_notify(wm, event);
+		break;
+	case XCB_DESTROY_NOTIFY:
+		weston_wm_handle_destroy_notify(wm, event);
+		break;
+	case XCB_MAPPING_NOTIFY:
+		wm_printf(wm, "XCB_MAPPING_NOTIFY\n");
+		break;
+	case XCB_PROPERTY_NOTIFY:
+		weston_wm_handle_property_notify(wm, event);
+		break;
+	case XCB_CLIENT_MESSAGE:
+		weston_wm_handle_client_message(wm, event);
+		break;
+	case XCB_FOCUS_IN:
+		weston_wm_handle_focus_in(wm, event);
+		break;
+	}
+}
+
+/* Sends the requests for a window announced by a CreateNotify ahead of
+ * its processing, see weston_wm_window_create() */
+static void
+weston_wm_prefetch_window(struct weston_wm *wm, xcb_window_t id)
+{
+	struct weston_wm_window_prefetch *prefetch;
+
+	prefetch = zalloc(sizeof *prefetch);
+	if (!prefetch)
+		return;
+
+	prefetch->id = id;
+	weston_wm_select_window_input(wm, id);
+	prefetch->geometry_cookie = xcb_get_geometry(wm->conn, id);
+	weston_wm_request_properties(wm, id, prefetch->property_cookies);
+	wl_list_insert(wm->window_prefetch_list.prev, &prefetch->link);
+}
+
+/* Requests what handling the events will need from the X server, so that
+ * the whole batch waits for a single round trip rather than one per
+ * window. Returns whether property changes are among the events. */
+static bool
+weston_wm_prefetch_events(struct weston_wm *wm, struct wl_array *events)
+{
+	xcb_generic_event_t **event;
+	xcb_create_notify_event_t *create_notify;
+	xcb_map_request_event_t *map_request;
+	xcb_property_notify_event_t *property;
+	struct weston_wm_window *window;
+	bool property_notify = false;
+
+	wl_array_for_each(event, events) {
+		switch (EVENT_TYPE(*event)) {
+		case XCB_CREATE_NOTIFY:
+			create_notify = (xcb_create_notify_event_t *) *event;
+			if (!our_resource(wm, create_notify->window))
+				weston_wm_prefetch_window(wm,
+							  create_notify->window);
+			break;
+		case XCB_PROPERTY_NOTIFY:
+			/* Marked here rather than when the event is handled,
+			 * as any fetch sent from now on sees the change */
+			property = (xcb_property_notify_event_t *) *event;
+			if (wm_lookup_window(wm, property->window, &window))
+				window->properties_dirty = 1;
+			property_notify = true;
+			break;
+		}
+	}
+
+	/* Mapping reads the properties right away */
+	wl_array_for_each(event, events) {
+		if (EVENT_TYPE(*event) != XCB_MAP_REQUEST)
+			continue;
+
+		map_request = (xcb_map_request_event_t *) *event;
+		if (wm_lookup_window(wm, map_request->window, &window))
+			weston_wm_window_fetch_properties(window);
+	}
+
+	return property_notify;
+}
+
+static void
+fetch_repaint_properties(void *element, void *data)
+{
+	struct weston_wm_window *window = element;
+
+	if (window->repaint_source)
+		weston_wm_window_fetch_properties(window);
+}
+
+static void
+weston_wm_discard_prefetches(struct weston_wm *wm)
+{
+	struct weston_wm_window_prefetch *prefetch, *next;
+
+	wl_list_for_each_safe(prefetch, next, &wm->window_prefetch_list, link) {
+		xcb_discard_reply(wm->conn, prefetch->geometry_cookie.sequence);
+		weston_wm_discard_properties(wm, prefetch->property_cookies);
+		wl_list_remove(&prefetch->link);
+		free(prefetch);
+	}
+}
+
 static int
 weston_wm_handle_event(int fd, uint32_t mask, void *data)
 {
 	struct weston_wm *wm = data;
-	xcb_generic_event_t *event;
+	xcb_generic_event_t *event, *overflow, **e;
+	struct wl_array events;
+	bool property_notify;
 	int count = 0;
 
-	while (event = xcb_poll_for_event(wm->conn), event != NULL) {
-		if (weston_wm_handle_selection_event(wm, event)) {
-			free(event);
-			count++;
-			continue;
+	/* Events are drained in batches, so that the requests for all the
+	 * windows in a batch are in flight before any reply is waited for */
+	wl_array_init(&events);
+	for (;;) {
+		events.size = 0;
+		overflow = NULL;
+		while (event = xcb_poll_for_event(wm->conn), event != NULL) {
+			e = wl_array_add(&events, sizeof *e);
+			if (!e) {
+				overflow = event;
+				break;
+			}
+			*e = event;
 		}
 
-		if (weston_wm_handle_dnd_event(wm, event)) {
-			free(event);
+		if (events.size == 0 && !overflow)
+			break;
+
+		property_notify = weston_wm_prefetch_events(wm, &events);
+
+		wl_array_for_each(e, &events) {
+			weston_wm_dispatch_event(wm, *e);
+			free(*e);
 			count++;
-			continue;
 		}
-
-		switch (EVENT_TYPE(event)) {
-		case XCB_BUTTON_PRESS:
-		case XCB_BUTTON_RELEASE:
-			weston_wm_handle_button(wm, event);
-			break;
-		case XCB_ENTER_NOTIFY:
-			weston_wm_handle_enter(wm, event);
-			break;
-		case XCB_LEAVE_NOTIFY:
-			weston_wm_handle_leave(wm, event);
-			break;
-		case XCB_MOTION_NOTIFY:
-			weston_wm_handle_motion(wm, event);
-			break;
-		case XCB_CREATE_NOTIFY:
-			weston_wm_handle_create_notify(wm, event);
-			break;
-		case XCB_MAP_REQUEST:
-			weston_wm_handle_map_request(wm, event);
-			break;
-		case XCB_MAP_NOTIFY:
-			weston_wm_handle_map_notify(wm, event);
-			break;
-		case XCB_UNMAP_NOTIFY:
-			weston_wm_handle_unmap_notify(wm, event);
-			break;
-		case XCB_REPARENT_NOTIFY:
-			weston_wm_handle_reparent_notify(wm, event);
-			break;
-		case XCB_CONFIGURE_REQUEST:
-			weston_wm_handle_configure_request(wm, event);
-			break;
-		case XCB_CONFIGURE_NOTIFY:
-			weston_wm_handle_configure_notify(wm, event);
-			break;
-		case XCB_DESTROY_NOTIFY:
-			weston_wm_handle_destroy_notify(wm, event);
-			break;
-		case XCB_MAPPING_NOTIFY:
-			wm_printf(wm, "XCB_MAPPING_NOTIFY\n");
-			break;
-		case XCB_PROPERTY_NOTIFY:
-			weston_wm_handle_property_notify(wm, event);
-			break;
-		case XCB_CLIENT_MESSAGE:
-			weston_wm_handle_client_message(wm, event);
-			break;
-		case XCB_FOCUS_IN:
-			weston_wm_handle_focus_in(wm, event);
-			break;
+		if (overflow) {
+			weston_wm_dispatch_event(wm, overflow);
+			free(overflow);
+			count++;
 		}
 
-		free(event);
-		count++;
+		/* Windows created and destroyed within the batch */
+		weston_wm_discard_prefetches(wm);
+
+		/* The repaints read the changed properties from idle
+		 * callbacks, have them all requested by then */
+		if (property_notify)
+			hash_table_for_each(wm->window_hash,
+					    fetch_repaint_properties, NULL);
 	}
+	wl_array_release(&events);
 
 	if (count != 0)
 		xcb_flush(wm->conn);
@@ -2574,6 +2921,8 @@ weston_wm_create(struct weston_xserver *wxs, int fd)
 	wl_signal_add(&wxs->compositor->kill_signal,
 		      &wm->kill_listener);
 	wl_list_init(&wm->unpaired_window_list);
+	wl_list_init(&wm->shadow_list);
+	wl_list_init(&wm->window_prefetch_list);
 
 	weston_wm_create_cursors(wm);
 	weston_wm_window_set_cursor(wm, wm->screen->root, XWM_CURSOR_LEFT_PTR);
@@ -76,6 +76,8 @@ struct weston_wm {
 	struct wl_listener activate_listener;
 	struct wl_listener kill_listener;
 	struct wl_list unpaired_window_list;
+	struct wl_list window_prefetch_list;
+	struct wl_list shadow_list;	/* weston_wm_shadow::link */
 
 	xcb_window_t selection_window;
 	xcb_window_t selection_owner;
@@ -84,6 +86,7 @@ struct weston_wm {
 	struct wl_event_source *property_source;
 	xcb_get_property_reply_t *property_reply;
 	int property_start;
+	uint32_t property_offset;
 	struct wl_array source_data;
 	xcb_selection_request_event_t selection_request;
 	xcb_atom_t selection_target;